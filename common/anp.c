@@ -13,6 +13,24 @@ char* anp_type_name(enum anp_type type) {
     }
 }
 
+/* This function decodes a 32 bits unsigned integer in network byte order. */
+static inline uint32_t anp_decode32(uint8_t *p) {
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+}
+
+/* This function decodes a 64 bits unsigned integer in network byte order. The
+ * compiler reduces this to a single byte swap instruction.
+ */
+static inline uint64_t anp_decode64(uint8_t *p) {
+    return ((uint64_t) anp_decode32(p) << 32) | anp_decode32(p + 4);
+}
+
+/* This function encodes a 64 bits unsigned integer in network byte order. */
+static inline void anp_encode64(uint8_t *p, uint64_t i) {
+    int j;
+    for (j = 7; j >= 0; j--, i >>= 8) p[j] = (uint8_t) i;
+}
+
 struct anp_element* anp_element_new() {
     return (struct anp_element *) kcalloc(sizeof(struct anp_element));
 }
@@ -48,6 +66,26 @@ void anp_write_uint64(kbuffer *buf, uint64_t i) {
     kbuffer_write64(buf, i);
 }
 
+/* This function adds 'count' 64 bits unsigned integers to the buffer. The
+ * integers are encoded as 'count' UINT64 elements, exactly as if
+ * anp_write_uint64() was called for each of them, but the buffer is grown only
+ * once.
+ */
+void anp_write_uint64_array(kbuffer *buf, uint64_t *array, int count) {
+    uint8_t *p;
+    int i;
+    
+    kbuffer_grow(buf, buf->len + count * 9);
+    p = buf->data + buf->len;
+    
+    for (i = 0; i < count; i++, p += 9) {
+        p[0] = ANP_UINT64;
+        anp_encode64(p + 1, array[i]);
+    }
+    
+    buf->len += count * 9;
+}
+
 /* This function adds a textual kstr to the buffer. */
 void anp_write_kstr(kbuffer *buf, kstr *str) {
     kbuffer_write8(buf, ANP_STR);
@@ -65,18 +103,24 @@ void anp_write_cstr(kbuffer *buf, char *str) {
 
 /* This function adds a binary buffer to the buffer. 'bin' can be NULL. */
 void anp_write_bin(kbuffer *buf, kbuffer *bin) {
-    kbuffer_write8(buf, ANP_BIN);
-    
     if (bin) {
-        kbuffer_write32(buf, bin->len);
+        anp_write_bin_hdr(buf, bin->len);
         kbuffer_write(buf, bin->data, bin->len);
     }
     
     else {
-        kbuffer_write32(buf, 0);
+        anp_write_bin_hdr(buf, 0);
     }
 }
 
+/* This function adds the header of a binary element of 'len' bytes to the
+ * buffer. The caller must add the data of the element.
+ */
+void anp_write_bin_hdr(kbuffer *buf, uint32_t len) {
+    kbuffer_write8(buf, ANP_BIN);
+    kbuffer_write32(buf, len);
+}
+
 /* Helper method for anp_read_element(). */
 static int anp_read_element_string(kbuffer *buf, kstr *str) {
     int error = 0;
@@ -213,6 +257,37 @@ int anp_read_uint64(kbuffer *buf, uint64_t *i) {
     return 0;
 }
 
+/* This function reads 'count' consecutive UINT64 elements from the buffer. The
+ * size of the run is verified once, then the type of every element is
+ * verified before the values are decoded.
+ * This function sets the KMOD error string. It returns -1 on failure.
+ */
+int anp_read_uint64_array(kbuffer *buf, uint64_t *array, int count) {
+    uint8_t *p = buf->data + buf->pos;
+    int i;
+    
+    if (count * 9 > buf->len - buf->pos) {
+        kmod_set_error("buffer too short");
+        kmod_append_error("cannot read UINT64 value in message");
+        return -1;
+    }
+    
+    for (i = 0; i < count; i++) {
+        if (p[i * 9] != ANP_UINT64) {
+            kmod_set_error("expected type %s, got type %s (%d)", anp_type_name(ANP_UINT64), anp_type_name(p[i * 9]),
+                           p[i * 9]);
+            kmod_append_error("cannot read UINT64 value in message");
+            return -1;
+        }
+    }
+    
+    for (i = 0; i < count; i++) array[i] = anp_decode64(p + i * 9 + 1);
+    
+    buf->pos += count * 9;
+    
+    return 0;
+}
+
 /* This function reads a kstr of type STR from the buffer.
  * This function sets the KMOD error string. It returns -1 on failure.
  */
@@ -273,6 +348,40 @@ int anp_read_bin(kbuffer *buf, kbuffer *bin) {
     return 0;
 }
 
+/* This function reads a buffer of type BIN from the buffer without copying it.
+ * On success, 'data' points to the data in the buffer, which must outlive the
+ * use of 'data'. This function sets the KMOD error string. It returns -1 on
+ * failure.
+ */
+int anp_read_bin_view(kbuffer *buf, uint8_t **data, uint32_t *len) {
+    int error = 0;
+    
+    do {
+	error = anp_read_ensure_type(buf, ANP_BIN);
+	if (error) break;
+	
+	error = kbuffer_read32(buf, len);
+	if (error) break;
+	
+	if (*len > (uint32_t) (buf->len - buf->pos)) {
+	    kmod_set_error("buffer too short");
+	    error = -1;
+	    break;
+	}
+	
+	*data = buf->data + buf->pos;
+	buf->pos += *len;
+
+    } while (0);
+    
+    if (error) {
+    	kmod_append_error("cannot read BIN value in message");
+    	return -1;
+    }
+    
+    return 0;
+}
+
 /* This function dumps the content of a ANP message buffer in the string
  * specified. This function sets the KMOD error string when it encounters an
  * error in the buffer. It returns -1 on failure.
@@ -348,82 +457,270 @@ int anp_dump(kbuffer *buf, kstr *dump_str) {
 struct anp_msg* anp_msg_new() {
     struct anp_msg *self = (struct anp_msg *) kcalloc(sizeof(struct anp_msg));
     kbuffer_init(&self->payload);
-    karray_init(&self->element_array);
     return self;
 }
 
+/* This function frees the memory of the message specified. */
+static void anp_msg_free(struct anp_msg *self) {
+    if (self->el_off_array) kfree(self->el_off_array);
+    kbuffer_clean(&self->payload);
+    kfree(self);
+}
+
+#ifdef ANP_NO_MSG_POOL
+void anp_msg_destroy(struct anp_msg *self) {
+    if (self) anp_msg_free(self);
+}
+
+/* This function destroys the messages of the array specified and resets the
+ * array.
+ */
+void anp_msg_destroy_array(karray *array) {
+    int i;
+    for (i = 0; i < array->size; i++) anp_msg_free((struct anp_msg *) array->data[i]);
+    karray_reset(array);
+}
+
+#else
+/* This function returns a message to its pool. The pool must be locked. */
+static void anp_msg_pool_put_locked(struct anp_msg_pool *pool, struct anp_msg *msg) {
+    assert(pool->nb_live > 0);
+    pool->nb_live--;
+    pool->payload_bytes += msg->payload.len;
+    pool->max_payload = MAX(pool->max_payload, msg->payload.len);
+    
+    /* Keep the message, but not its payload buffer if it is large. */
+    if (pool->free_array.size < ANP_MSG_POOL_MAX_FREE) {
+        if (msg->payload.allocated > ANP_MSG_POOL_MAX_KEPT) {
+            kbuffer_clean(&msg->payload);
+            kbuffer_init(&msg->payload);
+        }
+        
+        anp_msg_clear_payload(msg);
+        pool->free_bytes += msg->payload.allocated;
+        karray_push(&pool->free_array, msg);
+    }
+    
+    else anp_msg_free(msg);
+}
+
 void anp_msg_destroy(struct anp_msg *self) {
     if (self) {
-        anp_msg_clear_payload(self);
-        karray_clean(&self->element_array);
-	kbuffer_clean(&self->payload);
-	kfree(self);
+        struct anp_msg_pool *pool = self->pool;
+        
+        if (pool) {
+            kmutex_lock(&pool->mutex);
+            anp_msg_pool_put_locked(pool, self);
+            kmutex_unlock(&pool->mutex);
+        }
+        
+        else anp_msg_free(self);
     }
 }
 
+/* This function destroys the messages of the array specified and resets the
+ * array. The messages belonging to the same pool are returned to it in bulk.
+ */
+void anp_msg_destroy_array(karray *array) {
+    int i;
+    struct anp_msg_pool *locked = NULL;
+    
+    for (i = 0; i < array->size; i++) {
+        struct anp_msg *msg = (struct anp_msg *) array->data[i];
+        
+        if (locked && msg->pool != locked) {
+            kmutex_unlock(&locked->mutex);
+            locked = NULL;
+        }
+        
+        if (msg->pool && !locked) {
+            locked = msg->pool;
+            kmutex_lock(&locked->mutex);
+        }
+        
+        if (locked) anp_msg_pool_put_locked(locked, msg);
+        else anp_msg_free(msg);
+    }
+    
+    if (locked) kmutex_unlock(&locked->mutex);
+    karray_reset(array);
+}
+
+void anp_msg_pool_init(struct anp_msg_pool *self) {
+    memset(self, 0, sizeof(struct anp_msg_pool));
+    kmutex_init(&self->mutex);
+    karray_init(&self->free_array);
+}
+
+/* This function frees the free messages of the pool. All the messages handed
+ * out must have been returned. Otherwise, the pool is left intact, since the
+ * messages still live refer to it, and -1 is returned. The pool is then leaked.
+ */
+int anp_msg_pool_clean(struct anp_msg_pool *self) {
+    int i;
+    
+    if (self->nb_live) {
+        kmod_set_error("%d messages of the pool are still live", self->nb_live);
+        return -1;
+    }
+    
+    for (i = 0; i < self->free_array.size; i++) anp_msg_free((struct anp_msg *) self->free_array.data[i]);
+    karray_clean(&self->free_array);
+    kmutex_clean(&self->mutex);
+    return 0;
+}
+
+/* This function returns a new message from the pool specified, or from the
+ * heap if the pool is NULL. The message is returned to the pool when it is
+ * destroyed.
+ */
+struct anp_msg* anp_msg_pool_get(struct anp_msg_pool *self) {
+    struct anp_msg *msg = NULL;
+    
+    if (!self) return anp_msg_new();
+    
+    kmutex_lock(&self->mutex);
+    
+    if (self->free_array.size) {
+        msg = (struct anp_msg *) self->free_array.data[--self->free_array.size];
+        self->free_bytes -= msg->payload.allocated;
+        self->nb_reuse++;
+    }
+    
+    else self->nb_alloc++;
+    
+    self->nb_live++;
+    self->peak_live = MAX(self->peak_live, self->nb_live);
+    
+    kmutex_unlock(&self->mutex);
+    
+    /* Reset the message. */
+    if (msg) {
+        msg->major = msg->minor = msg->type = 0;
+        msg->id = 0;
+        msg->pos = 0;
+        anp_msg_clear_payload(msg);
+    }
+    
+    else msg = anp_msg_new();
+    
+    msg->pool = self;
+    return msg;
+}
+#endif
+
 /* This function clears the payload of this message. */
 void anp_msg_clear_payload(struct anp_msg *self) {
-    struct karray_iter iter;
-    struct anp_element *el;
-    karray_iter_init(&iter, &self->element_array);
-    while (kiter_next(&iter, &el) == 0) anp_element_destroy(el);
-    karray_reset(&self->element_array);
+    self->nb_el = 0;
     kbuffer_reset(&self->payload);
 }
 
-/* This function parses the elements contained in 'buf' and replaces the
- * payload of this message with those elements.
+/* This function adds the offset of an element to the offset table. */
+static void anp_msg_add_el_off(struct anp_msg *self, uint32_t off) {
+    if (self->nb_el == self->el_off_alloc) {
+        uint32_t *array;
+        
+        self->el_off_alloc = MAX(self->el_off_alloc * 2, 16);
+        array = (uint32_t *) kmalloc(self->el_off_alloc * sizeof(uint32_t));
+        
+        if (self->el_off_array) {
+            memcpy(array, self->el_off_array, self->nb_el * sizeof(uint32_t));
+            kfree(self->el_off_array);
+        }
+        
+        self->el_off_array = array;
+    }
+    
+    self->el_off_array[self->nb_el++] = off;
+}
+
+/* This function validates the framing of the elements contained in the payload
+ * of this message and records their offsets in a single pass. The values of the
+ * elements are not decoded. This function sets the KMOD error string. It
+ * returns -1 on failure.
  */
-int anp_msg_parse(struct anp_msg *self, kbuffer *buf) {
-    int error = 0;
+int anp_msg_index(struct anp_msg *self) {
+    uint8_t *data = self->payload.data;
+    uint32_t len = self->payload.len, pos = 0;
     
-    do {
-        /* Reset the payload and the element array. */
-        anp_msg_clear_payload(self);
+    self->nb_el = 0;
+    self->payload.pos = 0;
+    
+    while (pos < len) {
+        uint8_t type = data[pos];
+        uint64_t size;
         
-        /* Parse the elements. */
-        buf->pos = 0;
+        anp_msg_add_el_off(self, pos);
+        pos++;
         
-        while (buf->pos < buf->len) {
-            struct anp_element el;
-            
-            error = anp_read_element(buf, &el);
-            if (error) break;
-            
-            switch (el.type) {
-                case ANP_UINT32:
-                    anp_msg_write_uint32(self, el.uint32);
-                    break;
-                case ANP_UINT64:
-                    anp_msg_write_uint64(self, el.uint64);
-                    break;
-                case ANP_STR:
-                    anp_msg_write_kstr(self, el.str);
-                    break;
-                case ANP_BIN:
-                    anp_msg_write_bin(self, el.bin);
-                    break;
-            }
-            
-            anp_element_clean(&el);
+        switch (type) {
+            case ANP_UINT32:
+                size = 4;
+                break;
+            case ANP_UINT64:
+                size = 8;
+                break;
+            case ANP_STR:
+            case ANP_BIN:
+                size = (len - pos < 4) ? 4 : 4 + (uint64_t) anp_decode32(data + pos);
+                break;
+            default:
+                kmod_set_error("invalid ANP identifier (%u) at offset %u", type, pos - 1);
+                self->nb_el = 0;
+                return -1;
         }
         
-        if (error) break;
+        if (size > len - pos) {
+            kmod_set_error("truncated %s element at offset %u", anp_type_name(type), pos - 1);
+            self->nb_el = 0;
+            return -1;
+        }
         
-    } while (0);
+        pos += size;
+    }
+    
+    return 0;
+}
 
-    return error;
+/* This function replaces the payload of this message with the elements
+ * contained in 'buf'. The elements are validated and indexed, but not decoded.
+ */
+int anp_msg_parse(struct anp_msg *self, kbuffer *buf) {
+    anp_msg_clear_payload(self);
+    kbuffer_write(&self->payload, buf->data, buf->len);
+    buf->pos = buf->len;
+    
+    if (anp_msg_index(self)) {
+        anp_msg_clear_payload(self);
+        return -1;
+    }
+    
+    return 0;
 }
 
-/* This function adds a message to the buffer specified. The buffer is not
- * cleared prior to the message being added.
+/* This function adds the header of a message to the buffer specified. The
+ * buffer is not cleared prior to the header being added.
  */
-void anp_msg_to_buf(struct anp_msg *msg, kbuffer *buf) {
+void anp_msg_hdr_to_buf(struct anp_msg *msg, kbuffer *buf) {
+    anp_msg_ext_hdr_to_buf(msg, 0, buf);
+}
+
+/* Same as anp_msg_hdr_to_buf(), but 'ext_len' bytes of data sent outside the
+ * payload buffer are accounted for in the payload size.
+ */
+void anp_msg_ext_hdr_to_buf(struct anp_msg *msg, uint32_t ext_len, kbuffer *buf) {
     kbuffer_write32(buf, msg->major);
     kbuffer_write32(buf, msg->minor);
     kbuffer_write32(buf, msg->type);
     kbuffer_write64(buf, msg->id);
-    kbuffer_write32(buf, msg->payload.len);
+    kbuffer_write32(buf, msg->payload.len + ext_len);
+}
+
+/* This function adds a message to the buffer specified. The buffer is not
+ * cleared prior to the message being added.
+ */
+void anp_msg_to_buf(struct anp_msg *msg, kbuffer *buf) {
+    anp_msg_hdr_to_buf(msg, buf);
     kbuffer_write(buf, msg->payload.data, msg->payload.len);
 }
 
@@ -461,47 +758,29 @@ int anp_msg_dump(struct anp_msg *self, kstr *dump_str) {
  * anp_read_* counterparts.
  */
 void anp_msg_write_uint32(struct anp_msg *self, uint32_t i) {
-    struct anp_element *el = anp_element_new();
-    el->type = ANP_UINT32;
-    el->uint32 = i;
-    karray_push(&self->element_array, el);
-    anp_write_uint32(&self->payload, el->uint32);
+    anp_msg_add_el_off(self, self->payload.len);
+    anp_write_uint32(&self->payload, i);
 }
 
 void anp_msg_write_uint64(struct anp_msg *self, uint64_t i) {
-    struct anp_element *el = anp_element_new();
-    el->type = ANP_UINT64;
-    el->uint64 = i;
-    karray_push(&self->element_array, el);
-    anp_write_uint64(&self->payload, el->uint64);
+    anp_msg_add_el_off(self, self->payload.len);
+    anp_write_uint64(&self->payload, i);
 }
 
 void anp_msg_write_kstr(struct anp_msg *self, kstr *str) {
-    struct anp_element *el = anp_element_new();
-    el->type = ANP_STR;
-    el->str = kstr_new();
-    kstr_assign_kstr(el->str, str);
-    karray_push(&self->element_array, el);
-    anp_write_kstr(&self->payload, el->str);
+    anp_msg_add_el_off(self, self->payload.len);
+    anp_write_kstr(&self->payload, str);
 }
 
 void anp_msg_write_cstr(struct anp_msg *self, char *str) {
-    struct anp_element *el = anp_element_new();
-    el->type = ANP_STR;
-    el->str = kstr_new();
-    kstr_assign_cstr(el->str, str);
-    karray_push(&self->element_array, el);
-    anp_write_kstr(&self->payload, el->str);
+    anp_msg_add_el_off(self, self->payload.len);
+    anp_write_cstr(&self->payload, str);
 }
 
 /* 'bin' can be NULL'. */
 void anp_msg_write_bin(struct anp_msg *self, kbuffer *bin) {
-    struct anp_element *el = anp_element_new();
-    el->type = ANP_BIN;
-    el->bin = kbuffer_new();
-    if (bin) kbuffer_write_buffer(el->bin, bin);
-    karray_push(&self->element_array, el);
-    anp_write_bin(&self->payload, el->bin);
+    anp_msg_add_el_off(self, self->payload.len);
+    anp_write_bin(&self->payload, bin);
 }
 
 int anp_msg_read_uint32(struct anp_msg *self, uint32_t *i) {
@@ -520,32 +799,37 @@ int anp_msg_read_bin(struct anp_msg *self, kbuffer *bin) {
     return anp_msg_get_bin(self, self->pos++, bin);
 }
 
-/* Helper function for the anp_msg_get_* functions. It ensures that the value
- * has the expected type.
- * This function sets the KMOD error string. It returns -1 on failure.
+/* Helper function for the anp_msg_get_* functions. It returns a pointer to the
+ * value of the element at pos, after ensuring that the element has the
+ * expected type.
+ * This function sets the KMOD error string. It returns NULL on failure.
  */
-static int anp_msg_get_ensure_type(struct anp_element *el, int pos, uint8_t expected_type) {
-    if (! el) {
+static uint8_t * anp_msg_get_el(struct anp_msg *self, int pos, uint8_t expected_type) {
+    uint8_t *el;
+    
+    if (pos < 0 || pos >= self->nb_el) {
         kmod_set_error("there is no %s element at position %d", anp_type_name(expected_type), pos);
-        return -1;
+        return NULL;
     }
     
-    if (el->type != expected_type) {
+    el = self->payload.data + self->el_off_array[pos];
+    
+    if (*el != expected_type) {
         kmod_set_error("expected element of type %s at position %d, got type %s", anp_type_name(expected_type), pos,
-                                                                                  anp_type_name(el->type));
-        return -1;
+                                                                                  anp_type_name(*el));
+        return NULL;
     }
     
-    return 0;
+    return el + 1;
 }
 
 /* This function gets the element at pos in an anp_msg as a 32 bits unsigned
  * integer. This function sets the KMOD error string. It returns -1 on failure.
  */
 int anp_msg_get_uint32(struct anp_msg *self, int pos, uint32_t *i) {
-    struct anp_element *el = (struct anp_element *)karray_get(&self->element_array, pos);
-    if (anp_msg_get_ensure_type(el, pos, ANP_UINT32)) return -1;
-    *i = el->uint32;
+    uint8_t *el = anp_msg_get_el(self, pos, ANP_UINT32);
+    if (! el) return -1;
+    *i = anp_decode32(el);
     return 0;
 }
 
@@ -553,9 +837,9 @@ int anp_msg_get_uint32(struct anp_msg *self, int pos, uint32_t *i) {
  * integer. This function sets the KMOD error string. It returns -1 on failure.
  */
 int anp_msg_get_uint64(struct anp_msg *self, int pos, uint64_t *i) {
-    struct anp_element *el = (struct anp_element *) karray_get(&self->element_array, pos);
-    if (anp_msg_get_ensure_type(el, pos, ANP_UINT64)) return -1;
-    *i = el->uint64;
+    uint8_t *el = anp_msg_get_el(self, pos, ANP_UINT64);
+    if (! el) return -1;
+    *i = anp_decode64(el);
     return 0;
 }
 
@@ -563,9 +847,9 @@ int anp_msg_get_uint64(struct anp_msg *self, int pos, uint64_t *i) {
  * function sets the KMOD error string. It returns -1 on failure.
  */
 int anp_msg_get_kstr(struct anp_msg *self, int pos, kstr *str) {
-    struct anp_element *el = (struct anp_element *) karray_get(&self->element_array, pos);
-    if (anp_msg_get_ensure_type(el, pos, ANP_STR)) return -1;
-    kstr_assign_kstr(str, el->str);
+    uint8_t *el = anp_msg_get_el(self, pos, ANP_STR);
+    if (! el) return -1;
+    kstr_assign_buf(str, (char *) el + 4, anp_decode32(el));
     return 0;
 }
 
@@ -573,10 +857,22 @@ int anp_msg_get_kstr(struct anp_msg *self, int pos, kstr *str) {
  * function sets the KMOD error string. It returns -1 on failure.
  */
 int anp_msg_get_bin(struct anp_msg *self, int pos, kbuffer *bin) {
-    struct anp_element *el = (struct anp_element *) karray_get(&self->element_array, pos);
-    if (anp_msg_get_ensure_type(el, pos, ANP_BIN)) return -1;
+    uint8_t *el = anp_msg_get_el(self, pos, ANP_BIN);
+    if (! el) return -1;
     bin->pos = 0;
-    kbuffer_write_buffer(bin, el->bin);
+    kbuffer_write(bin, el + 4, anp_decode32(el));
     return 0;
 }
 
+/* This function gets the element at pos in an anp_msg as a bin without copying
+ * it. 'data' points in the payload of the message and remains valid until the
+ * payload is modified. This function sets the KMOD error string. It returns -1
+ * on failure.
+ */
+int anp_msg_get_bin_view(struct anp_msg *self, int pos, uint8_t **data, uint32_t *len) {
+    uint8_t *el = anp_msg_get_el(self, pos, ANP_BIN);
+    if (! el) return -1;
+    *len = anp_decode32(el);
+    *data = el + 4;
+    return 0;
+}
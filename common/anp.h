@@ -49,6 +49,12 @@
 /* Maximum size of an ANP message payload. */
 #define ANP_MSG_MAX_SIZE (102*1024*1024)
 
+/* Maximum number of free messages kept by a message pool, and maximum size of
+ * a payload buffer kept with a free message.
+ */
+#define ANP_MSG_POOL_MAX_FREE 256
+#define ANP_MSG_POOL_MAX_KEPT (64*1024)
+
 /* ANP object identifiers. */
 enum anp_type
 {
@@ -86,15 +92,65 @@ struct anp_msg {
     /* Payload of the message. */
     kbuffer payload;
 
-    /* Position in the element array, to allow functions to read a message
-     * element-by-element.
+    /* Position in the element offset table, to allow functions to read a
+     * message element-by-element.
      */
     int pos;
 
-    /* The elements in the message. */
-    karray element_array;
+    /* Table of the offsets of the elements in the payload. Each offset is the
+     * position of the type byte of the element. The values of the elements are
+     * decoded from the payload only when they are requested.
+     */
+    uint32_t *el_off_array;
+    
+    /* Number of elements in the table above and size of the table. */
+    int nb_el;
+    int el_off_alloc;
+    
+#ifndef ANP_NO_MSG_POOL
+    /* Pool the message is returned to when it is destroyed, if any. */
+    struct anp_msg_pool *pool;
+#endif
 };
 
+#ifndef ANP_NO_MSG_POOL
+
+/* Pool of ANP messages. The messages returned to the pool keep their payload
+ * buffer and their offset table, so that they can be reused without
+ * allocating memory. The pool also accounts for the messages it hands out. It
+ * can be shared by several threads.
+ */
+struct anp_msg_pool {
+    
+    /* Mutex protecting the pool. */
+    struct kmutex mutex;
+    
+    /* Array of free messages. */
+    karray free_array;
+    
+    /* Number of messages allocated from the heap and number of messages
+     * reused.
+     */
+    uint64_t nb_alloc;
+    uint64_t nb_reuse;
+    
+    /* Number of messages handed out and not returned yet, and peak of that
+     * number.
+     */
+    int nb_live;
+    int peak_live;
+    
+    /* Total size of the payloads of the messages returned to the pool, and size
+     * of the largest payload returned.
+     */
+    uint64_t payload_bytes;
+    uint32_t max_payload;
+    
+    /* Size of the payload buffers kept with the free messages. */
+    uint64_t free_bytes;
+};
+#endif
+
 char* anp_type_name(enum anp_type type);
 
 struct anp_element* anp_element_new();
@@ -103,20 +159,33 @@ void anp_element_destroy(struct anp_element *self);
 
 void anp_write_uint32(kbuffer *buf, uint32_t i);
 void anp_write_uint64(kbuffer *buf, uint64_t i);
+void anp_write_uint64_array(kbuffer *buf, uint64_t *array, int count);
 void anp_write_kstr(kbuffer *buf, kstr *str);
 void anp_write_cstr(kbuffer *buf, char *str);
 void anp_write_bin(kbuffer *buf, kbuffer *bin);
+void anp_write_bin_hdr(kbuffer *buf, uint32_t len);
 int anp_read_element(kbuffer *buf, struct anp_element *el);
 int anp_read_uint32(kbuffer *buf, uint32_t *i);
 int anp_read_uint64(kbuffer *buf, uint64_t *i);
+int anp_read_uint64_array(kbuffer *buf, uint64_t *array, int count);
 int anp_read_kstr(kbuffer *buf, kstr *str);
 int anp_read_bin(kbuffer *buf, kbuffer *bin);
+int anp_read_bin_view(kbuffer *buf, uint8_t **data, uint32_t *len);
 int anp_dump(kbuffer *buf, kstr *dump_str);
 
 struct anp_msg* anp_msg_new();
 void anp_msg_destroy(struct anp_msg *self);
+void anp_msg_destroy_array(karray *array);
+#ifndef ANP_NO_MSG_POOL
+void anp_msg_pool_init(struct anp_msg_pool *self);
+int anp_msg_pool_clean(struct anp_msg_pool *self);
+struct anp_msg* anp_msg_pool_get(struct anp_msg_pool *self);
+#endif
 void anp_msg_clear_payload(struct anp_msg *self);
+int anp_msg_index(struct anp_msg *self);
 int anp_msg_parse(struct anp_msg *self, kbuffer *buf);
+void anp_msg_hdr_to_buf(struct anp_msg *msg, kbuffer *buf);
+void anp_msg_ext_hdr_to_buf(struct anp_msg *msg, uint32_t ext_len, kbuffer *buf);
 void anp_msg_to_buf(struct anp_msg *msg, kbuffer *buf);
 int anp_msg_dump(struct anp_msg *self, kstr *dump_str);
 void anp_msg_write_uint32(struct anp_msg *self, uint32_t i);
@@ -132,5 +201,6 @@ int anp_msg_get_uint32(struct anp_msg *self, int pos, uint32_t *i);
 int anp_msg_get_uint64(struct anp_msg *self, int pos, uint64_t *i);
 int anp_msg_get_kstr(struct anp_msg *self, int pos, kstr *str);
 int anp_msg_get_bin(struct anp_msg *self, int pos, kbuffer *bin);
+int anp_msg_get_bin_view(struct anp_msg *self, int pos, uint8_t **data, uint32_t *len);
 
 #endif
@@ -2,18 +2,43 @@
 
 #include "common.h"
 
+/* This structure describes a segment of the packet being sent. */
+struct anp_tls_seg {
+    
+    /* Buffer containing the data, or NULL if the data is outside a buffer. */
+    kbuffer *buf;
+    
+    /* Address of the data if it is outside a buffer. */
+    uint8_t *data;
+    
+    /* Position of the data in the buffer or from the address above, and size
+     * of the data.
+     */
+    uint32_t pos;
+    uint32_t len;
+};
+
 void anp_tls_init(struct anp_tls_xfer *self) {
     self->in_state = 0;
     self->in_msg = NULL;
+    self->msg_pool = NULL;
     kbuffer_init(&self->in_buf);
     self->out_state = 0;
     kbuffer_init(&self->out_buf);
+    karray_init(&self->out_msg_array);
+    kbuffer_init(&self->out_hdr_buf);
+    kbuffer_init(&self->out_seg_buf);
+    self->out_seg = 0;
+    self->out_seg_pos = 0;
 }
 
 void anp_tls_clean(struct anp_tls_xfer *self) {
     anp_tls_reset(self);
     kbuffer_clean(&self->in_buf);
     kbuffer_clean(&self->out_buf);
+    karray_clean(&self->out_msg_array);
+    kbuffer_clean(&self->out_hdr_buf);
+    kbuffer_clean(&self->out_seg_buf);
 }
 
 void anp_tls_reset(struct anp_tls_xfer *self) {
@@ -58,6 +83,41 @@ void anp_tls_send_msg(struct anp_tls_xfer *self, struct anp_msg *msg) {
     anp_msg_to_buf(msg, &self->out_buf);
 }
 
+/* This function adds a segment to the packet being sent. The data is located at
+ * position 'pos' in 'buf', or from 'data' if 'buf' is NULL. The buffer may grow
+ * until the packet is sent.
+ */
+static void anp_tls_add_out_seg(struct anp_tls_xfer *self, kbuffer *buf, uint8_t *data, uint32_t pos,
+                                uint32_t len) {
+    struct anp_tls_seg seg;
+    
+    if (!len) return;
+    seg.buf = buf;
+    seg.data = data;
+    seg.pos = pos;
+    seg.len = len;
+    kbuffer_write(&self->out_seg_buf, (uint8_t *) &seg, sizeof(seg));
+}
+
+/* This function adds the header of the message specified to the packet being
+ * sent and takes ownership of the message.
+ */
+static void anp_tls_add_out_hdr(struct anp_tls_xfer *self, struct anp_msg *msg, uint32_t ext_len) {
+    uint32_t pos = self->out_hdr_buf.len;
+    anp_msg_ext_hdr_to_buf(msg, ext_len, &self->out_hdr_buf);
+    anp_tls_add_out_seg(self, &self->out_hdr_buf, NULL, pos, ANP_MSG_HDR_SIZE);
+    karray_push(&self->out_msg_array, msg);
+}
+
+/* This function returns the number of segments of the packet being sent. */
+static int anp_tls_get_nb_out_seg(struct anp_tls_xfer *self) {
+    return self->out_seg_buf.len / sizeof(struct anp_tls_seg);
+}
+
+/* This function sends the messages of the array specified in a single packet.
+ * The transfer takes ownership of the messages and the array is reset. Only the
+ * headers of the messages are serialized; the payloads are sent in place.
+ */
 void anp_tls_send_many_msg(struct anp_tls_xfer *self, karray *msg_array) {
     int i;
     
@@ -65,19 +125,125 @@ void anp_tls_send_many_msg(struct anp_tls_xfer *self, karray *msg_array) {
     self->out_state = 1;
     
     for (i = 0; i < msg_array->size; i++) {
-    	anp_msg_to_buf((struct anp_msg *) msg_array->data[i], &self->out_buf);
+        struct anp_msg *msg = (struct anp_msg *) msg_array->data[i];
+        anp_tls_add_out_hdr(self, msg, 0);
+        anp_tls_add_out_seg(self, &msg->payload, NULL, 0, msg->payload.len);
+    }
+    
+    karray_reset(msg_array);
+}
+
+/* This function sends the message specified with the external data of the array
+ * specified (anp_tls_ext_seg) inserted in its payload, sorted by position. The
+ * transfer takes ownership of the message. The external data is not copied; it
+ * is passed to GnuTLS in place.
+ */
+void anp_tls_send_msg_ext(struct anp_tls_xfer *self, struct anp_msg *msg, karray *ext_array) {
+    int i;
+    uint32_t pos = 0, ext_len = 0;
+    
+    anp_tls_flush_send(self);
+    self->out_state = 1;
+    
+    for (i = 0; i < ext_array->size; i++) ext_len += ((struct anp_tls_ext_seg *) ext_array->data[i])->len;
+    anp_tls_add_out_hdr(self, msg, ext_len);
+    
+    for (i = 0; i < ext_array->size; i++) {
+        struct anp_tls_ext_seg *ext = (struct anp_tls_ext_seg *) ext_array->data[i];
+        assert(pos <= ext->pos && ext->pos <= msg->payload.len);
+        anp_tls_add_out_seg(self, &msg->payload, NULL, pos, ext->pos - pos);
+        anp_tls_add_out_seg(self, NULL, ext->data, 0, ext->len);
+        pos = ext->pos;
     }
+    
+    anp_tls_add_out_seg(self, &msg->payload, NULL, pos, msg->payload.len - pos);
 }
 
 void anp_tls_flush_send(struct anp_tls_xfer *self) {
     self->out_state = 0;
     kbuffer_shrink(&self->out_buf, 1024);
+    
+    anp_msg_destroy_array(&self->out_msg_array);
+    kbuffer_shrink(&self->out_hdr_buf, 1024);
+    kbuffer_shrink(&self->out_seg_buf, 1024);
+    self->out_seg = 0;
+    self->out_seg_pos = 0;
+}
+
+/* This function sets the data of the segment specified of the packet being
+ * sent and returns its size.
+ */
+static int anp_tls_get_out_seg(struct anp_tls_xfer *self, int seg, char **data) {
+    struct anp_tls_seg *s = (struct anp_tls_seg *) self->out_seg_buf.data + seg;
+    *data = (char *) (s->buf ? s->buf->data : s->data) + s->pos;
+    return s->len;
+}
+
+/* This function sends the next record of the packet being sent. The segments
+ * smaller than a record are coalesced in the output buffer; the larger ones
+ * are sent in place. The function returns the number of bytes sent, -1 on
+ * failure or -2 if the function should be called again when the socket is ready
+ * for writing.
+ */
+static int anp_tls_send_out(struct anp_tls_xfer *self, struct ktls_conn *conn) {
+    kbuffer *buf = &self->out_buf;
+    int nb_seg = anp_tls_get_nb_out_seg(self);
+    char *data;
+    int len, r;
+    
+    /* Send the data coalesced in the output buffer. */
+    if (buf->pos < buf->len) {
+        r = ktls_send(conn, (char *) buf->data + buf->pos, buf->len - buf->pos);
+        if (r > 0) buf->pos += r;
+        return r;
+    }
+    
+    /* Skip the empty segments. */
+    while (self->out_seg < nb_seg && !anp_tls_get_out_seg(self, self->out_seg, &data)) self->out_seg++;
+    if (self->out_seg == nb_seg) return 0;
+    
+    /* Send a large segment in place. */
+    len = anp_tls_get_out_seg(self, self->out_seg, &data) - self->out_seg_pos;
+    
+    if (len >= ANP_TLS_GATHER_SIZE) {
+        r = ktls_send(conn, data + self->out_seg_pos, len);
+        
+        if (r > 0) {
+            self->out_seg_pos += r;
+            if (r == len) { self->out_seg++; self->out_seg_pos = 0; }
+        }
+        
+        return r;
+    }
+    
+    /* Coalesce the following segments in the output buffer, up to a record. */
+    kbuffer_reset(buf);
+    
+    while (self->out_seg < nb_seg && buf->len < ANP_TLS_GATHER_SIZE) {
+        int n;
+        len = anp_tls_get_out_seg(self, self->out_seg, &data) - self->out_seg_pos;
+        n = MIN(len, ANP_TLS_GATHER_SIZE - buf->len);
+        kbuffer_write(buf, (uint8_t *) data + self->out_seg_pos, n);
+        self->out_seg_pos += n;
+        if (n == len) { self->out_seg++; self->out_seg_pos = 0; }
+    }
+    
+    r = ktls_send(conn, (char *) buf->data, buf->len);
+    if (r > 0) buf->pos += r;
+    return r;
 }
 
 /* Helper method for anp_tls_do_xfer(). */
 static int anp_tls_xfer_state_3(struct anp_tls_xfer *self) {
+    kbuffer tmp;
     assert(self->in_msg);
-    if (anp_msg_parse(self->in_msg, &self->in_buf)) return -1;
+    
+    /* The received data becomes the payload of the message as is. */
+    tmp = self->in_msg->payload;
+    self->in_msg->payload = self->in_buf;
+    self->in_buf = tmp;
+    
+    if (anp_msg_index(self->in_msg)) return -1;
     kbuffer_shrink(&self->in_buf, 1024);
     self->in_state = 3;
     return 0;
@@ -113,7 +279,7 @@ int anp_tls_do_xfer(struct anp_tls_xfer *self, struct ktls_conn *conn) {
 		
 		if (buf->len == ANP_MSG_HDR_SIZE) {
                     assert(self->in_msg == NULL);
-                    self->in_msg = anp_msg_new();
+                    self->in_msg = anp_msg_pool_get(self->msg_pool);
 		    kbuffer_read32(buf, &self->in_msg->major);
 		    kbuffer_read32(buf, &self->in_msg->minor);
 		    kbuffer_read32(buf, &self->in_msg->type);
@@ -158,18 +324,15 @@ int anp_tls_do_xfer(struct anp_tls_xfer *self, struct ktls_conn *conn) {
 
 	if (self->out_state == 1) {
     	    kbuffer *buf = &self->out_buf;
-    	    int r = ktls_send(conn, buf->data + buf->pos, buf->len - buf->pos);
+    	    int r = anp_tls_send_out(self, conn);
 	    
 	    if (r == -1) { error = -1; break; }
 
-	    if (r > 0) {
-		loop = 1;
-		buf->pos += r;
-
-		if (buf->len == buf->pos) {
-		    self->out_state = 2;
-		}
-    	    }
+	    if (r > 0) loop = 1;
+	    
+	    if (buf->len == buf->pos && self->out_seg == anp_tls_get_nb_out_seg(self)) {
+		self->out_state = 2;
+	    }
 	}
     }
     
@@ -3,6 +3,26 @@
 #ifndef _ANP_TLS_H
 #define _ANP_TLS_H
 
+/* Maximum amount of data passed to GnuTLS in a single call when sending, which
+ * is the maximum size of a TLS record. Segments of a packet smaller than this
+ * are coalesced in a single record; larger segments are sent in place.
+ */
+#define ANP_TLS_GATHER_SIZE 16384
+
+/* This structure describes data sent in place in the payload of a message sent
+ * with anp_tls_send_msg_ext(). The data must remain valid until the packet has
+ * been sent.
+ */
+struct anp_tls_ext_seg {
+    
+    /* Position in the payload of the message where the data is inserted. */
+    uint32_t pos;
+    
+    /* Data and its size. */
+    uint8_t *data;
+    uint32_t len;
+};
+
 /* This structure is used to transfer ANP messages with a remote host. */
 struct anp_tls_xfer {
     
@@ -23,6 +43,9 @@ struct anp_tls_xfer {
     /* Pointer to the message received, if any. */
     struct anp_msg *in_msg;
     
+    /* Pool the messages received are allocated from, if any. */
+    struct anp_msg_pool *msg_pool;
+    
     /* State of the outgoing packet.
      * 0: no outgoing packet.
      * 1: packet being sent.
@@ -30,8 +53,31 @@ struct anp_tls_xfer {
      */
     int out_state;
     
-    /* Buffer containing the data of the packet being sent, if any. */
+    /* Buffer containing the data of the packet being sent, if any. When the
+     * packet is sent with anp_tls_send_many_msg() or anp_tls_send_msg_ext(),
+     * this buffer only contains the segments of the packet being coalesced in
+     * the current record.
+     */
     kbuffer out_buf;
+    
+    /* Array of messages (anp_msg) of the packet sent with
+     * anp_tls_send_many_msg() or anp_tls_send_msg_ext(). The messages are
+     * owned by this object until the packet has been sent. Their payload is
+     * not copied.
+     */
+    karray out_msg_array;
+    
+    /* Buffer containing the headers of the messages above. */
+    kbuffer out_hdr_buf;
+    
+    /* Buffer containing the segments (anp_tls_seg) of the packet, in order. */
+    kbuffer out_seg_buf;
+    
+    /* Index of the next segment of the packet to send and position in that
+     * segment.
+     */
+    int out_seg;
+    int out_seg_pos;
 };
 
 static inline int anp_tls_receiving(struct anp_tls_xfer *self) { return (self->in_state > 0); }
@@ -48,6 +94,7 @@ struct anp_msg * anp_tls_get_recv(struct anp_tls_xfer *self);
 void anp_tls_flush_recv(struct anp_tls_xfer *self);
 void anp_tls_send_msg(struct anp_tls_xfer *self, struct anp_msg *msg);
 void anp_tls_send_many_msg(struct anp_tls_xfer *self, karray *msg_array);
+void anp_tls_send_msg_ext(struct anp_tls_xfer *self, struct anp_msg *msg, karray *ext_array);
 void anp_tls_flush_send(struct anp_tls_xfer *self);
 int anp_tls_has_xfer(struct anp_tls_xfer *self);
 int anp_tls_do_xfer(struct anp_tls_xfer *self, struct ktls_conn *conn);
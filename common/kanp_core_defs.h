@@ -5,7 +5,7 @@
 
 /* Current KANP version. */
 #define KANP_MAJOR_VERSION   	        0u
-#define KANP_MINOR_VERSION   	        6u
+#define KANP_MINOR_VERSION   	        8u
 
 /* Version history:
  * 1: 2008-2009: Initial version.
@@ -16,6 +16,8 @@
  *               transient events. Added thin KFS flag.
  * 5: nov 2009:  Added error code in VNC end session and the freemium call.
  * 6: feb 2010:  Added expiration delay in GET_UURL. Added email ID in GET_UURL result.
+ * 7: oct 2026:  Added resumable and parallel KFS uploads.
+ * 8: oct 2026:  Added the KFS upload hash types.
  */
  
 /* Compatibility notes:
@@ -473,6 +475,12 @@
 #define KANP_KFS_SUBMESSAGE_CHUNK       2
 #define KANP_KFS_SUBMESSAGE_COMMIT      3
 #define KANP_KFS_SUBMESSAGE_ABORT       4
+#define KANP_KFS_SUBMESSAGE_SKIP        5
+#define KANP_KFS_SUBMESSAGE_HASH        6
+
+/* KFS hash types. */
+#define KANP_KFS_HASH_MD5               1
+#define KANP_KFS_HASH_SHA256            2
 
 /* Obtain a ticket to download files from a share.
  *   UINT64 Workspace ID.
@@ -587,16 +595,58 @@
  * file currently being uploaded.
  *   UINT32 Number of elements in this message (for compatibility).
  *   UINT32 Submessage type ("commit").
- *   BIN    File hash (checked for sanity).
+ *   BIN    File hash (checked for sanity), of the type selected.
  *
  * Submessage "abort": this submessage is sent to abort the transfer of
  * the file being uploaded. It can be sent before or between the
  * transfer of the chunks.
  *   UINT32 Number of elements in this message (for compatibility).
  *   UINT32 Submessage type ("abort").
+ *
+ * Submessage "skip" (added in version 7): this submessage is sent to leave the
+ * file being uploaded to another connection (see KANP_CMD_KFS_UPLOAD_JOIN). The
+ * data received for the file is kept. The file is released when the RES_OK
+ * reply of the command is sent.
+ *   UINT32 Number of elements in this message (for compatibility).
+ *   UINT32 Submessage type ("skip").
+ *
+ * Submessage "hash" (added in version 8): this submessage selects the type of
+ * the hash used to check the files that follow. The MD5 hash is used by
+ * default. The SHA-256 hash is cheaper to check since the KCD computes it in
+ * any case. This submessage cannot be sent while a file is partially uploaded.
+ *   UINT32 Number of elements in this message (for compatibility).
+ *   UINT32 Submessage type ("hash").
+ *   UINT32 Hash type.
+ *
+ * The files of an upload are committed as they are received. If the connection
+ * is lost, the data received for the file being uploaded is kept and the upload
+ * can be resumed with KANP_CMD_KFS_UPLOAD_JOIN. The upload expires if no
+ * connection refreshes it for 30 minutes. The files that a client of version 6
+ * or earlier did not upload are aborted when its connection is lost.
  */
 #define KANP_CMD_KFS_PHASE_2	        (KANP_PROTO | KANP_CMD | KANP_NS_KFS | (5 << 8))
 
+/* Join an upload in progress (added in version 7). This command is sent
+ * instead of KANP_CMD_KFS_PHASE_1 on the connection of a new upload ticket, to
+ * upload some files of the upload in parallel with the connection that
+ * performed phase 1, or to resume the upload after a connection was lost. A
+ * file can be joined if it is not uploaded by another connection, i.e. if it
+ * has been skipped or if its connection was lost or stalled for 3 minutes.
+ *   BIN    Upload ticket.
+ *   UINT64 Commit ID.
+ *   UINT32 Number of files to upload.
+ *     UINT64 Inode.
+ */
+#define KANP_CMD_KFS_UPLOAD_JOIN        (KANP_PROTO | KANP_CMD | KANP_NS_KFS | (6 << 8))
+
+/* Result of the command above. The files are then uploaded in the order
+ * requested with KANP_CMD_KFS_PHASE_2 commands, starting at the offset
+ * returned for each file.
+ *   UINT32 Number of files.
+ *     UINT64 Size of the data already received for the file.
+ */
+#define KANP_RES_KFS_UPLOAD_JOIN        (KANP_PROTO | KANP_RES | KANP_NS_KFS | (6 << 8))
+
 
 /* Obtain a ticket to reconnect to the KCD in server-side application sharing
  * mode.
@@ -861,7 +911,8 @@
  */
 #define KANP_EVT_KFS_PHASE_1    	(KANP_PROTO | KANP_EVT | KANP_NS_KFS | (1 << 8))
 
-/* Files have been uploaded (phase 2).
+/* Files have been uploaded (phase 2). The version of the event is 8 if a file
+ * hash is a SHA-256 hash.
  *   UINT64 Workspace ID.
  *   UINT64 Date (seconds since UNIX epoch).
  *   UINT32 User ID.
@@ -870,7 +921,7 @@
  *   UINT32 Number of files uploaded (same order as in KANP_EVT_KFS_PHASE_1).
  *     UINT64 Inode.
  *     UINT64 File size.
- *     BIN    File hash.
+ *     BIN    File hash (MD5, or SHA-256 if its size is 32 bytes).
  */
 #define KANP_EVT_KFS_PHASE_2    	(KANP_PROTO | KANP_EVT | KANP_NS_KFS | (2 << 8))
 
@@ -152,14 +152,10 @@ void kdaemon_prepare_select(struct kselect *sel) {
     sel->tv.tv_sec = 1000000;
 }
 
-/* This function adds the quit and the signal socket in the read set of select()
- * so that a call to select() doesn't block when a signal is received, and then
- * it waits for something to happen in select(). This function returns -1 if
- * it's time to quit, otherwise it returns 0. The KMOD error string is set when
- * it's time to quit. The signal socket, if any, is drained after the call to
- * select() has been made.
+/* Helper for kdaemon_do_select() and kdaemon_do_persistent_select(). The
+ * select set is waited upon with the poll set specified, if any.
  */
-int kdaemon_do_select(struct kselect *sel) {
+static int kdaemon_do_select_internal(struct kselect *sel, struct kpoll *poll) {
     int quit_sock = global_opts.quit_sock[1];
     int signal_sock = global_opts.signal_sock[1];
     
@@ -170,7 +166,8 @@ int kdaemon_do_select(struct kselect *sel) {
     
     kselect_add_read(sel, quit_sock);
     kselect_add_read(sel, signal_sock);
-    kselect_wait(sel);
+    
+    if (poll ? kpoll_wait_select(poll, sel) : kselect_wait(sel)) return -1;
     
     if (kselect_in_read(sel, quit_sock)) {
 	global_opts.quit_flag = 1;
@@ -191,6 +188,68 @@ int kdaemon_do_select(struct kselect *sel) {
     return 0;
 }
 
+/* This function adds the quit and the signal socket in the read set of select()
+ * so that a call to select() doesn't block when a signal is received, and then
+ * it waits for something to happen in select(). This function returns -1 if
+ * it's time to quit or if the select set is full, otherwise it returns 0. The
+ * KMOD error string is set when it's time to quit. The signal socket, if any,
+ * is drained after the call to select() has been made.
+ */
+int kdaemon_do_select(struct kselect *sel) {
+    return kdaemon_do_select_internal(sel, NULL);
+}
+
+/* Same as kdaemon_do_select(), but the descriptors of the select set are
+ * registered persistently in the poll set specified, which the caller keeps for
+ * the lifetime of its loop. See kpoll_wait_select().
+ */
+int kdaemon_do_persistent_select(struct kselect *sel, struct kpoll *poll) {
+    return kdaemon_do_select_internal(sel, poll);
+}
+
+/* This function registers the quit and the signal sockets in the poll set
+ * specified and sets the timeout to 1000000 seconds. The registration is only
+ * made once.
+ */
+void kdaemon_prepare_poll(struct kpoll *poll) {
+    kpoll_set(poll, global_opts.quit_sock[1], KSELECT_READ);
+    kpoll_set(poll, global_opts.signal_sock[1], KSELECT_READ);
+    poll->tv.tv_sec = 1000000;
+    poll->tv.tv_usec = 0;
+}
+
+/* Same as kdaemon_do_select(), for a poll set prepared with
+ * kdaemon_prepare_poll().
+ */
+int kdaemon_do_poll(struct kpoll *poll) {
+    int signal_sock = global_opts.signal_sock[1];
+    
+    if (global_opts.quit_flag) {
+	kmod_set_error("must quit");
+	return -1;
+    }
+    
+    kpoll_wait(poll);
+    
+    if (kpoll_get(poll, global_opts.quit_sock[1])) {
+	global_opts.quit_flag = 1;
+	kmod_set_error("must quit");
+	return -1;
+    }
+    
+    if (kpoll_get(poll, signal_sock)) {
+        while (1) {
+            char buf[1000];
+            uint32_t len = 1000;
+            int error = ksock_read(signal_sock, buf, &len);
+            if (error == -1) kerror_fatal("cannot drain signal socket: %s", kerror_syserror());
+            if (error == -2) break;
+        }
+    }
+    
+    return 0;
+}
+
 void kdaemon_lock_file_init(struct kdaemon_lock_file *self) {
     memset(self, 0, sizeof(struct kdaemon_lock_file));
     kstr_init(&self->path);
@@ -37,6 +37,9 @@ void kdaemon_unblock_signals();
 void kdaemon_register_signal();
 void kdaemon_prepare_select(struct kselect *sel);
 int kdaemon_do_select(struct kselect *sel);
+int kdaemon_do_persistent_select(struct kselect *sel, struct kpoll *poll);
+void kdaemon_prepare_poll(struct kpoll *poll);
+int kdaemon_do_poll(struct kpoll *poll);
 void kdaemon_lock_file_init(struct kdaemon_lock_file *self);
 void kdaemon_lock_file_clean(struct kdaemon_lock_file *self);
 int kdaemon_lock_file_exist(struct kdaemon_lock_file *self);
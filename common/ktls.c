@@ -1,5 +1,9 @@
 /* Copyright (C) 2006-2012 Opersys inc., All rights reserved. */
 
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "common.h"
 
 /* This function sets the KMOD error string based on the error that occurred on
@@ -9,12 +13,380 @@ static void ktls_import_tls_err(int error) {
     kmod_set_error("%s", gnutls_strerror(error));
 }
 
+/* Entry of the session cache. */
+struct ktls_cache_entry {
+    
+    /* Mutex protecting the entry. */
+    pthread_mutex_t mutex;
+    
+    /* Time at which the session expires. */
+    time_t expire;
+    
+    /* Session identifier and session data. The entry is empty if 'key_len' is
+     * 0.
+     */
+    uint32_t key_len;
+    uint32_t data_len;
+    uint8_t key[KTLS_CACHE_KEY_SIZE];
+    uint8_t data[KTLS_CACHE_DATA_SIZE];
+};
+
+/* Server state shared by all the processes of the server. It is kept in a
+ * shared memory segment mapped before the processes are forked.
+ */
+struct ktls_server_shared {
+    struct ktls_server_stats stats;
+    
+    /* Mutex protecting the session ticket key. */
+    pthread_mutex_t key_mutex;
+    
+    /* Current session ticket key and the time it was generated. */
+    time_t key_time;
+    uint32_t key_len;
+    uint8_t key[KTLS_TICKET_KEY_MAX_SIZE];
+    
+    /* Session cache. A session is stored in the entry selected by the hash of
+     * its identifier, replacing the previous session stored there.
+     */
+    int nb_entry;
+    struct ktls_cache_entry entry_array[];
+};
+
+/* Server state of this process. */
+static struct ktls_server {
+    
+    /* Shared state, NULL if ktls_server_init() has not been called. */
+    struct ktls_server_shared *shared;
+    
+    /* Anonymous credentials and Diffie-Hellman parameters, generated once and
+     * inherited by the forked processes.
+     */
+    gnutls_anon_server_credentials_t anon_cred;
+    gnutls_dh_params_t dh_params;
+    
+    /* Current certificate credentials, if any. */
+    struct ktls_cert_cred *cert;
+} ktls_server;
+
+/* This function initializes a mutex in shared memory. The mutex is robust: a
+ * process killed while holding it does not block the other processes.
+ */
+static void ktls_shared_mutex_init(pthread_mutex_t *mutex) {
+    pthread_mutexattr_t attr;
+    
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    
+    if (pthread_mutex_init(mutex, &attr)) kerror_fatal("cannot initialize TLS shared mutex");
+    
+    pthread_mutexattr_destroy(&attr);
+}
+
+/* Lock and unlock a mutex in shared memory. The mutexes are only held while
+ * data is copied. The lock function returns true if the previous owner died
+ * while holding the mutex, in which case the data protected may be
+ * half-written and must be reset by the caller.
+ */
+static int ktls_shared_mutex_lock(pthread_mutex_t *mutex) {
+    int r = pthread_mutex_lock(mutex);
+    
+    if (r == EOWNERDEAD) {
+        pthread_mutex_consistent(mutex);
+        return 1;
+    }
+    
+    if (r) kerror_fatal("cannot lock TLS shared mutex: %s", strerror(r));
+    
+    return 0;
+}
+
+static void ktls_shared_mutex_unlock(pthread_mutex_t *mutex) {
+    pthread_mutex_unlock(mutex);
+}
+
+/* This function returns the cache entry used to store the session having the
+ * identifier specified.
+ */
+static struct ktls_cache_entry * ktls_cache_get_entry(gnutls_datum_t *key) {
+    uint32_t hash = 2166136261u;
+    unsigned int i;
+    
+    for (i = 0; i < key->size; i++) hash = (hash ^ key->data[i]) * 16777619u;
+    
+    return ktls_server.shared->entry_array + hash % ktls_server.shared->nb_entry;
+}
+
+/* GnuTLS callback storing a session in the cache. */
+static int ktls_cache_store(void *ptr, gnutls_datum_t key, gnutls_datum_t data) {
+    struct ktls_cache_entry *entry;
+    
+    if (key.size == 0 || key.size > KTLS_CACHE_KEY_SIZE || data.size > KTLS_CACHE_DATA_SIZE) return -1;
+    
+    entry = ktls_cache_get_entry(&key);
+    
+    ktls_shared_mutex_lock(&entry->mutex);
+    entry->expire = time(NULL) + KTLS_SESSION_LIFETIME;
+    entry->key_len = key.size;
+    entry->data_len = data.size;
+    memcpy(entry->key, key.data, key.size);
+    memcpy(entry->data, data.data, data.size);
+    ktls_shared_mutex_unlock(&entry->mutex);
+    
+    __sync_fetch_and_add(&ktls_server.shared->stats.nb_cache_store, 1);
+    
+    return 0;
+}
+
+/* GnuTLS callback retrieving a session from the cache. The data returned is
+ * freed by GnuTLS.
+ */
+static gnutls_datum_t ktls_cache_retrieve(void *ptr, gnutls_datum_t key) {
+    gnutls_datum_t data = { NULL, 0 };
+    struct ktls_cache_entry *entry;
+    
+    if (key.size == 0 || key.size > KTLS_CACHE_KEY_SIZE) return data;
+    
+    entry = ktls_cache_get_entry(&key);
+    
+    if (ktls_shared_mutex_lock(&entry->mutex)) entry->key_len = 0;
+    
+    if (entry->key_len == key.size && !memcmp(entry->key, key.data, key.size) && entry->expire > time(NULL)) {
+        data.data = gnutls_malloc(entry->data_len);
+        
+        if (data.data) {
+            data.size = entry->data_len;
+            memcpy(data.data, entry->data, entry->data_len);
+        }
+    }
+    
+    ktls_shared_mutex_unlock(&entry->mutex);
+    
+    if (data.data) __sync_fetch_and_add(&ktls_server.shared->stats.nb_cache_hit, 1);
+    else __sync_fetch_and_add(&ktls_server.shared->stats.nb_cache_miss, 1);
+    
+    return data;
+}
+
+/* GnuTLS callback removing a session from the cache. */
+static int ktls_cache_remove(void *ptr, gnutls_datum_t key) {
+    int error = -1;
+    struct ktls_cache_entry *entry;
+    
+    if (key.size == 0 || key.size > KTLS_CACHE_KEY_SIZE) return -1;
+    
+    entry = ktls_cache_get_entry(&key);
+    
+    if (ktls_shared_mutex_lock(&entry->mutex)) entry->key_len = 0;
+    
+    if (entry->key_len == key.size && !memcmp(entry->key, key.data, key.size)) {
+        entry->key_len = 0;
+        error = 0;
+    }
+    
+    ktls_shared_mutex_unlock(&entry->mutex);
+    
+    return error;
+}
+
+/* This function generates the anonymous credentials of the server, if they
+ * have not been generated yet.
+ */
+static int ktls_server_load_anon_cred() {
+    int r;
+    
+    if (ktls_server.anon_cred) return 0;
+    
+    do {
+        r = gnutls_dh_params_init(&ktls_server.dh_params);
+        if (r) break;
+        
+        r = gnutls_dh_params_generate2(ktls_server.dh_params, 768);
+        if (r) break;
+        
+        r = gnutls_anon_allocate_server_credentials(&ktls_server.anon_cred);
+        if (r) break;
+        
+        gnutls_anon_set_server_dh_params(ktls_server.anon_cred, ktls_server.dh_params);
+        
+    } while (0);
+    
+    if (r) {
+        ktls_import_tls_err(r);
+        
+        if (ktls_server.dh_params) {
+            gnutls_dh_params_deinit(ktls_server.dh_params);
+            ktls_server.dh_params = NULL;
+        }
+        
+        return -1;
+    }
+    
+    return 0;
+}
+
+/* This function releases a reference to the certificate credentials
+ * specified. The credentials are freed when they are no longer used and they
+ * have been replaced.
+ */
+static void ktls_cert_cred_release(struct ktls_cert_cred *cert) {
+    if (__sync_sub_and_fetch(&cert->ref_count, 1)) return;
+    
+    gnutls_certificate_free_credentials(cert->cred);
+    kstr_clean(&cert->cert_path);
+    kstr_clean(&cert->key_path);
+    kfree(cert);
+}
+
+/* This function returns a reference to the certificate credentials loaded from
+ * the files specified. The credentials are loaded again if the paths or the
+ * modification times of the files have changed.
+ */
+static int ktls_server_get_cert_cred(char *cert_path, char *key_path, struct ktls_cert_cred **cert_handle) {
+    int r;
+    struct stat cert_st, key_st;
+    struct ktls_cert_cred *cert = ktls_server.cert;
+    
+    if (stat(cert_path, &cert_st) || stat(key_path, &key_st)) {
+        kmod_set_error("cannot stat certificate: %s", kerror_syserror());
+        return -1;
+    }
+    
+    if (cert && !strcmp(cert->cert_path.data, cert_path) && !strcmp(cert->key_path.data, key_path) &&
+        cert->cert_mtime == cert_st.st_mtime && cert->key_mtime == key_st.st_mtime) {
+        __sync_fetch_and_add(&cert->ref_count, 1);
+        *cert_handle = cert;
+        return 0;
+    }
+    
+    cert = (struct ktls_cert_cred *) kcalloc(sizeof(struct ktls_cert_cred));
+    cert->ref_count = 1;
+    kstr_init_cstr(&cert->cert_path, cert_path);
+    kstr_init_cstr(&cert->key_path, key_path);
+    cert->cert_mtime = cert_st.st_mtime;
+    cert->key_mtime = key_st.st_mtime;
+    
+    do {
+        r = gnutls_certificate_allocate_credentials(&cert->cred);
+        if (r) break;
+        
+        r = gnutls_certificate_set_x509_trust_file(cert->cred, cert_path, GNUTLS_X509_FMT_PEM);
+        if (r < 0) break;
+        
+        r = gnutls_certificate_set_x509_key_file(cert->cred, cert_path, key_path, GNUTLS_X509_FMT_PEM);
+        if (r) break;
+        
+    } while (0);
+    
+    if (r < 0) {
+        ktls_import_tls_err(r);
+        if (cert->cred) gnutls_certificate_free_credentials(cert->cred);
+        kstr_clean(&cert->cert_path);
+        kstr_clean(&cert->key_path);
+        kfree(cert);
+        return -1;
+    }
+    
+    /* Replace the current credentials. */
+    if (ktls_server.cert) ktls_cert_cred_release(ktls_server.cert);
+    ktls_server.cert = cert;
+    
+    __sync_fetch_and_add(&cert->ref_count, 1);
+    *cert_handle = cert;
+    
+    return 0;
+}
+
+/* This function copies the current session ticket key in the buffer
+ * specified, replacing the key first if it is too old. It returns the size of
+ * the key, or 0 if no key could be generated.
+ */
+static uint32_t ktls_server_get_ticket_key(uint8_t *buf) {
+    struct ktls_server_shared *shared = ktls_server.shared;
+    uint32_t key_len;
+    
+    /* Generate a new key if the previous owner of the mutex died while it
+     * was replacing the key.
+     */
+    if (ktls_shared_mutex_lock(&shared->key_mutex)) shared->key_len = 0;
+    
+    if (!shared->key_len || time(NULL) - shared->key_time >= KTLS_TICKET_KEY_LIFETIME) {
+        gnutls_datum_t key = { NULL, 0 };
+        
+        if (!gnutls_session_ticket_key_generate(&key)) {
+            shared->key_len = MIN(key.size, KTLS_TICKET_KEY_MAX_SIZE);
+            memcpy(shared->key, key.data, shared->key_len);
+            shared->key_time = time(NULL);
+            shared->stats.nb_key_rotation++;
+            gnutls_free(key.data);
+        }
+    }
+    
+    key_len = shared->key_len;
+    memcpy(buf, shared->key, key_len);
+    
+    ktls_shared_mutex_unlock(&shared->key_mutex);
+    
+    return key_len;
+}
+
+/* This function sets up the server state shared by the processes that will be
+ * forked. It must be called before the processes are forked. The anonymous
+ * credentials are generated, the session ticket key and the statistics are
+ * placed in shared memory, and a session cache of 'nb_cache_entry' entries is
+ * created. The cache is disabled if 'nb_cache_entry' is 0.
+ */
+void ktls_server_init(int nb_cache_entry) {
+    size_t size;
+    int i;
+    
+    if (ktls_server_load_anon_cred()) kmod_log_msg(KCD_LOG_BRIEF, "Cannot generate DH parameters: %s.\n", kmod_strerror());
+    
+    nb_cache_entry = MAX(nb_cache_entry, 0);
+    size = sizeof(struct ktls_server_shared) + nb_cache_entry * sizeof(struct ktls_cache_entry);
+    ktls_server.shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (ktls_server.shared == MAP_FAILED) kerror_fatal("cannot map TLS session cache: %s", kerror_syserror());
+    memset(ktls_server.shared, 0, size);
+    ktls_server.shared->nb_entry = nb_cache_entry;
+    
+    ktls_shared_mutex_init(&ktls_server.shared->key_mutex);
+    for (i = 0; i < nb_cache_entry; i++) ktls_shared_mutex_init(&ktls_server.shared->entry_array[i].mutex);
+}
+
+/* This function copies the server statistics in 'stats'. */
+void ktls_server_get_stats(struct ktls_server_stats *stats) {
+    if (ktls_server.shared) *stats = ktls_server.shared->stats;
+    else memset(stats, 0, sizeof(struct ktls_server_stats));
+}
+
+/* This function logs the server statistics. */
+void ktls_server_log_stats() {
+    struct ktls_server_stats stats;
+    uint64_t nb_handshake;
+    
+    ktls_server_get_stats(&stats);
+    nb_handshake = stats.nb_full_handshake + stats.nb_resumed_handshake;
+    
+    kmod_log_msg(KCD_LOG_BRIEF, "TLS: "PRINTF_64"u handshakes, "PRINTF_64"u resumed ("PRINTF_64"u%%), "
+                 "cache "PRINTF_64"u hits, "PRINTF_64"u misses, "PRINTF_64"u stores, "
+                 PRINTF_64"u ticket key rotations.\n",
+                 nb_handshake,
+                 stats.nb_resumed_handshake,
+                 (uint64_t) (nb_handshake ? stats.nb_resumed_handshake * 100 / nb_handshake : 0),
+                 stats.nb_cache_hit,
+                 stats.nb_cache_miss,
+                 stats.nb_cache_store,
+                 stats.nb_key_rotation);
+}
+
 void ktls_init(struct ktls_conn *self) {
     self->session = NULL;
     self->cert_cred = NULL;
     self->client_anon_cred = NULL;
     self->server_anon_cred = NULL;
     self->server_dh_params = NULL;
+    self->server_flag = 0;
+    self->shared_cert = NULL;
 }
 
 void ktls_clean(struct ktls_conn *self) {
@@ -51,17 +423,27 @@ void ktls_reset(struct ktls_conn *self) {
         gnutls_dh_params_deinit(self->server_dh_params);
         self->server_dh_params = NULL;
     }
+    
+    if (self->shared_cert) {
+        ktls_cert_cred_release(self->shared_cert);
+        self->shared_cert = NULL;
+    }
+    
+    self->server_flag = 0;
 }
  
 /* This function setups the connection for use on the server side. The function
  * accepts unauthenticated connections if requested, and authenticated
- * connections if 'cert_path' is non-null.
+ * connections if 'cert_path' is non-null. The credentials are shared by the
+ * connections of the process. If ktls_server_init() has been called, the
+ * sessions can be resumed with a session ticket or from the session cache.
  */
 int ktls_setup_server(struct ktls_conn *self, int sock, char *cert_path, char *key_path, int anon_flag) {
     int error = -1;
     
     ktls_reset(self);
     self->sock = sock;
+    self->server_flag = 1;
     
     /* Cipher suites reported by gnutls_cipher_suite_get_name() after handshake:
      * - With cert: RSA_AES_256_CBC_SHA1.
@@ -100,36 +482,40 @@ int ktls_setup_server(struct ktls_conn *self, int sock, char *cert_path, char *k
         if (r) { ktls_import_tls_err(r); break; }
         
         if (anon_flag) {
-            r = gnutls_anon_allocate_server_credentials(&self->server_anon_cred);
-            if (r) { ktls_import_tls_err(r); break; }
+            if (ktls_server_load_anon_cred()) break;
             
-            r = gnutls_dh_params_init(&self->server_dh_params);
-            if (r) { ktls_import_tls_err(r); break; }
-            
-            r = gnutls_dh_params_generate2(self->server_dh_params, 768);
-            if (r) { ktls_import_tls_err(r); break; }
-            
-            gnutls_anon_set_server_dh_params(self->server_anon_cred, self->server_dh_params);
-            
-            r = gnutls_credentials_set(self->session, GNUTLS_CRD_ANON, self->server_anon_cred);
+            r = gnutls_credentials_set(self->session, GNUTLS_CRD_ANON, ktls_server.anon_cred);
             if (r) { ktls_import_tls_err(r); break; }
             
             gnutls_dh_set_prime_bits(self->session, 768);
     	}
         
 	if (cert_flag) {
-	    r = gnutls_certificate_allocate_credentials(&self->cert_cred);
-	    if (r) { ktls_import_tls_err(r); break; }
+	    if (ktls_server_get_cert_cred(cert_path, key_path, &self->shared_cert)) break;
 	    
-	    r = gnutls_certificate_set_x509_trust_file(self->cert_cred, cert_path, GNUTLS_X509_FMT_PEM);
-	    if (r < 0) { ktls_import_tls_err(r); break; }
-	    
-	    r = gnutls_certificate_set_x509_key_file(self->cert_cred, cert_path, key_path, GNUTLS_X509_FMT_PEM);
-	    if (r) { ktls_import_tls_err(r); break; }
-	    
-	    r = gnutls_credentials_set(self->session, GNUTLS_CRD_CERTIFICATE, self->cert_cred);
+	    r = gnutls_credentials_set(self->session, GNUTLS_CRD_CERTIFICATE, self->shared_cert->cred);
     	    if (r) { ktls_import_tls_err(r); break; }
 	}
+        
+        /* Enable session resumption. */
+        if (ktls_server.shared) {
+            gnutls_datum_t key;
+            
+            key.data = self->ticket_key;
+            key.size = ktls_server_get_ticket_key(self->ticket_key);
+            
+            if (key.size) {
+                r = gnutls_session_ticket_enable_server(self->session, &key);
+                if (r) { ktls_import_tls_err(r); break; }
+            }
+            
+            if (ktls_server.shared->nb_entry) {
+                gnutls_db_set_retrieve_function(self->session, ktls_cache_retrieve);
+                gnutls_db_set_store_function(self->session, ktls_cache_store);
+                gnutls_db_set_remove_function(self->session, ktls_cache_remove);
+                gnutls_db_set_cache_expiration(self->session, KTLS_SESSION_LIFETIME);
+            }
+        }
 	
 	error = 0;
 	
@@ -208,6 +594,13 @@ int ktls_perform_handshake(struct ktls_conn *self) {
     int r = gnutls_handshake(self->session);
     
     if (! r) {
+        if (self->server_flag && ktls_server.shared) {
+            if (gnutls_session_is_resumed(self->session))
+                __sync_fetch_and_add(&ktls_server.shared->stats.nb_resumed_handshake, 1);
+            else
+                __sync_fetch_and_add(&ktls_server.shared->stats.nb_full_handshake, 1);
+        }
+        
     	return 0;
     }
     
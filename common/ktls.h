@@ -3,6 +3,66 @@
 #ifndef _KTLS_H
 #define _KTLS_H
 
+/* Maximum size of a session ticket key. */
+#define KTLS_TICKET_KEY_MAX_SIZE    64
+
+/* Lifetime of a session ticket key, in seconds. The key is replaced when it
+ * gets older than this.
+ */
+#define KTLS_TICKET_KEY_LIFETIME    (12*60*60)
+
+/* Lifetime of a session stored in the session cache, in seconds. */
+#define KTLS_SESSION_LIFETIME       (8*60*60)
+
+/* Maximum size of the session identifier and of the session data stored in an
+ * entry of the session cache.
+ */
+#define KTLS_CACHE_KEY_SIZE         32
+#define KTLS_CACHE_DATA_SIZE        2048
+
+/* Server-side TLS statistics, shared by all the processes of the server. */
+struct ktls_server_stats {
+    
+    /* Number of handshakes that were completed in full and number of
+     * handshakes that resumed a previous session.
+     */
+    uint64_t nb_full_handshake;
+    uint64_t nb_resumed_handshake;
+    
+    /* Number of lookups in the session cache that succeeded and failed. The
+     * resumptions that are not cache hits were done with a session ticket.
+     */
+    uint64_t nb_cache_hit;
+    uint64_t nb_cache_miss;
+    
+    /* Number of sessions stored in the session cache. */
+    uint64_t nb_cache_store;
+    
+    /* Number of times the session ticket key was replaced. */
+    uint64_t nb_key_rotation;
+};
+
+/* Certificate credentials shared by the server connections of a process. The
+ * credentials live in the memory of the process, not in the segment shared by
+ * the processes of the server: each process loads its own copy.
+ */
+struct ktls_cert_cred {
+    gnutls_certificate_credentials_t cred;
+    
+    /* Number of connections using the credentials, updated atomically since
+     * the connections may be cleaned up by other threads of the process.
+     */
+    volatile int ref_count;
+    
+    /* Paths and modification times of the files the credentials were loaded
+     * from, to reload them when they change.
+     */
+    kstr cert_path;
+    kstr key_path;
+    time_t cert_mtime;
+    time_t key_mtime;
+};
+
 struct ktls_conn {
 
     /* Socket, when the connection is open. */
@@ -20,6 +80,17 @@ struct ktls_conn {
     /* Server anonymous credentials, if any. */
     gnutls_anon_server_credentials_t server_anon_cred;
     gnutls_dh_params_t server_dh_params;
+    
+    /* True if this is a server connection. */
+    int server_flag;
+    
+    /* Shared certificate credentials used by the server connection, if
+     * any.
+     */
+    struct ktls_cert_cred *shared_cert;
+    
+    /* Copy of the session ticket key used by the server connection. */
+    uint8_t ticket_key[KTLS_TICKET_KEY_MAX_SIZE];
 };
 
 void ktls_init(struct ktls_conn *self);
@@ -31,5 +102,8 @@ int ktls_perform_handshake(struct ktls_conn *self);
 int ktls_recv(struct ktls_conn *self, char *buf, int len);
 int ktls_send(struct ktls_conn *self, char *buf, int len);
 int ktls_handshake_loop(struct ktls_conn *self);
+void ktls_server_init(int nb_cache_entry);
+void ktls_server_get_stats(struct ktls_server_stats *stats);
+void ktls_server_log_stats();
 
 #endif
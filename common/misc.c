@@ -1,35 +1,331 @@
 /* Copyright (C) 2006-2012 Opersys inc., All rights reserved. */
 
+#ifdef __linux__
+#include <limits.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#endif
 #include "common.h"
 
-/* Helper function for kselect_wait(). It turns out the kernel doesn't clear the
- * select sets when select() returns EINTR.
+/* This function returns the entry of the descriptor specified in the array
+ * specified, or NULL if there is none.
  */
-static void kselect_interrupt_clear(struct kselect *self) {
-    FD_ZERO(&self->read_set);
-    FD_ZERO(&self->write_set);
-    FD_ZERO(&self->error_set);
+static struct kselect_fd * kselect_find(struct kselect_fd *fd_array, int nb_fd, int fd) {
+    int i;
+    
+    for (i = 0; i < nb_fd; i++) {
+        if (fd_array[i].fd == fd) return fd_array + i;
+    }
+    
+    return NULL;
 }
 
-void kselect_wait(struct kselect *self) {
-    int error = select(self->max_fd + 1, &self->read_set, &self->write_set, &self->error_set, &self->tv);
+#ifndef __linux__
+/* This function waits with select() for the events requested on the
+ * descriptors specified. The events that occurred are set in the entries.
+ */
+static void kselect_wait_select(struct kselect_fd *fd_array, int nb_fd, struct timeval *tv) {
+    fd_set read_set, write_set, error_set;
+    int i, error, max_fd = 0;
+    
+    FD_ZERO(&read_set);
+    FD_ZERO(&write_set);
+    FD_ZERO(&error_set);
+    
+    for (i = 0; i < nb_fd; i++) {
+        struct kselect_fd *f = fd_array + i;
+        f->revents = 0;
+        
+        #ifdef __UNIX__
+        if (f->fd >= FD_SETSIZE) kerror_fatal("descriptor %d is too large for select()", f->fd);
+        #endif
+        
+        if (f->events & KSELECT_READ) FD_SET((unsigned int) f->fd, &read_set);
+        if (f->events & KSELECT_WRITE) FD_SET((unsigned int) f->fd, &write_set);
+        FD_SET((unsigned int) f->fd, &error_set);
+        max_fd = MAX(f->fd, max_fd);
+    }
+    
+    error = select(max_fd + 1, &read_set, &write_set, &error_set, tv);
 
     if (error < 0) {
 	
 	#ifdef __UNIX__
 	/* Ignore EINTR. */
-	if (errno == EINTR) {
-	    kselect_interrupt_clear(self);
-	    return;
-	}
+	if (errno == EINTR) return;
 	#else
-	if (WSAGetLastError() == WSAEINTR || WSAGetLastError() == WSAEINPROGRESS) {
-	    kselect_interrupt_clear(self);
-	    return;
-        }
+	if (WSAGetLastError() == WSAEINTR || WSAGetLastError() == WSAEINPROGRESS) return;
 	#endif
 	
 	/* We can't handle other errors. */
 	kerror_fatal("select() failed: %s", kmod_neterror());
     }
+    
+    for (i = 0; i < nb_fd; i++) {
+        struct kselect_fd *f = fd_array + i;
+        if (FD_ISSET(f->fd, &read_set)) f->revents |= KSELECT_READ;
+        if (FD_ISSET(f->fd, &write_set)) f->revents |= KSELECT_WRITE;
+        if (FD_ISSET(f->fd, &error_set)) f->revents |= KSELECT_ERROR;
+    }
+}
+#else
+/* This function converts a timeout to milliseconds, rounding up. */
+static int kselect_timeout_msec(struct timeval *tv) {
+    int64_t msec = (int64_t) tv->tv_sec * 1000 + (tv->tv_usec + 999) / 1000;
+    return (int) MIN(msec, (int64_t) INT_MAX);
+}
+
+/* This function waits with poll() for the events requested on the descriptors
+ * specified. The events that occurred are set in the entries.
+ */
+static void kselect_wait_poll(struct kselect_fd *fd_array, int nb_fd, struct timeval *tv) {
+    struct pollfd pfd_array[KSELECT_MAX_FD];
+    int i, error;
+    
+    for (i = 0; i < nb_fd; i++) {
+        pfd_array[i].fd = fd_array[i].fd;
+        pfd_array[i].events = 0;
+        pfd_array[i].revents = 0;
+        if (fd_array[i].events & KSELECT_READ) pfd_array[i].events |= POLLIN;
+        if (fd_array[i].events & KSELECT_WRITE) pfd_array[i].events |= POLLOUT;
+        fd_array[i].revents = 0;
+    }
+    
+    error = poll(pfd_array, nb_fd, kselect_timeout_msec(tv));
+    
+    if (error < 0) {
+        if (errno == EINTR) return;
+        kerror_fatal("poll() failed: %s", kmod_neterror());
+    }
+    
+    for (i = 0; i < nb_fd; i++) {
+        if (pfd_array[i].revents & POLLIN) fd_array[i].revents |= KSELECT_READ;
+        if (pfd_array[i].revents & POLLOUT) fd_array[i].revents |= KSELECT_WRITE;
+        if (pfd_array[i].revents & (POLLERR | POLLHUP | POLLNVAL)) fd_array[i].revents |= KSELECT_ERROR;
+    }
+}
+#endif
+
+/* Add the events specified for a socket if it is not -1. */
+void kselect_add(struct kselect *self, int fd, int events) {
+    struct kselect_fd *f;
+    
+    if (fd == -1) return;
+    
+    f = kselect_find(self->fd_array, self->nb_fd, fd);
+    
+    if (!f) {
+        
+        /* The error is reported by the wait. */
+        if (self->nb_fd == KSELECT_MAX_FD) {
+            self->overflow_flag = 1;
+            return;
+        }
+        
+        f = self->fd_array + self->nb_fd++;
+        f->fd = fd;
+        f->events = 0;
+        f->revents = 0;
+    }
+    
+    f->events |= events;
+}
+
+/* This function returns the events that occurred on the socket specified
+ * during the last wait. It returns 0 if the socket is -1 or not in the set.
+ */
+int kselect_get(struct kselect *self, int fd) {
+    struct kselect_fd *f = (fd == -1) ? NULL : kselect_find(self->fd_array, self->nb_fd, fd);
+    return f ? f->revents : 0;
+}
+
+/* This function waits for the events requested in the set. It returns -1 if
+ * too many descriptors were added to the set, 0 otherwise.
+ */
+int kselect_wait(struct kselect *self) {
+    if (self->overflow_flag) {
+        kmod_set_error("more than %d descriptors in select set", KSELECT_MAX_FD);
+        return -1;
+    }
+    
+    #ifdef __linux__
+    kselect_wait_poll(self->fd_array, self->nb_fd, &self->tv);
+    #else
+    kselect_wait_select(self->fd_array, self->nb_fd, &self->tv);
+    #endif
+    
+    return 0;
+}
+
+void kpoll_init(struct kpoll *self, int edge_flag) {
+    memset(self, 0, sizeof(struct kpoll));
+    self->edge_flag = edge_flag;
+    self->epoll_fd = -1;
+    
+    #ifdef __linux__
+    self->epoll_fd = epoll_create(KSELECT_MAX_FD);
+    if (self->epoll_fd == -1) kerror_fatal("epoll_create() failed: %s", kerror_syserror());
+    #endif
+}
+
+void kpoll_clean(struct kpoll *self) {
+    if (self->epoll_fd != -1) {
+        close(self->epoll_fd);
+        self->epoll_fd = -1;
+    }
+    
+    kfree(self->fd_array);
+    self->fd_array = NULL;
+    self->nb_fd = self->nb_alloc = 0;
+}
+
+#ifdef __linux__
+/* This function updates the epoll registration of the descriptor specified.
+ * 'op' is the operation to try first.
+ */
+static void kpoll_epoll_ctl(struct kpoll *self, int op, int fd, int events) {
+    struct epoll_event ev;
+    
+    memset(&ev, 0, sizeof(ev));
+    ev.data.fd = fd;
+    if (events & KSELECT_READ) ev.events |= EPOLLIN;
+    if (events & KSELECT_WRITE) ev.events |= EPOLLOUT;
+    if (self->edge_flag) ev.events |= EPOLLET;
+    
+    if (!epoll_ctl(self->epoll_fd, op, fd, &ev)) return;
+    
+    /* The descriptor was closed and reopened, or duplicated. Retry with the
+     * other operation.
+     */
+    if (op == EPOLL_CTL_MOD && errno == ENOENT) op = EPOLL_CTL_ADD;
+    else if (op == EPOLL_CTL_ADD && errno == EEXIST) op = EPOLL_CTL_MOD;
+    else kerror_fatal("epoll_ctl() failed: %s", kerror_syserror());
+    
+    if (epoll_ctl(self->epoll_fd, op, fd, &ev)) kerror_fatal("epoll_ctl() failed: %s", kerror_syserror());
+}
+#endif
+
+/* This function sets the events requested for the socket specified. The
+ * socket is removed if 'events' is 0. Nothing is done if the socket is -1.
+ */
+void kpoll_set(struct kpoll *self, int fd, int events) {
+    struct kselect_fd *f;
+    
+    if (fd == -1) return;
+    
+    f = kselect_find(self->fd_array, self->nb_fd, fd);
+    
+    /* Remove the socket. */
+    if (!events) {
+        if (!f) return;
+        
+        #ifdef __linux__
+        epoll_ctl(self->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+        #endif
+        
+        *f = self->fd_array[--self->nb_fd];
+        return;
+    }
+    
+    /* Add the socket. */
+    if (!f) {
+        if (self->nb_fd == self->nb_alloc) {
+            self->nb_alloc = MAX(self->nb_alloc * 2, 8);
+            self->fd_array = krealloc(self->fd_array, self->nb_alloc * sizeof(struct kselect_fd));
+        }
+        
+        f = self->fd_array + self->nb_fd++;
+        f->fd = fd;
+        f->events = events;
+        f->revents = 0;
+        
+        #ifdef __linux__
+        kpoll_epoll_ctl(self, EPOLL_CTL_ADD, fd, events);
+        #endif
+        
+        return;
+    }
+    
+    /* Update the socket. The registration is refreshed even if the events
+     * did not change: if the socket was closed and its number reused, the
+     * modification fails with ENOENT and the new file is added instead.
+     */
+    f->events = events;
+    
+    #ifdef __linux__
+    kpoll_epoll_ctl(self, EPOLL_CTL_MOD, fd, events);
+    #endif
+}
+
+/* This function waits for events on the registered sockets, up to the timeout
+ * specified in the 'tv' field.
+ */
+void kpoll_wait(struct kpoll *self) {
+    #ifdef __linux__
+    struct epoll_event ev_array[KSELECT_MAX_FD];
+    int i, nb_ev;
+    
+    for (i = 0; i < self->nb_fd; i++) self->fd_array[i].revents = 0;
+    
+    nb_ev = epoll_wait(self->epoll_fd, ev_array, KSELECT_MAX_FD, kselect_timeout_msec(&self->tv));
+    
+    if (nb_ev < 0) {
+        if (errno == EINTR) return;
+        kerror_fatal("epoll_wait() failed: %s", kerror_syserror());
+    }
+    
+    for (i = 0; i < nb_ev; i++) {
+        struct kselect_fd *f = kselect_find(self->fd_array, self->nb_fd, ev_array[i].data.fd);
+        if (!f) continue;
+        if (ev_array[i].events & EPOLLIN) f->revents |= KSELECT_READ;
+        if (ev_array[i].events & EPOLLOUT) f->revents |= KSELECT_WRITE;
+        if (ev_array[i].events & (EPOLLERR | EPOLLHUP)) f->revents |= KSELECT_ERROR;
+    }
+    #else
+    kselect_wait_select(self->fd_array, self->nb_fd, &self->tv);
+    #endif
+}
+
+/* This function returns the events that occurred on the socket specified
+ * during the last wait. It returns 0 if the socket is -1 or not registered.
+ */
+int kpoll_get(struct kpoll *self, int fd) {
+    struct kselect_fd *f = (fd == -1) ? NULL : kselect_find(self->fd_array, self->nb_fd, fd);
+    return f ? f->revents : 0;
+}
+
+/* This function waits for the events requested in the select set specified,
+ * using the registrations of the poll set specified. The registrations are
+ * made to match the select set: the descriptors that are not in the select set
+ * are removed and the registrations of the others are refreshed. Thus, a loop
+ * that rebuilds its select set before each wait keeps its epoll instance when
+ * it passes the same poll set every time, and the descriptors it closes and
+ * reopens between the waits are registered again. The events that occurred
+ * are set in the select set. The function returns -1 if too many descriptors
+ * were added to the select set, 0 otherwise.
+ */
+int kpoll_wait_select(struct kpoll *self, struct kselect *sel) {
+    int i;
+    
+    if (sel->overflow_flag) {
+        kmod_set_error("more than %d descriptors in select set", KSELECT_MAX_FD);
+        return -1;
+    }
+    
+    /* Going backward is safe since a removed entry is replaced by the last
+     * one.
+     */
+    for (i = self->nb_fd - 1; i >= 0; i--) {
+        int fd = self->fd_array[i].fd;
+        if (!kselect_find(sel->fd_array, sel->nb_fd, fd)) kpoll_set(self, fd, 0);
+    }
+    
+    for (i = 0; i < sel->nb_fd; i++) kpoll_set(self, sel->fd_array[i].fd, sel->fd_array[i].events);
+    
+    self->tv = sel->tv;
+    kpoll_wait(self);
+    
+    for (i = 0; i < sel->nb_fd; i++) sel->fd_array[i].revents = kpoll_get(self, sel->fd_array[i].fd);
+    
+    return 0;
 }
@@ -3,48 +3,102 @@
 #ifndef _MISC_H
 #define _MISC_H
 
+/* Maximum number of descriptors watched by a kselect, and maximum number of
+ * events reported by a single wait of a kpoll.
+ */
+#define KSELECT_MAX_FD  32
+
+/* Readiness events of a descriptor. */
+#define KSELECT_READ    1
+#define KSELECT_WRITE   2
+#define KSELECT_ERROR   4
+
+/* Descriptor watched by a kselect or a kpoll. */
+struct kselect_fd {
+    int fd;
+    
+    /* Events requested and events that occurred during the last wait. */
+    int events;
+    int revents;
+};
+
+/* Set of descriptors watched for a single wait. The set is rebuilt before each
+ * wait. The descriptors are not limited by FD_SETSIZE on Linux, where poll()
+ * is used instead of select(). If more than KSELECT_MAX_FD descriptors are
+ * added, the wait fails.
+ */
 struct kselect {
-    fd_set read_set;
-    fd_set write_set;
-    fd_set error_set;
-    int max_fd;
+    struct kselect_fd fd_array[KSELECT_MAX_FD];
+    int nb_fd;
+    struct timeval tv;
+    
+    /* True if a descriptor could not be added to the set. */
+    int overflow_flag;
+};
+
+/* Set of descriptors registered persistently. epoll is used on Linux, in
+ * level-triggered or edge-triggered mode. Elsewhere the select sets are rebuilt
+ * from the registrations before each wait. The epoll registration of a
+ * descriptor is refreshed whenever the descriptor is set, since it may have
+ * been closed and its number reused for another file: epoll forgets a file
+ * when it is closed.
+ */
+struct kpoll {
+    
+    /* epoll instance, or -1 if select() is used. */
+    int epoll_fd;
+    
+    /* True if the descriptors are registered in edge-triggered mode. */
+    int edge_flag;
+    
+    /* Registered descriptors. The array grows as needed. */
+    struct kselect_fd *fd_array;
+    int nb_fd;
+    int nb_alloc;
+    
+    /* Timeout of the next wait. */
     struct timeval tv;
 };
 
 static inline void kselect_zero(struct kselect *self) {
-    memset(self, 0, sizeof(struct kselect));
+    self->nb_fd = 0;
+    self->overflow_flag = 0;
+    self->tv.tv_sec = self->tv.tv_usec = 0;
 }
 
-/* Add a socket in the read and error sets if it is not -1. */
+void kselect_add(struct kselect *self, int fd, int events);
+int kselect_get(struct kselect *self, int fd);
+
+/* Add a socket in the read set if it is not -1. */
 static inline void kselect_add_read(struct kselect *self, int fd) {
-    if (fd == -1) return;
-    FD_SET((unsigned int) fd, &self->read_set);
-    FD_SET((unsigned int) fd, &self->error_set);
-    self->max_fd = MAX(fd, self->max_fd);
+    kselect_add(self, fd, KSELECT_READ);
 }
 
-/* Add a socket in the write and error sets if it is not -1. */
+/* Add a socket in the write set if it is not -1. */
 static inline void kselect_add_write(struct kselect *self, int fd) {
-    if (fd == -1) return;
-    FD_SET((unsigned int) fd, &self->write_set);
-    FD_SET((unsigned int) fd, &self->error_set);
-    self->max_fd = MAX(fd, self->max_fd);
+    kselect_add(self, fd, KSELECT_WRITE);
 }
 
-/* This function returns true if the socket is present in the read set or in the
- * error set. The function returns false if the socket is -1.
+/* This function returns true if the socket is readable or in error. The
+ * function returns false if the socket is -1.
  */
 static inline int kselect_in_read(struct kselect *self, int fd) {
-    return (fd != -1 && (FD_ISSET(fd, &self->read_set) || FD_ISSET(fd, &self->error_set)));
+    return (kselect_get(self, fd) & (KSELECT_READ | KSELECT_ERROR)) != 0;
 }
 
-/* This function returns true if the socket is present in the write set or in
- * the error set. The function returns false if the socket is -1.
+/* This function returns true if the socket is writable or in error. The
+ * function returns false if the socket is -1.
  */
 static inline int kselect_in_write(struct kselect *self, int fd) {
-    return (fd != -1 && (FD_ISSET(fd, &self->write_set) || FD_ISSET(fd, &self->error_set)));
+    return (kselect_get(self, fd) & (KSELECT_WRITE | KSELECT_ERROR)) != 0;
 }
 
-void kselect_wait(struct kselect *self);
+int kselect_wait(struct kselect *self);
+void kpoll_init(struct kpoll *self, int edge_flag);
+void kpoll_clean(struct kpoll *self);
+void kpoll_set(struct kpoll *self, int fd, int events);
+void kpoll_wait(struct kpoll *self);
+int kpoll_get(struct kpoll *self, int fd);
+int kpoll_wait_select(struct kpoll *self, struct kselect *sel);
 
 #endif
@@ -50,16 +50,22 @@ void pg_db_conn_init(struct pg_db_conn *self) {
     self->query_state = 0;
     self->nb_result_left = 0;
     self->buf_res = NULL;
+    karray_init(&self->prep_array);
 }
 
 void pg_db_conn_clean(struct pg_db_conn *self) {
-    if (self) pg_db_reset(self);
+    if (self) {
+        pg_db_reset(self);
+        karray_clean(&self->prep_array);
+    }
 }
 
 /* This function resets the state of the connection to the state it had
  * immediately after its initialization.
  */
 void pg_db_reset(struct pg_db_conn *self) {
+    int i;
+    
     if (self->pg_conn) {
     	PQfinish(self->pg_conn);
 	self->pg_conn = NULL;
@@ -72,6 +78,22 @@ void pg_db_reset(struct pg_db_conn *self) {
 	    self->buf_res = NULL;
 	}
     }
+    
+    /* The prepared statements die with the connection. */
+    for (i = 0; i < self->prep_array.size; i++) kstr_destroy((kstr *) self->prep_array.data[i]);
+    karray_reset(&self->prep_array);
+}
+
+/* This function returns true if the connection is established and no query is
+ * in progress. The connection may be in a transaction block.
+ */
+int pg_db_is_idle(struct pg_db_conn *self) {
+    return (self->pg_conn && PQstatus(self->pg_conn) == CONNECTION_OK && !self->query_state && !self->buf_res);
+}
+
+/* This function returns true if the connection is in a transaction block. */
+int pg_db_in_transaction(struct pg_db_conn *self) {
+    return (PQtransactionStatus(self->pg_conn) != PQTRANS_IDLE);
 }
 
 /* This function sets the connection blocking mode. */
@@ -170,6 +192,67 @@ int pg_db_query_start(struct pg_db_conn *self, char *query, int nb_result) {
     return 0;
 }
 
+/* This function sends a request to prepare the statement 'name' to the server.
+ * The parameter types are inferred by the server. The request is completed like
+ * a query with a single result.
+ */
+int pg_db_prepare_start(struct pg_db_conn *self, char *name, char *query, int nb_param) {
+    assert(! self->query_state);
+    self->query_state = 1;
+    self->nb_result_left = 1;
+    
+    if (! PQsendPrepare(self->pg_conn, name, query, nb_param, NULL)) {
+    	pg_db_import_conn_err(self);
+    	kmod_append_error("cannot prepare query");
+	return -1;
+    }
+    
+    return 0;
+}
+
+/* This function executes the prepared statement 'name' on the server. The
+ * parameters are passed as in PQexecPrepared(). The results are returned in
+ * binary format if 'binary_flag' is true. The query is completed like a query
+ * started with pg_db_query_start().
+ */
+int pg_db_query_prepared_start(struct pg_db_conn *self, char *name, int nb_param, char **values, int *lengths,
+                               int *formats, int binary_flag, int nb_result) {
+    assert(! self->query_state);
+    self->query_state = 1;
+    self->nb_result_left = nb_result;
+    
+    if (! PQsendQueryPrepared(self->pg_conn, name, nb_param, (const char * const *) values, lengths, formats,
+                              binary_flag)) {
+    	pg_db_import_conn_err(self);
+    	kmod_append_error("cannot execute prepared query");
+	return -1;
+    }
+    
+    return 0;
+}
+
+/* This function returns true if the statement 'name' has been prepared on the
+ * connection.
+ */
+int pg_db_is_prepared(struct pg_db_conn *self, char *name) {
+    int i;
+    
+    for (i = 0; i < self->prep_array.size; i++) {
+        if (! strcmp(((kstr *) self->prep_array.data[i])->data, name)) return 1;
+    }
+    
+    return 0;
+}
+
+/* This function records that the statement 'name' has been prepared on the
+ * connection.
+ */
+void pg_db_set_prepared(struct pg_db_conn *self, char *name) {
+    kstr *str = kstr_new();
+    kstr_assign_cstr(str, name);
+    karray_push(&self->prep_array, str);
+}
+
 /* This function checks whether a query has been sent completely to the server. 
  * It returns 0 on success, -1 on failure or -2 if the function should be
  * called again when the socket is ready for writing.
@@ -388,6 +471,35 @@ void pg_db_get_bytea(PGresult *res, int row, int col, kbuffer *to) {
     PQfreemem(tmp);
 }
 
+/* This function returns the 32 bits integer at the specified row/col in the
+ * binary result specified.
+ */
+uint32_t pg_db_get_bin_uint32(PGresult *res, int row, int col) {
+    uint8_t *p = (uint8_t *) PQgetvalue(res, row, col);
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+}
+
+/* This function returns the 64 bits integer at the specified row/col in the
+ * binary result specified.
+ */
+uint64_t pg_db_get_bin_uint64(PGresult *res, int row, int col) {
+    uint8_t *p = (uint8_t *) PQgetvalue(res, row, col);
+    uint64_t value = 0;
+    int i;
+    
+    for (i = 0; i < 8; i++) value = (value << 8) | p[i];
+    
+    return value;
+}
+
+/* This function fetches the binary string at the specified row/col in the
+ * binary result specified.
+ */
+void pg_db_get_bin(PGresult *res, int row, int col, kbuffer *to) {
+    kbuffer_reset(to);
+    kbuffer_write(to, (uint8_t *) PQgetvalue(res, row, col), PQgetlength(res, row, col));
+}
+
 /* This function creates a new large object. */
 int pg_db_lo_create(struct pg_db_conn *self, int *oid) {
 
@@ -27,15 +27,27 @@ struct pg_db_conn {
     
     /* Buffered last result. See pg_db_result_check() for details. */
     PGresult *buf_res;
+    
+    /* Array of the names (kstr) of the statements prepared on the
+     * connection.
+     */
+    karray prep_array;
 };
 
 void pg_db_conn_init(struct pg_db_conn *self);
 void pg_db_conn_clean(struct pg_db_conn *self);
 void pg_db_reset(struct pg_db_conn *self);
+int pg_db_is_idle(struct pg_db_conn *self);
+int pg_db_in_transaction(struct pg_db_conn *self);
 int pg_db_set_blocking_mode(struct pg_db_conn *self, int blocking);
 int pg_db_connect_start(struct pg_db_conn *self, char *conn_info);
 int pg_db_connect_check(struct pg_db_conn *self);
 int pg_db_query_start(struct pg_db_conn *self, char *query, int nb_result);
+int pg_db_prepare_start(struct pg_db_conn *self, char *name, char *query, int nb_param);
+int pg_db_query_prepared_start(struct pg_db_conn *self, char *name, int nb_param, char **values, int *lengths,
+                               int *formats, int binary_flag, int nb_result);
+int pg_db_is_prepared(struct pg_db_conn *self, char *name);
+void pg_db_set_prepared(struct pg_db_conn *self, char *name);
 int pg_db_query_check(struct pg_db_conn *self);
 int pg_db_consume(struct pg_db_conn *self);
 PGresult * pg_db_result_check(struct pg_db_conn *self);
@@ -50,6 +62,9 @@ void pg_db_add_bytea(struct pg_db_conn *self, kstr *to, kbuffer *from);
 uint32_t pg_db_get_uint32(PGresult *res, int row, int col);
 uint64_t pg_db_get_uint64(PGresult *res, int row, int col);
 void pg_db_get_bytea(PGresult *res, int row, int col, kbuffer *to);
+uint32_t pg_db_get_bin_uint32(PGresult *res, int row, int col);
+uint64_t pg_db_get_bin_uint64(PGresult *res, int row, int col);
+void pg_db_get_bin(PGresult *res, int row, int col, kbuffer *to);
 int pg_db_lo_create(struct pg_db_conn *self, int *oid);
 int pg_db_lo_open(struct pg_db_conn *self, int oid, int *fd);
 int pg_db_lo_close(struct pg_db_conn *self, int *fd);
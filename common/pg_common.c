@@ -7,6 +7,7 @@ struct kcd_kfs_uploaded_file* kcd_kfs_uploaded_file_new() {
     kstr_init(&self->share_path);
     kstr_init(&self->perm_path);
     kbuffer_init(&self->hash);
+    kstr_init(&self->blob);
     return self;
 }
 
@@ -15,6 +16,7 @@ void kcd_kfs_uploaded_file_destroy(struct kcd_kfs_uploaded_file *self) {
         kstr_clean(&self->share_path);
         kstr_clean(&self->perm_path);
         kbuffer_clean(&self->hash);
+        kstr_clean(&self->blob);
         kfree(self);
     }
 }
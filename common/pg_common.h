@@ -33,6 +33,11 @@ struct kcd_kfs_uploaded_file {
     
     /* Hash of the file. */
     kbuffer hash;
+    
+    /* Name of the blob containing the file in the KFS blob store, i.e. the
+     * SHA-256 of the file in hexadecimal.
+     */
+    kstr blob;
 };
 
 /* Ticket authorizing the creation / joining of a workspace. */
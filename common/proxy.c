@@ -128,12 +128,29 @@ void kproxy_do_xfer(struct kproxy_end *e1, struct kproxy_end *e2, int *move_flag
     if (move_flag) *move_flag = m;
 }
 
+/* This function returns the events to wait for on the socket of the proxy end
+ * 'e1', given the other end 'e2'.
+ */
+static int kproxy_get_events(struct kproxy_end *e1, struct kproxy_end *e2) {
+    int events = 0;
+    if (e1->lost) return 0;
+    if (!e1->buf.len) events |= KSELECT_READ;
+    if (e2->buf.len) events |= KSELECT_WRITE;
+    return events;
+}
+
 /* Prepare the call to select by adding the sockets in the select set specified. */
 void kproxy_prepare_select(struct kselect *sel, struct kproxy_end *e1, struct kproxy_end *e2) {
-    if (!e2->lost && e1->buf.len) kselect_add_write(sel, e2->sock);
-    if (!e1->lost && !e1->buf.len) kselect_add_read(sel, e1->sock);
-    if (!e1->lost && e2->buf.len) kselect_add_write(sel, e1->sock);
-    if (!e2->lost && !e2->buf.len) kselect_add_read(sel, e2->sock);
+    kselect_add(sel, e1->sock, kproxy_get_events(e1, e2));
+    kselect_add(sel, e2->sock, kproxy_get_events(e2, e1));
+}
+
+/* Same as kproxy_prepare_select() for a persistent poll set. The registration
+ * of a socket is only updated when the events to wait for change.
+ */
+void kproxy_prepare_poll(struct kpoll *poll, struct kproxy_end *e1, struct kproxy_end *e2) {
+    kpoll_set(poll, e1->sock, kproxy_get_events(e1, e2));
+    kpoll_set(poll, e2->sock, kproxy_get_events(e2, e1));
 }
     
 /* This function loops exchanging data between the two proxy ends. It returns -1
@@ -143,6 +160,10 @@ void kproxy_prepare_select(struct kselect *sel, struct kproxy_end *e1, struct kp
  */
 int kproxy_loop(struct kproxy_end *e1, struct kproxy_end *e2) {
     int error = 0;
+    struct kpoll poll;
+    
+    /* The sockets stay registered for the whole session. */
+    kpoll_init(&poll, 0);
     
     while (1) {
     	int move_flag = 0;
@@ -153,21 +174,25 @@ int kproxy_loop(struct kproxy_end *e1, struct kproxy_end *e2) {
         /* At least one side of the connection was lost, check if we're done. */
         if (kproxy_is_finished(e1, e2)) {
             kmod_set_error("session finished");
-            return -2;
+            error = -2;
+            break;
         }
         
-        /* Block in select if no data was transferred. */
+        /* Block in poll if no data was transferred. */
 	if (!move_flag) {
-	    struct kselect sel;
-	    kdaemon_prepare_select(&sel);
-            kproxy_prepare_select(&sel, e1, e2);
+	    kdaemon_prepare_poll(&poll);
+            kproxy_prepare_poll(&poll, e1, e2);
 	    
-	    kmod_log_msg(KCD_LOG_MISC, "kproxy_loop: about to wait in select().\n");
-	    error = kdaemon_do_select(&sel);
-	    kmod_log_msg(KCD_LOG_MISC, "kproxy_loop: out of select().\n");
+	    kmod_log_msg(KCD_LOG_MISC, "kproxy_loop: about to wait in poll().\n");
+	    error = kdaemon_do_poll(&poll);
+	    kmod_log_msg(KCD_LOG_MISC, "kproxy_loop: out of poll().\n");
             
-	    if (error) return -1;
+	    if (error) { error = -1; break; }
 	}
     }
+    
+    kpoll_clean(&poll);
+    
+    return error;
 }
 
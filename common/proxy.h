@@ -30,6 +30,7 @@ int kproxy_connect_tcp(int *sock, char *host, int port);
 int kproxy_is_finished(struct kproxy_end *e1, struct kproxy_end *e2);
 void kproxy_do_xfer(struct kproxy_end *e1, struct kproxy_end *e2, int *move_flag);
 void kproxy_prepare_select(struct kselect *sel, struct kproxy_end *e1, struct kproxy_end *e2);
+void kproxy_prepare_poll(struct kpoll *poll, struct kproxy_end *e1, struct kproxy_end *e2);
 int kproxy_loop(struct kproxy_end *e1, struct kproxy_end *e2);
 
 #endif
@@ -3,6 +3,7 @@
 #ifndef _COMMON_H
 #define _COMMON_H
 
+#include <pthread.h>
 #include <gnutls/gnutls.h>
 
 #include "config_path.h"
@@ -22,6 +23,7 @@
 #include "kcd_misc.h"
 #include "frontend.h"
 #include "kws.h"
+#include "kws_mux.h"
 #include "ticket.h"
 #include "mgt.h"
 #include "misc_cmd.h"
@@ -90,6 +92,7 @@ struct kdaemon_opts {
     kstr invite_mail_kcd_html;
     int use_kfs_dir;
     kstr kfs_dir_path;
+    uint64_t kfs_write_budget;
     kstr sendmail_path;
     int sendmail_timeout;
     kstr mail_sender;
@@ -99,6 +102,15 @@ struct kdaemon_opts {
     kstr db_port;
     kstr db_name;
     kstr catchall_tbx;
+    int kws_worker_count;
+    int kws_cmd_pipeline_depth;
+    int kws_evt_coalesce_usec;
+    int kws_client_queue_size;
+    int listen_worker_count;
+    int listen_worker_max;
+    int listen_worker_max_session;
+    int db_max_conn;
+    int tls_cache_size;
 };
 
 extern struct kdaemon_opts global_opts;
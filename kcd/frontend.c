@@ -1,5 +1,6 @@
 /* Copyright (C) 2009-2012 Opersys inc., All rights reserved. */
 
+#include <sys/mman.h>
 #include "common.h"
 
 /* Keepalive parameters. See the Linux documentation for details. Note that the
@@ -13,11 +14,6 @@
 /* Size of the buffer used when proxying. */
 #define KCD_PROXY_TRANS_BUF_SIZE            (256*1024)
 
-/* Number of bytes read to identify the protocol spoken by the client connecting
- * to us.
- */
-#define KCD_PROTO_NB_ID_BYTE                4
-
 /* Length of the credentials file name for VNC. */
 #define KCD_VNC_BEGIN_STRING_LENGTH         32
 
@@ -149,81 +145,84 @@ static int kcd_frontend_check_kanp_version(struct kcd_client *client, struct anp
     return 0;
 }
 
-/* This function negociates the role of KCD in KANP mode. */
-static int kcd_frontend_negociate_kanp_role(struct kcd_client *client, struct anp_tls_xfer *xfer) {
-    int error = 0, got_role_flag = 0, must_upgrade_flag = 0;
-    struct anp_msg *msg = NULL;
-    uint32_t role;
-    uint64_t msg_id;
+/* This function analyses the role negociation message received from the
+ * client. The result to send back to the client is set in 'res'. The function
+ * returns true if the role requested by the client is acceptable.
+ */
+int kcd_frontend_select_kanp_role(struct kcd_client *client, struct anp_msg *msg, uint32_t *role,
+                                  struct anp_msg **res) {
+    int got_role_flag = 0, must_upgrade_flag = 0;
     
-    kmod_log_msg(KCD_LOG_MISC, "kcd_frontend_negociate_kanp_role() called.\n");
-
+    kmod_log_msg(KCD_LOG_MISC, "kcd_frontend_select_kanp_role() called.\n");
+    
+    /* Analyse the first packet. */
     do {
-        /* Receive the first packet. */
-	error = kcd_do_anp_xfer(xfer, &client->conn);
-	if (error) break;
+        /* The first packet received should always be a role negociation. */
+        if (msg->type != KANP_CMD_MGT_SELECT_ROLE) {
+            kmod_set_error("expected select role packet");
+            break;
+        }
+        
+        /* Check the version number. If the client is too old, do not parse
+         * the message further.
+         */
+        if (kcd_frontend_check_kanp_version(client, msg)) {
+            must_upgrade_flag = 1;
+            break;
+        }
 
-	msg = anp_tls_get_recv(xfer);
-	msg_id = msg->id;
-        
-        /* Analyse the first packet. */
-	do {
-            /* The first packet received should always be a role negociation. */
-	    if (msg->type != KANP_CMD_MGT_SELECT_ROLE) {
-		kmod_set_error("expected select role packet");
-		break;
-	    }
-            
-            /* Check the version number. If the client is too old, do not parse
-             * the message further.
-             */
-            if (kcd_frontend_check_kanp_version(client, msg)) {
-                must_upgrade_flag = 1;
-                break;
-            }
+        if (anp_read_uint32(&msg->payload, role)) break;
 
-	    if (anp_read_uint32(&msg->payload, &role)) break;
+        if (*role != KANP_KCD_ROLE_WORKSPACE &&
+            *role != KANP_KCD_ROLE_FILE_XFER &&
+            *role != KANP_KCD_ROLE_APP_SHARE) { 
+            kmod_set_error("invalid role");
+            break;
+        }
+        
+        got_role_flag = 1;
 
-	    if (role != KANP_KCD_ROLE_WORKSPACE &&
-		role != KANP_KCD_ROLE_FILE_XFER &&
-		role != KANP_KCD_ROLE_APP_SHARE) { 
-		kmod_set_error("invalid role");
-		break;
-	    }
-            
-            got_role_flag = 1;
+    } while (0);
+    
+    /* Prepare the result. */
+    *res = anp_msg_new();
+    (*res)->major = KANP_MAJOR_VERSION;
+    (*res)->minor = KANP_MINOR_VERSION;
+    (*res)->id = msg->id;
 
-	} while (0);
+    if (!got_role_flag) {
+    
+        if (must_upgrade_flag) {
+            kmod_log_msg(KCD_LOG_BRIEF, "Refusing access to obsolete client with minor version %d.\n",
+                                        client->announced_minor);
+            kcd_kanp_set_failure(*res, KANP_RES_FAIL_MUST_UPGRADE);
+        }
         
-        /* Prepare the result. */
-	anp_msg_destroy(msg);
-        msg = anp_msg_new();
-        msg->major = KANP_MAJOR_VERSION;
-        msg->minor = KANP_MINOR_VERSION;
-        msg->id = msg_id;
+        else {
+            kmod_log_msg(KCD_LOG_BRIEF, "Bad select role packet: %s.\n", kmod_strerror());
+            kcd_kanp_set_gen_failure(*res);
+        }
+    }
 
-	if (!got_role_flag) {
-        
-            if (must_upgrade_flag) {
-                kmod_log_msg(KCD_LOG_BRIEF, "Refusing access to obsolete client with minor version %d.\n",
-                                            client->announced_minor);
-                kcd_kanp_set_failure(msg, KANP_RES_FAIL_MUST_UPGRADE);
-            }
-            
-            else {
-                kmod_log_msg(KCD_LOG_BRIEF, "Bad select role packet: %s.\n", kmod_strerror());
-	        kcd_kanp_set_gen_failure(msg);
-            }
-	}
+    else {
+        (*res)->type = KANP_RES_OK;
+    }
+    
+    return got_role_flag;
+}
 
-	else {
-	    msg->type = KANP_RES_OK;
-	}
-        
+/* This function sends the result of the role negociation to the client and
+ * dispatches the connection to the handler of the role selected, if any. The
+ * result is destroyed.
+ */
+int kcd_frontend_dispatch_kanp_role(struct kcd_client *client, struct anp_tls_xfer *xfer, struct anp_msg *res,
+                                    int got_role_flag, uint32_t role) {
+    int error = 0;
+    
+    do {
         /* Send the result with our latest version numbers in all cases. */
-	anp_tls_send_msg(xfer, msg);
-	anp_msg_destroy(msg);
-	msg = NULL;
+	anp_tls_send_msg(xfer, res);
+	anp_msg_destroy(res);
 	
         error = kcd_do_anp_xfer(xfer, &client->conn);
 	if (error) break;
@@ -238,6 +237,31 @@ static int kcd_frontend_negociate_kanp_role(struct kcd_client *client, struct an
         if (error) break;
 
     } while (0);
+    
+    return error;
+}
+
+/* This function negociates the role of KCD in KANP mode. */
+static int kcd_frontend_negociate_kanp_role(struct kcd_client *client, struct anp_tls_xfer *xfer) {
+    int error = 0, got_role_flag = 0;
+    struct anp_msg *msg = NULL, *res = NULL;
+    uint32_t role = 0;
+    
+    kmod_log_msg(KCD_LOG_MISC, "kcd_frontend_negociate_kanp_role() called.\n");
+
+    do {
+        /* Receive the first packet. */
+	error = kcd_do_anp_xfer(xfer, &client->conn);
+	if (error) break;
+
+	msg = anp_tls_get_recv(xfer);
+        got_role_flag = kcd_frontend_select_kanp_role(client, msg, &role, &res);
+        
+        /* Reply and dispatch. */
+        error = kcd_frontend_dispatch_kanp_role(client, xfer, res, got_role_flag, role);
+        if (error) break;
+
+    } while (0);
 
     anp_msg_destroy(msg);
     
@@ -416,29 +440,55 @@ static int kcd_frontend_handle_knp(struct kcd_client *client, char *id_buf) {
     return error;
 }
 
+/* This function prepares the TLS connection of the client for the handshake.
+ * Using /etc/kcd_noanon to disable support old ktlstunnel programs if desired.
+ */
+int kcd_frontend_setup_tls(struct kcd_client *client) {
+    return ktls_setup_server(&client->conn,
+                             client->sock,
+                             global_opts.ssl_cert_path.slen ? global_opts.ssl_cert_path.data : NULL,
+                             global_opts.ssl_key_path.data,
+                             global_opts.kanp_mode && !kfs_regular("/etc/kcd_noanon"));
+}
+
+/* Return true if the identification bytes specified are those of a KANP
+ * client.
+ */
+int kcd_frontend_is_kanp_id(char *id_buf) {
+    char anp_id_buf[KCD_PROTO_NB_ID_BYTE] = { 0, 0, 0, 0 };
+    return !memcmp(id_buf, anp_id_buf, KCD_PROTO_NB_ID_BYTE);
+}
+
+/* This function dispatches the connection to the handler of the protocol
+ * spoken by the client, according to the identification bytes received.
+ */
+int kcd_frontend_dispatch_proto(struct kcd_client *client, char *id_buf) {
+    char vnc_id_buf[KCD_PROTO_NB_ID_BYTE] = { 'V', 'N', 'C', '!' };
+    char knp_id_buf[KCD_PROTO_NB_ID_BYTE] = { 0, 0, 0, 4 };
+    
+    if (!memcmp(id_buf, vnc_id_buf, KCD_PROTO_NB_ID_BYTE))
+        return kcd_frontend_handle_vnc(client);
+        
+    else if (!memcmp(id_buf, knp_id_buf, KCD_PROTO_NB_ID_BYTE))
+        return kcd_frontend_handle_knp(client, id_buf);
+        
+    else if (kcd_frontend_is_kanp_id(id_buf))
+        return kcd_frontend_handle_kanp(client, id_buf);
+        
+    return kcd_frontend_handle_http(client, id_buf);
+}
+
 /* This function handles a connection in frontend mode. */
 static void kcd_frontend_handle_conn(struct kcd_client *client) {
     int error = 0;
-    struct anp_tls_xfer xfer;
     char recv_id_buf[KCD_PROTO_NB_ID_BYTE];
-    char vnc_id_buf[KCD_PROTO_NB_ID_BYTE] = { 'V', 'N', 'C', '!' };
-    char knp_id_buf[KCD_PROTO_NB_ID_BYTE] = { 0, 0, 0, 4 };
-    char anp_id_buf[KCD_PROTO_NB_ID_BYTE] = { 0, 0, 0, 0 };
-    
-    anp_tls_init(&xfer);
     
     kdaemon_set_task("Frontend | %s", client->addr.data);
     kmod_log_msg(KCD_LOG_MISC, "kcd_frontend_handle_conn() called.\n");
 
     do {
-        /* Establish the SSL connection. Using /etc/kcd_noanon to disable
-         * support old ktlstunnel programs if desired.
-         */
-	error = ktls_setup_server(&client->conn,
-                                  client->sock,
-                                  global_opts.ssl_cert_path.slen ? global_opts.ssl_cert_path.data : NULL,
-                                  global_opts.ssl_key_path.data,
-                                  global_opts.kanp_mode && !kfs_regular("/etc/kcd_noanon"));
+        /* Establish the SSL connection. */
+	error = kcd_frontend_setup_tls(client);
 	if (error) break;
 
 	error = ktls_handshake_loop(&client->conn);
@@ -449,17 +499,7 @@ static void kcd_frontend_handle_conn(struct kcd_client *client) {
 	if (error) break;
         
         /* Dispatch. */
-        if (!memcmp(recv_id_buf, vnc_id_buf, KCD_PROTO_NB_ID_BYTE))
-            error = kcd_frontend_handle_vnc(client);
-            
-        else if (!memcmp(recv_id_buf, knp_id_buf, KCD_PROTO_NB_ID_BYTE))
-            error = kcd_frontend_handle_knp(client, recv_id_buf);
-            
-        else if (!memcmp(recv_id_buf, anp_id_buf, KCD_PROTO_NB_ID_BYTE))
-            error = kcd_frontend_handle_kanp(client, recv_id_buf);
-            
-        else error = kcd_frontend_handle_http(client, recv_id_buf);
-        
+        error = kcd_frontend_dispatch_proto(client, recv_id_buf);
         if (error) break;
         
     } while(0);
@@ -467,24 +507,471 @@ static void kcd_frontend_handle_conn(struct kcd_client *client) {
     if (error) {
         kmod_log_msg(KCD_LOG_BRIEF, "Error in client connection: %s.\n", kmod_strerror());
     }
+}
+
+/* State of a slot of the listener worker pool. */
+#define KCD_LISTEN_SLOT_FREE                0
+#define KCD_LISTEN_SLOT_IDLE                1
+#define KCD_LISTEN_SLOT_BUSY                2
+
+/* Old C libraries do not define this option. */
+#ifndef SO_REUSEPORT
+#define SO_REUSEPORT                        15
+#endif
+
+/* Slot of a listener worker. The slots are kept in shared memory. The
+ * supervisor sets the PID when it spawns the worker and the worker updates its
+ * state when it starts and stops handling a session.
+ */
+struct kcd_listen_slot {
+    volatile int pid;
+    volatile int state;
+};
+
+/* This structure supervises the children of the listener. */
+struct kcd_frontend_pool {
     
-    anp_tls_clean(&xfer);
+    /* Total number of children to collect. */
+    int nb_child;
+    
+    /* PIDs of the workspace workers, 0 if the worker is not running. */
+    int *kws_pid_array;
+    int nb_kws;
+    
+    /* Slots of the listener workers, in shared memory. There are no slots
+     * if the listener workers are disabled.
+     */
+    struct kcd_listen_slot *slot_array;
+    int nb_slot;
+    
+    /* Number of idle listener workers to keep ready. */
+    int nb_spare;
+    
+    /* Number of sessions handled by a listener worker before it is recycled,
+     * 0 if unlimited.
+     */
+    int max_session;
+    
+    /* True if the pool has already been reported to be saturated. */
+    int saturated_flag;
+    
+    /* Socket pair used by the listener workers to wake up the supervisor when
+     * they become busy. The workers write to the first socket.
+     */
+    int wake_sock[2];
+    
+    /* Listening sockets handed off by the listener workers that became busy.
+     * Closing these sockets would drop the connections pending on them, so
+     * the supervisor keeps them and hands each of them to the next listener
+     * worker it spawns. The number of sockets held is also published in shared
+     * memory after the slots, for the workers.
+     */
+    int *handoff_sock_array;
+    int nb_handoff_sock;
+    volatile int *nb_handoff_shared;
+};
+
+static void kcd_frontend_pool_init(struct kcd_frontend_pool *self) {
+    memset(self, 0, sizeof(struct kcd_frontend_pool));
+    self->wake_sock[0] = self->wake_sock[1] = -1;
+    self->nb_kws = MAX(global_opts.kws_worker_count, 0);
+    self->kws_pid_array = kcalloc(MAX(self->nb_kws, 1) * sizeof(int));
+    
+    /* The workspace workers accept the connections themselves on a shared
+     * socket. The listener workers are only used when they are disabled.
+     */
+    if (!self->nb_kws && global_opts.listen_worker_count > 0) {
+        size_t size;
+        
+        self->nb_spare = global_opts.listen_worker_count;
+        self->nb_slot = MAX(global_opts.listen_worker_max, self->nb_spare);
+        self->max_session = MAX(global_opts.listen_worker_max_session, 0);
+        
+        size = self->nb_slot * sizeof(struct kcd_listen_slot) + sizeof(int);
+        self->slot_array = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (self->slot_array == MAP_FAILED) kerror_fatal("cannot map listener slots: %s", kerror_syserror());
+        memset(self->slot_array, 0, size);
+        self->nb_handoff_shared = (volatile int *) (self->slot_array + self->nb_slot);
+        self->handoff_sock_array = kcalloc(self->nb_slot * sizeof(int));
+        
+        kdaemon_open_socket_pair(self->wake_sock);
+    }
+}
+
+static void kcd_frontend_pool_clean(struct kcd_frontend_pool *self) {
+    int i;
+    
+    for (i = 0; i < self->nb_handoff_sock; i++) close(self->handoff_sock_array[i]);
+    
+    if (self->nb_slot) {
+        munmap(self->slot_array, self->nb_slot * sizeof(struct kcd_listen_slot) + sizeof(int));
+    }
+    
+    kdaemon_close_socket_pair(self->wake_sock);
+    kfree(self->handoff_sock_array);
+    kfree(self->kws_pid_array);
+}
+
+/* This function creates the listening socket of the KCD. If 'reuse_port_flag'
+ * is true, the socket is bound with SO_REUSEPORT so that each listener worker
+ * can own its socket. If 'listen_flag' is false, the socket is only bound.
+ */
+static int kcd_frontend_open_listen_sock(int *listen_sock, int reuse_port_flag, int listen_flag) {
+    int error = 0;
+    
+    do {
+	error = ksock_create(listen_sock);
+	if (error) break;
+        
+        if (reuse_port_flag) {
+            int on = 1;
+            
+            if (setsockopt(*listen_sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on))) {
+                kmod_set_error("cannot set SO_REUSEPORT: %s", kerror_syserror());
+                error = -1;
+                break;
+            }
+        }
+	
+	error = ksock_bind(*listen_sock, global_opts.listen_addr.data, global_opts.listen_port);
+	if (error) break;
+	
+        if (listen_flag) {
+            error = ksock_listen(*listen_sock);
+            if (error) break;
+        }
+	
+	error = ksock_set_unblocking(*listen_sock);
+	if (error) break;
+        
+    } while (0);
+    
+    if (error) ksock_close(listen_sock);
+    
+    return error;
+}
+
+/* This function collects the children of the listener. If 'wait_flag' is
+ * true, all children are collected, otherwise only zombies are collected. The
+ * slot of a worker that has been collected is cleared so that the worker gets
+ * spawned again.
+ */
+static void kcd_frontend_pool_collect(struct kcd_frontend_pool *self, int wait_flag) {
+    while (self->nb_child) {
+        int i, ignored;
+        int pid = kcd_waitpid(-1, wait_flag, &ignored);
+        
+        if (!pid) {
+            if (!wait_flag) return;
+            continue;
+        }
+        
+	self->nb_child--;
+        
+        for (i = 0; i < self->nb_kws; i++) {
+            if (self->kws_pid_array[i] == pid) {
+                kmod_log_msg(KCD_LOG_BRIEF, "Workspace worker %d exited.\n", pid);
+                self->kws_pid_array[i] = 0;
+            }
+        }
+        
+        for (i = 0; i < self->nb_slot; i++) {
+            if (self->slot_array[i].pid == pid) {
+                kmod_log_msg(KCD_LOG_MISC, "Listener worker %d exited.\n", pid);
+                self->slot_array[i].pid = 0;
+                self->slot_array[i].state = KCD_LISTEN_SLOT_FREE;
+            }
+        }
+    }
+}
+
+/* This function spawns the workspace workers that are not running. */
+static void kcd_frontend_pool_spawn_kws(struct kcd_frontend_pool *self, int listen_sock) {
+    int i;
+    
+    for (i = 0; i < self->nb_kws; i++) {
+        int error = 0;
+        int pid;
+        
+        if (self->kws_pid_array[i]) continue;
+        
+        error = kcd_fork("Workspace worker", &pid, 1);
+        
+        /* Child. */
+        if (!pid) {
+            if (!error) error = kcd_kws_mux_worker_loop(listen_sock);
+            if (error && !global_opts.quit_flag) {
+                kmod_log_msg(KCD_LOG_BRIEF, "Workspace worker error: %s.\n", kmod_strerror());
+            }
+            kcd_pg_pool_clean();
+            exit(0);
+        }
+        
+        /* Parent. */
+        if (error) {
+            kmod_log_msg(KCD_LOG_BRIEF, "Cannot spawn workspace worker: %s.\n", kmod_strerror());
+            return;
+        }
+        
+        kmod_log_msg(KCD_LOG_BRIEF, "Spawned workspace worker %d.\n", pid);
+        self->kws_pid_array[i] = pid;
+        self->nb_child++;
+    }
 }
 
-/* This function collects zombies in the frontend listener loop. If 'wait_flag'
- * is true, all children are collected, otherwise only zombies are collected.
+/* This function hands the listening socket of a listener worker that became
+ * busy to the supervisor, with the connections pending on it, and wakes up the
+ * supervisor. The socket of the worker is closed in all cases.
  */
-static void kcd_frontend_loop_collect_zombie(int *nb_child, int wait_flag) {
-    while (*nb_child) {
-        int ignored;
-        if (!kcd_waitpid(-1, wait_flag, &ignored) && !wait_flag) return;
-	(*nb_child)--;
+static void kcd_frontend_handoff_listen_sock(struct kcd_frontend_pool *pool, int *listen_sock) {
+    char a = 0;
+    char cmsg_buf[CMSG_SPACE(sizeof(int))];
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    
+    memset(&msg, 0, sizeof(msg));
+    memset(cmsg_buf, 0, sizeof(cmsg_buf));
+    iov.iov_base = &a;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg_buf;
+    msg.msg_controllen = sizeof(cmsg_buf);
+    
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), listen_sock, sizeof(int));
+    
+    while (sendmsg(pool->wake_sock[0], &msg, 0) == -1) {
+        if (errno == EINTR) continue;
+        
+        /* The pending connections are lost, but the supervisor still notices
+         * that we're busy when it collects the state of the slots.
+         */
+        kmod_log_msg(KCD_LOG_BRIEF, "Cannot hand off listening socket: %s.\n", kerror_syserror());
+        break;
     }
+    
+    ksock_close(listen_sock);
 }
 
-/* Handle the signaled state in the listener loop. */
-static int kcd_frontend_loop_handle_signal(int *nb_child) {
+/* Main loop of a listener worker. The worker owns a listening socket bound
+ * with SO_REUSEPORT and handles the connections it accepts itself, one at a
+ * time. If 'listen_sock' is not -1, it is a socket handed off by a worker that
+ * became busy and the worker adopts it. While a session is handled, the worker
+ * hands its socket off to the supervisor so that the kernel directs the new
+ * connections to the idle workers without dropping the pending ones. The worker
+ * exits when it has handled the maximum number of sessions, or after a session
+ * if the supervisor holds sockets to hand off, so that a new worker adopts them.
+ */
+static int kcd_frontend_listen_worker_loop(struct kcd_frontend_pool *pool, struct kcd_listen_slot *slot,
+                                           int listen_sock) {
     int error = 0;
+    int nb_session = 0;
+    
+    kmod_log_msg(KCD_LOG_MISC, "kcd_frontend_listen_worker_loop() called.\n");
+    
+    while (1) {
+        struct kselect sel;
+        struct kcd_client *client = NULL;
+        
+        if (global_opts.quit_flag) {
+            kmod_set_error("must quit");
+            error = -1;
+            break;
+        }
+        
+        if (listen_sock == -1) {
+            error = kcd_frontend_open_listen_sock(&listen_sock, 1, 1);
+            if (error) break;
+            slot->state = KCD_LISTEN_SLOT_IDLE;
+        }
+        
+        kdaemon_prepare_select(&sel);
+        kselect_add_read(&sel, listen_sock);
+        error = kdaemon_do_select(&sel);
+        if (error) break;
+        
+        /* We've been signaled. The processes spawned during a session are
+         * collected by the session itself.
+         */
+        global_opts.sigchld_count = 0;
+        
+        if (global_opts.sigusr1_count) {
+            global_opts.sigusr1_count = 0;
+            if (kdaemon_load_config(0)) kmod_log_msg(KCD_LOG_BRIEF, "Cannot reload configuration: %s.\n", kmod_strerror());
+        }
+        
+        if (!kselect_in_read(&sel, listen_sock)) continue;
+        
+        client = kcd_client_new();
+        error = kcd_frontend_accept_client(listen_sock, client);
+        
+        if (error) {
+            if (error != -2) kmod_log_msg(KCD_LOG_BRIEF, "Error accepting connection: %s.\n", kmod_strerror());
+            kcd_client_destroy(client);
+            error = 0;
+            continue;
+        }
+        
+        /* Hand our socket off while the session lasts and tell the supervisor
+         * that we're busy, so that it spawns a spare worker if needed.
+         */
+        slot->state = KCD_LISTEN_SLOT_BUSY;
+        kcd_frontend_handoff_listen_sock(pool, &listen_sock);
+        
+        kcd_frontend_handle_conn(client);
+        kcd_client_destroy(client);
+        kdaemon_set_task("Listener worker");
+        nb_session++;
+        
+        if (pool->max_session && nb_session >= pool->max_session) {
+            kmod_log_msg(KCD_LOG_MISC, "Listener worker recycled after %d sessions.\n", nb_session);
+            break;
+        }
+        
+        if (*pool->nb_handoff_shared) {
+            kmod_log_msg(KCD_LOG_MISC, "Listener worker recycled to adopt a handed off socket.\n");
+            break;
+        }
+    }
+    
+    ksock_close(&listen_sock);
+    
+    return error;
+}
+
+/* This function spawns listener workers until the number of idle workers
+ * reaches the number of spares requested or all slots are used.
+ */
+static void kcd_frontend_pool_spawn_listen_worker(struct kcd_frontend_pool *self, int listen_sock) {
+    int i, nb_idle = 0;
+    
+    for (i = 0; i < self->nb_slot; i++) {
+        if (self->slot_array[i].pid && self->slot_array[i].state != KCD_LISTEN_SLOT_BUSY) nb_idle++;
+    }
+    
+    /* The sockets handed off are adopted by the new workers, even if enough
+     * workers are idle.
+     */
+    for (i = 0; i < self->nb_slot && (nb_idle < self->nb_spare || self->nb_handoff_sock); i++) {
+        struct kcd_listen_slot *slot = self->slot_array + i;
+        int error = 0;
+        int pid;
+        int adopt_sock = -1;
+        
+        if (slot->pid) continue;
+        
+        if (self->nb_handoff_sock) {
+            adopt_sock = self->handoff_sock_array[--self->nb_handoff_sock];
+            *self->nb_handoff_shared = self->nb_handoff_sock;
+        }
+        
+        /* The worker is counted as idle until it accepts a connection. */
+        slot->state = KCD_LISTEN_SLOT_IDLE;
+        error = kcd_fork("Listener worker", &pid, 1);
+        
+        /* Child. */
+        if (!pid) {
+            int j;
+            
+            ksock_close(&listen_sock);
+            for (j = 0; j < self->nb_handoff_sock; j++) close(self->handoff_sock_array[j]);
+            self->nb_handoff_sock = 0;
+            
+            if (!error) error = kcd_frontend_listen_worker_loop(self, slot, adopt_sock);
+            if (error && !global_opts.quit_flag) {
+                kmod_log_msg(KCD_LOG_BRIEF, "Listener worker error: %s.\n", kmod_strerror());
+            }
+            kcd_pg_pool_clean();
+            exit(0);
+        }
+        
+        /* Parent. */
+        if (error) {
+            kmod_log_msg(KCD_LOG_BRIEF, "Cannot spawn listener worker: %s.\n", kmod_strerror());
+            slot->state = KCD_LISTEN_SLOT_FREE;
+            
+            if (adopt_sock != -1) {
+                self->handoff_sock_array[self->nb_handoff_sock++] = adopt_sock;
+                *self->nb_handoff_shared = self->nb_handoff_sock;
+            }
+            
+            return;
+        }
+        
+        if (adopt_sock != -1) close(adopt_sock);
+        slot->pid = pid;
+        self->nb_child++;
+        nb_idle++;
+    }
+    
+    /* All workers are busy. The new connections are refused until a worker
+     * becomes idle.
+     */
+    if (!nb_idle) {
+        if (!self->saturated_flag) {
+            kmod_log_msg(KCD_LOG_BRIEF, "All %d listener workers are busy.\n", self->nb_slot);
+            self->saturated_flag = 1;
+        }
+    }
+    
+    else {
+        self->saturated_flag = 0;
+    }
+}
+
+/* Drain the wake up socket of the pool and keep the listening sockets handed
+ * off by the workers. Each socket comes with its own byte, so it is read one
+ * byte at a time.
+ */
+static void kcd_frontend_pool_drain_wake_sock(struct kcd_frontend_pool *self) {
+    while (1) {
+        char a;
+        char cmsg_buf[CMSG_SPACE(sizeof(int))];
+        struct iovec iov;
+        struct msghdr msg;
+        struct cmsghdr *cmsg;
+        int sock;
+        
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = &a;
+        iov.iov_len = 1;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cmsg_buf;
+        msg.msg_controllen = sizeof(cmsg_buf);
+        
+        if (recvmsg(self->wake_sock[1], &msg, 0) == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            kerror_fatal("cannot drain wake up socket: %s", kerror_syserror());
+        }
+        
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+        memcpy(&sock, CMSG_DATA(cmsg), sizeof(int));
+        
+        /* There cannot be more sockets handed off than workers, since a
+         * worker that finishes a session exits while we hold sockets.
+         */
+        if (self->nb_handoff_sock == self->nb_slot) {
+            kmod_log_msg(KCD_LOG_BRIEF, "Too many listening sockets handed off.\n");
+            close(sock);
+            continue;
+        }
+        
+        self->handoff_sock_array[self->nb_handoff_sock++] = sock;
+        *self->nb_handoff_shared = self->nb_handoff_sock;
+    }
+}
+
+/* Handle the signaled state in the listener loop. */
+static int kcd_frontend_loop_handle_signal(struct kcd_frontend_pool *pool) {
+    int error = 0, i;
     
     kmod_log_msg(KCD_LOG_MISC, "kcd_frontend_loop_handle_signal() called.\n");
     
@@ -493,13 +980,27 @@ static int kcd_frontend_loop_handle_signal(int *nb_child) {
     do {
         if (global_opts.sigchld_count) {
             global_opts.sigchld_count = 0;
-            kcd_frontend_loop_collect_zombie(nb_child, 0);
+            kcd_frontend_pool_collect(pool, 0);
         }
         
         if (global_opts.sigusr1_count) {
             global_opts.sigusr1_count = 0;
             error = kdaemon_load_config(0);
             if (error) break;
+            
+            kcd_pg_pool_log_stats();
+            ktls_server_log_stats();
+            
+            /* The workers live in their own session. Forward the signal so
+             * that they reload their configuration too.
+             */
+            for (i = 0; i < pool->nb_kws; i++) {
+                if (pool->kws_pid_array[i]) kill(pool->kws_pid_array[i], SIGUSR1);
+            }
+            
+            for (i = 0; i < pool->nb_slot; i++) {
+                if (pool->slot_array[i].pid) kill(pool->slot_array[i].pid, SIGUSR1);
+            }
         }
         
     } while (0);
@@ -509,20 +1010,18 @@ static int kcd_frontend_loop_handle_signal(int *nb_child) {
     return error;
 }
 
-/* This function accepts a connection from a client in the listener loop. */
-static void kcd_frontend_loop_accept_conn(int *nb_child, int listen_sock) {
+/* This function accepts a connection from a client on the listening socket
+ * specified and prepares the client socket. It returns 0 on success, -1 on
+ * error and -2 if no connection was pending.
+ */
+int kcd_frontend_accept_client(int listen_sock, struct kcd_client *client) {
     int error = 0;
-    int pid;
     struct sockaddr_in sock_addr;
     socklen_t sock_len;
-    struct kcd_client *client = kcd_client_new();
-    
-    kmod_log_msg(KCD_LOG_MISC, "kcd_frontend_accept_conn() called.\n");
     
     do {
 	/* Try to accept a connection. */
 	error = ksock_accept(listen_sock, &client->sock);
-	if (error == -2) { error = 0; break; }
 	if (error) break;
 	
 	/* Get the client address. */
@@ -545,22 +1044,43 @@ static void kcd_frontend_loop_accept_conn(int *nb_child, int listen_sock) {
                                        KCD_TCP_KEEPALIVE_INTVl, KCD_TCP_KEEPALIVE_PROBES);
 	if (error) break;
 	
-	/* We got the connection. Dispatch it. */
 	kmod_log_msg(KCD_LOG_BRIEF, "Accepted connection from %s on port %u.\n", client->addr.data, client->port);
 	
-	/* Fork to handle the connection. */
+    } while (0);
+    
+    return error;
+}
+
+/* This function accepts a connection from a client in the listener loop and
+ * forks to handle it.
+ */
+static void kcd_frontend_loop_accept_conn(struct kcd_frontend_pool *pool, int listen_sock) {
+    int error = 0;
+    int pid;
+    struct kcd_client *client = kcd_client_new();
+    
+    kmod_log_msg(KCD_LOG_MISC, "kcd_frontend_accept_conn() called.\n");
+    
+    do {
+	/* Try to accept a connection. */
+	error = kcd_frontend_accept_client(listen_sock, client);
+	if (error == -2) { error = 0; break; }
+	if (error) break;
+	
+	/* We got the connection. Fork to handle the connection. */
         error = kcd_fork("Service ID", &pid, 1);
         if (error) break;
         
         /* Child. */
         else if (!pid) {
             kcd_frontend_handle_conn(client);
+            kcd_pg_pool_clean();
             exit(0);
         }
         
         /* Parent. */
         else {
-            (*nb_child)++;
+            pool->nb_child++;
         }
 	
     } while (0);
@@ -572,48 +1092,59 @@ static void kcd_frontend_loop_accept_conn(int *nb_child, int listen_sock) {
     kcd_client_destroy(client);
 }
 
-/* Loop accepting connections. */
+/* Loop accepting connections. If workspace workers or listener workers are
+ * enabled, the workers accept the connections themselves and this loop only
+ * supervises them. Otherwise, this loop forks to handle each connection.
+ */
 int kcd_frontend_listener_loop() {
     int error = 0;
-    int nb_child = 0;
     int listen_sock = -1;
+    struct kcd_frontend_pool pool;
+    int fork_flag;
     
     kdaemon_set_task("Listener");
     kmod_log_msg(KCD_LOG_BRIEF, "kcd_frontend_listener_loop() called.\n");
     
+    kcd_frontend_pool_init(&pool);
+    fork_flag = !pool.nb_kws && !pool.nb_slot;
+    
     do {
-	/* Begin listening for connections. */
-	error = ksock_create(&listen_sock);
-	if (error) break;
-	
-	error = ksock_bind(listen_sock, global_opts.listen_addr.data, global_opts.listen_port);
-	if (error) break;
-	
-	error = ksock_listen(listen_sock);
-	if (error) break;
-	
-	error = ksock_set_unblocking(listen_sock);
+	/* Begin listening for connections. With the listener workers, the
+         * socket is only bound to reserve the port and report binding errors
+         * early; each worker listens on its own socket.
+         */
+        error = kcd_frontend_open_listen_sock(&listen_sock, pool.nb_slot > 0, !pool.nb_slot);
 	if (error) break;
 	
 	/* Loop accepting connections. */
 	while (1) {
 	    struct kselect sel;
+            
+            /* Spawn the workers that are not running. */
+            kcd_frontend_pool_spawn_kws(&pool, listen_sock);
+            kcd_frontend_pool_spawn_listen_worker(&pool, listen_sock);
 	    
 	    /* Wait for a connection. */
 	    kdaemon_prepare_select(&sel);
-	    kselect_add_read(&sel, listen_sock);
+	    if (fork_flag) kselect_add_read(&sel, listen_sock);
+	    if (pool.nb_slot) kselect_add_read(&sel, pool.wake_sock[1]);
 	    error = kdaemon_do_select(&sel);
 	    if (error) break;
             
             /* We've been signaled. */
             if (global_opts.sigusr1_count || global_opts.sigchld_count) {
-                error = kcd_frontend_loop_handle_signal(&nb_child);
+                error = kcd_frontend_loop_handle_signal(&pool);
                 if (error) break;
             }
+            
+            /* A listener worker became busy. */
+            if (pool.nb_slot && kselect_in_read(&sel, pool.wake_sock[1])) {
+                kcd_frontend_pool_drain_wake_sock(&pool);
+            }
 	    
 	    /* Try to accept a connection. */
-	    if (kselect_in_read(&sel, listen_sock)) {
-		kcd_frontend_loop_accept_conn(&nb_child, listen_sock);
+	    if (fork_flag && kselect_in_read(&sel, listen_sock)) {
+		kcd_frontend_loop_accept_conn(&pool, listen_sock);
 	    }
 	}
 	
@@ -624,8 +1155,8 @@ int kcd_frontend_listener_loop() {
     ksock_close(&listen_sock);
     
     /* Collect all children. */
-    kcd_frontend_loop_collect_zombie(&nb_child, 1);
+    kcd_frontend_pool_collect(&pool, 1);
+    kcd_frontend_pool_clean(&pool);
     
     return error;
 }
-
@@ -3,6 +3,11 @@
 #ifndef _KCD_FRONTEND_H
 #define _KCD_FRONTEND_H
 
+/* Number of bytes read to identify the protocol spoken by the client connecting
+ * to us.
+ */
+#define KCD_PROTO_NB_ID_BYTE                4
+
 /* This structure represents a client connected to the KCD. */
 struct kcd_client {
     
@@ -29,6 +34,14 @@ struct kcd_client {
 
 struct kcd_client* kcd_client_new();
 void kcd_client_destroy(struct kcd_client *self);
+int kcd_frontend_select_kanp_role(struct kcd_client *client, struct anp_msg *msg, uint32_t *role,
+                                  struct anp_msg **res);
+int kcd_frontend_dispatch_kanp_role(struct kcd_client *client, struct anp_tls_xfer *xfer, struct anp_msg *res,
+                                    int got_role_flag, uint32_t role);
+int kcd_frontend_setup_tls(struct kcd_client *client);
+int kcd_frontend_is_kanp_id(char *id_buf);
+int kcd_frontend_dispatch_proto(struct kcd_client *client, char *id_buf);
+int kcd_frontend_accept_client(int listen_sock, struct kcd_client *client);
 int kcd_frontend_listener_loop();
 
 #endif
@@ -1,5 +1,6 @@
 /* Copyright (C) 2009-2012 Opersys inc., All rights reserved. */
 
+#include <sys/mman.h>
 #include "common.h"
 
 void kcd_pg_anp_query_init(struct kcd_pg_anp_query *self) {
@@ -48,6 +49,48 @@ int kcd_open_pg_conn(struct pg_db_conn *conn, char *conn_info) {
     return error;
 }
 
+/* This function loops until the query started on the connection has produced
+ * its result. The result is set in *res. The result must be freed by the caller
+ * with PQclear().
+ */
+static int kcd_wait_pg_result(struct pg_db_conn *conn, PGresult **res) {
+    int error = 0;
+    struct kselect sel;
+    
+    while (1) {
+        
+        /* Allow postgres to consume its input, if any. */
+        error = pg_db_consume(conn);
+        if (error) break;
+        
+        /* Finish sending the query to the server. */
+        if (conn->query_state == 1) {
+            int r = pg_db_query_check(conn);
+            
+            if (r == -1) {
+                error = -1;
+                break;
+            }
+        }
+        
+        /* Get the next result, if any. */
+        if (conn->query_state == 2) {
+            *res = pg_db_result_check(conn);
+            if (*res) break;
+        }
+        
+        /* Wait for the postgres connection to become ready. */
+        kdaemon_prepare_select(&sel);
+        kselect_add_read(&sel, conn->sock);
+        if (conn->query_state == 1) kselect_add_write(&sel, conn->sock);
+        
+        error = kdaemon_do_select(&sel);
+        if (error) break;
+    }
+    
+    return error;
+}
+
 /* This function executes a query on the server. The function assumes that only
  * one result will be returned by the server. This result is set in *res, if it
  * is wanted. The result must be freed by the caller with PQclear(). The result
@@ -56,7 +99,6 @@ int kcd_open_pg_conn(struct pg_db_conn *conn, char *conn_info) {
  */
 int kcd_exec_pg_query(struct pg_db_conn *conn, char *query, PGresult **db_res, char *err_str) {
     int error = 0;
-    struct kselect sel;
     PGresult *res = NULL;
     
     kmod_log_msg(KCD_LOG_PG, "kcd_kws_cmd_pg_query: executing |%s|.\n", query);
@@ -66,37 +108,57 @@ int kcd_exec_pg_query(struct pg_db_conn *conn, char *query, PGresult **db_res, c
     	error = pg_db_query_start(conn, query, 1);
 	if (error) break;
 	
-	while (1) {
-	    
-	    /* Allow postgres to consume its input, if any. */
-	    error = pg_db_consume(conn);
-	    if (error) break;
-
-	    /* Finish sending the query to the server. */
-	    if (conn->query_state == 1) {
-		int r = pg_db_query_check(conn);
-
-		if (r == -1) {
-	    	    error = -1;
-		    break;
-		}
-	    }
+	error = kcd_wait_pg_result(conn, &res);
+	if (error) break;
+	
+	error = pg_db_verify_result(res, err_str);
+	if (error) break;
+	
+    } while (0);
+    
+    if (db_res) *db_res = res;
+    else pg_db_destroy_res(&res);
+    
+    return error;
+}
 
-	    /* Get the next result, if any. */
-	    if (conn->query_state == 2) {
-		res = pg_db_result_check(conn);
-		if (res) break;
-	    }
+/* This function executes the prepared statement 'name' on the server. The
+ * statement is prepared from 'query' the first time it is executed on the
+ * connection. The parameters are passed as in PQexecPrepared() and the result
+ * is returned in binary format. Otherwise, this function behaves like
+ * kcd_exec_pg_query().
+ */
+int kcd_exec_pg_prepared(struct pg_db_conn *conn, char *name, char *query, int nb_param, char **values,
+                         int *lengths, int *formats, PGresult **db_res, char *err_str) {
+    int error = 0;
+    PGresult *res = NULL;
+    
+    if (db_res) *db_res = NULL;
 
-            /* Wait for the postgres connection to become ready. */
-	    kdaemon_prepare_select(&sel);
-	    kselect_add_read(&sel, conn->sock);
-	    if (conn->query_state == 1) kselect_add_write(&sel, conn->sock);
-	    
-	    error = kdaemon_do_select(&sel);
-	    if (error) break;
-	}
+    do {
+        /* Prepare the statement. */
+        if (! pg_db_is_prepared(conn, name)) {
+            kmod_log_msg(KCD_LOG_PG, "kcd_exec_pg_prepared: preparing %s as |%s|.\n", name, query);
+            
+            error = pg_db_prepare_start(conn, name, query, nb_param);
+            if (error) break;
+            
+            error = kcd_wait_pg_result(conn, &res);
+            if (error) break;
+            
+            error = pg_db_verify_result(res, err_str);
+            if (error) break;
+            
+            pg_db_destroy_res(&res);
+            pg_db_set_prepared(conn, name);
+        }
+        
+        kmod_log_msg(KCD_LOG_PG, "kcd_exec_pg_prepared: executing %s.\n", name);
+        
+    	error = pg_db_query_prepared_start(conn, name, nb_param, values, lengths, formats, 1, 1);
+	if (error) break;
 	
+	error = kcd_wait_pg_result(conn, &res);
 	if (error) break;
 	
 	error = pg_db_verify_result(res, err_str);
@@ -125,15 +187,16 @@ int kcd_exec_pg_anp_query(struct pg_db_conn *conn, struct kcd_pg_anp_query *anp_
     kstr_init(&tmp);
 
     do {
-        /* Execute the query. */
-        kstr_sf(&tmp, "SELECT %s(", query_name);
-        pg_db_add_bytea(conn, &tmp, &anp_query->input_buf);
-        kstr_append_cstr(&tmp, ")");
-        error = kcd_exec_pg_query(conn, tmp.data, &pg_res, query_name);
+        /* Execute the query. The input buffer is passed as is. */
+        char *value = (char *) anp_query->input_buf.data;
+        int length = anp_query->input_buf.len, format = 1;
+        
+        kstr_sf(&tmp, "SELECT %s($1)", query_name);
+        error = kcd_exec_pg_prepared(conn, query_name, tmp.data, 1, &value, &length, &format, &pg_res, query_name);
         if (error) break;
 
         /* Get the query code. */
-        pg_db_get_bytea(pg_res, 0, 0, &anp_query->output_buf);
+        pg_db_get_bin(pg_res, 0, 0, &anp_query->output_buf);
         error = anp_read_uint32(&anp_query->output_buf, &query_code);
         if (error) break;
 
@@ -168,6 +231,10 @@ int kcd_exec_safe_pg_anp_query(struct pg_db_conn *conn, struct kcd_pg_anp_query
  * succeeded, -1 if an internal error has occurred, -2 if a generic error has
  * occurred and -3 if an error result has been set. 'cmd' can be NULL.
  * 'extra_args' is reset once the query has been executed.
+ *
+ * 'perm' can be NULL. Otherwise, if its flags are valid, they are used by the
+ * query instead of reading them from the database. The flags obtained by the
+ * query, if any, are set in 'perm' when the query succeeds.
  */
 int kcd_exec_kws_bound_query(struct pg_db_conn *conn,
                              struct kcd_pg_anp_query *anp_query,
@@ -179,9 +246,11 @@ int kcd_exec_kws_bound_query(struct pg_db_conn *conn,
                              uint32_t login_type,
                              uint32_t user_id,
                              uint32_t cmd_minor,
-                             kbuffer *extra_args) {
+                             kbuffer *extra_args,
+                             struct kcd_kws_perm *perm) {
     int error = 0;
     uint32_t query_code;
+    struct kcd_kws_perm res_perm;
     kbuffer *in_buf = &anp_query->input_buf, *out_buf = &anp_query->output_buf;
     
     /* Prepare the query. */
@@ -192,6 +261,9 @@ int kcd_exec_kws_bound_query(struct pg_db_conn *conn,
     anp_write_uint32(in_buf, user_id);
     anp_write_uint32(in_buf, cmd_minor);
     anp_write_bin(in_buf, cmd ? &cmd->payload : NULL);
+    anp_write_uint32(in_buf, perm ? perm->valid_flag : 0);
+    anp_write_uint32(in_buf, perm ? perm->kws_flags : 0);
+    anp_write_uint32(in_buf, perm ? perm->user_flags : 0);
     kbuffer_write_buffer(in_buf, extra_args);
     kbuffer_reset(extra_args);
 
@@ -199,13 +271,20 @@ int kcd_exec_kws_bound_query(struct pg_db_conn *conn,
     error = kcd_exec_pg_anp_query(conn, anp_query, query_name);
     if (error) return error;
     
-    /* Get the result data, the result type and the second query code. */
+    /* Get the result data, the result type, the second query code and the
+     * permission flags.
+     */
     if (anp_read_uint32(out_buf, &res->type) ||
         anp_read_bin(out_buf, &res->payload) ||
-        anp_read_uint32(out_buf, &query_code)) {
+        anp_read_uint32(out_buf, &query_code) ||
+        anp_read_uint32(out_buf, &res_perm.valid_flag) ||
+        anp_read_uint32(out_buf, &res_perm.kws_flags) ||
+        anp_read_uint32(out_buf, &res_perm.user_flags)) {
         return -1;
     }
     
+    if (perm) *perm = res_perm;
+    
     return query_code ? -3 : 0;
 }
 
@@ -219,6 +298,526 @@ int kcd_commit_pg_transaction(struct pg_db_conn *conn) {
     return kcd_exec_pg_query(conn, "COMMIT", NULL, "commit transaction");
 }
 
+/* Postgres connection pool of this process. */
+static struct kcd_pg_pool pg_pool;
+
+/* This function returns the current time in microseconds. */
+static uint64_t kcd_pg_pool_get_usec() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* This function obtains the start time of the process specified, from
+ * /proc/<pid>/stat. The function returns -1 if the process does not exist.
+ */
+static int kcd_pg_pool_get_start_time(int pid, uint64_t *start_time) {
+    char path[64], buf[1024], *c;
+    int fd, len, i;
+    
+    sprintf(path, "/proc/%d/stat", pid);
+    fd = open(path, O_RDONLY);
+    if (fd == -1) return -1;
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) return -1;
+    buf[len] = 0;
+    
+    /* The start time is the 20th field after the command name, which is
+     * enclosed in parentheses and may contain spaces.
+     */
+    c = strrchr(buf, ')');
+    if (!c) return -1;
+    
+    for (i = 0; i < 20 && c; i++) c = strchr(c + 1, ' ');
+    if (!c) return -1;
+    
+    *start_time = strtoull(c + 1, NULL, 10);
+    return 0;
+}
+
+/* This function records the PID and the start time of the current process. */
+static void kcd_pg_pool_set_pid() {
+    pg_pool.pid = getpid();
+    pg_pool.start_time = 0;
+    kcd_pg_pool_get_start_time(pg_pool.pid, &pg_pool.start_time);
+}
+
+/* This function initializes the Postgres connection pool. It must be called
+ * before the processes of the KCD instance are forked, since the statistics
+ * and the connection slots are shared with them.
+ */
+void kcd_pg_pool_init() {
+    size_t size;
+    void *shm;
+    pthread_mutexattr_t mutex_attr;
+    pthread_condattr_t cond_attr;
+    
+    kmutex_init(&pg_pool.mutex);
+    kcd_pg_pool_set_pid();
+    karray_init(&pg_pool.idle_array);
+    pg_pool.nb_slot = MAX(global_opts.db_max_conn, 0);
+    
+    size = sizeof(struct kcd_pg_pool_shared) + pg_pool.nb_slot * sizeof(struct kcd_pg_pool_slot);
+    shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shm == MAP_FAILED) kerror_fatal("cannot map pool memory: %s", kerror_syserror());
+    memset(shm, 0, size);
+    
+    pg_pool.shared = (struct kcd_pg_pool_shared *) shm;
+    pg_pool.stats = &pg_pool.shared->stats;
+    pg_pool.slot_array = (struct kcd_pg_pool_slot *) (pg_pool.shared + 1);
+    
+    /* The mutex is robust: a process killed while holding it does not block
+     * the other processes.
+     */
+    pthread_mutexattr_init(&mutex_attr);
+    pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST);
+    
+    if (pthread_mutex_init(&pg_pool.shared->mutex, &mutex_attr))
+        kerror_fatal("cannot initialize pool mutex");
+    
+    pthread_mutexattr_destroy(&mutex_attr);
+    
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+    
+    if (pthread_cond_init(&pg_pool.shared->cond, &cond_attr))
+        kerror_fatal("cannot initialize pool condition");
+    
+    pthread_condattr_destroy(&cond_attr);
+}
+
+/* This function handles the result of a lock operation on the shared mutex of
+ * the pool. If the previous owner of the mutex died while holding it, the mutex
+ * is marked consistent: the slot table is updated by single stores, so it is
+ * never left half-modified.
+ */
+static void kcd_pg_pool_check_lock(int r) {
+    if (r == EOWNERDEAD) pthread_mutex_consistent(&pg_pool.shared->mutex);
+    else if (r && r != ETIMEDOUT) kerror_fatal("cannot lock pool mutex: %s", strerror(r));
+}
+
+/* This function locks the shared mutex of the pool. */
+static void kcd_pg_pool_lock_shared() {
+    kcd_pg_pool_check_lock(pthread_mutex_lock(&pg_pool.shared->mutex));
+}
+
+/* This function unlocks the shared mutex of the pool. */
+static void kcd_pg_pool_unlock_shared() {
+    pthread_mutex_unlock(&pg_pool.shared->mutex);
+}
+
+/* This function returns true if the owner of the slot specified is gone. The
+ * PID may have been reused by another process, which has a different start
+ * time.
+ */
+static int kcd_pg_pool_slot_owner_dead(struct kcd_pg_pool_slot *slot) {
+    uint64_t start_time;
+    if (kcd_pg_pool_get_start_time(slot->pid, &start_time)) return (kill(slot->pid, 0) == -1 && errno == ESRCH);
+    return (start_time != slot->start_time);
+}
+
+/* This function returns the number of free connection slots. If there are
+ * fewer than 'nb' free slots, the slots held by processes that are no longer
+ * alive are reclaimed. The shared mutex must be held.
+ */
+static int kcd_pg_pool_count_free_slots(int nb) {
+    int i, nb_free = 0;
+    
+    for (i = 0; i < pg_pool.nb_slot; i++) {
+        if (!pg_pool.slot_array[i].pid) nb_free++;
+    }
+    
+    if (nb_free >= nb) return nb_free;
+    
+    for (i = 0; i < pg_pool.nb_slot; i++) {
+        struct kcd_pg_pool_slot *slot = pg_pool.slot_array + i;
+        
+        if (slot->pid && kcd_pg_pool_slot_owner_dead(slot)) {
+            slot->pid = 0;
+            pg_pool.stats->nb_open--;
+            nb_free++;
+        }
+    }
+    
+    return nb_free;
+}
+
+/* This function waits until 'nb' connection slots are free and reserves them
+ * for this process, all at once. The function returns -1 if the process must
+ * quit or if more slots are requested than the pool contains.
+ */
+static int kcd_pg_pool_take_slots(int nb) {
+    int error = 0, wait_flag = 0, i, nb_left, pid = getpid();
+    
+    if (pg_pool.nb_slot && nb > pg_pool.nb_slot) {
+        kmod_set_error("%d database connections are needed, but the limit is %d", nb, pg_pool.nb_slot);
+        return -1;
+    }
+    
+    kcd_pg_pool_lock_shared();
+    
+    while (pg_pool.nb_slot && kcd_pg_pool_count_free_slots(nb) < nb) {
+        struct kselect sel;
+        struct timespec ts;
+        
+        if (!wait_flag) {
+            wait_flag = 1;
+            kmod_log_msg(KCD_LOG_PG, "Waiting for %d database connection slot(s).\n", nb);
+            pg_pool.stats->nb_wait++;
+            pg_pool.stats->nb_waiter++;
+        }
+        
+        /* Wait for a slot to be released. The wait is bounded so that the
+         * slots of the processes that died are reclaimed.
+         */
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += KCD_PG_POOL_WAIT_SEC;
+        kcd_pg_pool_check_lock(pthread_cond_timedwait(&pg_pool.shared->cond, &pg_pool.shared->mutex, &ts));
+        
+        /* Check whether we must quit. */
+        kcd_pg_pool_unlock_shared();
+        kdaemon_prepare_select(&sel);
+        sel.tv.tv_sec = 0;
+        sel.tv.tv_usec = 0;
+        error = kdaemon_do_select(&sel);
+        kcd_pg_pool_lock_shared();
+        
+        if (error) break;
+    }
+    
+    if (!error) {
+        for (i = 0, nb_left = nb; i < pg_pool.nb_slot && nb_left; i++) {
+            if (!pg_pool.slot_array[i].pid) {
+                pg_pool.slot_array[i].pid = pid;
+                pg_pool.slot_array[i].start_time = pg_pool.start_time;
+                nb_left--;
+            }
+        }
+        
+        pg_pool.stats->nb_open += nb;
+    }
+    
+    if (wait_flag) pg_pool.stats->nb_waiter--;
+    
+    kcd_pg_pool_unlock_shared();
+    
+    return error;
+}
+
+/* This function releases 'nb' connection slots held by this process and wakes
+ * up the processes waiting for a slot.
+ */
+static void kcd_pg_pool_release_slots(int nb) {
+    int i, nb_left, pid = getpid();
+    
+    if (!nb) return;
+    
+    kcd_pg_pool_lock_shared();
+    
+    pg_pool.stats->nb_open -= nb;
+    
+    for (i = 0, nb_left = nb; i < pg_pool.nb_slot && nb_left; i++) {
+        if (pg_pool.slot_array[i].pid == pid && pg_pool.slot_array[i].start_time == pg_pool.start_time) {
+            pg_pool.slot_array[i].pid = 0;
+            nb_left--;
+        }
+    }
+    
+    pthread_cond_broadcast(&pg_pool.shared->cond);
+    kcd_pg_pool_unlock_shared();
+}
+
+/* This function frees a connection inherited from the parent process. The
+ * socket of the connection is shared with the parent, so the termination
+ * message sent by PQfinish() must not reach the server: the socket is
+ * replaced by /dev/null before the connection is finished, which closes our
+ * copy of the socket and frees the libpq state.
+ */
+static void kcd_pg_pool_drop_inherited_conn(struct pg_db_conn *conn) {
+    int sock = conn->pg_conn ? PQsocket(conn->pg_conn) : -1;
+    int null_fd = open("/dev/null", O_WRONLY);
+    
+    if (sock != -1 && null_fd != -1 && dup2(null_fd, sock) != -1) {
+        pg_db_conn_clean(conn);
+    }
+    
+    /* We cannot neutralize the socket. Close it and leak the libpq state
+     * rather than terminating the connection of our parent.
+     */
+    else if (sock != -1) {
+        close(sock);
+    }
+    
+    else {
+        pg_db_conn_clean(conn);
+    }
+    
+    if (null_fd != -1) close(null_fd);
+    kfree(conn);
+}
+
+/* This function forgets the idle connections and the slots inherited from the
+ * parent process, if any. The pool mutex must be held.
+ */
+static void kcd_pg_pool_check_pid() {
+    int i;
+    
+    if (pg_pool.pid == getpid()) return;
+    
+    for (i = 0; i < pg_pool.idle_array.size; i++) kcd_pg_pool_drop_inherited_conn(pg_pool.idle_array.data[i]);
+    karray_reset(&pg_pool.idle_array);
+    
+    /* The slots belong to the parent. */
+    pg_pool.nb_owned = pg_pool.nb_spare = pg_pool.nb_reserved = 0;
+    kcd_pg_pool_set_pid();
+}
+
+/* This function returns a connection slot that is no longer used by a
+ * connection of this process. The slot is kept if this process needs it for
+ * its reservation, otherwise it is released.
+ */
+static void kcd_pg_pool_return_slot() {
+    int release_flag = 0;
+    
+    kmutex_lock(&pg_pool.mutex);
+    
+    if (pg_pool.nb_owned <= pg_pool.nb_reserved) {
+        pg_pool.nb_spare++;
+    }
+    
+    else {
+        pg_pool.nb_owned--;
+        release_flag = 1;
+    }
+    
+    kmutex_unlock(&pg_pool.mutex);
+    
+    if (release_flag) kcd_pg_pool_release_slots(1);
+}
+
+/* This function reserves 'nb' connection slots for this process. The slots are
+ * obtained all at once, so the function must be called before the process
+ * obtains the connections it needs. The slots remain reserved until
+ * kcd_pg_pool_unreserve() is called. The function returns -1 if the process
+ * must quit or if the pool is too small.
+ */
+int kcd_pg_pool_reserve(int nb) {
+    int error = 0, nb_missing;
+    
+    kmutex_lock(&pg_pool.mutex);
+    kcd_pg_pool_check_pid();
+    nb_missing = nb - pg_pool.nb_owned;
+    kmutex_unlock(&pg_pool.mutex);
+    
+    if (nb_missing > 0) {
+        error = kcd_pg_pool_take_slots(nb_missing);
+        if (error) return -1;
+    }
+    
+    kmutex_lock(&pg_pool.mutex);
+    
+    if (nb_missing > 0) {
+        pg_pool.nb_owned += nb_missing;
+        pg_pool.nb_spare += nb_missing;
+    }
+    
+    pg_pool.nb_reserved = nb;
+    
+    kmutex_unlock(&pg_pool.mutex);
+    
+    return 0;
+}
+
+/* This function cancels the reservation of this process. The reserved slots
+ * that are not used by a connection are released.
+ */
+void kcd_pg_pool_unreserve() {
+    int nb_spare;
+    
+    kmutex_lock(&pg_pool.mutex);
+    kcd_pg_pool_check_pid();
+    nb_spare = pg_pool.nb_spare;
+    pg_pool.nb_owned -= nb_spare;
+    pg_pool.nb_spare = 0;
+    pg_pool.nb_reserved = 0;
+    kmutex_unlock(&pg_pool.mutex);
+    
+    kcd_pg_pool_release_slots(nb_spare);
+}
+
+/* This function obtains a connection to the database from the pool. An idle
+ * connection of this process is reused if possible, otherwise a new connection
+ * is opened in a reserved slot or once a connection slot is available. The
+ * connection must be returned with kcd_pg_pool_put().
+ */
+int kcd_pg_pool_get(struct pg_db_conn *conn) {
+    int error = 0, spare_flag = 0;
+    uint64_t start = kcd_pg_pool_get_usec(), elapsed, max;
+    struct pg_db_conn *idle = NULL;
+    kstr conn_str;
+    
+    kstr_init(&conn_str);
+    
+    /* Take an idle connection, if any, or else a spare slot. */
+    kmutex_lock(&pg_pool.mutex);
+    
+    kcd_pg_pool_check_pid();
+    
+    if (pg_pool.idle_array.size) {
+        idle = (struct pg_db_conn *) pg_pool.idle_array.data[--pg_pool.idle_array.size];
+    }
+    
+    else if (pg_pool.nb_spare) {
+        pg_pool.nb_spare--;
+        spare_flag = 1;
+    }
+    
+    kmutex_unlock(&pg_pool.mutex);
+    
+    do {
+        if (idle) {
+            *conn = *idle;
+            kfree(idle);
+            __sync_fetch_and_add(&pg_pool.stats->nb_reused, 1);
+            break;
+        }
+        
+        /* Obtain a connection slot. */
+        if (!spare_flag) {
+            error = kcd_pg_pool_take_slots(1);
+            if (error) break;
+            
+            kmutex_lock(&pg_pool.mutex);
+            pg_pool.nb_owned++;
+            kmutex_unlock(&pg_pool.mutex);
+        }
+        
+        /* Open the connection. */
+        kstr_sf(&conn_str, "dbname=%s user=%s password=%s host=%s port=%s", 
+                global_opts.db_name.data, global_opts.db_user.data,
+                global_opts.db_password.data, global_opts.db_host.data,
+                global_opts.db_port.data);
+        
+        error = kcd_open_pg_conn(conn, conn_str.data);
+        
+        if (error) {
+            pg_db_reset(conn);
+            kcd_pg_pool_return_slot();
+            break;
+        }
+        
+        __sync_fetch_and_add(&pg_pool.stats->nb_created, 1);
+    
+    } while (0);
+    
+    if (!error) {
+        elapsed = kcd_pg_pool_get_usec() - start;
+        __sync_fetch_and_add(&pg_pool.stats->nb_checkout, 1);
+        __sync_fetch_and_add(&pg_pool.stats->checkout_usec, elapsed);
+        
+        do {
+            max = pg_pool.stats->max_checkout_usec;
+        } while (elapsed > max && !__sync_bool_compare_and_swap(&pg_pool.stats->max_checkout_usec, max, elapsed));
+    }
+    
+    kstr_clean(&conn_str);
+    
+    return error;
+}
+
+/* This function returns a connection obtained with kcd_pg_pool_get() to the
+ * pool. If the connection is idle and this process does not keep too many idle
+ * connections, the state of the connection is reset and the connection is kept
+ * for reuse. Otherwise, the connection is closed. The connection object is
+ * reset in both cases. This function is a no-op if the connection is not open.
+ */
+void kcd_pg_pool_put(struct pg_db_conn *conn) {
+    int keep_flag = 0;
+    
+    if (!conn->pg_conn) return;
+    
+    if (pg_db_is_idle(conn)) {
+        kmutex_lock(&pg_pool.mutex);
+        keep_flag = (pg_pool.pid == getpid() && pg_pool.idle_array.size < KCD_PG_POOL_MAX_IDLE);
+        kmutex_unlock(&pg_pool.mutex);
+        
+        /* Roll back the pending transaction, close the held cursors and stop
+         * listening.
+         */
+        if (keep_flag) {
+            keep_flag = !((pg_db_in_transaction(conn) &&
+                           kcd_exec_pg_query(conn, "ROLLBACK", NULL, "roll back transaction")) ||
+                          kcd_exec_pg_query(conn, "CLOSE ALL", NULL, "close cursors") ||
+                          kcd_exec_pg_query(conn, "UNLISTEN *", NULL, "unlisten"));
+        }
+    }
+    
+    if (keep_flag) {
+        struct pg_db_conn *idle = kmalloc(sizeof(struct pg_db_conn));
+        *idle = *conn;
+        
+        kmutex_lock(&pg_pool.mutex);
+        karray_push(&pg_pool.idle_array, idle);
+        kmutex_unlock(&pg_pool.mutex);
+        
+        pg_db_conn_init(conn);
+    }
+    
+    else {
+        pg_db_reset(conn);
+        kcd_pg_pool_return_slot();
+    }
+}
+
+/* This function closes the idle connections of this process and releases its
+ * connection slots. It should be called before the process exits, so that the
+ * connection slots are released promptly, and after a process is forked, so
+ * that the connections of the parent are closed in the child.
+ */
+void kcd_pg_pool_clean() {
+    int i, nb_release = 0;
+    
+    kmutex_lock(&pg_pool.mutex);
+    
+    kcd_pg_pool_check_pid();
+    
+    for (i = 0; i < pg_pool.idle_array.size; i++) {
+        struct pg_db_conn *idle = (struct pg_db_conn *) pg_pool.idle_array.data[i];
+        pg_db_conn_clean(idle);
+        kfree(idle);
+    }
+    
+    /* Release the slots of the idle connections and the spare slots. */
+    nb_release = pg_pool.idle_array.size + pg_pool.nb_spare;
+    pg_pool.nb_owned -= nb_release;
+    pg_pool.nb_spare = 0;
+    pg_pool.nb_reserved = 0;
+    karray_reset(&pg_pool.idle_array);
+    
+    kmutex_unlock(&pg_pool.mutex);
+    
+    kcd_pg_pool_release_slots(nb_release);
+}
+
+/* This function logs the statistics of the Postgres connection pool. */
+void kcd_pg_pool_log_stats() {
+    struct kcd_pg_pool_stats *stats = pg_pool.stats;
+    uint64_t nb_checkout = stats->nb_checkout;
+    
+    kmod_log_msg(KCD_LOG_BRIEF, "Database pool: %u open (max %d), %u waiting, "PRINTF_64"u created, "
+                 PRINTF_64"u checkouts ("PRINTF_64"u reused, "PRINTF_64"u waited), "
+                 "checkout latency "PRINTF_64"u usec avg, "PRINTF_64"u usec max.\n",
+                 stats->nb_open, pg_pool.nb_slot, stats->nb_waiter,
+                 stats->nb_created,
+                 nb_checkout,
+                 stats->nb_reused,
+                 stats->nb_wait,
+                 (uint64_t) (nb_checkout ? stats->checkout_usec / nb_checkout : 0),
+                 stats->max_checkout_usec);
+}
+
 /* This function loops until the specified ANP transfer has finished. The
  * parameter 'timeout' determines the time to wait, in milliseconds, for the
  * transfer to finish. If 'timeout' is zero, the time to wait is infinite. The
@@ -487,9 +1086,10 @@ void kcd_log_kanp_msg(uint32_t level, int is_cmd, struct anp_msg *msg) {
     buf->pos = cur_buf_pos;
 }
 
-/* Wait for the child specified. Return true if the child has been collected. If
- * block_flag is true, the call will block in waitpid(), though EINTR may cause
- * an early return. failed_flag will be set to true if the process has failed.
+/* Wait for the child specified. Return the PID of the child collected, or 0 if
+ * no child has been collected. If block_flag is true, the call will block in
+ * waitpid(), though EINTR may cause an early return. failed_flag will be set to
+ * true if the process has failed.
  */
 int kcd_waitpid(int pid, int block_flag, int *failed_flag) {
     int status;
@@ -499,7 +1099,7 @@ int kcd_waitpid(int pid, int block_flag, int *failed_flag) {
     else if (r == -1) kerror_fatal("waitpid() failed: %s", kerror_syserror());
     else if (r) {
         *failed_flag = (!WIFEXITED(status) || WEXITSTATUS(status) != 0);
-        return 1;
+        return r;
     }
     
     return 0;
@@ -9,6 +9,121 @@ struct kcd_pg_anp_query {
     kbuffer output_buf;
 };
 
+/* Maximum number of idle connections kept by each process in the Postgres
+ * connection pool.
+ */
+#define KCD_PG_POOL_MAX_IDLE            2
+
+/* Maximum delay a process waits for a connection slot to be released before
+ * it checks again for the slots held by dead processes, in seconds.
+ */
+#define KCD_PG_POOL_WAIT_SEC            1
+
+/* Statistics of the Postgres connection pool. They are shared by all the
+ * processes of the KCD instance.
+ */
+struct kcd_pg_pool_stats {
+    
+    /* Number of connections currently open. */
+    uint32_t nb_open;
+    
+    /* Number of requests currently waiting for a connection slot. */
+    uint32_t nb_waiter;
+    
+    /* Number of connections created. */
+    uint64_t nb_created;
+    
+    /* Number of connections handed out, and the number of those that were
+     * idle connections.
+     */
+    uint64_t nb_checkout;
+    uint64_t nb_reused;
+    
+    /* Number of requests that had to wait for a connection slot. */
+    uint64_t nb_wait;
+    
+    /* Total and maximum time spent obtaining a connection, in microseconds. */
+    uint64_t checkout_usec;
+    uint64_t max_checkout_usec;
+};
+
+/* Part of the Postgres connection pool shared by all the processes of the KCD
+ * instance.
+ */
+struct kcd_pg_pool_shared {
+    
+    /* Process-shared mutex protecting the table of connection slots, and
+     * condition signaled when connection slots are released.
+     */
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    
+    /* Statistics. */
+    struct kcd_pg_pool_stats stats;
+};
+
+/* Connection slot of the Postgres connection pool, in shared memory. The
+ * start time of the owner distinguishes it from a later process that reuses
+ * its PID.
+ */
+struct kcd_pg_pool_slot {
+    
+    /* PID of the process using the slot, or 0. */
+    int pid;
+    
+    /* Start time of that process, in clock ticks since boot. */
+    uint64_t start_time;
+};
+
+/* Postgres connection pool. The connections are handed out by the pool and
+ * returned to it when they are no longer needed. Each process keeps a few idle
+ * connections for reuse. The idle connections are not shared between
+ * processes: a process serving a single client, as in the default
+ * fork-per-client mode, opens its own connections. The total number of
+ * connections open by the KCD instance is capped by the 'db_max_conn' option:
+ * every connection occupies a slot in a table shared by all the processes of
+ * the instance.
+ *
+ * A process that needs several connections at once reserves their slots with
+ * kcd_pg_pool_reserve() before it obtains any connection. The reserved slots
+ * are obtained all together, so that two processes cannot each hold part of the
+ * slots they need while waiting for the other.
+ */
+struct kcd_pg_pool {
+    
+    /* Mutex protecting the idle connections and the slot counters below. */
+    struct kmutex mutex;
+    
+    /* PID and start time of the process owning the idle connections. The
+     * idle connections inherited from a parent process are not reused.
+     */
+    int pid;
+    uint64_t start_time;
+    
+    /* Array of idle connections (pg_db_conn). */
+    karray idle_array;
+    
+    /* Number of connection slots held by this process, number of those that
+     * are not used by a connection, and number of slots this process keeps
+     * reserved.
+     */
+    int nb_owned;
+    int nb_spare;
+    int nb_reserved;
+    
+    /* Shared part of the pool, in shared memory. */
+    struct kcd_pg_pool_shared *shared;
+    
+    /* Statistics, in shared memory. */
+    struct kcd_pg_pool_stats *stats;
+    
+    /* Table of connection slots, in shared memory. The table is sized when
+     * the pool is initialized.
+     */
+    struct kcd_pg_pool_slot *slot_array;
+    int nb_slot;
+};
+
 /* Represent the state of a process. */
 struct kcd_process {
     
@@ -56,10 +171,25 @@ struct kcd_process {
     kstr err_str;
 };
 
+/* Permission flags of a user in a workspace. */
+struct kcd_kws_perm {
+    
+    /* True if the flags are known. */
+    uint32_t valid_flag;
+    
+    /* Workspace flags. */
+    uint32_t kws_flags;
+    
+    /* Workspace user flags. */
+    uint32_t user_flags;
+};
+
 void kcd_pg_anp_query_init(struct kcd_pg_anp_query *self);
 void kcd_pg_anp_query_clean(struct kcd_pg_anp_query *self);
 int kcd_open_pg_conn(struct pg_db_conn *conn, char *conn_info);
 int kcd_exec_pg_query(struct pg_db_conn *conn, char *query, PGresult **db_res, char *err_str);
+int kcd_exec_pg_prepared(struct pg_db_conn *conn, char *name, char *query, int nb_param, char **values,
+                         int *lengths, int *formats, PGresult **db_res, char *err_str);
 int kcd_exec_pg_anp_query(struct pg_db_conn *conn, struct kcd_pg_anp_query *anp_query, char *query_name);
 int kcd_exec_safe_pg_anp_query(struct pg_db_conn *conn, struct kcd_pg_anp_query *anp_query, char *query_name);
 int kcd_exec_kws_bound_query(struct pg_db_conn *conn,
@@ -72,9 +202,17 @@ int kcd_exec_kws_bound_query(struct pg_db_conn *conn,
                              uint32_t login_type,
                              uint32_t user_id,
                              uint32_t cmd_minor,
-                             kbuffer *extra_args);
+                             kbuffer *extra_args,
+                             struct kcd_kws_perm *perm);
 int kcd_open_pg_serializable_transaction(struct pg_db_conn *conn);
 int kcd_commit_pg_transaction(struct pg_db_conn *conn);
+void kcd_pg_pool_init();
+int kcd_pg_pool_reserve(int nb);
+void kcd_pg_pool_unreserve();
+int kcd_pg_pool_get(struct pg_db_conn *conn);
+void kcd_pg_pool_put(struct pg_db_conn *conn);
+void kcd_pg_pool_clean();
+void kcd_pg_pool_log_stats();
 int kcd_do_anp_timed_xfer(struct anp_tls_xfer *xfer, struct ktls_conn *conn, int timeout);
 int kcd_do_anp_xfer(struct anp_tls_xfer *xfer, struct ktls_conn *conn);
 int kcd_ask_kmod_about_kws_ticket(char *ticket_data, int ticket_len, uint64_t key_id, int *valid);
@@ -1,6 +1,9 @@
 /* Copyright (C) 2009-2012 Opersys inc., All rights reserved. */
 
-#include <mhash.h>
+#include <aio.h>
+#include <gnutls/crypto.h>
+#include <sys/mman.h>
+#include <utime.h>
 #include "common.h"
 
 /* Preferred maximum size of a download message. */
@@ -9,6 +12,37 @@
 /* Preferred minimum size of a download chunk. */
 #define MIN_DOWNLOAD_CHUNK_SIZE (64*1024)
 
+/* Size of the buffer used to hash the data already received for a file. */
+#define RESUME_HASH_BUF_SIZE    (64*1024)
+
+/* Minimum size of a download chunk sent from a mapping of the file. The smaller
+ * chunks are coalesced with the rest of the message, so they are read in the
+ * message directly.
+ */
+#define MIN_MAPPED_CHUNK_SIZE   ANP_TLS_GATHER_SIZE
+
+/* Maximum number of directory descriptors kept open during an upload. The files
+ * of the other directories are opened by path.
+ */
+#define MAX_UPLOAD_DIR_FD       64
+
+/* Number of times a blob is stored again when it disappears after the link
+ * failed, which happens when the garbage collector quarantines it.
+ */
+#define MAX_BLOB_STORE_RETRY    3
+
+/* This structure describes a directory containing files to upload. */
+struct kcd_kfs_upload_dir {
+    
+    /* Path of the directory relative to the workspace directory, with a
+     * trailing '/'. The path is empty for the workspace directory.
+     */
+    kstr path;
+    
+    /* Descriptor of the directory, -1 if it is not kept open. */
+    int fd;
+};
+
 /* This structure contains the data required to process an upload request. */
 struct kcd_kfs_mode_upload {
     
@@ -17,14 +51,21 @@ struct kcd_kfs_mode_upload {
     uint64_t commit_id;
     uint64_t public_email_id;
     
-    /* Total file size and quota of the workspace. */
+    /* ID of this connection in the upload. The files of the upload may be
+     * uploaded by several connections.
+     */
+    uint64_t stream_id;
+    
+    /* Total file size and quota of the workspace. The files are added to the
+     * total file size as they are committed.
+     */
     uint64_t kws_total_size;
     uint64_t kws_quota;
     
-    /* Total size of the commited files in this upload. This does not account
-     * for the file currently being uploaded since it is not yet commited.
+    /* Size of the data received by the other connections for the files of the
+     * upload not yet committed.
      */
-    uint64_t commited_total_size;
+    uint64_t stream_total_size;
     
     /* True if the phase 2 is active. */
     int phase_2_active;
@@ -40,31 +81,52 @@ struct kcd_kfs_mode_upload {
      */
     uint32_t upload_index;
     
-    /* Number of files commited. */
-    uint32_t nb_commit;
-    
     /* Path on the storage filesystem to the file being uploaded. */
     kstr uploaded_path;
     
-    /* Pointer to the file object corresponding to the file currently being
-     * uploaded.
+    /* Descriptor of the file currently being uploaded, -1 if none. */
+    int uploaded_fd;
+    
+    /* Array containing the control blocks of the chunks being written to the
+     * uploaded file in the background, in the order they were queued. The
+     * entries before 'write_head' have been reaped.
      */
-    FILE *uploaded_file;
+    karray write_array;
+    int write_head;
     
-    /* Hash context corresponding to the file being uploaded. */
-    MHASH hash_context;
+    /* Size of the data being written in the background. */
+    uint64_t write_pending_size;
     
-    /* Hash of the uploaded file. */
+    /* Type of the hash used to check the uploaded files (KANP_KFS_HASH_*). */
+    uint32_t hash_type;
+    
+    /* MD5 context and hash of the uploaded file. They are only used if the
+     * client checks the file with the MD5 hash.
+     */
+    gnutls_hash_hd_t hash_context;
     unsigned char uploaded_hash[16];
     
-    /* Size of the uploaded file. */
+    /* SHA-256 context and hash of the uploaded file, used to name its blob. */
+    gnutls_hash_hd_t blob_hash_context;
+    unsigned char uploaded_blob_hash[32];
+    
+    /* Size of the uploaded file, including the data received before the upload
+     * was resumed. This is also the offset of the next chunk in the file.
+     */
     uint64_t uploaded_size;
     
     /* Array containing the files to upload. */
     karray upload_array;
     
-    /* Array containing the files commited. */
-    karray commit_array;
+    /* Array containing the directories of the files to upload, sorted by
+     * path. The directories are created before the files are received.
+     */
+    karray dir_array;
+    
+    /* Array containing the files skipped since the upload entry was last
+     * refreshed. The files are released when the entry is refreshed.
+     */
+    karray release_array;
     
     /* Array containing the path of the files to delete permanently. */
     karray perm_delete_array;
@@ -87,10 +149,8 @@ struct kcd_kfs_mode_download {
      */
     uint32_t download_index;
     
-    /* Pointer to the file object corresponding to the file currently being
-     * downloaded.
-     */
-    FILE *downloaded_file;
+    /* Descriptor of the file currently being downloaded, -1 if none. */
+    int downloaded_fd;
     
     /* Size of the downloaded file. */
     uint64_t downloaded_size;
@@ -98,6 +158,9 @@ struct kcd_kfs_mode_download {
     /* Size of the remaining data to read in the downloaded file. */
     uint64_t remaining_size;
     
+    /* Position of the next chunk in the downloaded file. */
+    uint64_t read_offset;
+    
     /* Array containing the inode ID of the files to download. */
     karray download_inode_array;
     
@@ -107,7 +170,9 @@ struct kcd_kfs_mode_download {
     /* Array containing the commit ID of the files to download. */
     karray download_commit_array;
     
-    /* Array containing the permanent path of the files to download. */
+    /* Array containing the path of the files to download, relative to the KFS
+     * directory.
+     */
     karray download_path_array;
     
     /* Ticket mode state. */
@@ -117,22 +182,42 @@ struct kcd_kfs_mode_download {
 static void kcd_kfs_mode_upload_init(struct kcd_kfs_mode_upload *self, struct kcd_ticket_mode_state *tms) {
     memset(self, 0, sizeof(struct kcd_kfs_mode_upload));
     kstr_init(&self->uploaded_path);
+    karray_init(&self->write_array);
     karray_init(&self->upload_array);
-    karray_init(&self->commit_array);
+    karray_init(&self->dir_array);
+    karray_init(&self->release_array);
     karray_init(&self->perm_delete_array);
+    self->uploaded_fd = -1;
+    self->hash_type = KANP_KFS_HASH_MD5;
     self->tms = tms;
 }
 
+static int kcd_kfs_reap_writes(struct kcd_kfs_mode_upload *mu, uint64_t max_pending_size);
+
 static void kcd_kfs_mode_upload_clean(struct kcd_kfs_mode_upload *self) {
     uint32_t i;
     
+    /* The chunks must be written before their buffers are freed. */
+    kcd_kfs_reap_writes(self, 0);
+    karray_clean(&self->write_array);
+    if (self->uploaded_fd != -1) close(self->uploaded_fd);
+    
     kstr_clean(&self->uploaded_path);
-    kfs_fclose(&self->uploaded_file, 1);
-    if (self->hash_context) mhash_deinit(self->hash_context, NULL);
+    if (self->hash_context) gnutls_hash_deinit(self->hash_context, NULL);
+    if (self->blob_hash_context) gnutls_hash_deinit(self->blob_hash_context, NULL);
     
     for (i = 0; i < self->nb_upload; i++) kcd_kfs_uploaded_file_destroy(self->upload_array.data[i]);
     karray_clean(&self->upload_array);
-    karray_clean(&self->commit_array);
+    
+    for (i = 0; i < self->dir_array.size; i++) {
+        struct kcd_kfs_upload_dir *dir = self->dir_array.data[i];
+        if (dir->fd != -1) close(dir->fd);
+        kstr_clean(&dir->path);
+        kfree(dir);
+    }
+    
+    karray_clean(&self->dir_array);
+    karray_clean(&self->release_array);
     karray_clear_kstr(&self->perm_delete_array);
     karray_clean(&self->perm_delete_array);
 }
@@ -143,13 +228,14 @@ static void kcd_kfs_mode_download_init(struct kcd_kfs_mode_download *self, struc
     karray_init(&self->download_offset_array);
     karray_init(&self->download_commit_array);
     karray_init(&self->download_path_array);
+    self->downloaded_fd = -1;
     self->tms = tms;
 }
 
 static void kcd_kfs_mode_download_clean(struct kcd_kfs_mode_download *self) {
     ssize_t i;
     
-    kfs_fclose(&self->downloaded_file, 1);
+    if (self->downloaded_fd != -1) close(self->downloaded_fd);
     
     for (i = 0; i < self->download_inode_array.size; i++) kfree(self->download_inode_array.data[i]);
     karray_clean(&self->download_inode_array);
@@ -198,156 +284,438 @@ static int kcd_kfs_get_share_id_from_ticket(struct kcd_ticket_mode_state *tms, u
     return 0;
 }
 
-/* This function refreshes the upload entry in phase 2. */
+/* This function refreshes the upload entry in phase 2 and releases the files
+ * skipped.
+ */
 static int kcd_kfs_refresh_phase_2_upload(struct kcd_kfs_mode_upload *mu) {
+    int error = 0, i;
     struct kcd_ticket_mode_state *tms = mu->tms;
     kbuffer *kbb = &tms->kws_bound_buf;
+    struct kcd_kfs_uploaded_file *f = NULL;
     
     kmod_log_msg(KCD_LOG_KFS, "kcd_kfs_refresh_phase_2_upload() called.\n");
     
+    if (mu->uploaded_fd != -1) f = mu->upload_array.data[mu->upload_index];
+    
     anp_write_uint32(kbb, mu->share_id);
     anp_write_uint64(kbb, mu->commit_id);
-    return kcd_ticket_mode_kws_bound_query(tms, "refresh_upload", ktime_now_sec(), NULL);
+    anp_write_uint64(kbb, mu->stream_id);
+    anp_write_uint64(kbb, f ? f->inode : 0);
+    anp_write_uint64(kbb, f ? mu->uploaded_size : 0);
+    anp_write_uint32(kbb, mu->release_array.size);
+    
+    for (i = 0; i < mu->release_array.size; i++) {
+        f = mu->release_array.data[i];
+        anp_write_uint64(kbb, f->inode);
+    }
+    
+    karray_reset(&mu->release_array);
+    
+    error = kcd_ticket_mode_kws_bound_query(tms, "refresh_upload", ktime_now_sec(), NULL);
+    if (error) return error;
+    
+    if (anp_read_uint64(&tms->aq.output_buf, &mu->stream_total_size)) return -1;
+    
+    return 0;
 }
 
-/* This function posts the phase 2 event. */
-static int kcd_kfs_post_phase_2_event(struct kcd_kfs_mode_upload *mu) {
-    int error = 0;
-    uint32_t i;
-    uint64_t date = ktime_now_sec();
-    kbuffer evt;
-    kbuffer notif;
+/* This function commits or aborts the file specified. The phase 2 event is
+ * posted if this is the last file of the upload.
+ */
+static int kcd_kfs_commit_file(struct kcd_kfs_mode_upload *mu, struct kcd_kfs_uploaded_file *f, int commit_flag) {
     struct kcd_ticket_mode_state *tms = mu->tms;
     kbuffer *kbb = &tms->kws_bound_buf;
     
-    kmod_log_msg(KCD_LOG_KFS, "kcd_kfs_post_phase_2_event() called.\n");
+    kmod_log_msg(KCD_LOG_KFS, "kcd_kfs_commit_file() called.\n");
     
-    kbuffer_init(&evt);
-    kbuffer_init(&notif);
+    anp_write_uint32(kbb, mu->share_id);
+    anp_write_uint64(kbb, mu->commit_id);
+    anp_write_uint64(kbb, mu->stream_id);
+    anp_write_uint64(kbb, f->inode);
+    anp_write_uint32(kbb, commit_flag);
+    anp_write_uint64(kbb, f->size);
+    anp_write_bin(kbb, &f->hash);
+    anp_write_kstr(kbb, &f->blob);
+    return kcd_ticket_mode_kws_bound_query(tms, "upload_commit_file", ktime_now_sec(), NULL);
+}
+
+/* This function returns the length of the directory part of the path
+ * specified, including the trailing '/'.
+ */
+static int kcd_kfs_get_dir_len(kstr *path) {
+    char *c = strrchr(path->data, '/');
+    return c ? c - path->data + 1 : 0;
+}
+
+/* This function compares two directory paths. */
+static int kcd_kfs_cmp_dir_path(char *a, int a_len, char *b, int b_len) {
+    int r = memcmp(a, b, MIN(a_len, b_len));
+    if (r) return r;
+    return a_len - b_len;
+}
+
+/* qsort() callback that sorts the files to upload by directory. */
+static int kcd_kfs_cmp_upload_file_dir(const void *a, const void *b) {
+    kstr *a_path = &(*(struct kcd_kfs_uploaded_file **) a)->perm_path;
+    kstr *b_path = &(*(struct kcd_kfs_uploaded_file **) b)->perm_path;
+    return kcd_kfs_cmp_dir_path(a_path->data, kcd_kfs_get_dir_len(a_path), b_path->data, kcd_kfs_get_dir_len(b_path));
+}
+
+/* This function creates the directories of the files to upload. The files are
+ * sorted by directory so that each directory is handled once and the
+ * components that a directory shares with the previous one are not created
+ * again. The descriptors of the directories are kept open, up to a limit, so
+ * that the files are opened relative to them.
+ */
+static void kcd_kfs_prepare_upload_dirs(struct kcd_kfs_mode_upload *mu) {
+    uint32_t i;
+    int j, len, base_len, common_len;
+    char c;
+    karray sorted_array;
+    kstr path;
+    struct kcd_kfs_upload_dir *dir = NULL;
     
-    do {
-        anp_write_uint64(&evt, tms->kws_id);
-	anp_write_uint64(&evt, date);
-	anp_write_uint32(&evt, tms->user_id);
-	anp_write_uint32(&evt, mu->share_id);
-	anp_write_uint64(&evt, mu->commit_id);
-	anp_write_uint32(&evt, mu->nb_commit);
-        
-        anp_write_uint64(&notif, mu->public_email_id);
-        anp_write_uint32(&notif, mu->nb_commit);
-        
-        for (i = 0; i < mu->nb_commit; i++) {
-            struct kcd_kfs_uploaded_file *f = mu->commit_array.data[i];
-            
-            anp_write_uint64(&evt, f->inode);
-            anp_write_uint64(&evt, f->size);
-            anp_write_bin(&evt, &f->hash);
-            
-            anp_write_uint32(&notif, f->create_flag);
-            anp_write_kstr(&notif, &f->share_path);
+    kmod_log_msg(KCD_LOG_KFS, "kcd_kfs_prepare_upload_dirs() called.\n");
+    
+    karray_init(&sorted_array);
+    kstr_init(&path);
+    
+    for (i = 0; i < mu->nb_upload; i++) karray_push(&sorted_array, mu->upload_array.data[i]);
+    qsort(sorted_array.data, sorted_array.size, sizeof(void *), kcd_kfs_cmp_upload_file_dir);
+    
+    kstr_sf(&path, "%s"PRINTF_64"u/", global_opts.kfs_dir_path.data, mu->tms->kws_id);
+    base_len = path.slen;
+    kfs_mkdir(path.data);
+    
+    for (i = 0; i < sorted_array.size; i++) {
+        kstr *rel_path = &((struct kcd_kfs_uploaded_file *) sorted_array.data[i])->perm_path;
+        len = kcd_kfs_get_dir_len(rel_path);
+        
+        /* Same directory as the previous file. */
+        if (dir && !kcd_kfs_cmp_dir_path(dir->path.data, dir->path.slen, rel_path->data, len)) continue;
+        
+        /* Find the components shared with the previous directory. */
+        common_len = 0;
+        
+        for (j = 0; dir && j < len && j < dir->path.slen && rel_path->data[j] == dir->path.data[j]; j++) {
+            if (rel_path->data[j] == '/') common_len = j + 1;
         }
         
-        anp_write_uint32(kbb, mu->share_id);
-        anp_write_uint64(kbb, mu->commit_id);
-        anp_write_uint64(kbb, mu->public_email_id);
-        anp_write_bin(kbb, &evt);
-        anp_write_bin(kbb, &notif);
-        anp_write_uint32(kbb, mu->nb_commit);
+        /* Create the other components. Ignore failures since concurrent
+         * operations may be taking place. We will detect that something is
+         * wrong when we try to open the file.
+         */
+        kstr_sf(&path, "%s"PRINTF_64"u/%.*s", global_opts.kfs_dir_path.data, mu->tms->kws_id, len, rel_path->data);
         
-        for (i = 0; i < mu->nb_commit; i++) {
-            struct kcd_kfs_uploaded_file *f = mu->commit_array.data[i];
-            anp_write_uint64(kbb, f->inode);
-            anp_write_uint64(kbb, f->size);
+        for (j = common_len; j < len; j++) {
+            if (rel_path->data[j] != '/') continue;
+            c = path.data[base_len + j + 1];
+            path.data[base_len + j + 1] = 0;
+            kfs_mkdir(path.data);
+            path.data[base_len + j + 1] = c;
         }
         
-        error = kcd_ticket_mode_kws_bound_query(tms, "upload_phase_two", date, NULL);
-        if (error) break;
+        /* Add the directory. */
+        dir = kmalloc(sizeof(struct kcd_kfs_upload_dir));
+        kstr_init(&dir->path);
+        kstr_sf(&dir->path, "%.*s", len, rel_path->data);
+        dir->fd = -1;
+        if (mu->dir_array.size < MAX_UPLOAD_DIR_FD) dir->fd = open(path.data, O_RDONLY | O_DIRECTORY);
+        karray_push(&mu->dir_array, dir);
+    }
+    
+    karray_clean(&sorted_array);
+    kstr_clean(&path);
+}
+
+/* This function opens the file currently being uploaded with the flags
+ * specified. The file is opened relative to the descriptor of its directory if
+ * it is kept open, otherwise it is opened by path. The descriptor of the file is
+ * returned, or -1 on failure.
+ */
+static int kcd_kfs_open_uploaded_path(struct kcd_kfs_mode_upload *mu, int flags) {
+    kstr *rel_path = &((struct kcd_kfs_uploaded_file *) mu->upload_array.data[mu->upload_index])->perm_path;
+    int len = kcd_kfs_get_dir_len(rel_path);
+    int low = 0, high = mu->dir_array.size - 1;
+    
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        struct kcd_kfs_upload_dir *dir = mu->dir_array.data[mid];
+        int r = kcd_kfs_cmp_dir_path(dir->path.data, dir->path.slen, rel_path->data, len);
         
-    } while (0);
+        if (r < 0) low = mid + 1;
+        else if (r > 0) high = mid - 1;
+        else if (dir->fd != -1) return openat(dir->fd, rel_path->data + len, flags, 0666);
+        else break;
+    }
     
-    kbuffer_clean(&evt);
-    kbuffer_clean(&notif);
+    return open(mu->uploaded_path.data, flags, 0666);
+}
+
+/* This function hashes data of the file being uploaded. */
+static void kcd_kfs_hash_data(struct kcd_kfs_mode_upload *mu, uint8_t *data, uint32_t len) {
+    if (mu->hash_context) gnutls_hash(mu->hash_context, data, len);
+    gnutls_hash(mu->blob_hash_context, data, len);
+}
+
+/* This function hashes the data already received for the file being uploaded,
+ * if any, and sets the uploaded size accordingly.
+ */
+static int kcd_kfs_hash_phase_2_file(struct kcd_kfs_mode_upload *mu) {
+    int error = 0, fd;
+    uint8_t *buf;
+    
+    mu->uploaded_size = 0;
+    
+    fd = kcd_kfs_open_uploaded_path(mu, O_RDONLY);
+    
+    if (fd == -1) {
+        if (errno == ENOENT) return 0;
+        kmod_set_error("cannot open %s: %s", mu->uploaded_path.data, kmod_syserror());
+        return -1;
+    }
+    
+    buf = kmalloc(RESUME_HASH_BUF_SIZE);
+    
+    while (1) {
+        ssize_t r = read(fd, buf, RESUME_HASH_BUF_SIZE);
+        
+        if (r == -1 && errno == EINTR) continue;
+        
+        if (r == -1) {
+            kmod_set_error("cannot read %s: %s", mu->uploaded_path.data, kmod_syserror());
+            error = -1;
+            break;
+        }
+        
+        if (r == 0) break;
+        
+        kcd_kfs_hash_data(mu, buf, r);
+        mu->uploaded_size += r;
+    }
+    
+    kfree(buf);
+    close(fd);
+    
+    if (mu->uploaded_size) {
+        kmod_log_msg(KCD_LOG_KFS, "Resuming upload of %s at offset "PRINTF_64"u.\n", mu->uploaded_path.data, mu->uploaded_size);
+    }
     
     return error;
 }
 
 /* This function opens the file currently being uploaded if it is not already
- * open. The hash context is also initialized.
+ * open. The hash context is also initialized. If some data has already been
+ * received for the file, the data is hashed and the upload is resumed.
  */
 static int kcd_open_phase_2_file_if_needed(struct kcd_kfs_mode_upload *mu) {
     int error = 0;
-    int i;
-    karray components;
     kstr *rel_path = &((struct kcd_kfs_uploaded_file *)mu->upload_array.data[mu->upload_index])->perm_path;
-    kstr final_name;
-    struct kcd_ticket_mode_state *tms = mu->tms;
     
     kmod_log_msg(KCD_LOG_KFS, "kcd_open_phase_2_file_if_needed() called.\n");
     
-    karray_init(&components);
-    kstr_init(&final_name);
-    
     do {
         /* The file is already open. */
-        if (mu->uploaded_file) break;
+        if (mu->uploaded_fd != -1) break;
         
-        /* Create the missing directories. Ignore failures since concurrent
-         * operations may be taking place. We will detect that something is
-         * wrong when we try to open the file.
+        /* The directories have been created by kcd_kfs_prepare_upload_dirs(). */
+        kstr_sf(&mu->uploaded_path, "%s"PRINTF_64"u/%s", global_opts.kfs_dir_path.data, mu->tms->kws_id,
+                rel_path->data);
+        
+        /* Open the hash contexts. The MD5 hash is only computed if the client
+         * checks the file with it.
          */
-        kcd_kfs_split_path(rel_path, &components, &final_name);
-        kstr_sf(&mu->uploaded_path, "%s"PRINTF_64"u/", global_opts.kfs_dir_path.data, tms->kws_id);
-        kfs_mkdir(mu->uploaded_path.data);
+        assert(mu->blob_hash_context == NULL);
         
-        for (i = 0; i < components.size; i++) {
-            kstr *c = components.data[i];
-            kstr_append_kstr(&mu->uploaded_path, c);
-            kstr_append_char(&mu->uploaded_path, '/');
-            kfs_mkdir(mu->uploaded_path.data);
+        if (gnutls_hash_init(&mu->blob_hash_context, GNUTLS_DIG_SHA256) < 0) {
+            mu->blob_hash_context = NULL;
+            kmod_set_error("cannot initialize the SHA-256 hash");
+            error = -1;
+            break;
         }
         
-        kstr_append_kstr(&mu->uploaded_path, &final_name);
+        if (mu->hash_type == KANP_KFS_HASH_MD5 && gnutls_hash_init(&mu->hash_context, GNUTLS_DIG_MD5) < 0) {
+            mu->hash_context = NULL;
+            kmod_set_error("cannot initialize the MD5 hash");
+            error = -1;
+            break;
+        }
         
-        /* Open the file. */
-        error = kfs_fopen(&mu->uploaded_file, mu->uploaded_path.data, "wb");
+        /* Hash the data already received. */
+        error = kcd_kfs_hash_phase_2_file(mu);
         if (error) break;
         
-        /* Open the hash context. */
-        assert(mu->hash_context == NULL);
-        mu->hash_context = mhash_init(MHASH_MD5);
+        /* Open the file. The chunks are written at their offset. */
+        mu->uploaded_fd = kcd_kfs_open_uploaded_path(mu, O_WRONLY | O_CREAT);
         
-        /* Reset the uploaded size. */
-        mu->uploaded_size = 0;
+        if (mu->uploaded_fd == -1) {
+            kmod_set_error("cannot open %s: %s", mu->uploaded_path.data, kmod_syserror());
+            error = -1;
+            break;
+        }
         
     } while (0);
     
-    karray_clear_kstr(&components);
-    karray_clean(&components);
-    kstr_clean(&final_name);
-    
     return error;
 }
 
 /* This function closes the file currently being uploaded if it is open and
- * deletes it if requested. The hash context is also closed.
+ * deletes it if requested. The chunks being written are waited for and the hash
+ * context is also closed.
  */
 static int kcd_close_phase_2_file_if_needed(struct kcd_kfs_mode_upload *mu, int delete_flag) {
+    int error = 0;
     
     kmod_log_msg(KCD_LOG_KFS, "kcd_close_phase_2_file_if_needed() called.\n");
     
     if (mu->hash_context) {
-        mhash_deinit(mu->hash_context, mu->uploaded_hash);
+        gnutls_hash_deinit(mu->hash_context, mu->uploaded_hash);
         mu->hash_context = NULL;
     }
     
-    if (!mu->uploaded_file) return 0;
+    if (mu->blob_hash_context) {
+        gnutls_hash_deinit(mu->blob_hash_context, mu->uploaded_blob_hash);
+        mu->blob_hash_context = NULL;
+    }
+    
+    if (mu->uploaded_fd == -1) return 0;
+    
+    error = kcd_kfs_reap_writes(mu, 0);
+    
+    if (close(mu->uploaded_fd) && !error) {
+        kmod_set_error("cannot close %s: %s", mu->uploaded_path.data, kmod_syserror());
+        error = -1;
+    }
+    
+    mu->uploaded_fd = -1;
+    
+    if (delete_flag) return kfs_delete(mu->uploaded_path.data, 1);
+    
+    return error;
+}
+
+/* This function writes a chunk to the uploaded file synchronously. */
+static int kcd_kfs_write_chunk(struct kcd_kfs_mode_upload *mu, uint8_t *data, uint32_t len, uint64_t offset) {
+    
+    while (len) {
+        ssize_t r = pwrite(mu->uploaded_fd, data, len, offset);
+        
+        if (r == -1 && errno == EINTR) continue;
+        
+        if (r == -1) {
+            kmod_set_error("cannot write %s: %s", mu->uploaded_path.data, kmod_syserror());
+            return -1;
+        }
+        
+        data += r;
+        len -= r;
+        offset += r;
+    }
+    
+    return 0;
+}
+
+/* This function reaps the chunks that have been written to the uploaded file in
+ * the background, in the order they were queued. The function waits until no
+ * more than 'max_pending_size' bytes are being written. If a write failed, the
+ * function waits for all the writes and truncates the file where the first
+ * failed write begins, so that the file only contains the data received before.
+ */
+static int kcd_kfs_reap_writes(struct kcd_kfs_mode_upload *mu, uint64_t max_pending_size) {
+    int error = 0;
+    off_t fail_offset = 0;
+    
+    while (mu->write_head < mu->write_array.size) {
+        struct aiocb *cb = mu->write_array.data[mu->write_head];
+        const struct aiocb *wait_list[1] = { cb };
+        ssize_t r;
+        
+        /* The write is in progress. Wait for it if needed. */
+        if (aio_error(cb) == EINPROGRESS) {
+            if (!error && mu->write_pending_size <= max_pending_size) break;
+            aio_suspend(wait_list, 1, NULL);
+            continue;
+        }
+        
+        r = aio_return(cb);
+        
+        if (r != (ssize_t) cb->aio_nbytes && !error) {
+            if (r == -1) {
+                kmod_set_error("cannot write %s: %s", mu->uploaded_path.data, strerror(aio_error(cb)));
+            }
+            
+            else {
+                kmod_set_error("cannot write %s: short write", mu->uploaded_path.data);
+            }
+            
+            fail_offset = cb->aio_offset;
+            error = -1;
+        }
+        
+        mu->write_pending_size -= cb->aio_nbytes;
+        mu->write_head++;
+        kfree(cb);
+    }
+    
+    if (mu->write_head == mu->write_array.size) {
+        karray_reset(&mu->write_array);
+        mu->write_head = 0;
+    }
+    
+    if (error) {
+        if (ftruncate(mu->uploaded_fd, fail_offset)) {
+            kmod_log_msg(KCD_LOG_KFS, "Cannot truncate %s: %s.\n", mu->uploaded_path.data, kmod_syserror());
+        }
+        
+        mu->uploaded_size = fail_offset;
+    }
+    
+    return error;
+}
+
+/* This function queues a chunk to write to the uploaded file at the current
+ * offset. The chunk is copied and written in the background, so that a slow
+ * storage filesystem does not stall the connection. This function only blocks
+ * when the data being written would exceed the configured budget. The chunk is
+ * written synchronously if the budget is 0 or if it cannot be queued.
+ */
+static int kcd_kfs_queue_chunk(struct kcd_kfs_mode_upload *mu, uint8_t *data, uint32_t len) {
+    int error = 0;
+    uint64_t budget = global_opts.kfs_write_budget;
+    struct aiocb *cb;
+    
+    if (!len) return 0;
+    
+    /* Wait until the chunk fits in the budget. */
+    error = kcd_kfs_reap_writes(mu, budget > len ? budget - len : 0);
+    if (error) return error;
     
-    if (delete_flag) {
-        kfs_fclose(&mu->uploaded_file, 1);
-        return kfs_delete(mu->uploaded_path.data, 1);
+    if (!budget) return kcd_kfs_write_chunk(mu, data, len, mu->uploaded_size);
+    
+    /* The data follows the control block. */
+    cb = kmalloc(sizeof(struct aiocb) + len);
+    memset(cb, 0, sizeof(struct aiocb));
+    memcpy(cb + 1, data, len);
+    cb->aio_fildes = mu->uploaded_fd;
+    cb->aio_buf = cb + 1;
+    cb->aio_nbytes = len;
+    cb->aio_offset = mu->uploaded_size;
+    cb->aio_sigevent.sigev_notify = SIGEV_NONE;
+    
+    if (aio_write(cb)) {
+        kmod_log_msg(KCD_LOG_KFS, "Cannot queue write: %s.\n", kmod_syserror());
+        kfree(cb);
+        
+        error = kcd_kfs_reap_writes(mu, 0);
+        if (error) return error;
+        
+        return kcd_kfs_write_chunk(mu, data, len, mu->uploaded_size);
     }
     
-    return kfs_fclose(&mu->uploaded_file, 0);
+    karray_push(&mu->write_array, cb);
+    mu->write_pending_size += len;
+    
+    return 0;
 }
 
 /* This function handles a chunk in phase 2. */
@@ -355,15 +723,14 @@ static int kcd_kfs_handle_phase_2_chunk(struct kcd_kfs_mode_upload *mu) {
     int error = 0;
     struct kcd_ticket_mode_state *tms = mu->tms;
     uint64_t upload_total_size;
-    kbuffer chunk;
+    uint8_t *chunk_data;
+    uint32_t chunk_len;
     
     kmod_log_msg(KCD_LOG_KFS, "kcd_kfs_handle_phase_2_chunk() called.\n");
     
-    kbuffer_init(&chunk);
-    
     do {
-        /* Get the chunk data. */
-        if (anp_read_bin(&tms->in_msg->payload, &chunk)) {
+        /* Get the chunk data. The data is used in place in the message. */
+        if (anp_read_bin_view(&tms->in_msg->payload, &chunk_data, &chunk_len)) {
             error = -2;
             break;
         }
@@ -372,14 +739,10 @@ static int kcd_kfs_handle_phase_2_chunk(struct kcd_kfs_mode_upload *mu) {
         error = kcd_open_phase_2_file_if_needed(mu);
         if (error) break;
         
-        /* Hash the data. */
-        mhash(mu->hash_context, chunk.data, chunk.len);
-        
-        /* Update the file size. */
-        mu->uploaded_size += chunk.len;
-        
-        /* Compute the current total size of the upload. */
-        upload_total_size = mu->commited_total_size + mu->uploaded_size;
+        /* Compute the current total size of the upload. The files committed
+         * are accounted in the total file size of the workspace.
+         */
+        upload_total_size = mu->stream_total_size + mu->uploaded_size + chunk_len;
         
         /* Debugging. Remove me eventually. */
         kmod_log_msg(KCD_LOG_KFS, "Upload file size %llu, upload total size %llu, "
@@ -403,13 +766,79 @@ static int kcd_kfs_handle_phase_2_chunk(struct kcd_kfs_mode_upload *mu) {
             break;
         }
         
-        /* Write the chunk data in the file. */
-        error = kfs_fwrite(mu->uploaded_file, chunk.data, chunk.len);
+        /* Write the chunk data in the file. The data is hashed while it is
+         * being written.
+         */
+        error = kcd_kfs_queue_chunk(mu, chunk_data, chunk_len);
         if (error) break;
         
+        kcd_kfs_hash_data(mu, chunk_data, chunk_len);
+        
+        /* Update the file size. */
+        mu->uploaded_size += chunk_len;
+        
     } while (0);
     
-    kbuffer_clean(&chunk);
+    return error;
+}
+
+/* This function moves the file that has been uploaded to the blob store. If the
+ * blob already exists, the file is deleted and the blob is touched so that it
+ * is not garbage collected before the file map references it.
+ */
+static int kcd_kfs_store_blob(struct kcd_kfs_mode_upload *mu, struct kcd_kfs_uploaded_file *f) {
+    int error = 0, i;
+    kstr blob_path;
+    
+    kmod_log_msg(KCD_LOG_KFS, "kcd_kfs_store_blob() called.\n");
+    
+    kstr_init(&blob_path);
+    
+    do {
+        kstr_reset(&f->blob);
+        for (i = 0; i < 32; i++) kstr_append_sf(&f->blob, "%02x", mu->uploaded_blob_hash[i]);
+        
+        /* Create the blob directory. Ignore failures; we will detect them
+         * when we link the file.
+         */
+        kstr_sf(&blob_path, "%sblob/", global_opts.kfs_dir_path.data);
+        kfs_mkdir(blob_path.data);
+        kstr_append_sf(&blob_path, "%.2s/", f->blob.data);
+        kfs_mkdir(blob_path.data);
+        kstr_append_kstr(&blob_path, &f->blob);
+        
+        /* The link fails if the blob exists, even if the same file is being
+         * stored concurrently. The existing blob is touched so that the
+         * garbage collector keeps it until we reference it. If the blob is
+         * gone by then, the garbage collector has quarantined it and we store
+         * our file instead.
+         */
+        for (i = 0; link(mu->uploaded_path.data, blob_path.data); i++) {
+            if (errno != EEXIST) {
+                kmod_set_error("cannot store blob %s: %s", blob_path.data, kmod_syserror());
+                error = -1;
+                break;
+            }
+            
+            kmod_log_msg(KCD_LOG_KFS, "Blob %s already stored.\n", f->blob.data);
+            
+            if (!utime(blob_path.data, NULL)) break;
+            
+            if (errno != ENOENT || i == MAX_BLOB_STORE_RETRY) {
+                kmod_set_error("cannot touch blob %s: %s", blob_path.data, kmod_syserror());
+                error = -1;
+                break;
+            }
+        }
+        
+        if (error) break;
+        
+        /* Remove the workspace path of the file. */
+        kfs_delete(mu->uploaded_path.data, 1);
+    
+    } while (0);
+    
+    kstr_clean(&blob_path);
     
     return error;
 }
@@ -419,6 +848,8 @@ static int kcd_kfs_handle_phase_2_commit(struct kcd_kfs_mode_upload *mu) {
     int error = 0;
     kbuffer user_hash;
     struct kcd_kfs_uploaded_file *f;
+    unsigned char *hash = mu->uploaded_hash;
+    uint32_t hash_len = 16;
     
     kmod_log_msg(KCD_LOG_KFS, "kcd_kfs_handle_phase_2_commit() called.\n");
     
@@ -442,21 +873,32 @@ static int kcd_kfs_handle_phase_2_commit(struct kcd_kfs_mode_upload *mu) {
         if (error) break;
         
         /* Verify if the hashes match. */
-        if (user_hash.len != 16 || memcmp(user_hash.data, mu->uploaded_hash, 16)) {
+        if (mu->hash_type == KANP_KFS_HASH_SHA256) {
+            hash = mu->uploaded_blob_hash;
+            hash_len = 32;
+        }
+        
+        if (user_hash.len != hash_len || memcmp(user_hash.data, hash, hash_len)) {
             kmod_set_error("the computed file hash does not match");
+            kfs_delete(mu->uploaded_path.data, 1);
             error = -2;
             break;
         }
         
-        /* Remember the information about this file. */
+        /* Move the file to the blob store. */
         f =  mu->upload_array.data[mu->upload_index];
-        karray_push(&mu->commit_array, f);
+        error = kcd_kfs_store_blob(mu, f);
+        if (error) break;
+        
+        /* Commit the file. */
         f->size = mu->uploaded_size;
-        kbuffer_write(&f->hash, mu->uploaded_hash, 16);
-        mu->nb_commit++;
+        kbuffer_write(&f->hash, hash, hash_len);
+        error = kcd_kfs_commit_file(mu, f, 1);
+        if (error) break;
         
-        /* Update the commited total size. */
-        mu->commited_total_size += mu->uploaded_size;
+        /* Update the usage. */
+        mu->kws_total_size += f->size;
+        mu->tms->usage_info.kfs_usage += f->size;
         
         /* Pass to the next file. */
         mu->upload_index++;
@@ -470,11 +912,19 @@ static int kcd_kfs_handle_phase_2_commit(struct kcd_kfs_mode_upload *mu) {
 
 /* This function handles an abort in phase 2. */
 static int kcd_kfs_handle_phase_2_abort(struct kcd_kfs_mode_upload *mu) {
+    int error = 0;
     
     kmod_log_msg(KCD_LOG_KFS, "kcd_kfs_handle_phase_2_abort() called.\n");
     
-    /* Close the uploaded file, if needed. */
-    if (kcd_close_phase_2_file_if_needed(mu, 1)) return -1;
+    /* Close the uploaded file, if needed, and delete the data received. */
+    if (kcd_close_phase_2_file_if_needed(mu, 0)) return -1;
+    kstr_sf(&mu->uploaded_path, "%s"PRINTF_64"u/%s", global_opts.kfs_dir_path.data, mu->tms->kws_id,
+            ((struct kcd_kfs_uploaded_file *) mu->upload_array.data[mu->upload_index])->perm_path.data);
+    kfs_delete(mu->uploaded_path.data, 1);
+    
+    /* Abort the file. */
+    error = kcd_kfs_commit_file(mu, mu->upload_array.data[mu->upload_index], 0);
+    if (error) return error;
         
     /* Pass to the next file. */
     mu->upload_index++;
@@ -482,6 +932,47 @@ static int kcd_kfs_handle_phase_2_abort(struct kcd_kfs_mode_upload *mu) {
     return 0;
 }
 
+/* This function handles a skip in phase 2. The data received is kept and the
+ * file is released for another connection.
+ */
+static int kcd_kfs_handle_phase_2_skip(struct kcd_kfs_mode_upload *mu) {
+    
+    kmod_log_msg(KCD_LOG_KFS, "kcd_kfs_handle_phase_2_skip() called.\n");
+    
+    /* Close the uploaded file, if needed. */
+    if (kcd_close_phase_2_file_if_needed(mu, 0)) return -1;
+    
+    /* Release the file and pass to the next file. */
+    karray_push(&mu->release_array, mu->upload_array.data[mu->upload_index]);
+    mu->upload_index++;
+    
+    return 0;
+}
+
+/* This function handles a hash type selection in phase 2. */
+static int kcd_kfs_handle_phase_2_hash(struct kcd_kfs_mode_upload *mu) {
+    uint32_t hash_type;
+    
+    kmod_log_msg(KCD_LOG_KFS, "kcd_kfs_handle_phase_2_hash() called.\n");
+    
+    if (anp_read_uint32(&mu->tms->in_msg->payload, &hash_type)) return -2;
+    
+    if (hash_type != KANP_KFS_HASH_MD5 && hash_type != KANP_KFS_HASH_SHA256) {
+        kmod_set_error("unsupported hash type %u", hash_type);
+        return -2;
+    }
+    
+    /* The data of the file being uploaded has been hashed already. */
+    if (mu->uploaded_fd != -1) {
+        kmod_set_error("cannot change the hash type while a file is being uploaded");
+        return -2;
+    }
+    
+    mu->hash_type = hash_type;
+    
+    return 0;
+}
+
 /* This function handles a command message in phase 2. */
 static int kcd_kfs_handle_phase_2_msg(struct kcd_kfs_mode_upload *mu) {
     int error = 0;
@@ -523,6 +1014,16 @@ static int kcd_kfs_handle_phase_2_msg(struct kcd_kfs_mode_upload *mu) {
             error = kcd_kfs_handle_phase_2_abort(mu);
             if (error) return error;
         }
+        
+        else if (sub_type == KANP_KFS_SUBMESSAGE_SKIP) {
+            error = kcd_kfs_handle_phase_2_skip(mu);
+            if (error) return error;
+        }
+        
+        else if (sub_type == KANP_KFS_SUBMESSAGE_HASH) {
+            error = kcd_kfs_handle_phase_2_hash(mu);
+            if (error) return error;
+        }
             
         else {
             kmod_set_error("unexpected submessage type %u", sub_type);
@@ -530,9 +1031,7 @@ static int kcd_kfs_handle_phase_2_msg(struct kcd_kfs_mode_upload *mu) {
         }
     }
     
-    /* Send the result. */
-    kcd_ticket_mode_new_out_msg(mu->tms, KANP_RES_OK);
-    return kcd_ticket_mode_send_msg(mu->tms);
+    return 0;
 }
 
 /* This function handles upload phase 2. */
@@ -542,6 +1041,9 @@ static int kcd_kfs_handle_phase_2(struct kcd_kfs_mode_upload *mu) {
     
     kmod_log_msg(KCD_LOG_KFS, "kcd_kfs_handle_phase_2() called.\n");
     
+    /* Create the directories of the files before the data is received. */
+    kcd_kfs_prepare_upload_dirs(mu);
+    
     do {
         /* Receive ANP messages until we've received all the data. */
         while (mu->upload_index != mu->nb_upload) {
@@ -564,21 +1066,65 @@ static int kcd_kfs_handle_phase_2(struct kcd_kfs_mode_upload *mu) {
                 if (error) break;
             }
         
-            /* Refresh the upload entry. */
-            error = kcd_kfs_refresh_phase_2_upload(mu);
-            if (error) break;
+            /* Refresh the upload entry, unless all our files have been
+             * committed. In that case the entry may have been removed.
+             */
+            if (mu->upload_index != mu->nb_upload || mu->release_array.size) {
+                error = kcd_kfs_refresh_phase_2_upload(mu);
+                if (error) break;
+            }
+            
+            /* Send the result. */
+            if (tms->in_msg) {
+                kcd_ticket_mode_new_out_msg(tms, KANP_RES_OK);
+                error = kcd_ticket_mode_send_msg(tms);
+                if (error) break;
+            }
         }
         
         if (error) break;
         
     } while (0);
     
-    /* Delete the file currently being uploaded, if required. */
-    kcd_close_phase_2_file_if_needed(mu, 1);
+    /* Close the file currently being uploaded, if required. The data received
+     * is kept so that the upload can be resumed.
+     */
+    kcd_close_phase_2_file_if_needed(mu, 0);
     
     return error;
 }
 
+/* This function releases the files that this connection did not upload, so that
+ * another connection can resume their upload. Errors are ignored.
+ */
+static void kcd_kfs_release_phase_2_files(struct kcd_kfs_mode_upload *mu) {
+    uint32_t i;
+    
+    kmod_log_msg(KCD_LOG_KFS, "kcd_kfs_release_phase_2_files() called.\n");
+    
+    if (!mu->phase_2_active || (mu->upload_index == mu->nb_upload && !mu->release_array.size)) return;
+    
+    kcd_close_phase_2_file_if_needed(mu, 0);
+    for (i = mu->upload_index; i < mu->nb_upload; i++) karray_push(&mu->release_array, mu->upload_array.data[i]);
+    mu->upload_index = mu->nb_upload;
+    kcd_kfs_refresh_phase_2_upload(mu);
+}
+
+/* This function aborts the files that this connection did not upload. This is
+ * done for the clients that cannot join an upload (version 6 and earlier), so
+ * that the phase 2 event is posted right away instead of when the upload
+ * expires. Errors are ignored.
+ */
+static void kcd_kfs_abort_phase_2_files(struct kcd_kfs_mode_upload *mu) {
+    kmod_log_msg(KCD_LOG_KFS, "kcd_kfs_abort_phase_2_files() called.\n");
+    
+    if (!mu->phase_2_active) return;
+    
+    while (mu->upload_index < mu->nb_upload) {
+        if (kcd_kfs_handle_phase_2_abort(mu)) break;
+    }
+}
+
 /* Delete the files permanently, if possible. */
 static void kcd_kfs_delete_files_permanently(struct kcd_kfs_mode_upload *mu) {
     uint32_t i;
@@ -598,6 +1144,27 @@ static void kcd_kfs_delete_files_permanently(struct kcd_kfs_mode_upload *mu) {
     kstr_clean(&full_path);
 }
 
+/* This function reads the files to upload returned by Postgres. */
+static int kcd_kfs_read_upload_files(struct kcd_kfs_mode_upload *mu, kbuffer *out_buf) {
+    uint32_t i;
+    
+    if (anp_read_uint32(out_buf, &mu->nb_upload)) return -1;
+    
+    for (i = 0; i < mu->nb_upload; i++) {
+        struct kcd_kfs_uploaded_file *f = kcd_kfs_uploaded_file_new();
+        karray_push(&mu->upload_array, f);
+    
+        if (anp_read_uint32(out_buf, &f->create_flag) ||
+            anp_read_uint64(out_buf, &f->inode) ||
+            anp_read_kstr(out_buf, &f->share_path) ||
+            anp_read_kstr(out_buf, &f->perm_path)) {
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
 /* This function handles upload phase 1. */
 static int kcd_kfs_handle_phase_1(struct kcd_kfs_mode_upload *mu) {
     int error = 0;
@@ -609,27 +1176,16 @@ static int kcd_kfs_handle_phase_1(struct kcd_kfs_mode_upload *mu) {
     
     /* Call the phase 1 handler in Postgres. */
     anp_write_uint32(kbb, mu->share_id);
+    anp_write_uint64(kbb, mu->stream_id);
     error = kcd_ticket_mode_kws_bound_query(mu->tms, "upload_phase_one", ktime_now_sec(), tms->in_msg);
     if (error) return error;
 
     if (anp_read_uint64(out_buf, &mu->commit_id) ||
         anp_read_uint64(out_buf, &mu->public_email_id) ||
-        anp_read_uint32(out_buf, &mu->nb_upload)) {
+        kcd_kfs_read_upload_files(mu, out_buf)) {
         return -1;
     }
     
-    for (i = 0; i < mu->nb_upload; i++) {
-        struct kcd_kfs_uploaded_file *f = kcd_kfs_uploaded_file_new();
-        karray_push(&mu->upload_array, f);
-    
-        if (anp_read_uint32(out_buf, &f->create_flag) ||
-            anp_read_uint64(out_buf, &f->inode) ||
-            anp_read_kstr(out_buf, &f->share_path) ||
-            anp_read_kstr(out_buf, &f->perm_path)) {
-            return -1;
-        }
-    }
-    
     if (anp_read_uint32(out_buf, &mu->nb_perm_delete)) return -1;
     
     for (i = 0; i < mu->nb_perm_delete; i++) {
@@ -648,12 +1204,66 @@ static int kcd_kfs_handle_phase_1(struct kcd_kfs_mode_upload *mu) {
     return kcd_ticket_mode_send_msg(tms);
 }
 
+/* This function handles a connection joining an upload in progress. The size
+ * of the data already received for each file is sent to the client.
+ */
+static int kcd_kfs_handle_join(struct kcd_kfs_mode_upload *mu) {
+    int error = 0;
+    uint32_t i;
+    struct stat st;
+    struct kcd_ticket_mode_state *tms = mu->tms;
+    kbuffer *kbb = &tms->kws_bound_buf, *out_buf = &tms->aq.output_buf;
+    kstr path;
+    
+    kmod_log_msg(KCD_LOG_KFS, "kcd_kfs_handle_join() called.\n");
+    
+    kstr_init(&path);
+    
+    do {
+        /* Call the join handler in Postgres. */
+        anp_write_uint32(kbb, mu->share_id);
+        anp_write_uint64(kbb, mu->stream_id);
+        error = kcd_ticket_mode_kws_bound_query(tms, "join_upload", ktime_now_sec(), tms->in_msg);
+        if (error) break;
+        
+        if (anp_read_uint64(out_buf, &mu->commit_id) ||
+            anp_read_uint64(out_buf, &mu->public_email_id) ||
+            kcd_kfs_read_upload_files(mu, out_buf) ||
+            anp_read_uint64(out_buf, &mu->stream_total_size)) {
+            error = -1;
+            break;
+        }
+        
+        /* Write the size of the data received for each file. */
+        anp_write_uint32(&tms->out_msg->payload, mu->nb_upload);
+        
+        for (i = 0; i < mu->nb_upload; i++) {
+            struct kcd_kfs_uploaded_file *f = mu->upload_array.data[i];
+            kstr_sf(&path, "%s"PRINTF_64"u/%s", global_opts.kfs_dir_path.data, tms->kws_id, f->perm_path.data);
+            anp_write_uint64(&tms->out_msg->payload, stat(path.data, &st) ? 0 : st.st_size);
+        }
+        
+        /* Remember whether the phase 2 is active. */
+        mu->phase_2_active = (mu->nb_upload > 0);
+        
+        /* Send the result to the client. */
+        error = kcd_ticket_mode_send_msg(tms);
+        if (error) break;
+        
+    } while (0);
+    
+    kstr_clean(&path);
+    
+    return error;
+}
+
 /* Perform upload phases 1 and 2, as required. */
 static int kcd_kfs_handle_upload_phases(struct kcd_kfs_mode_upload *mu) {
     int error;
 
-    /* Handle upload phase 1. */
-    error = kcd_kfs_handle_phase_1(mu);
+    /* Handle upload phase 1, or join the upload specified. */
+    if (mu->tms->in_msg->type == KANP_CMD_KFS_UPLOAD_JOIN) error = kcd_kfs_handle_join(mu);
+    else error = kcd_kfs_handle_phase_1(mu);
     if (error) return error;
 
     /* Handle upload phase 2. */
@@ -702,18 +1312,22 @@ int kcd_kfs_handle_upload(struct kcd_ticket_mode_state *tms) {
         error = kcd_kfs_get_share_id_from_ticket(tms, &mu.share_id);
         if (error) break;
         
+        /* Identify this connection in the upload. */
+        error = kutil_generate_random((char *) &mu.stream_id, sizeof(mu.stream_id));
+        if (error) break;
+        mu.stream_id &= INT64_MAX;
+        if (!mu.stream_id) mu.stream_id = 1;
+        
         /* Perform upload phases 1 and 2, as required. */
         error = kcd_kfs_handle_upload_error(tms, kcd_kfs_handle_upload_phases(&mu), &user_error_flag);
         if (error) break;
         
-        /* Post the phase 2 event if the phase 2 is active. */
-        if (mu.phase_2_active) {
-            error = kcd_kfs_handle_upload_error(tms, kcd_kfs_post_phase_2_event(&mu), &user_error_flag);
-            if (error) break;
-        }
-        
-        /* Handle user errors. */
+        /* Handle user errors. The files not uploaded are released so that
+         * the upload can be resumed, unless the client cannot resume it.
+         */
         if (user_error_flag) {
+            if (tms->client->effective_minor < 7) kcd_kfs_abort_phase_2_files(&mu);
+            else kcd_kfs_release_phase_2_files(&mu);
             kmod_set_error("closed client connection after handling upload error");
             error = -4;
             break;
@@ -734,46 +1348,159 @@ int kcd_kfs_handle_upload(struct kcd_ticket_mode_state *tms) {
 }
 
 
+/* This structure describes a chunk of a downloaded file mapped in memory. */
+struct kcd_kfs_mapped_chunk {
+    
+    /* Data of the chunk, inserted in the download message. */
+    struct anp_tls_ext_seg seg;
+    
+    /* Address and size of the mapping, which starts on a page boundary. */
+    void *addr;
+    size_t len;
+};
+
+/* This function unmaps the chunks (kcd_kfs_mapped_chunk) of the array
+ * specified and resets the array.
+ */
+static void kcd_kfs_clear_mapped_chunks(karray *chunk_array) {
+    int i;
+    
+    for (i = 0; i < chunk_array->size; i++) {
+        struct kcd_kfs_mapped_chunk *c = chunk_array->data[i];
+        munmap(c->addr, c->len);
+        kfree(c);
+    }
+    
+    karray_reset(chunk_array);
+}
+
 /* This function passes to the next file to download. */
 static void kcd_kfs_download_next_file(struct kcd_kfs_mode_download *md) {
     assert(md->download_index < md->nb_download);
     md->download_index++;
-    kfs_fclose(&md->downloaded_file, 1);
+    close(md->downloaded_fd);
+    md->downloaded_fd = -1;
+}
+
+/* This function opens the file to download specified and gets its size. */
+static int kcd_kfs_download_open_file(struct kcd_kfs_mode_download *md, char *path) {
+    struct stat st;
+    
+    md->downloaded_fd = open(path, O_RDONLY);
+    
+    if (md->downloaded_fd == -1) {
+        kmod_set_error("cannot open %s: %s", path, kmod_syserror());
+        return -1;
+    }
+    
+    if (fstat(md->downloaded_fd, &st)) {
+        kmod_set_error("cannot get the size of %s: %s", path, kmod_syserror());
+        return -1;
+    }
+    
+    md->downloaded_size = st.st_size;
+    return 0;
+}
+
+/* This function reads the next chunk of the downloaded file in the buffer
+ * specified.
+ */
+static int kcd_kfs_download_read_chunk(struct kcd_kfs_mode_download *md, uint8_t *buf, uint32_t len) {
+    while (len) {
+        ssize_t r = pread(md->downloaded_fd, buf, len, md->read_offset);
+        
+        if (r == -1 && errno == EINTR) continue;
+        
+        if (r <= 0) {
+            kmod_set_error("cannot read downloaded file: %s", r ? kmod_syserror() : "file truncated");
+            return -1;
+        }
+        
+        buf += r;
+        len -= r;
+        md->read_offset += r;
+    }
+    
+    return 0;
+}
+
+/* This function maps the next chunk of the downloaded file in memory and adds
+ * it to the array specified. The committed KFS files are never modified in
+ * place and deleting the file does not invalidate the mapping.
+ */
+static int kcd_kfs_download_map_chunk(struct kcd_kfs_mode_download *md, uint32_t len, karray *chunk_array) {
+    struct kcd_kfs_mapped_chunk *c;
+    uint64_t start = md->read_offset - md->read_offset % sysconf(_SC_PAGESIZE);
+    void *addr;
+    struct stat st;
+    
+    /* Accessing a mapping past the end of the file raises SIGBUS. The file
+     * may have been truncated since we opened it.
+     */
+    if (fstat(md->downloaded_fd, &st)) {
+        kmod_set_error("cannot stat downloaded file: %s", kmod_syserror());
+        return -1;
+    }
+    
+    if (md->read_offset + len > (uint64_t) st.st_size) {
+        kmod_set_error("downloaded file is shorter than expected");
+        return -1;
+    }
+    
+    addr = mmap(NULL, md->read_offset - start + len, PROT_READ, MAP_SHARED, md->downloaded_fd, start);
+    
+    if (addr == MAP_FAILED) {
+        kmod_set_error("cannot map downloaded file: %s", kmod_syserror());
+        return -1;
+    }
+    
+    /* The chunk is about to be sent; read it ahead. */
+    madvise(addr, md->read_offset - start + len, MADV_WILLNEED);
+    
+    c = kmalloc(sizeof(struct kcd_kfs_mapped_chunk));
+    c->addr = addr;
+    c->len = md->read_offset - start + len;
+    c->seg.data = (uint8_t *) addr + (md->read_offset - start);
+    c->seg.len = len;
+    karray_push(chunk_array, c);
+    
+    md->read_offset += len;
+    return 0;
 }
 
-/* Send the next message to the user. */
+/* Send the next message to the user. The large chunks are sent from a mapping of
+ * the file, without being copied in the message.
+ */
 static int kcd_kfs_download_send_msg(struct kcd_kfs_mode_download *md) {
-    int error = 0;
-    uint32_t nb_sub = 0;
-    kbuffer payload, data_buf, *buf;
+    int error = 0, i;
+    uint32_t nb_sub = 0, ext_size = 0;
+    kbuffer payload, *buf;
+    karray chunk_array, ext_array;
     kstr full_path;
     struct kcd_ticket_mode_state *tms = md->tms;
     
     kmod_log_msg(KCD_LOG_KFS, "kcd_kfs_download_send_msg() called.\n");
     
     kbuffer_init(&payload);
-    kbuffer_init(&data_buf);
+    karray_init(&chunk_array);
+    karray_init(&ext_array);
     kstr_init(&full_path);
     
     do {
-        /* Loop until the message is full or we run out of files to download. */
-        while (payload.len < MAX_DOWNLOAD_SIZE && md->download_index != md->nb_download) {
+        /* Loop until the message is full or we run out of files to download.
+         * The message size includes the mapped chunks.
+         */
+        while (payload.len + ext_size < MAX_DOWNLOAD_SIZE && md->download_index != md->nb_download) {
 
             /* The current file is closed. */
-            if (md->downloaded_file == NULL) {
-                uint64_t size;
+            if (md->downloaded_fd == -1) {
                 uint64_t *inode = md->download_inode_array.data[md->download_index];
                 uint64_t *offset = md->download_offset_array.data[md->download_index];
                 kstr *path = md->download_path_array.data[md->download_index];
-                kstr_sf(&full_path, "%s"PRINTF_64"u/%s", global_opts.kfs_dir_path.data, tms->kws_id, path->data);
+                kstr_sf(&full_path, "%s%s", global_opts.kfs_dir_path.data, path->data);
                 
-                error = kfs_fopen(&md->downloaded_file, full_path.data, "rb");
+                error = kcd_kfs_download_open_file(md, full_path.data);
                 if (error) break;
-
-                /* Get the file size. */
-                error = kfs_fsize(md->downloaded_file, &size);
-                if (error) break;
-                md->downloaded_size = size;
                 
                 /* If the offset is bigger than the file size, complain. */
                 if (*offset > md->downloaded_size) {
@@ -795,10 +1522,7 @@ static int kcd_kfs_download_send_msg(struct kcd_kfs_mode_download *md) {
 
                 /* The remaining size is non-zero, there will be a chunk. */
                 if (md->remaining_size) {
-
-                    /* Seek at the specified offset. */
-                    error = kfs_fseek(md->downloaded_file, *offset, SEEK_SET);
-                    if (error) break;
+                    md->read_offset = *offset;
                 }
 
                 /* Pass to the next file. */
@@ -813,20 +1537,33 @@ static int kcd_kfs_download_send_msg(struct kcd_kfs_mode_download *md) {
 
                 /* Compute the chunk size. */
                 assert(md->remaining_size);
-                chunk_size = MAX(MIN_DOWNLOAD_CHUNK_SIZE, MAX_DOWNLOAD_SIZE - (int32_t) payload.len);
+                chunk_size = MAX(MIN_DOWNLOAD_CHUNK_SIZE, MAX_DOWNLOAD_SIZE - (int32_t) (payload.len + ext_size));
                 chunk_size = MIN(chunk_size, md->remaining_size);
                 md->remaining_size -= chunk_size;
 
-                /* Read the chunk. */
-                kbuffer_reset(&data_buf);
-                error = kfs_fread(md->downloaded_file, kbuffer_write_nbytes(&data_buf, chunk_size), chunk_size);
-                if (error) break;
-
                 /* Add the 'chunk' submessage. */
                 nb_sub++;
                 anp_write_uint32(&payload, 3);
                 anp_write_uint32(&payload, KANP_KFS_SUBMESSAGE_CHUNK);
-                anp_write_bin(&payload, &data_buf);
+                anp_write_bin_hdr(&payload, chunk_size);
+                
+                /* Map the chunk and insert it at this point of the message. */
+                if (chunk_size >= MIN_MAPPED_CHUNK_SIZE) {
+                    struct kcd_kfs_mapped_chunk *c;
+                    error = kcd_kfs_download_map_chunk(md, chunk_size, &chunk_array);
+                    if (error) break;
+                    
+                    c = chunk_array.data[chunk_array.size - 1];
+                    c->seg.pos = payload.len;
+                    karray_push(&ext_array, &c->seg);
+                    ext_size += chunk_size;
+                }
+                
+                /* Read the chunk in the message. */
+                else {
+                    error = kcd_kfs_download_read_chunk(md, kbuffer_write_nbytes(&payload, chunk_size), chunk_size);
+                    if (error) break;
+                }
 
                 /* Pass to the next file. */
                 if (!md->remaining_size) {
@@ -837,17 +1574,22 @@ static int kcd_kfs_download_send_msg(struct kcd_kfs_mode_download *md) {
         
         if (error) break;
     
-        /* Create and send the message. */
+        /* Create and send the message. The mapped chunks are positioned
+         * relatively to the start of the message payload.
+         */
         buf = kcd_ticket_mode_new_out_msg(tms, KANP_RES_KFS_DOWNLOAD_DATA);
         anp_write_uint32(buf, nb_sub);
+        for (i = 0; i < ext_array.size; i++) ((struct anp_tls_ext_seg *) ext_array.data[i])->pos += buf->len;
         kbuffer_write_buffer(buf, &payload);
-        error = kcd_ticket_mode_send_msg(tms);
+        error = kcd_ticket_mode_send_msg_ext(tms, &ext_array);
         if (error) break;
         
     } while (0);
     
+    kcd_kfs_clear_mapped_chunks(&chunk_array);
+    karray_clean(&chunk_array);
+    karray_clean(&ext_array);
     kbuffer_clean(&payload);
-    kbuffer_clean(&data_buf);
     kstr_clean(&full_path);
     
     return error;
@@ -857,43 +1599,61 @@ static int kcd_kfs_download_send_msg(struct kcd_kfs_mode_download *md) {
 static int kcd_kfs_download_get_path(struct kcd_kfs_mode_download *md) {
     int error = 0;
     uint32_t i;
+    uint64_t *run;
     struct kcd_ticket_mode_state *tms = md->tms;
     kbuffer *kbb = &tms->kws_bound_buf, *in_buf = &tms->in_msg->payload, *out_buf = &tms->aq.output_buf;
     
     kmod_log_msg(KCD_LOG_KFS, "kcd_kfs_download_get_path() called.\n");
     
-    /* Get the list of files to download. */
+    /* Get the list of files to download. The (inode, offset, commit ID)
+     * triplets form a single run of UINT64 elements.
+     */
     if (anp_read_uint32(in_buf, &md->nb_download)) return -2;
     
-    for (i = 0; i < md->nb_download; i++) {
-        uint64_t *inode = kmalloc(8), *offset = kmalloc(8), *commit_id = kmalloc(8);
-        karray_push(&md->download_inode_array, inode);
-        karray_push(&md->download_offset_array, offset);
-        karray_push(&md->download_commit_array, commit_id);
-        
-        if (anp_read_uint64(in_buf, inode) ||
-            anp_read_uint64(in_buf, offset) ||
-            anp_read_uint64(in_buf, commit_id)) {
-            return -2;
-        }
-    }
-    
     if (!md->nb_download) {
         kmod_set_error("the number of files to download is 0");
         return -2;
     }
     
-    /* Get the permanent paths from Postgres. */
-    anp_write_uint32(kbb, md->share_id);
-    anp_write_uint32(kbb, md->nb_download);
-    
-    for (i = 0; i < md->nb_download; i++) {
-        uint64_t *inode = md->download_inode_array.data[i];
-        uint64_t *commit_id = md->download_commit_array.data[i];
-        anp_write_uint64(kbb, *inode);
-        anp_write_uint64(kbb, *commit_id);
+    if (md->nb_download > (uint32_t) (in_buf->len - in_buf->pos) / 27) {
+        kmod_set_error("the list of files to download is truncated");
+        return -2;
     }
     
+    run = kmalloc(md->nb_download * 3 * sizeof(uint64_t));
+    
+    do {
+        if (anp_read_uint64_array(in_buf, run, md->nb_download * 3)) {
+            error = -2;
+            break;
+        }
+        
+        for (i = 0; i < md->nb_download; i++) {
+            uint64_t *inode = kmalloc(8), *offset = kmalloc(8), *commit_id = kmalloc(8);
+            karray_push(&md->download_inode_array, inode);
+            karray_push(&md->download_offset_array, offset);
+            karray_push(&md->download_commit_array, commit_id);
+            *inode = run[i * 3];
+            *offset = run[i * 3 + 1];
+            *commit_id = run[i * 3 + 2];
+        }
+        
+        /* Get the permanent paths from Postgres. */
+        anp_write_uint32(kbb, md->share_id);
+        anp_write_uint32(kbb, md->nb_download);
+        
+        for (i = 0; i < md->nb_download; i++) {
+            run[i * 2] = run[i * 3];
+            run[i * 2 + 1] = run[i * 3 + 2];
+        }
+        
+        anp_write_uint64_array(kbb, run, md->nb_download * 2);
+    
+    } while (0);
+    
+    kfree(run);
+    if (error) return error;
+    
     error = kcd_ticket_mode_kws_bound_query(tms, "download_file", ktime_now_sec(), NULL);
     if (error) return error;
 
@@ -1,6 +1,7 @@
 /* Copyright (C) 2006-2012 Opersys inc., All rights reserved. */
 
 #include "kmod_transfer.h"
+#include "misc.h"
 
 /* Communication driver for sockets. */
 struct kmod_comm_driver kmod_sock_driver = { ksock_read, ksock_write, ksock_close };
@@ -23,6 +24,7 @@ void kmod_data_transfer_clean(struct kmod_data_transfer *self) {
 /* This function initializes the transfer hub. */
 void kmod_transfer_hub_init(struct kmod_transfer_hub *self) {
     khash_init(&self->transfer_hash);
+    kpoll_init(&self->poll, 0);
 }
 
 /* This function frees the transfer hub. */
@@ -30,6 +32,7 @@ void kmod_transfer_hub_clean(struct kmod_transfer_hub *self) {
     if (self == NULL) return;
     
     khash_clean(&self->transfer_hash);
+    kpoll_clean(&self->poll);
 }
 
 /* This function adds a tranfer to the transfer hub. The transfer must not
@@ -89,17 +92,15 @@ void kmod_transfer_hub_wait(struct kmod_transfer_hub *hub) {
     /* Loop until we manage to complete a transfer. */
     while (! done_flag) {
 	int error = 0;
-	int max_sock = 0;
 	int i;
 	struct kmod_data_transfer *transfer;
 	struct khash_iter iter;
 	struct timeval deadline = { 2147483647, 0 };
 	struct timeval now, min_time, time_to_wait;
-	fd_set read_set, write_set;
+	struct kselect sel;
     	
 	khash_iter_init(&iter, &hub->transfer_hash);
-	FD_ZERO(&read_set);
-	FD_ZERO(&write_set);
+	kselect_zero(&sel);
     
 	/* Find which transfers must be processed. */
 	transfer_array.size = 0;
@@ -121,11 +122,9 @@ void kmod_transfer_hub_wait(struct kmod_transfer_hub *hub) {
 		
 		/* Put the transfer in the appropriate select() set. */
 		if (transfer->read_flag)
-	    	    FD_SET((unsigned int) transfer->fd, &read_set);
+	    	    kselect_add_read(&sel, transfer->fd);
 		else
-	    	    FD_SET((unsigned int) transfer->fd, &write_set);
-    	    	
-		max_sock = MAX(transfer->fd, max_sock);
+	    	    kselect_add_write(&sel, transfer->fd);
 		
 		/* Compute deadline for select(). */
 		if (ktime_cmp(&transfer->deadline, &deadline) == -1) {
@@ -158,20 +157,20 @@ void kmod_transfer_hub_wait(struct kmod_transfer_hub *hub) {
 	    ktime_sub(&time_to_wait, &deadline, &now);
 	}
     
-     	/* Wait for the sockets to become readable or writable. */
-    	error = select(max_sock + 1, &read_set, &write_set, NULL, &time_to_wait);
-
-	if (error < 0) {
-    	    
-	    #ifdef __UNIX__
-	    /* Ignore EINTR. */
-	    if (errno == EINTR) {
-	    	continue;
+     	/* Wait for the sockets to become readable or writable. The
+	 * descriptors stay registered between the waits.
+	 */
+	sel.tv = time_to_wait;
+	
+	if (kpoll_wait_select(&hub->poll, &sel)) {
+	    for (i = 0; i < transfer_array.size; i++) {
+	        transfer = (struct kmod_data_transfer *) transfer_array.data[i];
+	        transfer->status = KMOD_DATA_TRANS_ERROR;
+	        transfer->err_msg = kstr_new();
+	        kstr_assign_kstr(transfer->err_msg, kmod_kstrerror());
 	    }
-	    #endif
 	    
-	    /* We can't handle other errors. */
-    	    kerror_fatal("select() failed: %s", kmod_neterror());
+	    break;
 	}
 		
 	/* Check what happened. */
@@ -179,10 +178,11 @@ void kmod_transfer_hub_wait(struct kmod_transfer_hub *hub) {
 	
 	for (i = 0; i < transfer_array.size; i++) {
 	    transfer = (struct kmod_data_transfer *) transfer_array.data[i];
-	    fd_set *set = transfer->read_flag ? &read_set : &write_set;
+	    int ready_flag = transfer->read_flag ? kselect_in_read(&sel, transfer->fd) :
+	                                           kselect_in_write(&sel, transfer->fd);
 	    
 	    /* This transfer is ready. */
-	    if (FD_ISSET(transfer->fd, set)) {
+	    if (ready_flag) {
 	    	
 		uint32_t nb = transfer->max_len - transfer->trans_len;
 		error = 0;
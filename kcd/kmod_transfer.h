@@ -4,6 +4,7 @@
 #define _KMOD_TRANSFER_H
 
 #include "kmod_base.h"
+#include "misc.h"
 
 /* This object represents a communication driver. */
 struct kmod_comm_driver {
@@ -121,6 +122,9 @@ struct kmod_transfer_hub {
 
     /* Hash containing the current transfers. */
     khash transfer_hash;
+    
+    /* Descriptors of the transfers, registered for the lifetime of the hub. */
+    struct kpoll poll;
 };
 
 /* This function returns the error message corresponding to the transfer error
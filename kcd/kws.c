@@ -1,5 +1,6 @@
 /* Copyright (C) 2009-2012 Opersys inc., All rights reserved. */
 
+#include <sys/eventfd.h>
 #include "common.h"
 
 /* Conventions used in KANP workspace mode to handle user commands:
@@ -25,12 +26,6 @@
  * We don't use linked lists for lists; there are race conditions; the code is
  * generally ugly. The whole thing must be rewritten.
  */
- 
-/* Maximum size of each message queue of a client. */
-#define KCD_KWS_MAX_CLIENT_QUEUE_SIZE           (2*1024*1024)
-
-/* How much data we can be put in a single outgoing packet. */
-#define KCD_KWS_MAX_CLIENT_OUT_PACKET_SIZE	(1*1024*1024)
 
 
 /******************************************************************************/
@@ -95,6 +90,12 @@ void kcd_kws_cmd_kws_destroy(struct kcd_kws_cmd_kws *self) {
     }
 }
 
+/* Return the maximum size of each message queue of a client. */
+int kcd_kws_get_max_queue_size() {
+    return (global_opts.kws_client_queue_size > 0) ? global_opts.kws_client_queue_size :
+                                                     KCD_KWS_MAX_CLIENT_QUEUE_SIZE;
+}
+
 static struct kcd_kws_evt_kws* kcd_kws_evt_kws_new() {
     struct kcd_kws_evt_kws *self = kcalloc(sizeof(struct kcd_kws_evt_kws));
     return self;
@@ -121,11 +122,9 @@ static void kcd_kws_state_destroy_thread_msg(struct kcd_thread_msg *msg) {
 /* Destroy the ANP messages in the array specified and clean/reset the array as
  * requested.
  */
-static void kcd_kws_clear_anp_msg_array(karray *array, int clean_flag) {
-    int i;
-    for (i = 0; i < array->size; i++) anp_msg_destroy(array->data[i]);
+void kcd_kws_clear_anp_msg_array(karray *array, int clean_flag) {
+    anp_msg_destroy_array(array);
     if (clean_flag) karray_clean(array);
-    else karray_reset(array);
 }
 
 /* Destroy the ANP messages in the array specified and clean/reset the array as
@@ -149,36 +148,101 @@ void kcd_internal_ticket_clean(struct kcd_internal_ticket *self) {
     kbuffer_clean(&self->ext);
 }
 
-static void kcd_kws_cmd_exec_state_init(struct kcd_kws_cmd_exec_state *self) {
+void kcd_kws_cmd_exec_state_init(struct kcd_kws_cmd_exec_state *self) {
     memset(self, 0, sizeof(struct kcd_kws_cmd_exec_state));
     kstr_init(&self->query);
     kcd_pg_anp_query_init(&self->aq);
     kbuffer_init(&self->kws_bound_buf);
 }
 
-static void kcd_kws_cmd_exec_state_clean(struct kcd_kws_cmd_exec_state *self) {
+void kcd_kws_cmd_exec_state_clean(struct kcd_kws_cmd_exec_state *self) {
     kstr_clean(&self->query);
     kcd_pg_anp_query_clean(&self->aq);
     kbuffer_clean(&self->kws_bound_buf);
 }
 
+static void kcd_kws_queue_init(struct kcd_kws_queue *self) {
+    self->head = self->tail = kcalloc(sizeof(struct kcd_kws_queue_node));
+    self->count = 0;
+}
+
+/* This function adds a message at the end of the queue. It must only be called
+ * by the producer. It returns true if the queue was empty.
+ */
+static int kcd_kws_queue_push(struct kcd_kws_queue *self, void *data) {
+    struct kcd_kws_queue_node *node = kmalloc(sizeof(struct kcd_kws_queue_node));
+    node->next = NULL;
+    node->data = data;
+    
+    /* Make the node visible to the consumer once it is complete. */
+    __sync_synchronize();
+    self->tail->next = node;
+    self->tail = node;
+    self->nb_push++;
+    
+    return __sync_fetch_and_add(&self->count, 1) == 0;
+}
+
+/* This function removes the first message of the queue, if any. It must only
+ * be called by the consumer.
+ */
+static void * kcd_kws_queue_pop(struct kcd_kws_queue *self) {
+    struct kcd_kws_queue_node *next = self->head->next;
+    void *data;
+    
+    if (!next) return NULL;
+    __sync_synchronize();
+    
+    /* The node becomes the new dummy node. */
+    data = next->data;
+    next->data = NULL;
+    kfree(self->head);
+    self->head = next;
+    self->nb_pop++;
+    __sync_fetch_and_sub(&self->count, 1);
+    
+    return data;
+}
+
+/* This function returns true if the queue is empty. */
+static inline int kcd_kws_queue_empty(struct kcd_kws_queue *self) {
+    return self->count == 0;
+}
+
+/* This function destroys the messages left in the queue with the function
+ * specified and frees the queue. No thread may use the queue anymore.
+ */
+static void kcd_kws_queue_clean(struct kcd_kws_queue *self, void (*destroy_func)(void *)) {
+    void *data;
+    while ((data = kcd_kws_queue_pop(self))) destroy_func(data);
+    kfree(self->head);
+    self->head = self->tail = NULL;
+}
+
 static void kcd_kws_state_init(struct kcd_kws_state *self) {
     memset(self, 0, sizeof(struct kcd_kws_state));
     
-    kdaemon_open_socket_pair(self->brk_sock);
-    kdaemon_open_socket_pair(self->cmd_sock);
-    kdaemon_open_socket_pair(self->evt_sock);
+    anp_msg_pool_init(&self->msg_pool);
+    self->max_queue_size = kcd_kws_get_max_queue_size();
+    
+    self->brk_efd = eventfd(0, EFD_NONBLOCK);
+    self->cmd_efd = eventfd(0, EFD_NONBLOCK);
+    self->evt_efd = eventfd(0, EFD_NONBLOCK);
+    if (self->brk_efd == -1 || self->cmd_efd == -1 || self->evt_efd == -1)
+        kerror_fatal("cannot create eventfd: %s", kerror_syserror());
     
     kmutex_init(&self->mutex);
     kstr_init(&self->no_backend_str);
     kstr_init(&self->no_client_str);
-    karray_init(&self->in_msg_array);
-    karray_init(&self->out_msg_array);
-    karray_init(&self->evt_msg_array);
-    karray_init(&self->cmd_msg_array);
+    kcd_kws_queue_init(&self->in_queue);
+    kcd_kws_queue_init(&self->cmd_out_queue);
+    kcd_kws_queue_init(&self->evt_out_queue);
+    kcd_kws_queue_init(&self->evt_msg_queue);
+    kcd_kws_queue_init(&self->cmd_msg_queue);
     
     karray_init(&self->brk_out_msg_array);
     anp_tls_init(&self->brk_xfer);
+    self->brk_xfer.msg_pool = &self->msg_pool;
     
     krb_tree_init_func(&self->evt_kws_tree, kutil_uint64_cmp);
     krb_tree_init_func(&self->evt_kws_active_tree, kutil_uint64_cmp);
@@ -192,14 +256,19 @@ static void kcd_kws_state_clean(struct kcd_kws_state *self) {
     int i, size;
     struct krb_node *iter;
     
+    close(self->brk_efd);
+    close(self->cmd_efd);
+    close(self->evt_efd);
+    
     kmutex_clean(&self->mutex);
     kstr_clean(&self->no_backend_str);
     kstr_clean(&self->no_client_str);
     
-    kcd_kws_clear_anp_msg_array(&self->in_msg_array, 1);
-    kcd_kws_clear_anp_msg_array(&self->out_msg_array, 1);
-    kcd_kws_clear_thread_msg_array(&self->evt_msg_array, 1);
-    kcd_kws_clear_thread_msg_array(&self->cmd_msg_array, 1);
+    kcd_kws_queue_clean(&self->in_queue, (void (*)(void *)) anp_msg_destroy);
+    kcd_kws_queue_clean(&self->cmd_out_queue, (void (*)(void *)) anp_msg_destroy);
+    kcd_kws_queue_clean(&self->evt_out_queue, (void (*)(void *)) anp_msg_destroy);
+    kcd_kws_queue_clean(&self->evt_msg_queue, (void (*)(void *)) kcd_kws_state_destroy_thread_msg);
+    kcd_kws_queue_clean(&self->cmd_msg_queue, (void (*)(void *)) kcd_kws_state_destroy_thread_msg);
     
     
     kcd_kws_clear_anp_msg_array(&self->brk_out_msg_array, 1);
@@ -212,7 +281,7 @@ static void kcd_kws_state_clean(struct kcd_kws_state *self) {
     krb_tree_clean(&self->evt_kws_tree);
     
     krb_tree_clean(&self->evt_kws_active_tree);
-    pg_db_conn_clean(&self->evt_conn);
+    kcd_pg_pool_put(&self->evt_conn);
     
     
     iter = krb_tree_iter_start(&self->cmd_kws_tree);
@@ -220,24 +289,53 @@ static void kcd_kws_state_clean(struct kcd_kws_state *self) {
     for (i = 0; i < size; i++) kcd_kws_cmd_kws_destroy(krb_tree_iter_next(&self->cmd_kws_tree, &iter));
     krb_tree_clean(&self->cmd_kws_tree);
     
-    pg_db_conn_clean(&self->cmd_conn);
+    kcd_pg_pool_put(&self->cmd_conn);
+    anp_msg_destroy(self->cmd_pending);
+    
+    /* All the messages should have been returned to the pool at this point.
+     * If not, the pool is leaked rather than freed under the live messages.
+     */
+    if (anp_msg_pool_clean(&self->msg_pool))
+        kmod_log_msg(KCD_LOG_BRIEF, "Leaking the session message pool: %s.\n", kmod_strerror());
 }
 
-static void kcd_kws_notify_sock(int fd) {
-    char a = 0;
-    write(fd, &a, 1);
+/* Log the memory and permission cache statistics of the session. */
+static void kcd_kws_log_session_stats(struct kcd_kws_state *st) {
+    struct anp_msg_pool *pool = &st->msg_pool;
+    
+    kmod_log_msg(KCD_LOG_KWS, "Session messages: "PRINTF_64"u allocated, "PRINTF_64"u reused, %d live at peak, "
+                 PRINTF_64"u payload bytes, largest payload %u bytes, "PRINTF_64"u bytes kept in free messages.\n",
+                 pool->nb_alloc, pool->nb_reuse, pool->peak_live, pool->payload_bytes, pool->max_payload,
+                 pool->free_bytes);
+    kmod_log_msg(KCD_LOG_KWS, "Session queues: %d bytes incoming at peak, %d bytes outgoing at peak, "
+                 "limit %d bytes.\n", st->in_peak, st->out_peak, st->max_queue_size);
+    kmod_log_msg(KCD_LOG_KWS, "Session permission cache: "PRINTF_64"u hits, "PRINTF_64"u misses, "
+                 PRINTF_64"u invalidations.\n", st->nb_perm_hit, st->nb_perm_miss, st->nb_perm_invalidate);
+}
+
+/* Signal the eventfd specified. EAGAIN means that the counter is saturated,
+ * so the eventfd is already signaled.
+ */
+static void kcd_kws_notify_efd(int fd) {
+    uint64_t one = 1;
+    
+    while (write(fd, &one, sizeof(one)) == -1) {
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN) break;
+        kerror_fatal("cannot signal eventfd: %s", kerror_syserror());
+    }
 }
 
 static void kcd_kws_notify_brk_thread(struct kcd_kws_state *st) {
-    kcd_kws_notify_sock(st->brk_sock[0]);
+    kcd_kws_notify_efd(st->brk_efd);
 }
 
 static void kcd_kws_notify_cmd_thread(struct kcd_kws_state *st) {
-    kcd_kws_notify_sock(st->cmd_sock[0]);
+    kcd_kws_notify_efd(st->cmd_efd);
 }
 
 static void kcd_kws_notify_evt_thread(struct kcd_kws_state *st) {
-    kcd_kws_notify_sock(st->evt_sock[0]);
+    kcd_kws_notify_efd(st->evt_efd);
 }
 
 static void kcd_kws_notify_all_thread(struct kcd_kws_state *st) {
@@ -246,73 +344,106 @@ static void kcd_kws_notify_all_thread(struct kcd_kws_state *st) {
     kcd_kws_notify_evt_thread(st);
 }
 
-static void kcd_kws_clear_notif_sock(int fd) {
-    char buf[1000];
-    while (read(fd, buf, 1000) > 0) {}
+/* Clear the eventfd specified. EAGAIN means that it was not signaled. */
+static void kcd_kws_clear_notif_efd(int fd) {
+    uint64_t count;
+    
+    while (read(fd, &count, sizeof(count)) == -1) {
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN) break;
+        kerror_fatal("cannot clear eventfd: %s", kerror_syserror());
+    }
 }
 
 static void kcd_kws_clear_notif_brk(struct kcd_kws_state *st) {
-    kcd_kws_clear_notif_sock(st->brk_sock[1]);
+    kcd_kws_clear_notif_efd(st->brk_efd);
 }
 
 static void kcd_kws_clear_notif_cmd(struct kcd_kws_state *st) {
-    kcd_kws_clear_notif_sock(st->cmd_sock[1]);
+    kcd_kws_clear_notif_efd(st->cmd_efd);
 }
 
 static void kcd_kws_clear_notif_evt(struct kcd_kws_state *st) {
-    kcd_kws_clear_notif_sock(st->evt_sock[1]);
+    kcd_kws_clear_notif_efd(st->evt_efd);
 }
 
-/* These functions add/remove an ANP message to the incoming/outgoing message
- * queue and update quenching as needed.
+/* This function adds 'delta' to the queued size specified, updates the peak
+ * of that size and notifies all threads if the quench status changes as a
+ * result.
  */
-static void kcd_kws_push_msg_queue(struct kcd_kws_state *st, struct karray *queue, int *queue_size, int *quench,
-			           struct anp_msg *msg) {
-    karray_push(queue, msg);
-    *queue_size += msg->payload.len + 50;
-    
-    if (*queue_size > KCD_KWS_MAX_CLIENT_QUEUE_SIZE && ! *quench) {
-	*quench = 1;
-	kcd_kws_notify_all_thread(st);
-    }
-}
+static void kcd_kws_update_queue_size(struct kcd_kws_state *st, volatile int *size, volatile int *peak, int delta) {
+    int old_size = __sync_fetch_and_add(size, delta);
+    int new_size = old_size + delta;
+    int max;
     
-static struct anp_msg * kcd_kws_pop_msg_queue(struct kcd_kws_state *st, struct karray *queue, int *queue_size,
-					      int *quench) {
-    assert(queue->size);
-    struct anp_msg *msg = (struct anp_msg *) queue->data[0];
-    int i;
-    
-    /* FIXME: implement a doubly-linked list. */
-    for (i = 0; i < queue->size - 1; i++) {
-	queue->data[i] = queue->data[i + 1];
-    }
-    
-    queue->size--;
-    *queue_size -= msg->payload.len + 50;
+    do {
+        max = *peak;
+    } while (new_size > max && !__sync_bool_compare_and_swap(peak, max, new_size));
     
-    if (*queue_size <= KCD_KWS_MAX_CLIENT_QUEUE_SIZE && *quench) {
-	*quench = 0;
-	kcd_kws_notify_all_thread(st);
+    if ((old_size > st->max_queue_size) != (new_size > st->max_queue_size)) {
+        kmod_log_msg(KCD_LOG_KWS, "%s queue %s at %d bytes.\n", (size == &st->in_size) ? "Incoming" : "Outgoing",
+                     (new_size > st->max_queue_size) ? "quenched" : "unquenched", new_size);
+        kcd_kws_notify_all_thread(st);
     }
-    
-    return msg;
 }
 
+/* Return true if the incoming/outgoing message queues are quenched. */
+static int kcd_kws_in_quenched(struct kcd_kws_state *st) {
+    return st->in_size > st->max_queue_size;
+}
+
+static int kcd_kws_out_quenched(struct kcd_kws_state *st) {
+    return st->out_size > st->max_queue_size;
+}
+
+/* These functions add/remove an ANP message to the incoming/outgoing message
+ * queues and update quenching as needed. A message pushed wakes up the
+ * consuming thread if the queue was empty.
+ */
 static void kcd_kws_push_in_msg(struct kcd_kws_state *st, struct anp_msg *msg) {
-    kcd_kws_push_msg_queue(st, &st->in_msg_array, &st->in_msg_array_size, &st->in_quenched, msg);
+    kcd_kws_update_queue_size(st, &st->in_size, &st->in_peak, msg->payload.len + 50);
+    if (kcd_kws_queue_push(&st->in_queue, msg)) kcd_kws_notify_cmd_thread(st);
 }
 
 static struct anp_msg * kcd_kws_pop_in_msg(struct kcd_kws_state *st) {
-    return kcd_kws_pop_msg_queue(st, &st->in_msg_array, &st->in_msg_array_size, &st->in_quenched);
+    struct anp_msg *msg = kcd_kws_queue_pop(&st->in_queue);
+    if (msg) kcd_kws_update_queue_size(st, &st->in_size, &st->in_peak, -(msg->payload.len + 50));
+    return msg;
+}
+
+static void kcd_kws_push_out_msg(struct kcd_kws_state *st, struct kcd_kws_queue *queue, struct anp_msg *msg) {
+    kcd_kws_update_queue_size(st, &st->out_size, &st->out_peak, msg->payload.len + 50);
+    if (kcd_kws_queue_push(queue, msg)) kcd_kws_notify_brk_thread(st);
+}
+
+/* This function pushes a message on the outgoing queue of the event thread.
+ * If 'urgent_flag' is false, the broker may hold the message to coalesce it
+ * with the messages that follow.
+ */
+static void kcd_kws_push_evt_out_msg(struct kcd_kws_state *st, struct anp_msg *msg, int urgent_flag) {
+    
+    /* Update the counter before pushing so that the broker cannot see the
+     * message without the counter.
+     */
+    if (urgent_flag) {
+        st->evt_urgent_push = st->evt_out_queue.nb_push + 1;
+        __sync_synchronize();
+    }
+    
+    kcd_kws_push_out_msg(st, &st->evt_out_queue, msg);
 }
 
-static void kcd_kws_push_out_msg(struct kcd_kws_state *st, struct anp_msg *msg) {
-    kcd_kws_push_msg_queue(st, &st->out_msg_array, &st->out_msg_array_size, &st->out_quenched, msg);
+static struct anp_msg * kcd_kws_pop_out_msg(struct kcd_kws_state *st, struct kcd_kws_queue *queue) {
+    struct anp_msg *msg = kcd_kws_queue_pop(queue);
+    if (msg) kcd_kws_update_queue_size(st, &st->out_size, &st->out_peak, -(msg->payload.len + 50));
+    return msg;
 }
 
-static struct anp_msg * kcd_kws_pop_out_msg(struct kcd_kws_state *st) {
-    return kcd_kws_pop_msg_queue(st, &st->out_msg_array, &st->out_msg_array_size, &st->out_quenched);
+/* This function posts a thread message to the queue specified and wakes up
+ * the consuming thread if the queue was empty.
+ */
+static void kcd_kws_push_thread_msg(struct kcd_kws_queue *queue, int efd, struct kcd_thread_msg *msg) {
+    if (kcd_kws_queue_push(queue, msg)) kcd_kws_notify_efd(efd);
 }
 
 /* This function should be called when a client error occurs. */
@@ -320,16 +451,18 @@ static void kcd_kws_set_client_error(struct kcd_kws_state *st) {
     kmutex_lock(&st->mutex);
     
     if (! st->no_client_flag) {
-    	st->no_client_flag = 1;
 	kstr_assign_kstr(&st->no_client_str, kmod_kstrerror());
+    	st->no_client_flag = 1;
 	kcd_kws_notify_all_thread(st);
     }
     
     kmutex_unlock(&st->mutex);
 }
 
-/* This function should be called when a backend error occurs. */
-static void kcd_kws_set_backend_error(struct kcd_kws_state *st) {
+/* This function should be called when a backend error occurs. 'out_queue' is
+ * the outgoing queue of the calling thread.
+ */
+static void kcd_kws_set_backend_error(struct kcd_kws_state *st, struct kcd_kws_queue *out_queue) {
     kmutex_lock(&st->mutex);
     
     if (! st->no_backend_flag && ! global_opts.quit_flag) {
@@ -337,14 +470,15 @@ static void kcd_kws_set_backend_error(struct kcd_kws_state *st) {
 	/* Post an event message to inform the client that a backend error 
 	 * has occurred.
 	 */
-	struct anp_msg *msg = anp_msg_new();
+	struct anp_msg *msg = anp_msg_pool_get(&st->msg_pool);
 	msg->id = 0;
         msg->minor = st->client->effective_minor;
 	kcd_kanp_set_failure(msg, KANP_RES_FAIL_BACKEND);
-	kcd_kws_push_out_msg(st, msg);
+	if (out_queue == &st->evt_out_queue) kcd_kws_push_evt_out_msg(st, msg, 1);
+	else kcd_kws_push_out_msg(st, out_queue, msg);
 	
-    	st->no_backend_flag = 1;
 	kstr_assign_kstr(&st->no_backend_str, kmod_kstrerror());
+    	st->no_backend_flag = 1;
 	kmod_log_msg(KCD_LOG_BRIEF, "Backend error: %s.\n", st->no_backend_str.data);
 	kcd_kws_notify_all_thread(st);
     }
@@ -363,46 +497,94 @@ static int kcd_kws_should_bail_out(struct kcd_kws_state *st) {
 /******************************************************************************/
 /* Broker thread functions */
 
-/* This function pops some messages off the main outgoing message queue, and
- * adds them to the broker outgoing message queue.
+/* This function pops some messages off the outgoing message queues of the
+ * command and event threads, and adds them to the broker outgoing message
+ * queue. The queues are drained alternately so that neither thread starves the
+ * other.
  */
 static void kcd_kws_brk_pop_outgoing_msg(struct kcd_kws_state *st) {
     int cur_size = 0;
     
-    assert(st->out_msg_array.size);
     assert(! st->brk_out_msg_array.size);
     
-    do {
-	struct anp_msg *msg = kcd_kws_pop_out_msg(st);
-	karray_push(&st->brk_out_msg_array, msg);
-	cur_size += msg->payload.len + 50;
+    while (cur_size < KCD_KWS_MAX_CLIENT_OUT_PACKET_SIZE) {
+	struct anp_msg *cmd_msg = kcd_kws_pop_out_msg(st, &st->cmd_out_queue);
+	struct anp_msg *evt_msg = NULL;
+	
+	if (cmd_msg) {
+	    karray_push(&st->brk_out_msg_array, cmd_msg);
+	    cur_size += cmd_msg->payload.len + 50;
+	    if (cur_size >= KCD_KWS_MAX_CLIENT_OUT_PACKET_SIZE) break;
+	}
+	
+	evt_msg = kcd_kws_pop_out_msg(st, &st->evt_out_queue);
+	
+	if (evt_msg) {
+	    karray_push(&st->brk_out_msg_array, evt_msg);
+	    cur_size += evt_msg->payload.len + 50;
+	}
 	
-    } while (st->out_msg_array.size && cur_size < KCD_KWS_MAX_CLIENT_OUT_PACKET_SIZE);
+	if (! cmd_msg && ! evt_msg) break;
+    }
+}
+
+/* This function returns true if the broker should wait before sending the
+ * events queued, to coalesce more of them in the next packet. This is only done
+ * while all the events queued belong to workspaces catching up on their
+ * events, for at most the configured latency budget. Command results and the
+ * events of live workspaces are sent at once.
+ */
+static int kcd_kws_brk_should_coalesce(struct kcd_kws_state *st) {
+    struct timeval now;
+    
+    if (st->evt_out_queue.nb_pop < st->evt_urgent_push || global_opts.kws_evt_coalesce_usec <= 0 ||
+        !kcd_kws_queue_empty(&st->cmd_out_queue) || st->out_size >= KCD_KWS_MAX_CLIENT_OUT_PACKET_SIZE) {
+        st->brk_coalesce_flag = 0;
+        return 0;
+    }
+    
+    ktime_now(&now);
+    
+    /* Start the coalescing window. */
+    if (!st->brk_coalesce_flag) {
+        struct timeval budget;
+        budget.tv_sec = global_opts.kws_evt_coalesce_usec / 1000000;
+        budget.tv_usec = global_opts.kws_evt_coalesce_usec % 1000000;
+        ktime_add(&st->brk_coalesce_deadline, &now, &budget);
+        st->brk_coalesce_flag = 1;
+        return 1;
+    }
+    
+    /* The window is over. */
+    if (ktime_cmp(&now, &st->brk_coalesce_deadline) >= 0) {
+        st->brk_coalesce_flag = 0;
+        return 0;
+    }
+    
+    return 1;
 }
 
 /* This function checks the state of the client broker thread and performs short
- * adjustments as required in mutual exclusion.
+ * adjustments as required.
  */
-static void kcd_kws_brk_check_state_mutex(struct kcd_kws_state *st) {
+static void kcd_kws_brk_check_state(struct kcd_kws_state *st) {
 
     /* We are not currently receiving a new message. */
     if (! anp_tls_receiving(&st->brk_xfer)) {
     
 	/* But we can receive one now, so start an incoming transfer. */
-	if (! st->in_quenched) {
+	if (! kcd_kws_in_quenched(st)) {
 	    anp_tls_begin_recv(&st->brk_xfer);
 	}
     }
     
-    /* We are not currently sending a packet. */
-    if (! anp_tls_sending(&st->brk_xfer)) {
-	
-	/* But there is a message to send. Pop some messages off the
-	 * outgoing queue.
-	 */
-	if (st->out_msg_array.size) {
-	    kcd_kws_brk_pop_outgoing_msg(st);
-	}
+    /* We are not currently sending a packet. Pop some messages off the
+     * outgoing queues, if there are any, unless we are coalescing events.
+     */
+    if (! anp_tls_sending(&st->brk_xfer) &&
+        (! kcd_kws_queue_empty(&st->cmd_out_queue) || ! kcd_kws_queue_empty(&st->evt_out_queue)) &&
+        ! kcd_kws_brk_should_coalesce(st)) {
+	kcd_kws_brk_pop_outgoing_msg(st);
     }
 }
 
@@ -414,15 +596,7 @@ static int kcd_kws_brk_do_xfer(struct kcd_kws_state *st, int *check_state) {
      * to send, so build a packet.
      */
     if (! anp_tls_sending(&st->brk_xfer) && st->brk_out_msg_array.size) {
-	int i;
-	
 	anp_tls_send_many_msg(&st->brk_xfer, &st->brk_out_msg_array);
-	
-	for (i = 0; i < st->brk_out_msg_array.size; i++) {
-	    anp_msg_destroy((struct anp_msg *) st->brk_out_msg_array.data[i]);
-	}
-	
-	karray_reset(&st->brk_out_msg_array);
     }
     
     do {
@@ -432,10 +606,7 @@ static int kcd_kws_brk_do_xfer(struct kcd_kws_state *st, int *check_state) {
 	if (anp_tls_done_receiving(&st->brk_xfer)) { 
 	    *check_state = 1;
 	    
-	    kmutex_lock(&st->mutex);
 	    kcd_kws_push_in_msg(st, anp_tls_get_recv(&st->brk_xfer));
-	    kcd_kws_notify_cmd_thread(st);
-	    kmutex_unlock(&st->mutex);
 	}
 	
 	if (anp_tls_done_sending(&st->brk_xfer)) {
@@ -451,27 +622,29 @@ static int kcd_kws_brk_do_xfer(struct kcd_kws_state *st, int *check_state) {
 /* Main loop of the broker thread. */
 static void kcd_kws_brk_main_loop(struct kthread *thread, struct kcd_kws_state *st) {    
     int error = 0;
+    struct kpoll poll;
     thread = NULL;
     
     kmod_log_msg(KCD_LOG_KWS, "kcd_kws_brk_main_loop() called.\n");
     
+    /* The descriptors are registered once for the session. */
+    kpoll_init(&poll, 0);
+    
     do {
 	while (1) {
 	    int stop_flag = 0;
 	    int check_state = 0;
 
-	    /* Check our state in mutual exclusion. */
-	    kmutex_lock(&st->mutex);
-
+	    /* Check our state. The notification is cleared before the queues
+	     * are examined so that no wake-up is lost.
+	     */
 	    kcd_kws_clear_notif_brk(st);
 	    stop_flag = kcd_kws_should_bail_out(st);
 
 	    if (! stop_flag) {
-		kcd_kws_brk_check_state_mutex(st);
+		kcd_kws_brk_check_state(st);
 	    }
 
-	    kmutex_unlock(&st->mutex);
-
 	    /* Stop. */
 	    if (stop_flag) break;
 
@@ -482,10 +655,19 @@ static void kcd_kws_brk_main_loop(struct kthread *thread, struct kcd_kws_state *
 	    if (! check_state) {
 		struct kselect sel;
 		kdaemon_prepare_select(&sel);
-		kselect_add_read(&sel, st->brk_sock[1]);
+		kselect_add_read(&sel, st->brk_efd);
+		
+		/* Wake up at the end of the coalescing window. */
+		if (st->brk_coalesce_flag) {
+		    struct timeval now;
+		    ktime_now(&now);
+		    if (ktime_cmp(&st->brk_coalesce_deadline, &now) > 0) ktime_sub(&sel.tv, &st->brk_coalesce_deadline, &now);
+		    else sel.tv.tv_sec = sel.tv.tv_usec = 0;
+		}
+		
 		if (anp_tls_receiving(&st->brk_xfer)) kselect_add_read(&sel, st->client->sock);
 		if (anp_tls_sending(&st->brk_xfer)) kselect_add_write(&sel, st->client->sock);
-		error = kdaemon_do_select(&sel);
+		error = kdaemon_do_persistent_select(&sel, &poll);
 		if (error) break;
 	    }
 	}
@@ -494,6 +676,8 @@ static void kcd_kws_brk_main_loop(struct kthread *thread, struct kcd_kws_state *
 	
     } while (0);
     
+    kpoll_clean(&poll);
+    
     if (error) {
     	kmod_log_msg(KCD_LOG_BRIEF, "Lost client connection: %s.\n", kmod_strerror());
     	kcd_kws_set_client_error(st);
@@ -528,10 +712,7 @@ static void kcd_kws_evt_notify_check_kws(struct kcd_kws_state *st, struct kcd_kw
     m->data = c;
     c->kws_id = kws->kws_id;
 
-    kmutex_lock(&st->mutex);
-    karray_push(&st->cmd_msg_array, m);
-    kcd_kws_notify_cmd_thread(st);
-    kmutex_unlock(&st->mutex);
+    kcd_kws_push_thread_msg(&st->cmd_msg_queue, st->cmd_efd, m);
 }
 
 /* This function removes the workspace having the specified ID, if any. */
@@ -540,9 +721,12 @@ static void kcd_kws_evt_remove_kws(struct kcd_kws_state *st, struct kcd_kws_evt_
     kcd_kws_evt_kws_destroy(krb_tree_remove(&st->evt_kws_tree, &kws->kws_id));
 }
 
-/* Return true if there is work to do in the event thread. */
+/* Return true if there is work to do in the event thread. The work is
+ * postponed while the outgoing queues are quenched, so that a workspace
+ * catching up on its events does not queue more than the client can take.
+ */
 static int kcd_kws_evt_has_work(struct kcd_kws_state *st) {
-    return (krb_tree_size(&st->evt_kws_active_tree) > 0);
+    return (krb_tree_size(&st->evt_kws_active_tree) > 0 && !kcd_kws_out_quenched(st));
 }
 
 /* This function handles a request to listen to a workspace. */
@@ -573,15 +757,13 @@ static void kcd_kws_evt_handle_unlisten_request(struct kcd_kws_state *st, struct
 }
 
 /* This function checks the state of the event thread and performs short
- * adjustments as required in mutual exclusion.
+ * adjustments as required.
  */
-static void kcd_kws_evt_check_state_mutex(struct kcd_kws_state *st) {
-    int i;
+static void kcd_kws_evt_check_state(struct kcd_kws_state *st) {
+    struct kcd_thread_msg *thread_msg;
     
     /* Process the messages we have received. */
-    for (i = 0; i < st->evt_msg_array.size; i++) {
-	struct kcd_thread_msg *thread_msg = st->evt_msg_array.data[i];
-        
+    while ((thread_msg = kcd_kws_queue_pop(&st->evt_msg_queue))) {
 	if (thread_msg->type == KCD_THREAD_MSG_LISTEN_KWS)
             kcd_kws_evt_handle_listen_request(st, thread_msg->data);
 	else if (thread_msg->type == KCD_THREAD_MSG_UNLISTEN_KWS)
@@ -590,8 +772,6 @@ static void kcd_kws_evt_check_state_mutex(struct kcd_kws_state *st) {
         
         kcd_kws_state_destroy_thread_msg(thread_msg);
     }
-    
-    karray_reset(&st->evt_msg_array);
 }
 
 /* Listen to the workspace specified. */
@@ -605,8 +785,11 @@ static int kcd_kws_evt_listen_to_kws(struct kcd_kws_state *st, struct kcd_kws_ev
     kstr_sf(query, "LISTEN kws_"PRINTF_64"u_perm_check", kws->kws_id);
     if (kcd_exec_pg_query(&st->evt_conn, query->data, NULL, "listen to workspace")) return -1;
     
-    /* Mark the workspace active to poll it now that we are listening to it. */
+    /* Mark the workspace active to poll it now that we are listening to it.
+     * The events posted while we were not listening may have been archived.
+     */
     kws->listening_flag = 1;
+    kws->hot_flag = 0;
     kcd_kws_evt_mark_kws_active(st, kws);
     
     /* Notify the command thread to poll the workspace. */   
@@ -632,50 +815,170 @@ static int kcd_kws_evt_unlisten_from_kws(struct kcd_kws_state *st, struct kcd_kw
     return 0;
 }
     
-/* Poll the workspace specified for events. */
-static int kcd_kws_evt_poll_kws(struct kcd_kws_state *st, struct kcd_kws_evt_kws *kws, kstr *query) {
-    int error = 0, limit = 100, i, nrow;
+/* Convert the event rows of the result specified to ANP messages allocated from
+ * 'pool', which may be NULL. The messages are appended to 'msg_array' and
+ * 'last_event_id' is updated to the ID of the last event.
+ */
+static void kcd_kws_get_event_rows(PGresult *pg_res, struct anp_msg_pool *pool, uint64_t kws_id,
+                                   uint64_t *last_event_id, karray *msg_array) {
+    int i, nrow = PQntuples(pg_res);
+    
+    kmod_log_msg(KCD_LOG_KWS, "Fetched %d events for workspace "PRINTF_64"u.\n", nrow, kws_id);
+    
+    for (i = 0; i < nrow; i++) {
+        struct anp_msg *msg = anp_msg_pool_get(pool);
+        karray_push(msg_array, msg);
+        msg->id = pg_db_get_bin_uint64(pg_res, i, 0);
+        msg->minor = pg_db_get_bin_uint32(pg_res, i, 1);
+        msg->type = pg_db_get_bin_uint32(pg_res, i, 2);
+        pg_db_get_bin(pg_res, i, 3, &msg->payload);
+        *last_event_id = MAX(*last_event_id, msg->id);
+    }
+}
+
+/* Fetch at most 'limit' events posted in the workspace specified after the
+ * event 'last_event_id'. The events are allocated from 'pool', which may be
+ * NULL, and appended to 'msg_array'. 'last_event_id' is updated to the ID of
+ * the last event fetched.
+ *
+ * If '*hot_flag' is true, 'last_event_id' is known to be recent and the hot
+ * partition of the event log is queried first. Its result is only used if it
+ * starts with the event following 'last_event_id': the event IDs have no
+ * gaps, so otherwise that event has been archived, or there is no such event,
+ * which the hot partition alone cannot tell apart. In both cases the whole
+ * event log is queried. '*hot_flag' is set to true on success.
+ */
+int kcd_kws_fetch_events(struct pg_db_conn *conn, struct anp_msg_pool *pool, uint64_t kws_id,
+                         uint64_t *last_event_id, int limit, int *hot_flag, karray *msg_array) {
+    int error = 0;
     PGresult *pg_res = NULL;
+    char kws_id_buf[32], evt_id_buf[32], limit_buf[16];
+    char *values[3] = { kws_id_buf, evt_id_buf, limit_buf };
+    
+    do {
+        /* Get the events. The parameters are sent as text, the events are
+         * received in binary format.
+         */
+        sprintf(kws_id_buf, PRINTF_64"u", kws_id);
+        sprintf(evt_id_buf, PRINTF_64"u", *last_event_id);
+        sprintf(limit_buf, "%u", limit);
+        
+        if (*hot_flag) {
+            error = kcd_exec_pg_prepared(conn, "kcd_kws_fetch_hot_events",
+                                         "SELECT evt_id, minor, type, event FROM kcd_kws_event_log_hot "
+                                         "WHERE kws_id = $1 AND evt_id > $2 ORDER BY evt_id LIMIT $3",
+                                         3, values, NULL, NULL, &pg_res, "poll workspace");
+            if (error) break;
+            
+            /* The hot partition has all the events we want. */
+            if (PQntuples(pg_res) && pg_db_get_bin_uint64(pg_res, 0, 0) == *last_event_id + 1) {
+                kcd_kws_get_event_rows(pg_res, pool, kws_id, last_event_id, msg_array);
+                break;
+            }
+            
+            pg_db_destroy_res(&pg_res);
+        }
+        
+        error = kcd_exec_pg_prepared(conn, "kcd_kws_fetch_events",
+                                     "SELECT evt_id, minor, type, event FROM kcd_kws_event_log "
+                                     "WHERE kws_id = $1 AND evt_id > $2 ORDER BY evt_id LIMIT $3",
+                                     3, values, NULL, NULL, &pg_res, "poll workspace");
+        if (error) break;
+        
+        kcd_kws_get_event_rows(pg_res, pool, kws_id, last_event_id, msg_array);
+    
+    } while (0);
+    
+    if (!error) *hot_flag = 1;
+        
+    pg_db_destroy_res(&pg_res);
+    
+    return error;
+}
+
+/* Return the number of rows to fetch at once while the workspace specified
+ * catches up, so that about KCD_KWS_EVT_FETCH_BYTES bytes are fetched.
+ */
+static int kcd_kws_evt_get_catch_up_rows(struct kcd_kws_evt_kws *kws) {
+    int nb_row = KCD_KWS_EVT_FETCH_BYTES / MAX(kws->avg_event_size, 1);
+    return MAX(KCD_KWS_EVT_FETCH_LIMIT, MIN(nb_row, KCD_KWS_EVT_FETCH_MAX_ROWS));
+}
+
+/* Poll the workspace specified for events. The recent events are fetched with
+ * a single query. If there are more events than that query returns, the
+ * workspace catches up on the remaining events, in pages sized by bytes. Each
+ * page is fetched by a separate query that starts after the last event
+ * fetched, so that the server never has to materialize the whole backlog.
+ */
+static int kcd_kws_evt_poll_kws(struct kcd_kws_state *st, struct kcd_kws_evt_kws *kws) {
+    int error = 0, limit = KCD_KWS_EVT_FETCH_LIMIT, i;
+    uint64_t nb_byte = 0;
     karray msg_array;
         
     karray_init(&msg_array);
         
     do {
-        /* Get the events. */
-        kstr_sf(query, "SELECT evt_id, minor, type, event FROM kcd_kws_event_log "
-                       "WHERE kws_id = "PRINTF_64"u AND evt_id > " PRINTF_64"u ORDER BY evt_id LIMIT %u",
-                       kws->kws_id, kws->last_event_id, limit);
-        error = kcd_exec_pg_query(&st->evt_conn, query->data, &pg_res, "poll workspace");
-        if (error) break;
+        /* Get the next page of the backlog. The backlog is mostly archived,
+         * so the hot partition is not queried.
+         */
+        if (kws->catch_up_flag) {
+            int hot_flag = 0;
+            limit = kcd_kws_evt_get_catch_up_rows(kws);
+            error = kcd_kws_fetch_events(&st->evt_conn, &st->msg_pool, kws->kws_id, &kws->last_event_id, limit,
+                                         &hot_flag, &msg_array);
+            if (error) break;
+        }
         
-        nrow = PQntuples(pg_res);
-        kmod_log_msg(KCD_LOG_KWS, "Fetched %d events for workspace "PRINTF_64"u.\n", nrow, kws->kws_id);
+        /* Get the recent events. */
+        else {
+            error = kcd_kws_fetch_events(&st->evt_conn, &st->msg_pool, kws->kws_id, &kws->last_event_id, limit,
+                                         &kws->hot_flag, &msg_array);
+            if (error) break;
+        }
+        
+        /* Update the average event size used to size the catch-up pages. */
+        if (msg_array.size) {
+            uint32_t avg;
+            for (i = 0; i < msg_array.size; i++) nb_byte += ((struct anp_msg *) msg_array.data[i])->payload.len;
+            avg = nb_byte / msg_array.size;
+            kws->avg_event_size = kws->avg_event_size ? (3 * kws->avg_event_size + avg) / 4 : avg;
+        }
+        
+        /* Push the events to the broker thread. The events of a workspace
+         * catching up may be held by the broker to coalesce them.
+         */
+        for (i = 0; i < msg_array.size; i++) kcd_kws_push_evt_out_msg(st, msg_array.data[i], !kws->catch_up_flag);
+        karray_reset(&msg_array);
+        
+        /* There may be more events. */
+        if (i == limit) {
+            kws->poll_event_flag = 1;
+            
+            /* Switch to the catch-up mode. */
+            if (!kws->catch_up_flag) {
+                kmod_log_msg(KCD_LOG_KWS, "Catching up on the events of workspace "PRINTF_64"u.\n", kws->kws_id);
+                kws->catch_up_flag = 1;
+            }
+        }
         
-        /* No failures from this point. */
-        for (i = 0; i < nrow; i++) {
-            struct anp_msg *msg = anp_msg_new();
-            karray_push(&msg_array, msg);
-            msg->id = pg_db_get_uint64(pg_res, i, 0);
-            msg->minor = pg_db_get_uint32(pg_res, i, 1);
-            msg->type = pg_db_get_uint32(pg_res, i, 2);
-            pg_db_get_bytea(pg_res, i, 3, &msg->payload);
-            kws->last_event_id = MAX(kws->last_event_id, msg->id);
+        /* The backlog is exhausted. Poll once more in the normal mode to get
+         * the recent events from the hot partition.
+         */
+        else if (kws->catch_up_flag) {
+            kws->catch_up_flag = 0;
+            kws->poll_event_flag = 1;
         }
         
-        /* Push the events to the broker thread. */
-        kmutex_lock(&st->mutex);
-        for (i = 0; i < nrow; i++) kcd_kws_push_out_msg(st, msg_array.data[i]);
-        kcd_kws_notify_brk_thread(st);
-        kmutex_unlock(&st->mutex);
+        else {
+            kws->poll_event_flag = 0;
+        }
         
-        /* Update the poll flag and mark the workspace active if needed. */
-        kws->poll_event_flag = (nrow == limit);
+        /* Mark the workspace active if needed. */
         if (kws->poll_event_flag) kcd_kws_evt_mark_kws_active(st, kws);
     
     } while (0);
         
-    karray_clean(&msg_array);
-    pg_db_destroy_res(&pg_res);
+    kcd_kws_clear_anp_msg_array(&msg_array, 1);
     
     return error;
 }
@@ -697,7 +1000,7 @@ static int kcd_kws_evt_find_work(struct kcd_kws_state *st) {
     /* Dispatch. */
     if (!kws->listening_flag && kws->wanted_flag) error = kcd_kws_evt_listen_to_kws(st, kws, &query);
     else if (kws->listening_flag && !kws->wanted_flag) error = kcd_kws_evt_unlisten_from_kws(st, kws, &query);
-    else if (kws->poll_event_flag) error = kcd_kws_evt_poll_kws(st, kws, &query);
+    else if (kws->poll_event_flag) error = kcd_kws_evt_poll_kws(st, kws);
     
     kstr_clean(&query);
     
@@ -749,31 +1052,20 @@ static int kcd_kws_evt_process_db_notif(struct kcd_kws_state *st) {
 static void kcd_kws_evt_main_loop(struct kthread *thread, struct kcd_kws_state *st) {
     int error = 0;
     thread = NULL;
-    kstr conn_str;
 
-    kstr_init(&conn_str);
     kmod_log_msg(KCD_LOG_KWS, "kcd_kws_evt_main_loop() called.\n");
     
     do {
-        kstr_sf(&conn_str, "dbname=%s user=%s password=%s host=%s port=%s", 
-                global_opts.db_name.data, global_opts.db_user.data,
-                global_opts.db_password.data, global_opts.db_host.data,
-                global_opts.db_port.data);
-
-	error = kcd_open_pg_conn(&st->evt_conn, conn_str.data);
+	error = kcd_pg_pool_get(&st->evt_conn);
 	if (error) break;
 
 	while (1) {
 	    int stop_flag = 0;
 
-	    /* Check our state in mutual exclusion. */
-	    kmutex_lock(&st->mutex);
-
+	    /* Check our state. */
 	    kcd_kws_clear_notif_evt(st);
 	    stop_flag = kcd_kws_should_bail_out(st);
-	    if (!stop_flag) kcd_kws_evt_check_state_mutex(st);
-
-	    kmutex_unlock(&st->mutex);
+	    if (!stop_flag) kcd_kws_evt_check_state(st);
 
 	    /* Stop. */
 	    if (stop_flag) break;
@@ -792,7 +1084,7 @@ static void kcd_kws_evt_main_loop(struct kthread *thread, struct kcd_kws_state *
             if (!kcd_kws_evt_has_work(st)) {
                 struct kselect sel;
                 kdaemon_prepare_select(&sel);
-                kselect_add_read(&sel, st->evt_sock[1]);
+                kselect_add_read(&sel, st->evt_efd);
                 kselect_add_read(&sel, st->evt_conn.sock);
                 error = kdaemon_do_select(&sel);
                 if (error) break;
@@ -802,10 +1094,8 @@ static void kcd_kws_evt_main_loop(struct kthread *thread, struct kcd_kws_state *
 	if (error) break;
     
     } while (0);
-    
-    kstr_clean(&conn_str);
 
-    if (error) kcd_kws_set_backend_error(st);
+    if (error) kcd_kws_set_backend_error(st, &st->evt_out_queue);
 }
 
 
@@ -818,7 +1108,8 @@ struct kcd_kws_cmd_kws* kcd_kws_cmd_get_kws_by_id(krb_tree *kws_tree, uint64_t i
 }
 
 /* Add a workspace to the command workspace set of the client. */
-void kcd_kws_cmd_add_kws(struct kcd_kws_state *st, struct kcd_kws_cmd_kws *kws, uint64_t last_event_id) {
+static void kcd_kws_cmd_add_kws_internal(struct kcd_kws_state *st, struct kcd_kws_cmd_kws *kws,
+                                         uint64_t last_event_id) {
     krb_tree_add_fast(&st->cmd_kws_tree, &kws->kws_id, kws);
 
     if (kws->login_type != KCD_KWS_LOGIN_TYPE_KWMO) {
@@ -831,15 +1122,12 @@ void kcd_kws_cmd_add_kws(struct kcd_kws_state *st, struct kcd_kws_cmd_kws *kws,
         l->user_id = kws->user_id;
         l->last_event_id = last_event_id;
         
-        kmutex_lock(&st->mutex);
-        karray_push(&st->evt_msg_array, m);
-        kcd_kws_notify_evt_thread(st);
-        kmutex_unlock(&st->mutex);
+        kcd_kws_push_thread_msg(&st->evt_msg_queue, st->evt_efd, m);
     }
 }
     
 /* Remove a workspace from the command workspace set of the client. */
-void kcd_kws_cmd_remove_kws(struct kcd_kws_state *st, struct kcd_kws_cmd_kws *kws) {
+static void kcd_kws_cmd_remove_kws_internal(struct kcd_kws_state *st, struct kcd_kws_cmd_kws *kws) {
     struct kcd_thread_msg *m = kcalloc(sizeof(struct kcd_thread_msg));
     struct kcd_thread_msg_unlisten_kws *l = kcalloc(sizeof(struct kcd_thread_msg_unlisten_kws));
 
@@ -847,19 +1135,59 @@ void kcd_kws_cmd_remove_kws(struct kcd_kws_state *st, struct kcd_kws_cmd_kws *kw
     m->data = l;
     l->kws_id = kws->kws_id;
 
-    kmutex_lock(&st->mutex);
-    karray_push(&st->evt_msg_array, m);
-    kcd_kws_notify_evt_thread(st);
-    kmutex_unlock(&st->mutex);
+    kcd_kws_push_thread_msg(&st->evt_msg_queue, st->evt_efd, m);
 
     kcd_kws_cmd_kws_destroy(krb_tree_remove(&st->cmd_kws_tree, &kws->kws_id));
 }
 
-/* Prepare and execute a workspace-bound query in Postgres. */
+/* Add a workspace to the command workspace set of the client, whether the
+ * client is serviced by its own threads or by a workspace worker.
+ */
+void kcd_kws_cmd_add_kws(struct kcd_kws_cmd_exec_state *ces, struct kcd_kws_cmd_kws *kws, uint64_t last_event_id) {
+    if (ces->sess) kcd_kws_mux_add_kws(ces->sess, kws, last_event_id);
+    else kcd_kws_cmd_add_kws_internal(ces->st, kws, last_event_id);
+}
+
+/* Remove a workspace from the command workspace set of the client. */
+void kcd_kws_cmd_remove_kws(struct kcd_kws_cmd_exec_state *ces, struct kcd_kws_cmd_kws *kws) {
+    if (ces->sess) kcd_kws_mux_remove_kws(ces->sess, kws);
+    else kcd_kws_cmd_remove_kws_internal(ces->st, kws);
+}
+
+/* Prepare and execute a workspace-bound query in Postgres. The cached
+ * permission flags of the workspace are passed to the query, which refreshes
+ * them. The KWMO logins do not listen to the perm_check notifications of the
+ * workspace, so their flags are read from the database every time.
+ */
 int kcd_kws_cmd_kws_bound_query(struct kcd_kws_cmd_exec_state *ces, char *query_name) {
-    return kcd_exec_kws_bound_query(ces->conn, &ces->aq, query_name, ces->cmd, ces->res, ces->kws->kws_id, ces->date,
-                                    ces->kws->login_type, ces->kws->user_id, ces->client->effective_minor,
-                                    &ces->kws_bound_buf);
+    struct kcd_kws_cmd_kws *kws = ces->kws;
+    struct kcd_kws_perm *perm = (kws->login_type == KCD_KWS_LOGIN_TYPE_KWMO) ? NULL : &kws->perm;
+    int hit_flag = (perm && perm->valid_flag);
+    int error;
+    
+    if (ces->st) {
+        if (hit_flag) __sync_fetch_and_add(&ces->st->nb_perm_hit, 1);
+        else __sync_fetch_and_add(&ces->st->nb_perm_miss, 1);
+    }
+    
+    else if (ces->sess) {
+        if (hit_flag) ces->sess->nb_perm_hit++;
+        else ces->sess->nb_perm_miss++;
+    }
+    
+    error = kcd_exec_kws_bound_query(ces->conn, &ces->aq, query_name, ces->cmd, ces->res, kws->kws_id, ces->date,
+                                     kws->login_type, kws->user_id, ces->client->effective_minor,
+                                     &ces->kws_bound_buf, perm);
+    
+    /* The state of the permission flags is unknown if the query failed. */
+    if (perm && (error == -1 || error == -2)) perm->valid_flag = 0;
+    
+    return error;
+}
+
+/* Invalidate the cached permission flags of the workspace specified. */
+void kcd_kws_cmd_invalidate_perm(struct kcd_kws_cmd_kws *kws) {
+    kws->perm.valid_flag = 0;
 }
 
 /* Generate a ticket for reconnecting to KCD in a special mode and insert the
@@ -938,22 +1266,26 @@ static int kcd_kws_cmd_validate_kws(struct kcd_kws_cmd_exec_state *ces) {
     return error;
 }
 
-/* Execute a command from the client. */
-static int kcd_kws_cmd_exec_cmd(struct kcd_kws_state *st, krb_tree *dispatch_tree, struct anp_msg *cmd) {
+/* Populate the tree of dispatch entries indexed by command type. */
+void kcd_kws_cmd_init_dispatch_tree(krb_tree *dispatch_tree) {
+    uint32_t i;
+    
+    for (i = 0; i < sizeof(kcd_kws_cmd_dispatch_table)/sizeof(struct kcd_kws_cmd_dispatch_entry); i++) {
+        struct kcd_kws_cmd_dispatch_entry *entry = kcd_kws_cmd_dispatch_table + i;
+        krb_tree_add_fast(dispatch_tree, &entry->type, entry);
+    }
+}
+
+/* Dispatch the command contained in the execution state specified to its
+ * handler. The generic and specific failures are converted to results. The
+ * function returns 0 if a result has been obtained, -1 if an internal error has
+ * occurred.
+ */
+int kcd_kws_cmd_dispatch(struct kcd_kws_cmd_exec_state *ces, krb_tree *dispatch_tree) {
     int error = 0;
-    struct kcd_kws_cmd_exec_state ces;
-    struct anp_msg *res = anp_msg_new();
+    struct anp_msg *cmd = ces->cmd, *res = ces->res;
     
-    kcd_kws_cmd_exec_state_init(&ces);
-    ces.date = ktime_now_sec();
-    ces.cmd = cmd;
-    ces.res = res;
-    ces.kws_tree = &st->cmd_kws_tree;
-    ces.conn = &st->cmd_conn;
-    ces.st = st;
-    ces.client = st->client;
-    	
-    res->minor = st->client->effective_minor;
+    res->minor = ces->client->effective_minor;
     res->id = cmd->id;
     res->type = KANP_RES_OK;
     
@@ -974,12 +1306,12 @@ static int kcd_kws_cmd_exec_cmd(struct kcd_kws_state *st, krb_tree *dispatch_tre
         
         /* If this is a workspace-bound query, validate the workspace ID. */
         if (entry->kws_bound_flag) {
-            error = kcd_kws_cmd_validate_kws(&ces);
+            error = kcd_kws_cmd_validate_kws(ces);
             if (error) break;
         }
         
         /* Dispatch. */
-        error = entry->handler(&ces);
+        error = entry->handler(ces);
         if (error) break;
     
     } while (0);
@@ -997,15 +1329,35 @@ static int kcd_kws_cmd_exec_cmd(struct kcd_kws_state *st, krb_tree *dispatch_tre
     
     assert(error == 0 || error == -1);
     
+    if (!error) kcd_log_kanp_msg(KCD_LOG_BRIEF, 0, res);
+    
+    return error;
+}
+
+/* Execute a command from the client using the database connection specified.
+ * The result is stored in 'res_handle' on success.
+ */
+static int kcd_kws_cmd_run_cmd(struct kcd_kws_state *st, krb_tree *dispatch_tree, struct pg_db_conn *conn,
+                               struct anp_msg *cmd, struct anp_msg **res_handle) {
+    int error = 0;
+    struct kcd_kws_cmd_exec_state ces;
+    struct anp_msg *res = anp_msg_pool_get(&st->msg_pool);
+    
+    kcd_kws_cmd_exec_state_init(&ces);
+    ces.date = ktime_now_sec();
+    ces.cmd = cmd;
+    ces.res = res;
+    ces.kws_tree = &st->cmd_kws_tree;
+    ces.conn = conn;
+    ces.st = st;
+    ces.client = st->client;
+    
+    error = kcd_kws_cmd_dispatch(&ces, dispatch_tree);
+    
     /* A result has been obtained. */
     if (!error) {
-        kcd_log_kanp_msg(KCD_LOG_BRIEF, 0, res);
-	
-	kmutex_lock(&st->mutex);
-    	kcd_kws_push_out_msg(st, res);
+        *res_handle = res;
 	res = NULL;
-    	kcd_kws_notify_brk_thread(st);
-	kmutex_unlock(&st->mutex);
     }
     
     kcd_kws_cmd_exec_state_clean(&ces);
@@ -1014,8 +1366,23 @@ static int kcd_kws_cmd_exec_cmd(struct kcd_kws_state *st, krb_tree *dispatch_tre
     return error;
 }
 
-/* Validate that the user can log in the workspace specified. */
-static int kcd_kws_cmd_check_kws(struct kcd_kws_state *st, struct kcd_kws_cmd_kws *kws) {
+/* Execute a command from the client in the command thread. */
+static int kcd_kws_cmd_exec_cmd(struct kcd_kws_state *st, krb_tree *dispatch_tree, struct anp_msg *cmd) {
+    struct anp_msg *res = NULL;
+    
+    if (kcd_kws_cmd_run_cmd(st, dispatch_tree, &st->cmd_conn, cmd, &res)) return -1;
+    kcd_kws_push_out_msg(st, &st->cmd_out_queue, res);
+    
+    return 0;
+}
+
+/* Validate that the user can still log in the workspace specified.
+ * 'revoked_flag' is set to true if the user cannot log in the workspace
+ * anymore. In that case, if the client minor version is above 3, 'evt' is set
+ * to the log out event to send to the client.
+ */
+int kcd_kws_cmd_query_kws_login(struct pg_db_conn *conn, struct kcd_kws_cmd_kws *kws, uint32_t minor,
+                                int *revoked_flag, struct anp_msg **evt) {
     int error = 0;
     uint32_t query_res;
     uint32_t login_code;
@@ -1023,7 +1390,10 @@ static int kcd_kws_cmd_check_kws(struct kcd_kws_state *st, struct kcd_kws_cmd_kw
     struct kcd_pg_anp_query aq;
     kbuffer *in_buf = &aq.input_buf, *out_buf = &aq.output_buf;
     
-    kmod_log_msg(KCD_LOG_KWS, "kcd_kws_cmd_check_kws() called.\n");
+    kmod_log_msg(KCD_LOG_KWS, "kcd_kws_cmd_query_kws_login() called.\n");
+    
+    *revoked_flag = 0;
+    *evt = NULL;
     
     kstr_init(&error_str);
     kcd_pg_anp_query_init(&aq);
@@ -1032,7 +1402,7 @@ static int kcd_kws_cmd_check_kws(struct kcd_kws_state *st, struct kcd_kws_cmd_kw
         anp_write_uint64(in_buf, kws->kws_id);
         anp_write_uint32(in_buf, kws->login_type);
         anp_write_uint32(in_buf, kws->user_id);
-        error = kcd_exec_safe_pg_anp_query(&st->cmd_conn, &aq, "check_kws_login");
+        error = kcd_exec_safe_pg_anp_query(conn, &aq, "check_kws_login");
         if (error) break;
         
         if (anp_read_uint32(out_buf, &query_res) ||
@@ -1044,25 +1414,18 @@ static int kcd_kws_cmd_check_kws(struct kcd_kws_state *st, struct kcd_kws_cmd_kw
         
         /* The client cannot log in the workspace anymore. */
         if (query_res) {
+            *revoked_flag = 1;
             
             /* Notify the client if its minor is above 3. */
-            if (st->client->effective_minor > 3) {
-                struct anp_msg *evt = anp_msg_new();
-                evt->minor = 4;
-                evt->type = KANP_EVT_KWS_LOG_OUT;
-                anp_write_uint64(&evt->payload, kws->kws_id);
-                anp_write_uint64(&evt->payload, ktime_now_sec());
-                anp_write_uint32(&evt->payload, login_code);
-                anp_write_kstr(&evt->payload, &error_str);
-
-                kmutex_lock(&st->mutex);
-                kcd_kws_push_out_msg(st, evt);
-                kcd_kws_notify_brk_thread(st);
-                kmutex_unlock(&st->mutex);
+            if (minor > 3) {
+                *evt = anp_msg_new();
+                (*evt)->minor = 4;
+                (*evt)->type = KANP_EVT_KWS_LOG_OUT;
+                anp_write_uint64(&(*evt)->payload, kws->kws_id);
+                anp_write_uint64(&(*evt)->payload, ktime_now_sec());
+                anp_write_uint32(&(*evt)->payload, login_code);
+                anp_write_kstr(&(*evt)->payload, &error_str);
             }
-            
-            /* Remove the workspace from the command workspace set. */
-            kcd_kws_cmd_remove_kws(st, kws);
         }
             
     } while (0);
@@ -1073,97 +1436,371 @@ static int kcd_kws_cmd_check_kws(struct kcd_kws_state *st, struct kcd_kws_cmd_kw
     return error;
 }
 
+/* Validate that the user can log in the workspace specified. */
+static int kcd_kws_cmd_check_kws(struct kcd_kws_state *st, struct kcd_kws_cmd_kws *kws) {
+    int error = 0, revoked_flag;
+    struct anp_msg *evt = NULL;
+    
+    kmod_log_msg(KCD_LOG_KWS, "kcd_kws_cmd_check_kws() called.\n");
+    
+    /* The permissions have changed. */
+    kcd_kws_cmd_invalidate_perm(kws);
+    __sync_fetch_and_add(&st->nb_perm_invalidate, 1);
+    
+    do {
+        error = kcd_kws_cmd_query_kws_login(&st->cmd_conn, kws, st->client->effective_minor, &revoked_flag, &evt);
+        if (error) break;
+        
+        /* The client cannot log in the workspace anymore. */
+        if (revoked_flag) {
+            
+            /* Notify the client. */
+            if (evt) {
+                kcd_kws_push_out_msg(st, &st->cmd_out_queue, evt);
+                evt = NULL;
+            }
+            
+            /* Remove the workspace from the command workspace set. */
+            kcd_kws_cmd_remove_kws_internal(st, kws);
+        }
+            
+    } while (0);
+    
+    anp_msg_destroy(evt);
+    
+    return error;
+}
+
+/* Main loop of a command lane. */
+static void kcd_kws_cmd_lane_main_loop(struct kthread *thread, struct kcd_kws_cmd_lane *lane) {
+    thread = NULL;
+    
+    kmod_log_msg(KCD_LOG_KWS, "kcd_kws_cmd_lane_main_loop() called.\n");
+    
+    while (1) {
+        kcd_kws_clear_notif_efd(lane->efd);
+        if (lane->quit_flag) break;
+        
+        /* Execute the command handed to us. */
+        if (lane->state == KCD_KWS_CMD_LANE_BUSY) {
+            int error = 0;
+            __sync_synchronize();
+            
+            if (!lane->conn.pg_conn) error = kcd_pg_pool_get(&lane->conn);
+            if (!error) error = kcd_kws_cmd_run_cmd(lane->st, lane->dispatch_tree, &lane->conn, lane->cmd, &lane->res);
+            
+            lane->error = error;
+            if (error) kstr_assign_kstr(&lane->error_str, kmod_kstrerror());
+            
+            /* Publish the result. */
+            __sync_synchronize();
+            lane->state = KCD_KWS_CMD_LANE_DONE;
+            kcd_kws_notify_cmd_thread(lane->st);
+        }
+        
+        /* Wait for the next command. The command thread tells us when to
+         * quit. The set is small enough that the wait cannot fail.
+         */
+        else {
+            struct kselect sel;
+            kdaemon_prepare_select(&sel);
+            kselect_add_read(&sel, lane->efd);
+            if (kselect_wait(&sel)) kerror_fatal("cannot wait for commands: %s", kmod_strerror());
+        }
+    }
+}
+
+/* Return the number of command lanes started for each client. A pipeline depth
+ * of 1, the default, means that the commands are executed sequentially by the
+ * command thread. Each lane uses its own database connection, in addition to
+ * the connections of the event and command threads, so the lanes of a client
+ * are limited to a fraction of the connections when their number is capped.
+ * With a small cap, the commands are executed sequentially.
+ */
+static int kcd_kws_cmd_get_nb_lane() {
+    int nb_lane = MIN(global_opts.kws_cmd_pipeline_depth, KCD_KWS_CMD_MAX_LANE);
+    
+    if (global_opts.db_max_conn > 0) {
+        nb_lane = MIN(nb_lane, global_opts.db_max_conn / KCD_KWS_CMD_LANE_POOL_DIVISOR);
+    }
+    
+    return (nb_lane <= 1) ? 0 : nb_lane;
+}
+
+/* Start the command lanes of the client. */
+static void kcd_kws_cmd_start_lanes(struct kcd_kws_state *st, krb_tree *dispatch_tree) {
+    int i;
+    
+    st->nb_cmd_lane = kcd_kws_cmd_get_nb_lane();
+    if (!st->nb_cmd_lane) return;
+    
+    st->cmd_lane_array = kcalloc(st->nb_cmd_lane * sizeof(struct kcd_kws_cmd_lane));
+    
+    for (i = 0; i < st->nb_cmd_lane; i++) {
+        struct kcd_kws_cmd_lane *lane = st->cmd_lane_array + i;
+        lane->st = st;
+        lane->dispatch_tree = dispatch_tree;
+        lane->efd = eventfd(0, EFD_NONBLOCK);
+        if (lane->efd == -1) kerror_fatal("cannot create eventfd: %s", kerror_syserror());
+        pg_db_conn_init(&lane->conn);
+        kstr_init(&lane->error_str);
+        kthread_init(&lane->thread);
+        kthread_start(&lane->thread, (void (*)(struct kthread *, void *)) kcd_kws_cmd_lane_main_loop, lane);
+    }
+}
+
+/* Stop the command lanes of the client. The commands being executed are
+ * completed first.
+ */
+static void kcd_kws_cmd_stop_lanes(struct kcd_kws_state *st) {
+    int i;
+    
+    for (i = 0; i < st->nb_cmd_lane; i++) {
+        struct kcd_kws_cmd_lane *lane = st->cmd_lane_array + i;
+        lane->quit_flag = 1;
+        kcd_kws_notify_efd(lane->efd);
+    }
+    
+    for (i = 0; i < st->nb_cmd_lane; i++) {
+        struct kcd_kws_cmd_lane *lane = st->cmd_lane_array + i;
+        kthread_join(&lane->thread);
+        kthread_clean(&lane->thread);
+        close(lane->efd);
+        kcd_pg_pool_put(&lane->conn);
+        kstr_clean(&lane->error_str);
+        anp_msg_destroy(lane->cmd);
+        anp_msg_destroy(lane->res);
+    }
+    
+    kfree(st->cmd_lane_array);
+    st->cmd_lane_array = NULL;
+    st->nb_cmd_lane = 0;
+    st->nb_cmd_in_flight = 0;
+}
+
+/* This function returns true if the command specified can be handed to a
+ * lane. This is the case for the workspace-bound commands; the ID of the
+ * workspace, which is used as the ordering key of the command, is stored in
+ * 'kws_id'. The other commands, which may change the set of workspaces of the
+ * client, are executed by the command thread once the lanes are idle.
+ */
+static int kcd_kws_cmd_can_pipeline(struct kcd_kws_state *st, krb_tree *dispatch_tree, struct anp_msg *cmd,
+                                    uint64_t *kws_id) {
+    struct kcd_kws_cmd_dispatch_entry *entry;
+    int ok_flag;
+    
+    if (!st->nb_cmd_lane) return 0;
+    
+    entry = krb_tree_get(dispatch_tree, &cmd->type);
+    if (!entry || !entry->kws_bound_flag) return 0;
+    
+    /* Peek at the workspace ID. The command is parsed from the start when it
+     * is executed.
+     */
+    ok_flag = !anp_read_uint64(&cmd->payload, kws_id);
+    cmd->payload.pos = 0;
+    
+    return ok_flag;
+}
+
+/* This function returns an idle lane that can execute a command bound to the
+ * workspace specified, if any. The commands bound to the same workspace are
+ * executed one at a time, in order.
+ */
+static struct kcd_kws_cmd_lane * kcd_kws_cmd_get_lane(struct kcd_kws_state *st, uint64_t kws_id) {
+    int i;
+    struct kcd_kws_cmd_lane *idle = NULL;
+    
+    for (i = 0; i < st->nb_cmd_lane; i++) {
+        struct kcd_kws_cmd_lane *lane = st->cmd_lane_array + i;
+        
+        if (lane->state == KCD_KWS_CMD_LANE_IDLE) {
+            if (!idle) idle = lane;
+        }
+        
+        else if (lane->kws_id == kws_id) {
+            return NULL;
+        }
+    }
+    
+    return idle;
+}
+
+/* Send the results of the commands executed by the lanes, in the order the
+ * commands were received. This function returns -1 if a lane failed to
+ * execute its command.
+ */
+static int kcd_kws_cmd_collect_results(struct kcd_kws_state *st) {
+    int i;
+    
+    while (st->nb_cmd_in_flight) {
+        struct kcd_kws_cmd_lane *lane = NULL;
+        
+        for (i = 0; i < st->nb_cmd_lane; i++) {
+            if (st->cmd_lane_array[i].state != KCD_KWS_CMD_LANE_IDLE &&
+                st->cmd_lane_array[i].seq == st->cmd_emit_seq) {
+                lane = st->cmd_lane_array + i;
+                break;
+            }
+        }
+        
+        /* The next result is not available yet. */
+        if (!lane || lane->state != KCD_KWS_CMD_LANE_DONE) break;
+        __sync_synchronize();
+        
+        if (lane->error) {
+            kmod_set_error("%s", lane->error_str.data);
+            return -1;
+        }
+        
+        kcd_kws_push_out_msg(st, &st->cmd_out_queue, lane->res);
+        lane->res = NULL;
+        anp_msg_destroy(lane->cmd);
+        lane->cmd = NULL;
+        lane->state = KCD_KWS_CMD_LANE_IDLE;
+        
+        st->nb_cmd_in_flight--;
+        st->cmd_emit_seq++;
+    }
+    
+    return 0;
+}
+
+/* Dispatch the commands received from the client. The workspace-bound
+ * commands are handed to the lanes; the other commands are executed in the
+ * command thread. 'select_flag' is cleared if the function should be called
+ * again without waiting.
+ */
+static int kcd_kws_cmd_dispatch_pending(struct kcd_kws_state *st, krb_tree *dispatch_tree, int *select_flag) {
+    
+    /* Stop processing commands if the client is not reading its replies fast
+     * enough.
+     */
+    while (!kcd_kws_out_quenched(st)) {
+        struct kcd_kws_cmd_lane *lane;
+        uint64_t kws_id = 0;
+        
+        /* Get the next command to process. */
+        if (!st->cmd_pending) st->cmd_pending = kcd_kws_pop_in_msg(st);
+        if (!st->cmd_pending) break;
+        
+        /* Execute the command ourselves once the lanes are idle. */
+        if (!kcd_kws_cmd_can_pipeline(st, dispatch_tree, st->cmd_pending, &kws_id)) {
+            if (st->nb_cmd_in_flight) break;
+            
+            if (kcd_kws_cmd_exec_cmd(st, dispatch_tree, st->cmd_pending)) return -1;
+            
+            anp_msg_destroy(st->cmd_pending);
+            st->cmd_pending = NULL;
+            *select_flag = 0;
+            break;
+        }
+        
+        /* Hand the command to a lane, if one is available. */
+        lane = kcd_kws_cmd_get_lane(st, kws_id);
+        if (!lane) break;
+        
+        lane->seq = st->cmd_next_seq++;
+        lane->kws_id = kws_id;
+        lane->cmd = st->cmd_pending;
+        lane->res = NULL;
+        lane->error = 0;
+        st->cmd_pending = NULL;
+        st->nb_cmd_in_flight++;
+        
+        __sync_synchronize();
+        lane->state = KCD_KWS_CMD_LANE_BUSY;
+        kcd_kws_notify_efd(lane->efd);
+    }
+    
+    return 0;
+}
+
 /* Main loop of the command thread. */
 static void kcd_kws_cmd_main_loop(struct kthread *thread, struct kcd_kws_state *st) {
     int error = 0, i;
     krb_tree dispatch_tree;
     karray thread_msg_array;
-    struct anp_msg *cmd = NULL;
-    kstr conn_str;
     thread = NULL;
     
     krb_tree_init_func(&dispatch_tree, kutil_uint32_cmp);
     karray_init(&thread_msg_array);
-    kstr_init(&conn_str);
     
     kmod_log_msg(KCD_LOG_KWS, "kcd_kws_cmd_main_loop() called.\n");
     
     /* Populate the dispatch tree. */
-    for (i = 0; (uint32_t)i < sizeof(kcd_kws_cmd_dispatch_table)/sizeof(struct kcd_kws_cmd_dispatch_entry); i++) {
-        struct kcd_kws_cmd_dispatch_entry *entry = kcd_kws_cmd_dispatch_table + i;
-        krb_tree_add_fast(&dispatch_tree, &entry->type, entry);
-    }
+    kcd_kws_cmd_init_dispatch_tree(&dispatch_tree);
+    
+    /* Start the command lanes. */
+    kcd_kws_cmd_start_lanes(st, &dispatch_tree);
     
     do {
-        kstr_sf(&conn_str, "dbname=%s user=%s password=%s host=%s port=%s", 
-                global_opts.db_name.data, global_opts.db_user.data,
-                global_opts.db_password.data, global_opts.db_host.data,
-                global_opts.db_port.data);
-
-	error = kcd_open_pg_conn(&st->cmd_conn, conn_str.data);
+	error = kcd_pg_pool_get(&st->cmd_conn);
 	if (error) break;
 
 	while (1) {
     	    int stop_flag = 0;
     	    int select_flag = 1;
+            struct kcd_thread_msg *thread_msg;
     	    
-	    /* Check our state in mutual exclusion. */
-	    kmutex_lock(&st->mutex);
-
+	    /* Check our state. */
 	    kcd_kws_clear_notif_cmd(st);
 	    stop_flag = kcd_kws_should_bail_out(st);
 
-	    if (!stop_flag) {
-            
-                /* Get the thread messages to process. */
-                for (i = 0; i < st->cmd_msg_array.size; i++) karray_push(&thread_msg_array, st->cmd_msg_array.data[i]);
-                karray_reset(&st->cmd_msg_array);
-                
-                /* Get the next command to process. */
-		if (!st->in_quenched && st->in_msg_array.size) {
-                    cmd = kcd_kws_pop_in_msg(st);
-		    select_flag = 0;
-		}
-	    }
-
-	    kmutex_unlock(&st->mutex);
-
 	    /* Stop. */
 	    if (stop_flag) break;
             
-            /* Process the check-workspace thread messages. */
-            for (i = 0; i < thread_msg_array.size; i++) {
-                struct kcd_thread_msg *msg = thread_msg_array.data[i];
-                struct kcd_kws_cmd_kws *kws;
-                uint64_t kws_id;
-                
-                assert(msg->type == KCD_THREAD_MSG_CHECK_KWS);
-                kws_id = ((struct kcd_thread_msg_check_kws*)msg->data)->kws_id;
-                kws = kcd_kws_cmd_get_kws_by_id(&st->cmd_kws_tree, kws_id);
-                
-                if (kws) {
-                    error = kcd_kws_cmd_check_kws(st, kws);
-                    if (error) break;
-                }
-            }
+            /* Get the thread messages to process. */
+            while ((thread_msg = kcd_kws_queue_pop(&st->cmd_msg_queue)))
+                karray_push(&thread_msg_array, thread_msg);
             
+            /* Send the results of the commands executed by the lanes. */
+            error = kcd_kws_cmd_collect_results(st);
             if (error) break;
             
-            kcd_kws_clear_thread_msg_array(&thread_msg_array, 0);
-
-	    /* We have a command to process. */
-	    if (cmd) {
-                error = kcd_kws_cmd_exec_cmd(st, &dispatch_tree, cmd);
-		if (error) break;
+            /* Process the check-workspace thread messages. A workspace may be
+             * removed, so the commands being executed must complete first.
+             */
+            if (thread_msg_array.size && !st->nb_cmd_in_flight) {
+                for (i = 0; i < thread_msg_array.size; i++) {
+                    struct kcd_thread_msg *msg = thread_msg_array.data[i];
+                    struct kcd_kws_cmd_kws *kws;
+                    uint64_t kws_id;
+                    int j;
+                    
+                    assert(msg->type == KCD_THREAD_MSG_CHECK_KWS);
+                    kws_id = ((struct kcd_thread_msg_check_kws*)msg->data)->kws_id;
+                    kws = kcd_kws_cmd_get_kws_by_id(&st->cmd_kws_tree, kws_id);
+                    
+                    /* Check each workspace once, the notifications of a
+                     * burst of permission changes are received together.
+                     */
+                    for (j = 0; kws && j < i; j++) {
+                        struct kcd_thread_msg *prev = thread_msg_array.data[j];
+                        if (((struct kcd_thread_msg_check_kws*)prev->data)->kws_id == kws_id) kws = NULL;
+                    }
+                    
+                    if (kws) {
+                        error = kcd_kws_cmd_check_kws(st, kws);
+                        if (error) break;
+                    }
+                }
                 
-                anp_msg_destroy(cmd);
-                cmd = NULL;
-	    }
+                if (error) break;
+                
+                kcd_kws_clear_thread_msg_array(&thread_msg_array, 0);
+            }
+
+	    /* Dispatch the commands received. */
+            if (!thread_msg_array.size) {
+                error = kcd_kws_cmd_dispatch_pending(st, &dispatch_tree, &select_flag);
+                if (error) break;
+            }
 	    
 	    if (select_flag) {
 	    	struct kselect sel;
 		kdaemon_prepare_select(&sel);
-	    	kselect_add_read(&sel, st->cmd_sock[1]);
+	    	kselect_add_read(&sel, st->cmd_efd);
 	    	error = kdaemon_do_select(&sel);
 		if (error) break;
 	    }
@@ -1173,12 +1810,11 @@ static void kcd_kws_cmd_main_loop(struct kthread *thread, struct kcd_kws_state *
     
     } while (0);
     
+    kcd_kws_cmd_stop_lanes(st);
     krb_tree_clean(&dispatch_tree);
     kcd_kws_clear_thread_msg_array(&thread_msg_array, 1);
-    anp_msg_destroy(cmd);
-    kstr_clean(&conn_str);
     
-    if (error) kcd_kws_set_backend_error(st);
+    if (error) kcd_kws_set_backend_error(st, &st->cmd_out_queue);
 }
 
 
@@ -1192,6 +1828,14 @@ int kcd_kws_handle_conn(struct kcd_client *client) {
     kdaemon_set_task("Workspace | %s", client->addr.data);
     kmod_log_msg(KCD_LOG_BRIEF, "kcd_kws_handle_conn() called.\n");
     
+    /* Reserve the database connections of the event thread, the command thread
+     * and the command lanes.
+     */
+    if (kcd_pg_pool_reserve(2 + kcd_kws_cmd_get_nb_lane())) {
+        kmod_log_msg(KCD_LOG_BRIEF, "Cannot reserve the database connections: %s.\n", kmod_strerror());
+        return 0;
+    }
+    
     kcd_kws_state_init(&st);
     st.client = client;
     
@@ -1211,7 +1855,9 @@ int kcd_kws_handle_conn(struct kcd_client *client) {
     kthread_clean(&evt_thread);
     kthread_clean(&cmd_thread);
     
+    kcd_kws_log_session_stats(&st);
     kcd_kws_state_clean(&st);
+    kcd_pg_pool_unreserve();
     
     kmod_log_msg(KCD_LOG_BRIEF, "kcd_kws_handle_conn(): exiting.\n");
     
@@ -3,6 +3,29 @@
 #ifndef _KWS_H
 #define _KWS_H
 
+/* Default maximum size of each message queue of a client. */
+#define KCD_KWS_MAX_CLIENT_QUEUE_SIZE           (2*1024*1024)
+
+/* How much data we can be put in a single outgoing packet. */
+#define KCD_KWS_MAX_CLIENT_OUT_PACKET_SIZE      (1*1024*1024)
+
+/* Maximum number of events fetched from the event log in a single query. */
+#define KCD_KWS_EVT_FETCH_LIMIT                 100
+
+/* Approximate amount of event data fetched at once while a workspace catches
+ * up on its events, and maximum number of rows fetched at once in that case.
+ */
+#define KCD_KWS_EVT_FETCH_BYTES                 (256*1024)
+#define KCD_KWS_EVT_FETCH_MAX_ROWS              10000
+
+/* Maximum number of command lanes of a client. */
+#define KCD_KWS_CMD_MAX_LANE                    16
+
+/* When the number of database connections is capped, the command lanes of a
+ * client may use at most this fraction of the connections (1/N).
+ */
+#define KCD_KWS_CMD_LANE_POOL_DIVISOR           4
+
 /* This structure represents a message exchanged between KCD threads. */
 struct kcd_thread_msg {
     
@@ -71,6 +94,19 @@ struct kcd_kws_evt_kws {
     
     /* ID of the last event retrieved from the workspace's event log. */
     uint64_t last_event_id;
+    
+    /* True if the workspace is catching up on its backlog of events. */
+    int catch_up_flag;
+    
+    /* Average size of the events of the workspace, used to size the fetches
+     * while catching up.
+     */
+    uint32_t avg_event_size;
+    
+    /* True if the events can be fetched from the hot partition of the event
+     * log.
+     */
+    int hot_flag;
 };
 
 /* Represent a workspace to which the user is logged in as seen by the command
@@ -86,6 +122,15 @@ struct kcd_kws_cmd_kws {
     
     /* ID of the user in the workspace. */
     uint32_t user_id;
+    
+    /* Cached permission flags of the user in the workspace. The flags are
+     * obtained by the workspace-bound queries and they are invalidated when
+     * the workspace is checked following a perm_check notification. Only one
+     * command is executed at a time for a given workspace, hence no locking.
+     * The flags are never cached for the KWMO logins, which do not receive
+     * the perm_check notifications.
+     */
+    struct kcd_kws_perm perm;
 };
 
 /* Represent a KCD ticket. */
@@ -135,13 +180,114 @@ struct kcd_kws_cmd_exec_state {
      */
     kbuffer kws_bound_buf;
     
-    /* Pointer to the KANP workspace mode state. */
+    /* Pointer to the KANP workspace mode state. This is NULL if the client is
+     * serviced by a workspace worker.
+     */
     struct kcd_kws_state *st;
     
+    /* Pointer to the workspace worker session, if the client is serviced by a
+     * workspace worker.
+     */
+    struct kcd_kws_mux_session *sess;
+    
     /* Pointer to the client to service. Read-only. */
     struct kcd_client *client;
 };
 
+/* Node of a thread message queue. */
+struct kcd_kws_queue_node {
+    
+    /* Next node, written by the producer and read by the consumer. */
+    struct kcd_kws_queue_node * volatile next;
+    
+    /* Message carried by the node. */
+    void *data;
+};
+
+/* Single-producer, single-consumer message queue between two threads. The
+ * queue is a linked list that always contains a dummy node at its head. Only
+ * the producer touches the tail and only the consumer touches the head, so no
+ * lock is needed.
+ */
+struct kcd_kws_queue {
+    
+    /* Dummy node preceding the first message. Owned by the consumer. */
+    struct kcd_kws_queue_node *head;
+    
+    /* Last node. Owned by the producer. */
+    struct kcd_kws_queue_node *tail;
+    
+    /* Number of messages in the queue, updated atomically. */
+    volatile int count;
+    
+    /* Number of messages ever pushed, owned by the producer, and number of
+     * messages ever popped, owned by the consumer.
+     */
+    uint64_t nb_push;
+    uint64_t nb_pop;
+};
+
+/* States of a command lane. */
+enum {
+    KCD_KWS_CMD_LANE_IDLE = 0,
+    KCD_KWS_CMD_LANE_BUSY,
+    KCD_KWS_CMD_LANE_DONE,
+};
+
+/* A command lane executes workspace-bound commands on behalf of the command
+ * thread, with its own thread and its own database connection. The commands
+ * bound to different workspaces are executed concurrently by the lanes, so
+ * that a client sending a burst of commands is not limited to one database
+ * round-trip at a time.
+ */
+struct kcd_kws_cmd_lane {
+    
+    /* Pointer to the KANP workspace mode state. */
+    struct kcd_kws_state *st;
+    
+    /* Dispatch tree of the command thread. Read-only. */
+    krb_tree *dispatch_tree;
+    
+    /* Thread of the lane. */
+    struct kthread thread;
+    
+    /* Eventfd used to wake up the lane thread. */
+    int efd;
+    
+    /* Connection to the database, obtained when the first command is
+     * executed.
+     */
+    struct pg_db_conn conn;
+    
+    /* State of the lane. The command thread hands a command to an idle lane
+     * and marks it busy. The lane marks it done once the command has been
+     * executed. The command thread then sends the result and marks the lane
+     * idle.
+     */
+    volatile int state;
+    
+    /* True if the lane thread must exit. */
+    volatile int quit_flag;
+    
+    /* Sequence number of the command, in the order the commands were
+     * received.
+     */
+    uint64_t seq;
+    
+    /* ID of the workspace the command is bound to. */
+    uint64_t kws_id;
+    
+    /* Command to execute and its result. */
+    struct anp_msg *cmd;
+    struct anp_msg *res;
+    
+    /* Error code of the execution and error string, if the execution failed
+     * with an internal error.
+     */
+    int error;
+    kstr error_str;
+};
+
 /* This structure contains the data required to service a client in workspace
  * mode.
  */
@@ -150,70 +296,77 @@ struct kcd_kws_state {
     /* Pointer to the client to service. Read-only. */
     struct kcd_client *client;
     
-    /* Notifier socket arrays. This is used to wake up waiting threads. The
-     * first socket must be written to, the second must be read from.
+    /* Pool of the ANP messages exchanged with the client. */
+    struct anp_msg_pool msg_pool;
+    
+    /* Eventfd descriptors used to wake up waiting threads. A thread is only
+     * signalled when a queue it consumes goes from empty to non-empty, or
+     * when the state of the session changes.
      */
-    int brk_sock[2];
-    int cmd_sock[2];
-    int evt_sock[2];
+    int brk_efd;
+    int cmd_efd;
+    int evt_efd;
     
     
-    /* Mutex protecting the following fields in this structure. */
+    /* Mutex protecting the error state below. The message queues are not
+     * protected by the mutex.
+     */
     struct kmutex mutex;
     
-    /* True if the backend encountered an error. Protected by mutex. */
-    int no_backend_flag;
+    /* True if the backend encountered an error. */
+    volatile int no_backend_flag;
     
     /* Backend error string. Protected by mutex. */
     kstr no_backend_str;
     
-    /* True if we lost the connection with the client. Protected by mutex. */
-    int no_client_flag;
+    /* True if we lost the connection with the client. */
+    volatile int no_client_flag;
     
     /* Client error string. Protected by mutex. */    
     kstr no_client_str;
     
-    /* Array of ANP messages received. Protected by mutex. The command thread
-     * must be notified when a new message is received, so that it can process
-     * it.
+    /* Queue of ANP messages received, from the broker thread to the command
+     * thread.
      */
-    karray in_msg_array;
+    struct kcd_kws_queue in_queue;
     
-    /* Total size of the data in the array above. Protected by mutex. */
-    int in_msg_array_size;
-    
-    /* Array of ANP messages to send. Protected by mutex. The broker thread must
-     * be notified when a new message is added to this queue, so that it can
-     * send it.
+    /* Queues of ANP messages to send, from the command and event threads to
+     * the broker thread.
      */
-    karray out_msg_array;
-    
-    /* Total size of the data in the array above. Protected by mutex. */
-    int out_msg_array_size;
-    
-    /* True if the incoming message queue is quenched because it is full. In
-     * that case, the broker thread will stop receiving messages from the
-     * client. Protected by mutex. Whenever this status changes, all threads
-     * must be notified.
+    struct kcd_kws_queue cmd_out_queue;
+    struct kcd_kws_queue evt_out_queue;
+    
+    /* Maximum size of each message queue of the client. */
+    int max_queue_size;
+    
+    /* Total size of the data in the incoming and outgoing queues, updated
+     * atomically. The incoming queue is quenched when its size exceeds
+     * max_queue_size; in that case, the broker thread stops receiving
+     * messages from the client. The outgoing queues are quenched when their
+     * size exceeds that limit; in that case, the command thread stops
+     * processing commands. All threads are notified when the quench status
+     * changes.
      */
-    int in_quenched; 
+    volatile int in_size;
+    volatile int out_size;
     
-    /* True if the outgoing message queue is quenched because it is full. In
-     * that case, the command and event threads should refrain from posting
-     * further messages in the queue. Protected by mutex. Whenever this status
-     * changes, all threads must be notified.
-     */
-    int out_quenched;
+    /* Peak of the sizes above, reported when the session ends. */
+    volatile int in_peak;
+    volatile int out_peak;
     
-    /* Array of thread messages to be processed by the event thread. Protected
-     * by mutex.
+    /* Number of workspace-bound queries that used the cached permission
+     * flags, number of queries that had to read them and number of times the
+     * cached flags were invalidated. Updated atomically.
      */
-    karray evt_msg_array;
+    volatile uint64_t nb_perm_hit;
+    volatile uint64_t nb_perm_miss;
+    volatile uint64_t nb_perm_invalidate;
     
-    /* Array of thread messages to be processed by the command thread. Protected
-     * by mutex.
-     */
-    karray cmd_msg_array;
+    /* Queue of thread messages from the command thread to the event thread. */
+    struct kcd_kws_queue evt_msg_queue;
+    
+    /* Queue of thread messages from the event thread to the command thread. */
+    struct kcd_kws_queue cmd_msg_queue;
     
     
     /* Data specific to the broker thread. */
@@ -224,6 +377,12 @@ struct kcd_kws_state {
     /* ANP message transfer with the client. */
     struct anp_tls_xfer brk_xfer;
     
+    /* True if the broker is waiting to coalesce events, and end of the
+     * coalescing window.
+     */
+    int brk_coalesce_flag;
+    struct timeval brk_coalesce_deadline;
+    
     
     /* Data specific to the event thread. */
     
@@ -238,6 +397,13 @@ struct kcd_kws_state {
     /* Connection to the database used by the event thread. */
     struct pg_db_conn evt_conn;
     
+    /* Value of evt_out_queue.nb_push after the last message that must be
+     * sent at once was pushed. The other messages of that queue are the
+     * events of the workspaces catching up, which the broker may hold to
+     * coalesce them. Read by the broker thread.
+     */
+    volatile uint64_t evt_urgent_push;
+    
     
     /* Data specific to the command thread. */
     
@@ -248,17 +414,47 @@ struct kcd_kws_state {
     
     /* Connection to the database used by the command thread. */
     struct pg_db_conn cmd_conn;
+    
+    /* Command lanes and number of lanes. There are no lanes if the commands
+     * are executed sequentially by the command thread.
+     */
+    struct kcd_kws_cmd_lane *cmd_lane_array;
+    int nb_cmd_lane;
+    
+    /* Number of commands being executed by the lanes. */
+    int nb_cmd_in_flight;
+    
+    /* Sequence number of the next command handed to a lane and sequence number
+     * of the next result to send. The results are sent in the order the
+     * commands were received.
+     */
+    uint64_t cmd_next_seq;
+    uint64_t cmd_emit_seq;
+    
+    /* Command received that has not been dispatched yet, if any. */
+    struct anp_msg *cmd_pending;
 };
 
 struct kcd_kws_cmd_kws* kcd_kws_cmd_kws_new();
 void kcd_kws_cmd_kws_destroy(struct kcd_kws_cmd_kws *self);
 void kcd_internal_ticket_init(struct kcd_internal_ticket *self);
 void kcd_internal_ticket_clean(struct kcd_internal_ticket *self);
+void kcd_kws_cmd_exec_state_init(struct kcd_kws_cmd_exec_state *self);
+void kcd_kws_cmd_exec_state_clean(struct kcd_kws_cmd_exec_state *self);
+void kcd_kws_clear_anp_msg_array(karray *array, int clean_flag);
+int kcd_kws_get_max_queue_size();
+int kcd_kws_fetch_events(struct pg_db_conn *conn, struct anp_msg_pool *pool, uint64_t kws_id,
+                         uint64_t *last_event_id, int limit, int *hot_flag, karray *msg_array);
 struct kcd_kws_cmd_kws* kcd_kws_cmd_get_kws_by_id(krb_tree *kws_tree, uint64_t id);
-void kcd_kws_cmd_add_kws(struct kcd_kws_state *st, struct kcd_kws_cmd_kws *kws, uint64_t last_event_id);
-void kcd_kws_cmd_remove_kws(struct kcd_kws_state *st, struct kcd_kws_cmd_kws *kws);
+void kcd_kws_cmd_add_kws(struct kcd_kws_cmd_exec_state *ces, struct kcd_kws_cmd_kws *kws, uint64_t last_event_id);
+void kcd_kws_cmd_remove_kws(struct kcd_kws_cmd_exec_state *ces, struct kcd_kws_cmd_kws *kws);
 int kcd_kws_cmd_kws_bound_query(struct kcd_kws_cmd_exec_state *ces, char *query_name);
+void kcd_kws_cmd_invalidate_perm(struct kcd_kws_cmd_kws *kws);
 int kcd_kws_cmd_create_kcd_ticket(struct kcd_kws_cmd_exec_state *ces, struct kcd_internal_ticket *ticket);
+void kcd_kws_cmd_init_dispatch_tree(krb_tree *dispatch_tree);
+int kcd_kws_cmd_dispatch(struct kcd_kws_cmd_exec_state *ces, krb_tree *dispatch_tree);
+int kcd_kws_cmd_query_kws_login(struct pg_db_conn *conn, struct kcd_kws_cmd_kws *kws, uint32_t minor,
+                                int *revoked_flag, struct anp_msg **evt);
 int kcd_kws_handle_conn(struct kcd_client *client);
 
 #endif
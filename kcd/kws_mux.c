@@ -0,0 +1,1251 @@
+/* Copyright (C) 2009-2012 Opersys inc., All rights reserved. */
+
+#include <sys/epoll.h>
+#include "common.h"
+
+/* Workspace worker mode.
+ *
+ * When workspace workers are enabled, the listener does not accept the
+ * connections itself. Each worker accepts connections on the shared listening
+ * socket and services the KANP workspace clients from a single event loop
+ * instead of dedicating a process and three threads to every client. All the
+ * clients of a worker share the same two database connections: one to execute
+ * the commands, one to listen to and poll the workspaces.
+ *
+ * The worker listens to each workspace once and fetches each new range of
+ * events once, whatever the number of subscribed sessions. The events fetched
+ * are kept in a bounded ring per workspace and copied to the outgoing queue of
+ * each subscribed session as its queue drains. A session that falls behind the
+ * ring reads the missing events from the event log.
+ *
+ * The connections that are not in the KANP workspace mode (file transfer, VNC,
+ * KNP, HTTP) are handed off to a child process once they are identified, as
+ * the listener does.
+ *
+ * The commands of a worker are executed synchronously, one at a time, in the
+ * order the sessions become ready. A slow command delays the other clients of
+ * the worker, so the number of workers should be chosen accordingly.
+ */
+
+/* Maximum number of epoll events retrieved per iteration. */
+#define KCD_KWS_MUX_MAX_EPOLL_EVENT             256
+
+/* Maximum number of connections accepted per iteration. */
+#define KCD_KWS_MUX_MAX_ACCEPT                  64
+
+/* Let the kernel wake up a single worker when a connection is pending, if
+ * supported.
+ */
+#ifdef EPOLLEXCLUSIVE
+#define KCD_KWS_MUX_LISTEN_EVENTS               (EPOLLIN | EPOLLEXCLUSIVE)
+#else
+#define KCD_KWS_MUX_LISTEN_EVENTS               (EPOLLIN)
+#endif
+
+
+/******************************************************************************/
+/* Object management functions. */
+
+static struct kcd_kws_mux_kws* kcd_kws_mux_kws_new(uint64_t kws_id) {
+    struct kcd_kws_mux_kws *self = (struct kcd_kws_mux_kws *) kcalloc(sizeof(struct kcd_kws_mux_kws));
+    self->kws_id = kws_id;
+    karray_init(&self->sess_array);
+    return self;
+}
+
+static void kcd_kws_mux_kws_destroy(struct kcd_kws_mux_kws *self) {
+    if (self) {
+        int i;
+        for (i = 0; i < self->ring_count; i++)
+            anp_msg_destroy(self->evt_ring[(self->ring_start + i) % KCD_KWS_MUX_EVT_RING_SIZE]);
+        karray_clean(&self->sess_array);
+        kfree(self);
+    }
+}
+
+static struct kcd_kws_mux_session* kcd_kws_mux_session_new(struct kcd_kws_mux_worker *worker,
+                                                           struct kcd_client *client) {
+    struct kcd_kws_mux_session *self = (struct kcd_kws_mux_session *) kcalloc(sizeof(struct kcd_kws_mux_session));
+    self->worker = worker;
+    self->client = client;
+    self->state = KCD_KWS_MUX_SESS_HANDSHAKE;
+    anp_tls_init(&self->xfer);
+    karray_init(&self->in_msg_array);
+    karray_init(&self->out_msg_array);
+    krb_tree_init_func(&self->cmd_kws_tree, kutil_uint64_cmp);
+    krb_tree_init_func(&self->sub_tree, kutil_uint64_cmp);
+    return self;
+}
+
+static void kcd_kws_mux_session_destroy(struct kcd_kws_mux_session *self) {
+    int i, size;
+    struct krb_node *iter;
+
+    if (!self) return;
+
+    kcd_client_destroy(self->client);
+    anp_tls_clean(&self->xfer);
+    kcd_kws_clear_anp_msg_array(&self->in_msg_array, 1);
+    kcd_kws_clear_anp_msg_array(&self->out_msg_array, 1);
+
+    iter = krb_tree_iter_start(&self->cmd_kws_tree);
+    size = krb_tree_size(&self->cmd_kws_tree);
+    for (i = 0; i < size; i++) kcd_kws_cmd_kws_destroy(krb_tree_iter_next(&self->cmd_kws_tree, &iter));
+    krb_tree_clean(&self->cmd_kws_tree);
+
+    iter = krb_tree_iter_start(&self->sub_tree);
+    size = krb_tree_size(&self->sub_tree);
+    for (i = 0; i < size; i++) kfree(krb_tree_iter_next(&self->sub_tree, &iter));
+    krb_tree_clean(&self->sub_tree);
+
+    kfree(self);
+}
+
+static void kcd_kws_mux_worker_init(struct kcd_kws_mux_worker *self) {
+    memset(self, 0, sizeof(struct kcd_kws_mux_worker));
+    self->epoll_fd = -1;
+    self->listen_sock = -1;
+    krb_tree_init_func(&self->sess_tree, kutil_uint32_cmp);
+    karray_init(&self->ready_array);
+    karray_init(&self->dead_array);
+    krb_tree_init_func(&self->kws_tree, kutil_uint64_cmp);
+    krb_tree_init_func(&self->kws_active_tree, kutil_uint64_cmp);
+    krb_tree_init_func(&self->dispatch_tree, kutil_uint32_cmp);
+    pg_db_conn_init(&self->cmd_conn);
+    pg_db_conn_init(&self->evt_conn);
+}
+
+static void kcd_kws_mux_worker_clean(struct kcd_kws_mux_worker *self) {
+    int i, size;
+    struct krb_node *iter;
+
+    iter = krb_tree_iter_start(&self->sess_tree);
+    size = krb_tree_size(&self->sess_tree);
+    for (i = 0; i < size; i++) kcd_kws_mux_session_destroy(krb_tree_iter_next(&self->sess_tree, &iter));
+    krb_tree_clean(&self->sess_tree);
+
+    for (i = 0; i < self->dead_array.size; i++) kcd_kws_mux_session_destroy(self->dead_array.data[i]);
+    karray_clean(&self->dead_array);
+    karray_clean(&self->ready_array);
+
+    iter = krb_tree_iter_start(&self->kws_tree);
+    size = krb_tree_size(&self->kws_tree);
+    for (i = 0; i < size; i++) kcd_kws_mux_kws_destroy(krb_tree_iter_next(&self->kws_tree, &iter));
+    krb_tree_clean(&self->kws_tree);
+    krb_tree_clean(&self->kws_active_tree);
+
+    krb_tree_clean(&self->dispatch_tree);
+    kcd_pg_pool_put(&self->cmd_conn);
+    kcd_pg_pool_put(&self->evt_conn);
+
+    if (self->epoll_fd != -1) close(self->epoll_fd);
+}
+
+
+/******************************************************************************/
+/* Miscellaneous functions. */
+
+/* Remove the element specified from the array specified, if it is present. The
+ * order of the elements is not preserved.
+ */
+static void kcd_kws_mux_array_remove(karray *array, void *elem) {
+    int i;
+
+    for (i = 0; i < array->size; i++) {
+        if (array->data[i] == elem) {
+            array->data[i] = array->data[array->size - 1];
+            array->size--;
+            return;
+        }
+    }
+}
+
+/* Add, modify or remove the registration of a descriptor with epoll. */
+static void kcd_kws_mux_epoll_ctl(struct kcd_kws_mux_worker *worker, int op, int fd, uint32_t events) {
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+
+    if (epoll_ctl(worker->epoll_fd, op, fd, &ev)) kerror_fatal("epoll_ctl() failed: %s", kerror_syserror());
+}
+
+/* Open the command connection of the worker, if needed. */
+static int kcd_kws_mux_open_cmd_conn(struct kcd_kws_mux_worker *worker) {
+    if (worker->cmd_conn_flag) return 0;
+    if (kcd_pg_pool_get(&worker->cmd_conn)) return -1;
+    worker->cmd_conn_flag = 1;
+    return 0;
+}
+
+/* Close the command connection of the worker. It will be reopened when
+ * needed.
+ */
+static void kcd_kws_mux_close_cmd_conn(struct kcd_kws_mux_worker *worker) {
+    kcd_pg_pool_put(&worker->cmd_conn);
+    worker->cmd_conn_flag = 0;
+}
+
+/* Open the event connection of the worker, if needed. */
+static int kcd_kws_mux_open_evt_conn(struct kcd_kws_mux_worker *worker) {
+    if (worker->evt_conn_flag) return 0;
+    if (kcd_pg_pool_get(&worker->evt_conn)) return -1;
+    worker->evt_conn_flag = 1;
+    kcd_kws_mux_epoll_ctl(worker, EPOLL_CTL_ADD, worker->evt_conn.sock, EPOLLIN);
+    return 0;
+}
+
+/* Close the event connection of the worker. */
+static void kcd_kws_mux_close_evt_conn(struct kcd_kws_mux_worker *worker) {
+    if (worker->evt_conn_flag) kcd_kws_mux_epoll_ctl(worker, EPOLL_CTL_DEL, worker->evt_conn.sock, 0);
+    kcd_pg_pool_put(&worker->evt_conn);
+    worker->evt_conn_flag = 0;
+}
+
+
+/******************************************************************************/
+/* Session functions. */
+
+/* Mark the session specified ready to be processed. */
+static void kcd_kws_mux_mark_ready(struct kcd_kws_mux_session *sess) {
+    if (!sess->ready_flag && !sess->dead_flag) {
+        sess->ready_flag = 1;
+        karray_push(&sess->worker->ready_array, sess);
+    }
+}
+
+/* These functions add/remove an ANP message to the incoming/outgoing message
+ * queue and update quenching as needed. The session is marked ready when the
+ * outgoing queue is no longer quenched.
+ */
+static void kcd_kws_mux_push_msg_queue(struct karray *queue, int *queue_size, int *quench, struct anp_msg *msg) {
+    karray_push(queue, msg);
+    *queue_size += msg->payload.len + 50;
+    if (*queue_size > kcd_kws_get_max_queue_size()) *quench = 1;
+}
+
+static struct anp_msg * kcd_kws_mux_pop_msg_queue(struct karray *queue, int *queue_size, int *quench) {
+    struct anp_msg *msg;
+    int i;
+
+    assert(queue->size);
+    msg = (struct anp_msg *) queue->data[0];
+
+    for (i = 0; i < queue->size - 1; i++) {
+	queue->data[i] = queue->data[i + 1];
+    }
+
+    queue->size--;
+    *queue_size -= msg->payload.len + 50;
+    if (*queue_size <= kcd_kws_get_max_queue_size()) *quench = 0;
+
+    return msg;
+}
+
+static void kcd_kws_mux_push_in_msg(struct kcd_kws_mux_session *sess, struct anp_msg *msg) {
+    kcd_kws_mux_push_msg_queue(&sess->in_msg_array, &sess->in_msg_array_size, &sess->in_quenched, msg);
+}
+
+static struct anp_msg * kcd_kws_mux_pop_in_msg(struct kcd_kws_mux_session *sess) {
+    return kcd_kws_mux_pop_msg_queue(&sess->in_msg_array, &sess->in_msg_array_size, &sess->in_quenched);
+}
+
+static void kcd_kws_mux_push_out_msg(struct kcd_kws_mux_session *sess, struct anp_msg *msg) {
+    kcd_kws_mux_push_msg_queue(&sess->out_msg_array, &sess->out_msg_array_size, &sess->out_quenched, msg);
+}
+
+static struct anp_msg * kcd_kws_mux_pop_out_msg(struct kcd_kws_mux_session *sess) {
+    int quenched = sess->out_quenched;
+    struct anp_msg *msg = kcd_kws_mux_pop_msg_queue(&sess->out_msg_array, &sess->out_msg_array_size,
+                                                    &sess->out_quenched);
+    if (quenched && !sess->out_quenched) kcd_kws_mux_mark_ready(sess);
+    return msg;
+}
+
+/* Remove the subscription specified from the workspace it refers to. The
+ * workspace is marked active so that it is unlistened to if it has no more
+ * subscribers. The subscription is destroyed.
+ */
+static void kcd_kws_mux_detach_sub(struct kcd_kws_mux_session *sess, struct kcd_kws_mux_sub *sub) {
+    struct kcd_kws_mux_kws *kws = sub->kws;
+    kcd_kws_mux_array_remove(&kws->sess_array, sess);
+    krb_tree_add(&sess->worker->kws_active_tree, &kws->kws_id, kws);
+    kfree(sub);
+}
+
+/* Close the session specified. The session is destroyed at the end of the
+ * current iteration of the worker loop.
+ */
+static void kcd_kws_mux_close_session(struct kcd_kws_mux_session *sess) {
+    struct kcd_kws_mux_worker *worker = sess->worker;
+
+    if (sess->dead_flag) return;
+
+    kmod_log_msg(KCD_LOG_KWS, "Session permission cache: "PRINTF_64"u hits, "PRINTF_64"u misses, "
+                 PRINTF_64"u invalidations.\n", sess->nb_perm_hit, sess->nb_perm_miss, sess->nb_perm_invalidate);
+
+    /* Stop listening to the workspaces of the session. */
+    while (krb_tree_size(&sess->sub_tree)) {
+        struct kcd_kws_mux_sub *sub = krb_tree_get_by_index(&sess->sub_tree, 0);
+        krb_tree_remove(&sess->sub_tree, &sub->kws->kws_id);
+        kcd_kws_mux_detach_sub(sess, sub);
+    }
+
+    /* Close the client socket. */
+    krb_tree_remove(&worker->sess_tree, &sess->client->sock);
+    kcd_kws_mux_epoll_ctl(worker, EPOLL_CTL_DEL, sess->client->sock, 0);
+    ksock_close(&sess->client->sock);
+
+    sess->dead_flag = 1;
+    karray_push(&worker->dead_array, sess);
+}
+
+/* This function should be called when a backend error occurs while servicing
+ * the session specified.
+ */
+static void kcd_kws_mux_set_backend_error(struct kcd_kws_mux_session *sess) {
+    if (! sess->no_backend_flag && ! global_opts.quit_flag) {
+
+	/* Post an event message to inform the client that a backend error
+	 * has occurred.
+	 */
+	struct anp_msg *msg = anp_msg_new();
+	msg->id = 0;
+        msg->minor = sess->client->effective_minor;
+	kcd_kanp_set_failure(msg, KANP_RES_FAIL_BACKEND);
+	kcd_kws_mux_push_out_msg(sess, msg);
+
+    	sess->no_backend_flag = 1;
+	kmod_log_msg(KCD_LOG_BRIEF, "Backend error for %s: %s.\n", sess->client->addr.data, kmod_strerror());
+        kcd_kws_mux_mark_ready(sess);
+    }
+}
+
+/* Return true if the session specified has commands or events to process. */
+static int kcd_kws_mux_session_has_work(struct kcd_kws_mux_session *sess) {
+    int i, size;
+    struct krb_node *iter;
+
+    if (sess->no_backend_flag || sess->dead_flag) return 0;
+    if (!sess->out_quenched && sess->in_msg_array.size) return 1;
+
+    iter = krb_tree_iter_start(&sess->sub_tree);
+    size = krb_tree_size(&sess->sub_tree);
+
+    for (i = 0; i < size; i++) {
+        struct kcd_kws_mux_sub *sub = krb_tree_iter_next(&sess->sub_tree, &iter);
+        if (sub->check_kws_flag) return 1;
+        if (sub->poll_event_flag && sub->kws->listening_flag && !sess->out_quenched) return 1;
+    }
+
+    return 0;
+}
+
+
+/******************************************************************************/
+/* Workspace subscription functions. */
+
+/* Add a workspace to the command workspace set of the session and subscribe
+ * the session to the events of the workspace.
+ */
+void kcd_kws_mux_add_kws(struct kcd_kws_mux_session *sess, struct kcd_kws_cmd_kws *kws, uint64_t last_event_id) {
+    struct kcd_kws_mux_worker *worker = sess->worker;
+    struct kcd_kws_mux_kws *mux_kws;
+    struct kcd_kws_mux_sub *sub;
+
+    krb_tree_add_fast(&sess->cmd_kws_tree, &kws->kws_id, kws);
+
+    if (kws->login_type == KCD_KWS_LOGIN_TYPE_KWMO) return;
+    if (krb_tree_get(&sess->sub_tree, &kws->kws_id)) return;
+
+    mux_kws = krb_tree_get(&worker->kws_tree, &kws->kws_id);
+
+    if (!mux_kws) {
+        mux_kws = kcd_kws_mux_kws_new(kws->kws_id);
+        krb_tree_add(&worker->kws_tree, &mux_kws->kws_id, mux_kws);
+    }
+
+    /* If we are already listening to the workspace, poll it now. Otherwise it
+     * will be polled once we listen to it.
+     */
+    sub = (struct kcd_kws_mux_sub *) kcalloc(sizeof(struct kcd_kws_mux_sub));
+    sub->kws = mux_kws;
+    sub->last_event_id = last_event_id;
+    sub->poll_event_flag = mux_kws->listening_flag;
+    sub->check_kws_flag = mux_kws->listening_flag;
+    krb_tree_add(&sess->sub_tree, &mux_kws->kws_id, sub);
+
+    karray_push(&mux_kws->sess_array, sess);
+    krb_tree_add(&worker->kws_active_tree, &mux_kws->kws_id, mux_kws);
+    kcd_kws_mux_mark_ready(sess);
+}
+
+/* Remove a workspace from the command workspace set of the session and
+ * unsubscribe the session from the events of the workspace.
+ */
+void kcd_kws_mux_remove_kws(struct kcd_kws_mux_session *sess, struct kcd_kws_cmd_kws *kws) {
+    struct kcd_kws_mux_sub *sub = krb_tree_remove(&sess->sub_tree, &kws->kws_id);
+    if (sub) kcd_kws_mux_detach_sub(sess, sub);
+    kcd_kws_cmd_kws_destroy(krb_tree_remove(&sess->cmd_kws_tree, &kws->kws_id));
+}
+
+/* Return true if the event connection of the worker is still usable after a
+ * query failed on it, i.e. the failure only concerns that query.
+ */
+static int kcd_kws_mux_evt_conn_ok(struct kcd_kws_mux_worker *worker) {
+    return (worker->evt_conn_flag && pg_db_is_idle(&worker->evt_conn));
+}
+
+/* This function should be called when a query about the workspace specified
+ * fails while the event connection is still usable. Only the sessions
+ * subscribed to that workspace get a backend error.
+ */
+static void kcd_kws_mux_set_kws_error(struct kcd_kws_mux_kws *kws) {
+    int i;
+    for (i = 0; i < kws->sess_array.size; i++) kcd_kws_mux_set_backend_error(kws->sess_array.data[i]);
+}
+
+/* This function should be called when the event connection fails. All the
+ * subscribed sessions get a backend error and the event connection is closed.
+ */
+static void kcd_kws_mux_set_evt_error(struct kcd_kws_mux_worker *worker) {
+    while (krb_tree_size(&worker->kws_tree)) {
+        struct kcd_kws_mux_kws *kws = krb_tree_get_by_index(&worker->kws_tree, 0);
+        int i;
+
+        for (i = 0; i < kws->sess_array.size; i++) {
+            struct kcd_kws_mux_session *sess = kws->sess_array.data[i];
+            kcd_kws_mux_set_backend_error(sess);
+            kfree(krb_tree_remove(&sess->sub_tree, &kws->kws_id));
+        }
+
+        krb_tree_remove(&worker->kws_active_tree, &kws->kws_id);
+        krb_tree_remove(&worker->kws_tree, &kws->kws_id);
+        kcd_kws_mux_kws_destroy(kws);
+    }
+
+    kcd_kws_mux_close_evt_conn(worker);
+}
+
+/* Listen to the workspace specified. */
+static int kcd_kws_mux_listen_to_kws(struct kcd_kws_mux_worker *worker, struct kcd_kws_mux_kws *kws, kstr *query) {
+    int i;
+
+    kmod_log_msg(KCD_LOG_KWS, "Starting to listen to workspace " PRINTF_64"u.\n", kws->kws_id);
+
+    kstr_sf(query, "LISTEN kws_"PRINTF_64"u_event_log", kws->kws_id);
+    if (kcd_exec_pg_query(&worker->evt_conn, query->data, NULL, "listen to workspace")) return -1;
+
+    kstr_sf(query, "LISTEN kws_"PRINTF_64"u_perm_check", kws->kws_id);
+    if (kcd_exec_pg_query(&worker->evt_conn, query->data, NULL, "listen to workspace")) return -1;
+
+    kws->listening_flag = 1;
+    kws->hot_flag = 0;
+
+    /* Check the login of the subscribers now that we are listening to the
+     * workspace. The event ring starts after the most recent event seen by the
+     * subscribers. The subscribers that are further behind catch up from the
+     * event log.
+     */
+    for (i = 0; i < kws->sess_array.size; i++) {
+        struct kcd_kws_mux_session *sess = kws->sess_array.data[i];
+        struct kcd_kws_mux_sub *sub = krb_tree_get(&sess->sub_tree, &kws->kws_id);
+        kws->last_event_id = MAX(kws->last_event_id, sub->last_event_id);
+        sub->poll_event_flag = 1;
+        sub->check_kws_flag = 1;
+        kcd_kws_mux_mark_ready(sess);
+    }
+
+    kws->ring_base_id = kws->last_event_id;
+
+    /* Poll the workspace now that we are listening to it. */
+    kws->poll_event_flag = 1;
+    krb_tree_add(&worker->kws_active_tree, &kws->kws_id, kws);
+
+    return 0;
+}
+
+/* Add the event specified to the event ring of the workspace specified. The
+ * oldest event is discarded if the ring is full.
+ */
+static void kcd_kws_mux_ring_push(struct kcd_kws_mux_kws *kws, struct anp_msg *msg) {
+    if (kws->ring_count == KCD_KWS_MUX_EVT_RING_SIZE) {
+        struct anp_msg *oldest = kws->evt_ring[kws->ring_start];
+        kws->ring_base_id = oldest->id;
+        anp_msg_destroy(oldest);
+        kws->ring_start = (kws->ring_start + 1) % KCD_KWS_MUX_EVT_RING_SIZE;
+        kws->ring_count--;
+    }
+
+    kws->evt_ring[(kws->ring_start + kws->ring_count) % KCD_KWS_MUX_EVT_RING_SIZE] = msg;
+    kws->ring_count++;
+}
+
+/* Poll the workspace specified for events. The new events are added to the
+ * event ring of the workspace and the subscribed sessions are marked ready.
+ */
+static int kcd_kws_mux_poll_kws(struct kcd_kws_mux_worker *worker, struct kcd_kws_mux_kws *kws) {
+    int error = 0, limit = KCD_KWS_EVT_FETCH_LIMIT, i;
+    karray msg_array;
+
+    karray_init(&msg_array);
+
+    do {
+        error = kcd_kws_fetch_events(&worker->evt_conn, NULL, kws->kws_id, &kws->last_event_id, limit,
+                                     &kws->hot_flag, &msg_array);
+        if (error) break;
+
+        for (i = 0; i < msg_array.size; i++) kcd_kws_mux_ring_push(kws, msg_array.data[i]);
+
+        /* Update the poll flag and mark the workspace active if needed. */
+        kws->poll_event_flag = (msg_array.size == limit);
+        if (kws->poll_event_flag) krb_tree_add(&worker->kws_active_tree, &kws->kws_id, kws);
+
+        /* Fan out the events. */
+        if (msg_array.size) {
+            for (i = 0; i < kws->sess_array.size; i++) {
+                struct kcd_kws_mux_session *sess = kws->sess_array.data[i];
+                struct kcd_kws_mux_sub *sub = krb_tree_get(&sess->sub_tree, &kws->kws_id);
+                sub->poll_event_flag = 1;
+                kcd_kws_mux_mark_ready(sess);
+            }
+        }
+
+        karray_reset(&msg_array);
+
+    } while (0);
+
+    kcd_kws_clear_anp_msg_array(&msg_array, 1);
+
+    return error;
+}
+
+/* Unlisten from the workspace specified and destroy it. */
+static int kcd_kws_mux_unlisten_from_kws(struct kcd_kws_mux_worker *worker, struct kcd_kws_mux_kws *kws,
+                                         kstr *query) {
+    if (kws->listening_flag) {
+        kmod_log_msg(KCD_LOG_KWS, "Stopping to listen to workspace " PRINTF_64"u.\n", kws->kws_id);
+
+        kstr_sf(query, "UNLISTEN kws_"PRINTF_64"u_event_log", kws->kws_id);
+        if (kcd_exec_pg_query(&worker->evt_conn, query->data, NULL, "unlisten to workspace")) return -1;
+
+        kstr_sf(query, "UNLISTEN kws_"PRINTF_64"u_perm_check", kws->kws_id);
+        if (kcd_exec_pg_query(&worker->evt_conn, query->data, NULL, "unlisten to workspace")) return -1;
+    }
+
+    krb_tree_remove(&worker->kws_tree, &kws->kws_id);
+    kcd_kws_mux_kws_destroy(kws);
+
+    return 0;
+}
+
+/* Listen to, unlisten from or poll the workspaces that are marked active. The
+ * workspaces marked active meanwhile are processed in the next iteration. If a
+ * query fails but the event connection is still usable, only the sessions
+ * subscribed to the workspace concerned get a backend error. An error is
+ * returned if the event connection fails.
+ */
+static int kcd_kws_mux_do_kws_work(struct kcd_kws_mux_worker *worker) {
+    int error = 0, i, size;
+    struct krb_node *iter;
+    karray kws_array;
+    kstr query;
+
+    karray_init(&kws_array);
+    kstr_init(&query);
+
+    iter = krb_tree_iter_start(&worker->kws_active_tree);
+    size = krb_tree_size(&worker->kws_active_tree);
+    for (i = 0; i < size; i++) karray_push(&kws_array, krb_tree_iter_next(&worker->kws_active_tree, &iter));
+    krb_tree_clean(&worker->kws_active_tree);
+    krb_tree_init_func(&worker->kws_active_tree, kutil_uint64_cmp);
+
+    for (i = 0; i < kws_array.size; i++) {
+        struct kcd_kws_mux_kws *kws = kws_array.data[i];
+
+        if (!kws->sess_array.size) {
+            error = kcd_kws_mux_unlisten_from_kws(worker, kws, &query);
+        }
+
+        else if (!kws->listening_flag) {
+            error = kcd_kws_mux_open_evt_conn(worker);
+            if (!error) error = kcd_kws_mux_listen_to_kws(worker, kws, &query);
+        }
+
+        else if (kws->poll_event_flag) {
+            error = kcd_kws_mux_poll_kws(worker, kws);
+        }
+        
+        if (error) {
+            if (!kcd_kws_mux_evt_conn_ok(worker)) break;
+            kcd_kws_mux_set_kws_error(kws);
+            error = 0;
+        }
+    }
+
+    karray_clean(&kws_array);
+    kstr_clean(&query);
+
+    return error;
+}
+
+/* Process the pending database notifications. */
+static int kcd_kws_mux_process_db_notif(struct kcd_kws_mux_worker *worker) {
+    if (!worker->evt_conn_flag) return 0;
+
+    /* Allow postgres to consume its input, if any. */
+    if (pg_db_consume(&worker->evt_conn)) return -1;
+
+    /* Process all notifications. */
+    while (1) {
+        int what = 0; /* 0: nothing, 1: event log, 2: perm check. */
+        PGnotify *notif = pg_db_notify_check(&worker->evt_conn);
+        if (!notif) return 0;
+
+        if (strstr(notif->relname, "_event_log")) what = 1;
+        else if (strstr(notif->relname, "_perm_check")) what = 2;
+
+        if (what) {
+            uint64_t kws_id = strtoll(notif->relname + 4, NULL, 10);
+            struct kcd_kws_mux_kws *kws = krb_tree_get(&worker->kws_tree, &kws_id);
+
+            if (kws) {
+                int i;
+
+                /* Event log. The workspace is polled once for all the
+                 * subscribers.
+                 */
+                if (what == 1) {
+                    kmod_log_msg(KCD_LOG_KWS, "Got event notification for workspace "PRINTF_64"u.\n", kws_id);
+                    kws->poll_event_flag = 1;
+                    krb_tree_add(&worker->kws_active_tree, &kws->kws_id, kws);
+                }
+
+                /* Permission check. */
+                else {
+                    kmod_log_msg(KCD_LOG_KWS, "Got perm check notification for workspace "PRINTF_64"u.\n",
+                                 kws_id);
+
+                    for (i = 0; i < kws->sess_array.size; i++) {
+                        struct kcd_kws_mux_session *sess = kws->sess_array.data[i];
+                        struct kcd_kws_mux_sub *sub = krb_tree_get(&sess->sub_tree, &kws_id);
+                        sub->check_kws_flag = 1;
+                        kcd_kws_mux_mark_ready(sess);
+                    }
+                }
+            }
+        }
+
+        PQfreemem(notif);
+    }
+}
+
+
+/******************************************************************************/
+/* Session processing functions. */
+
+/* Validate that the user can still log in the workspaces for which a permission
+ * check has been requested.
+ */
+static int kcd_kws_mux_check_kws(struct kcd_kws_mux_session *sess) {
+    int error = 0, i;
+    struct anp_msg *evt = NULL;
+
+    for (i = 0; i < krb_tree_size(&sess->sub_tree); i++) {
+        struct kcd_kws_mux_sub *sub = krb_tree_get_by_index(&sess->sub_tree, i);
+        struct kcd_kws_cmd_kws *kws;
+        int revoked_flag;
+
+        if (!sub->check_kws_flag) continue;
+        sub->check_kws_flag = 0;
+
+        kws = kcd_kws_cmd_get_kws_by_id(&sess->cmd_kws_tree, sub->kws->kws_id);
+        if (!kws) continue;
+        
+        /* The permissions have changed. */
+        kcd_kws_cmd_invalidate_perm(kws);
+        sess->nb_perm_invalidate++;
+
+        error = kcd_kws_mux_open_cmd_conn(sess->worker);
+        if (error) break;
+
+        error = kcd_kws_cmd_query_kws_login(&sess->worker->cmd_conn, kws, sess->client->effective_minor,
+                                            &revoked_flag, &evt);
+        if (error) break;
+
+        /* The client cannot log in the workspace anymore. */
+        if (revoked_flag) {
+            if (evt) kcd_kws_mux_push_out_msg(sess, evt);
+            evt = NULL;
+
+            /* The subscription is gone. Restart the scan. */
+            kcd_kws_mux_remove_kws(sess, kws);
+            i = -1;
+        }
+    }
+
+    anp_msg_destroy(evt);
+
+    return error;
+}
+
+/* Return a copy of the event specified. */
+static struct anp_msg * kcd_kws_mux_copy_evt(struct anp_msg *evt) {
+    struct anp_msg *msg = anp_msg_new();
+    msg->major = evt->major;
+    msg->minor = evt->minor;
+    msg->type = evt->type;
+    msg->id = evt->id;
+    kbuffer_write(&msg->payload, evt->payload.data, evt->payload.len);
+    return msg;
+}
+
+/* Send the pending events of the workspace specified to the session. The events
+ * are taken from the event ring of the workspace if it still contains them,
+ * otherwise they are read from the event log of the workspace.
+ */
+static int kcd_kws_mux_deliver_sub_evt(struct kcd_kws_mux_session *sess, struct kcd_kws_mux_sub *sub) {
+    int error = 0, limit = KCD_KWS_EVT_FETCH_LIMIT, i;
+    struct kcd_kws_mux_kws *kws = sub->kws;
+
+    /* The session is too far behind, catch up from the event log. */
+    if (sub->last_event_id < kws->ring_base_id) {
+        int hot_flag = 0;
+        uint64_t fetch_id = sub->last_event_id;
+        karray msg_array;
+        karray_init(&msg_array);
+
+        kmod_log_msg(KCD_LOG_KWS, "Catching up on workspace "PRINTF_64"u from event "PRINTF_64"u.\n",
+                     kws->kws_id, sub->last_event_id);
+
+        error = kcd_kws_fetch_events(&sess->worker->evt_conn, NULL, kws->kws_id, &fetch_id, limit,
+                                     &hot_flag, &msg_array);
+
+        if (!error) {
+            /* Stop when the outgoing queue is quenched, as for the events of
+             * the ring. The events not sent are fetched again later.
+             */
+            for (i = 0; i < msg_array.size && !sess->out_quenched; i++) {
+                struct anp_msg *evt = msg_array.data[i];
+                sub->last_event_id = evt->id;
+                kcd_kws_mux_push_out_msg(sess, evt);
+            }
+
+            /* The session has all the events fetched by the worker. */
+            if (i == msg_array.size && msg_array.size < limit) {
+                sub->last_event_id = MAX(sub->last_event_id, kws->last_event_id);
+            }
+
+            for (; i < msg_array.size; i++) anp_msg_destroy(msg_array.data[i]);
+            karray_reset(&msg_array);
+        }
+
+        kcd_kws_clear_anp_msg_array(&msg_array, 1);
+    }
+
+    /* Send the events from the ring. */
+    else {
+        for (i = 0; i < kws->ring_count && !sess->out_quenched; i++) {
+            struct anp_msg *evt = kws->evt_ring[(kws->ring_start + i) % KCD_KWS_MUX_EVT_RING_SIZE];
+            if (evt->id <= sub->last_event_id) continue;
+            kcd_kws_mux_push_out_msg(sess, kcd_kws_mux_copy_evt(evt));
+            sub->last_event_id = evt->id;
+        }
+    }
+
+    sub->poll_event_flag = (sub->last_event_id < kws->last_event_id);
+
+    return error;
+}
+
+/* Send the pending events of the workspaces of the session. */
+static int kcd_kws_mux_deliver_evt(struct kcd_kws_mux_session *sess) {
+    int error = 0, i, size;
+    struct krb_node *iter;
+
+    iter = krb_tree_iter_start(&sess->sub_tree);
+    size = krb_tree_size(&sess->sub_tree);
+
+    for (i = 0; i < size && !sess->out_quenched; i++) {
+        struct kcd_kws_mux_sub *sub = krb_tree_iter_next(&sess->sub_tree, &iter);
+        if (!sub->poll_event_flag || !sub->kws->listening_flag) continue;
+
+        error = kcd_kws_mux_deliver_sub_evt(sess, sub);
+        if (error) break;
+    }
+
+    return error;
+}
+
+/* Execute the next command of the session. */
+static int kcd_kws_mux_exec_cmd(struct kcd_kws_mux_session *sess) {
+    int error = 0;
+    struct kcd_kws_cmd_exec_state ces;
+    struct anp_msg *cmd = kcd_kws_mux_pop_in_msg(sess);
+    struct anp_msg *res = anp_msg_new();
+
+    kcd_kws_cmd_exec_state_init(&ces);
+    ces.date = ktime_now_sec();
+    ces.cmd = cmd;
+    ces.res = res;
+    ces.kws_tree = &sess->cmd_kws_tree;
+    ces.conn = &sess->worker->cmd_conn;
+    ces.sess = sess;
+    ces.client = sess->client;
+
+    do {
+        error = kcd_kws_mux_open_cmd_conn(sess->worker);
+        if (error) break;
+
+        error = kcd_kws_cmd_dispatch(&ces, &sess->worker->dispatch_tree);
+        if (error) break;
+
+        /* A result has been obtained. */
+        kcd_kws_mux_push_out_msg(sess, res);
+        res = NULL;
+
+    } while (0);
+
+    kcd_kws_cmd_exec_state_clean(&ces);
+    anp_msg_destroy(cmd);
+    anp_msg_destroy(res);
+
+    return error;
+}
+
+/* Pop some messages off the outgoing message queue and start sending them. */
+static void kcd_kws_mux_send_out_msg(struct kcd_kws_mux_session *sess) {
+    int cur_size = 0;
+    karray msg_array;
+
+    karray_init(&msg_array);
+
+    do {
+	struct anp_msg *msg = kcd_kws_mux_pop_out_msg(sess);
+	karray_push(&msg_array, msg);
+	cur_size += msg->payload.len + 50;
+
+    } while (sess->out_msg_array.size && cur_size < KCD_KWS_MAX_CLIENT_OUT_PACKET_SIZE);
+
+    anp_tls_send_many_msg(&sess->xfer, &msg_array);
+    karray_clean(&msg_array);
+}
+
+/* Transfer the messages of a session in workspace mode. The epoll events to
+ * wait for are set in 'events'.
+ */
+static int kcd_kws_mux_do_xfer(struct kcd_kws_mux_session *sess, uint32_t *events) {
+    struct anp_tls_xfer *xfer = &sess->xfer;
+    int loop = 1;
+
+    while (loop) {
+        loop = 0;
+
+        if (!anp_tls_receiving(xfer) && !sess->in_quenched) anp_tls_begin_recv(xfer);
+        if (!anp_tls_sending(xfer) && sess->out_msg_array.size) kcd_kws_mux_send_out_msg(sess);
+
+        if (anp_tls_do_xfer(xfer, &sess->client->conn)) return -1;
+
+        if (anp_tls_done_receiving(xfer)) {
+            kcd_kws_mux_push_in_msg(sess, anp_tls_get_recv(xfer));
+            kcd_kws_mux_mark_ready(sess);
+            loop = 1;
+        }
+
+        if (anp_tls_done_sending(xfer)) {
+            anp_tls_flush_send(xfer);
+            loop = 1;
+        }
+    }
+
+    if (anp_tls_receiving(xfer)) *events |= EPOLLIN;
+    if (anp_tls_sending(xfer)) *events |= EPOLLOUT;
+
+    return 0;
+}
+
+/* Hand off the session specified to a child process. If 'kanp_flag' is true,
+ * the child replies to the role negociation and services the role selected,
+ * otherwise the child dispatches the connection according to the protocol
+ * identification bytes. The result 'res', if any, is destroyed.
+ */
+static void kcd_kws_mux_hand_off(struct kcd_kws_mux_session *sess, int kanp_flag, struct anp_msg *res,
+                                 int got_role_flag, uint32_t role) {
+    struct kcd_kws_mux_worker *worker = sess->worker;
+    int error = 0;
+    int pid;
+
+    error = kcd_fork("Service ID", &pid, 1);
+
+    /* Child. Close the descriptors of the worker, without disturbing the
+     * database sessions of the worker.
+     */
+    if (!pid) {
+        int i, size;
+        struct krb_node *iter;
+
+        close(worker->epoll_fd);
+        close(worker->listen_sock);
+        if (worker->cmd_conn_flag) close(worker->cmd_conn.sock);
+        if (worker->evt_conn_flag) close(worker->evt_conn.sock);
+
+        iter = krb_tree_iter_start(&worker->sess_tree);
+        size = krb_tree_size(&worker->sess_tree);
+
+        for (i = 0; i < size; i++) {
+            struct kcd_kws_mux_session *other = krb_tree_iter_next(&worker->sess_tree, &iter);
+            if (other != sess) close(other->client->sock);
+        }
+
+        if (!error) {
+            if (kanp_flag) {
+                kdaemon_set_task("KANP | %s", sess->client->addr.data);
+                error = kcd_frontend_dispatch_kanp_role(sess->client, &sess->xfer, res, got_role_flag, role);
+            }
+
+            else error = kcd_frontend_dispatch_proto(sess->client, sess->id_buf);
+        }
+
+        if (error) kmod_log_msg(KCD_LOG_BRIEF, "Error in client connection: %s.\n", kmod_strerror());
+        kcd_pg_pool_clean();
+        exit(0);
+    }
+
+    /* Parent. */
+    if (error) kmod_log_msg(KCD_LOG_BRIEF, "Error handing off connection: %s.\n", kmod_strerror());
+    else worker->nb_child++;
+
+    anp_msg_destroy(res);
+    kcd_kws_mux_close_session(sess);
+}
+
+/* Advance the state of the session specified as far as possible without
+ * blocking.
+ */
+static void kcd_kws_mux_step_session(struct kcd_kws_mux_session *sess) {
+    int error = 0;
+    uint32_t events = 0;
+    struct kcd_client *client = sess->client;
+
+    if (sess->dead_flag) return;
+
+    do {
+        if (sess->state == KCD_KWS_MUX_SESS_HANDSHAKE) {
+            int r = ktls_perform_handshake(&client->conn);
+            if (r == -1) { error = -1; break; }
+            if (r == -2) { events = EPOLLIN; break; }
+            if (r == -3) { events = EPOLLOUT; break; }
+            sess->state = KCD_KWS_MUX_SESS_IDENTIFY;
+        }
+
+        if (sess->state == KCD_KWS_MUX_SESS_IDENTIFY) {
+            while (sess->id_len < KCD_PROTO_NB_ID_BYTE) {
+                int r = ktls_recv(&client->conn, sess->id_buf + sess->id_len, KCD_PROTO_NB_ID_BYTE - sess->id_len);
+                if (r == -1) { error = -1; break; }
+                if (r == -2) break;
+                sess->id_len += r;
+            }
+
+            if (error) break;
+            if (sess->id_len < KCD_PROTO_NB_ID_BYTE) { events = EPOLLIN; break; }
+
+            /* Only the KANP connections are serviced by the worker. */
+            if (!global_opts.kanp_mode || !kcd_frontend_is_kanp_id(sess->id_buf)) {
+                kcd_kws_mux_hand_off(sess, 0, NULL, 0, 0);
+                return;
+            }
+
+            sess->state = KCD_KWS_MUX_SESS_NEGOCIATE;
+            anp_tls_begin_recv(&sess->xfer);
+            anp_tls_add_id_buf(&sess->xfer, sess->id_buf);
+        }
+
+        if (sess->state == KCD_KWS_MUX_SESS_NEGOCIATE) {
+            struct anp_msg *msg, *res = NULL;
+            uint32_t role = 0;
+            int got_role_flag;
+
+            error = anp_tls_do_xfer(&sess->xfer, &client->conn);
+            if (error) break;
+            if (!anp_tls_done_receiving(&sess->xfer)) { events = EPOLLIN; break; }
+
+            msg = anp_tls_get_recv(&sess->xfer);
+            got_role_flag = kcd_frontend_select_kanp_role(client, msg, &role, &res);
+            anp_msg_destroy(msg);
+
+            /* Only the workspace role is serviced by the worker. */
+            if (!got_role_flag || role != KANP_KCD_ROLE_WORKSPACE) {
+                kcd_kws_mux_hand_off(sess, 1, res, got_role_flag, role);
+                return;
+            }
+
+            kmod_log_msg(KCD_LOG_BRIEF, "Servicing %s in workspace mode.\n", client->addr.data);
+            sess->state = KCD_KWS_MUX_SESS_WORKSPACE;
+            kcd_kws_mux_push_out_msg(sess, res);
+        }
+
+        error = kcd_kws_mux_do_xfer(sess, &events);
+        if (error) break;
+
+    } while (0);
+
+    if (error) {
+        if (sess->state == KCD_KWS_MUX_SESS_WORKSPACE)
+            kmod_log_msg(KCD_LOG_BRIEF, "Lost client connection: %s.\n", kmod_strerror());
+        else
+            kmod_log_msg(KCD_LOG_BRIEF, "Error in client connection: %s.\n", kmod_strerror());
+
+        kcd_kws_mux_close_session(sess);
+        return;
+    }
+
+    /* Update the epoll registration. */
+    if (events != sess->epoll_events) {
+        sess->epoll_events = events;
+        kcd_kws_mux_epoll_ctl(sess->worker, EPOLL_CTL_MOD, client->sock, events);
+    }
+}
+
+/* Process the commands and the events of a ready session, then transfer its
+ * messages.
+ */
+static void kcd_kws_mux_process_session(struct kcd_kws_mux_session *sess) {
+    struct kcd_kws_mux_worker *worker = sess->worker;
+
+    if (sess->state == KCD_KWS_MUX_SESS_WORKSPACE && !sess->no_backend_flag) {
+        do {
+            /* Check the workspace logins. */
+            if (kcd_kws_mux_check_kws(sess)) {
+                kcd_kws_mux_set_backend_error(sess);
+                kcd_kws_mux_close_cmd_conn(worker);
+                break;
+            }
+
+            /* Send the events. The other sessions are only affected if the
+             * event connection has failed.
+             */
+            if (!sess->out_quenched && kcd_kws_mux_deliver_evt(sess)) {
+                kcd_kws_mux_set_backend_error(sess);
+                if (!kcd_kws_mux_evt_conn_ok(worker)) kcd_kws_mux_set_evt_error(worker);
+                break;
+            }
+
+            /* Execute a command. */
+            if (!sess->out_quenched && sess->in_msg_array.size && kcd_kws_mux_exec_cmd(sess)) {
+                kcd_kws_mux_set_backend_error(sess);
+                kcd_kws_mux_close_cmd_conn(worker);
+                break;
+            }
+
+            /* Come back later if there is more work to do. */
+            if (kcd_kws_mux_session_has_work(sess)) kcd_kws_mux_mark_ready(sess);
+
+        } while (0);
+    }
+
+    kcd_kws_mux_step_session(sess);
+}
+
+
+/******************************************************************************/
+/* Worker loop functions. */
+
+/* Accept the pending connections. */
+static void kcd_kws_mux_accept_conn(struct kcd_kws_mux_worker *worker) {
+    int i;
+
+    for (i = 0; i < KCD_KWS_MUX_MAX_ACCEPT; i++) {
+        int error = 0;
+        struct kcd_client *client = kcd_client_new();
+        struct kcd_kws_mux_session *sess;
+
+        error = kcd_frontend_accept_client(worker->listen_sock, client);
+        if (!error) error = kcd_frontend_setup_tls(client);
+
+        if (error) {
+            if (error == -1) kmod_log_msg(KCD_LOG_BRIEF, "Error accepting connection: %s.\n", kmod_strerror());
+            kcd_client_destroy(client);
+            break;
+        }
+
+        sess = kcd_kws_mux_session_new(worker, client);
+        krb_tree_add(&worker->sess_tree, &client->sock, sess);
+        sess->epoll_events = EPOLLIN;
+        kcd_kws_mux_epoll_ctl(worker, EPOLL_CTL_ADD, client->sock, sess->epoll_events);
+        kcd_kws_mux_step_session(sess);
+    }
+}
+
+/* Handle the signals received by the worker. */
+static void kcd_kws_mux_handle_signal(struct kcd_kws_mux_worker *worker) {
+    int ignored;
+
+    if (global_opts.sigchld_count) {
+        global_opts.sigchld_count = 0;
+        while (worker->nb_child && kcd_waitpid(-1, 0, &ignored)) worker->nb_child--;
+    }
+
+    if (global_opts.sigusr1_count) {
+        global_opts.sigusr1_count = 0;
+        if (kdaemon_load_config(0)) kmod_log_msg(KCD_LOG_BRIEF, "Cannot reload configuration: %s.\n", kmod_strerror());
+    }
+}
+
+/* Drain the signal socket. */
+static void kcd_kws_mux_drain_signal_sock() {
+    while (1) {
+        char buf[1000];
+        uint32_t len = 1000;
+        int error = ksock_read(global_opts.signal_sock[1], buf, &len);
+        if (error == -1) kerror_fatal("cannot drain signal socket: %s", kerror_syserror());
+        if (error == -2) break;
+    }
+}
+
+/* Destroy the sessions closed during the current iteration. */
+static void kcd_kws_mux_reap_dead_session(struct kcd_kws_mux_worker *worker) {
+    int i;
+
+    if (!worker->dead_array.size) return;
+
+    for (i = 0; i < worker->dead_array.size; i++) {
+        struct kcd_kws_mux_session *sess = worker->dead_array.data[i];
+        if (sess->ready_flag) kcd_kws_mux_array_remove(&worker->ready_array, sess);
+        kcd_kws_mux_session_destroy(sess);
+    }
+
+    karray_reset(&worker->dead_array);
+}
+
+/* Perform one iteration of the worker loop. */
+static int kcd_kws_mux_worker_iterate(struct kcd_kws_mux_worker *worker) {
+    struct epoll_event events[KCD_KWS_MUX_MAX_EPOLL_EVENT];
+    int timeout = -1, nb_event, i;
+    karray ready_array;
+
+    if (global_opts.quit_flag) {
+	kmod_set_error("must quit");
+	return -1;
+    }
+
+    /* Do not sleep if there is work pending. */
+    if (worker->ready_array.size || krb_tree_size(&worker->kws_active_tree)) timeout = 0;
+
+    nb_event = epoll_wait(worker->epoll_fd, events, KCD_KWS_MUX_MAX_EPOLL_EVENT, timeout);
+
+    if (nb_event == -1) {
+        if (errno != EINTR) {
+            kmod_set_error("epoll_wait() failed: %s", kerror_syserror());
+            return -1;
+        }
+
+        nb_event = 0;
+    }
+
+    for (i = 0; i < nb_event; i++) {
+        int fd = events[i].data.fd;
+
+        if (fd == global_opts.quit_sock[1]) {
+            global_opts.quit_flag = 1;
+	    kmod_set_error("must quit");
+	    return -1;
+        }
+
+        else if (fd == global_opts.signal_sock[1]) kcd_kws_mux_drain_signal_sock();
+        else if (fd == worker->listen_sock) kcd_kws_mux_accept_conn(worker);
+
+        /* The notifications are processed below. */
+        else if (worker->evt_conn_flag && fd == worker->evt_conn.sock) {}
+
+        else {
+            struct kcd_kws_mux_session *sess = krb_tree_get(&worker->sess_tree, &fd);
+            if (sess) kcd_kws_mux_step_session(sess);
+        }
+    }
+
+    /* We've been signaled. */
+    if (global_opts.sigusr1_count || global_opts.sigchld_count) kcd_kws_mux_handle_signal(worker);
+
+    /* Listen to, unlisten from and poll the workspaces. */
+    if (kcd_kws_mux_do_kws_work(worker)) kcd_kws_mux_set_evt_error(worker);
+
+    /* Process the sessions that were ready when the iteration began. The
+     * sessions that become ready meanwhile are processed in the next
+     * iteration.
+     */
+    ready_array = worker->ready_array;
+    karray_init(&worker->ready_array);
+
+    for (i = 0; i < ready_array.size; i++) {
+        struct kcd_kws_mux_session *sess = ready_array.data[i];
+        sess->ready_flag = 0;
+        if (!sess->dead_flag) kcd_kws_mux_process_session(sess);
+    }
+
+    karray_clean(&ready_array);
+
+    /* Process the pending database notifications. This is done last since the
+     * queries executed above may have buffered notifications. This only fails
+     * if the event connection has failed.
+     */
+    if (kcd_kws_mux_process_db_notif(worker)) kcd_kws_mux_set_evt_error(worker);
+
+    kcd_kws_mux_reap_dead_session(worker);
+
+    return 0;
+}
+
+/* Main loop of a workspace worker. The worker accepts the connections on the
+ * listening socket specified until it is time to quit.
+ */
+int kcd_kws_mux_worker_loop(int listen_sock) {
+    int error = 0, ignored;
+    struct kcd_kws_mux_worker worker;
+
+    kmod_log_msg(KCD_LOG_BRIEF, "kcd_kws_mux_worker_loop() called.\n");
+
+    kcd_kws_mux_worker_init(&worker);
+    worker.listen_sock = listen_sock;
+    kcd_kws_cmd_init_dispatch_tree(&worker.dispatch_tree);
+
+    do {
+        worker.epoll_fd = epoll_create(KCD_KWS_MUX_MAX_EPOLL_EVENT);
+
+        if (worker.epoll_fd == -1) {
+            kmod_set_error("epoll_create() failed: %s", kerror_syserror());
+            error = -1;
+            break;
+        }
+
+        kcd_kws_mux_epoll_ctl(&worker, EPOLL_CTL_ADD, global_opts.quit_sock[1], EPOLLIN);
+        kcd_kws_mux_epoll_ctl(&worker, EPOLL_CTL_ADD, global_opts.signal_sock[1], EPOLLIN);
+        kcd_kws_mux_epoll_ctl(&worker, EPOLL_CTL_ADD, listen_sock, KCD_KWS_MUX_LISTEN_EVENTS);
+
+        /* Reserve the command and event connections, then open them before
+         * accepting clients so that their descriptors are low. They are
+         * reopened as needed on failure.
+         */
+        if (kcd_pg_pool_reserve(2) ||
+            kcd_kws_mux_open_cmd_conn(&worker) || kcd_kws_mux_open_evt_conn(&worker)) {
+            kmod_log_msg(KCD_LOG_BRIEF, "Cannot connect to the database: %s.\n", kmod_strerror());
+        }
+
+        while (1) {
+            error = kcd_kws_mux_worker_iterate(&worker);
+            if (error) break;
+        }
+
+    } while (0);
+
+    kcd_kws_mux_worker_clean(&worker);
+
+    /* Collect all children. */
+    while (worker.nb_child) {
+        if (kcd_waitpid(-1, 1, &ignored)) worker.nb_child--;
+    }
+
+    kmod_log_msg(KCD_LOG_BRIEF, "kcd_kws_mux_worker_loop(): exiting.\n");
+
+    return error;
+}
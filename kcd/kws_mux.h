@@ -0,0 +1,219 @@
+/* Copyright (C) 2009-2012 Opersys inc., All rights reserved. */
+
+#ifndef _KWS_MUX_H
+#define _KWS_MUX_H
+
+/* Number of recent events of a workspace kept in memory by a workspace worker.
+ * The sessions that fall further behind read the event log of the workspace.
+ */
+#define KCD_KWS_MUX_EVT_RING_SIZE               256
+
+/* States of a session in a workspace worker. */
+enum {
+
+    /* The TLS handshake is being performed. */
+    KCD_KWS_MUX_SESS_HANDSHAKE = 1,
+
+    /* The protocol identification bytes are being received. */
+    KCD_KWS_MUX_SESS_IDENTIFY,
+
+    /* The KANP role negociation message is being received. */
+    KCD_KWS_MUX_SESS_NEGOCIATE,
+
+    /* The client is serviced in KANP workspace mode. */
+    KCD_KWS_MUX_SESS_WORKSPACE,
+};
+
+/* This structure represents a workspace listened to by a workspace worker on
+ * behalf of its sessions.
+ */
+struct kcd_kws_mux_kws {
+
+    /* ID of the workspace. */
+    uint64_t kws_id;
+
+    /* True if we are listening to the workspace. */
+    int listening_flag;
+
+    /* True if the database should be polled for new events ASAP. */
+    int poll_event_flag;
+
+    /* ID of the last event fetched from the workspace's event log. */
+    uint64_t last_event_id;
+
+    /* True if the events can be fetched from the hot partition of the event
+     * log.
+     */
+    int hot_flag;
+
+    /* Ring of the most recent events (anp_msg) fetched, oldest first. The ring
+     * contains all the events posted after the event 'ring_base_id' up to the
+     * event 'last_event_id'.
+     */
+    struct anp_msg *evt_ring[KCD_KWS_MUX_EVT_RING_SIZE];
+
+    /* Position of the oldest event in the ring and number of events in the
+     * ring.
+     */
+    int ring_start;
+    int ring_count;
+
+    /* ID of the last event that is no longer in the ring. */
+    uint64_t ring_base_id;
+
+    /* Array of sessions (kcd_kws_mux_session) subscribed to the events of the
+     * workspace. The workspace is unlistened to when this array becomes empty.
+     */
+    karray sess_array;
+};
+
+/* This structure represents the subscription of a session to the events of a
+ * workspace.
+ */
+struct kcd_kws_mux_sub {
+
+    /* Workspace listened to by the worker. */
+    struct kcd_kws_mux_kws *kws;
+
+    /* ID of the last event sent to the client. */
+    uint64_t last_event_id;
+
+    /* True if events may be pending for the session. */
+    int poll_event_flag;
+
+    /* True if the login of the user in the workspace must be verified. */
+    int check_kws_flag;
+};
+
+/* This structure contains the data required to service a client in a
+ * workspace worker. It replaces the broker, event and command threads used
+ * when a process is dedicated to the client.
+ */
+struct kcd_kws_mux_session {
+
+    /* Worker servicing the session. */
+    struct kcd_kws_mux_worker *worker;
+
+    /* Client being serviced. */
+    struct kcd_client *client;
+
+    /* State of the session. */
+    int state;
+
+    /* Identification bytes received from the client. */
+    char id_buf[KCD_PROTO_NB_ID_BYTE];
+
+    /* Number of identification bytes received. */
+    int id_len;
+
+    /* ANP message transfer with the client. */
+    struct anp_tls_xfer xfer;
+
+    /* Events the socket of the client is registered for with epoll. */
+    uint32_t epoll_events;
+
+    /* Array of ANP messages received and not processed yet. */
+    karray in_msg_array;
+
+    /* Total size of the data in the array above. */
+    int in_msg_array_size;
+
+    /* True if the incoming message queue is quenched because it is full. In
+     * that case we stop receiving messages from the client.
+     */
+    int in_quenched;
+
+    /* Array of ANP messages to send. */
+    karray out_msg_array;
+
+    /* Total size of the data in the array above. */
+    int out_msg_array_size;
+
+    /* True if the outgoing message queue is quenched because it is full. In
+     * that case no command or event is processed for the client until the
+     * queue drains.
+     */
+    int out_quenched;
+
+    /* True if the session is in the ready array of the worker. */
+    int ready_flag;
+
+    /* True if the backend encountered an error while servicing the client. */
+    int no_backend_flag;
+
+    /* True if the session has been closed. The session is destroyed at the
+     * end of the current iteration of the worker loop.
+     */
+    int dead_flag;
+
+    /* Tree of workspaces (kcd_kws_cmd_kws) the user is logged to indexed by
+     * workspace ID.
+     */
+    krb_tree cmd_kws_tree;
+
+    /* Tree of event subscriptions (kcd_kws_mux_sub) indexed by workspace
+     * ID.
+     */
+    krb_tree sub_tree;
+
+    /* Statistics of the permission cache of the session. */
+    uint64_t nb_perm_hit;
+    uint64_t nb_perm_miss;
+    uint64_t nb_perm_invalidate;
+};
+
+/* This structure contains the state of a workspace worker. */
+struct kcd_kws_mux_worker {
+
+    /* Epoll descriptor. */
+    int epoll_fd;
+
+    /* Listening socket shared with the other workers. */
+    int listen_sock;
+
+    /* Number of children forked to handle non-workspace connections. */
+    int nb_child;
+
+    /* Tree of sessions indexed by client socket. */
+    krb_tree sess_tree;
+
+    /* Array of sessions having commands or events to process. */
+    karray ready_array;
+
+    /* Array of sessions closed during the current loop iteration. */
+    karray dead_array;
+
+    /* Tree of workspaces (kcd_kws_mux_kws) listened to indexed by workspace
+     * ID.
+     */
+    krb_tree kws_tree;
+
+    /* Tree of workspaces that must be listened to or unlistened from. Memory
+     * not owned by this object.
+     */
+    krb_tree kws_active_tree;
+
+    /* Tree of KANP command dispatch entries indexed by command type. */
+    krb_tree dispatch_tree;
+
+    /* Connection to the database used to execute the commands of all
+     * sessions.
+     */
+    struct pg_db_conn cmd_conn;
+
+    /* Connection to the database used to listen to and poll the workspaces of
+     * all sessions. The events of a workspace are fetched once and fanned out
+     * to the subscribed sessions from the event ring of the workspace.
+     */
+    struct pg_db_conn evt_conn;
+
+    /* True if the connections above are open. */
+    int cmd_conn_flag;
+    int evt_conn_flag;
+};
+
+void kcd_kws_mux_add_kws(struct kcd_kws_mux_session *sess, struct kcd_kws_cmd_kws *kws, uint64_t last_event_id);
+void kcd_kws_mux_remove_kws(struct kcd_kws_mux_session *sess, struct kcd_kws_cmd_kws *kws);
+int kcd_kws_mux_worker_loop(int listen_sock);
+
+#endif
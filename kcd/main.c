@@ -449,6 +449,16 @@ static int kdaemon_parse_kcd_ini() {
         kdaemon_get_ini_str(d, "config:db_port", &global_opts.db_port);
         kdaemon_get_ini_str(d, "config:db_name", &global_opts.db_name);
         kdaemon_get_ini_str(d, "config:catchall_tbx", &global_opts.catchall_tbx);
+        kdaemon_get_ini_int(d, "config:kws_worker_count", 0, &global_opts.kws_worker_count);
+        kdaemon_get_ini_int(d, "config:kws_cmd_pipeline_depth", 1, &global_opts.kws_cmd_pipeline_depth);
+        kdaemon_get_ini_int(d, "config:kws_evt_coalesce_usec", 2000, &global_opts.kws_evt_coalesce_usec);
+        kdaemon_get_ini_int(d, "config:kws_client_queue_size", KCD_KWS_MAX_CLIENT_QUEUE_SIZE,
+                            &global_opts.kws_client_queue_size);
+        kdaemon_get_ini_int(d, "config:listen_worker_count", 0, &global_opts.listen_worker_count);
+        kdaemon_get_ini_int(d, "config:listen_worker_max", 256, &global_opts.listen_worker_max);
+        kdaemon_get_ini_int(d, "config:listen_worker_max_session", 1000, &global_opts.listen_worker_max_session);
+        kdaemon_get_ini_int(d, "config:db_max_conn", 0, &global_opts.db_max_conn);
+        kdaemon_get_ini_int(d, "config:tls_cache_size", 1024, &global_opts.tls_cache_size);
         
 	/* Switch '\n' for real newlines. */
         kstr_replace(&global_opts.web_link, "\\n", "\n");
@@ -527,6 +537,18 @@ static int kcd_parse_kfs_ini() {
 	}
         
         global_opts.default_kfs_quota = i64*1024*1024;
+        
+        /* Maximum size of the upload data being written in the background, in
+         * KB. 0 means the data is written synchronously.
+         */
+        i64 = iniparser_getint(d, "config:upload_write_budget", 4096);
+	if (i64 < 0) {
+	    kmod_set_error("the specified value for config:upload_write_budget is invalid");
+	    error = -1;
+	    break;
+	}
+        
+        global_opts.kfs_write_budget = i64*1024;
 	
     } while (0);
     
@@ -803,10 +825,17 @@ static int handle_start_action() {
             /* Otherwise just set the process task. */
 	    else kdaemon_set_task("Initializing");
     
+            /* Set up the database connection pool shared by our children. */
+            kcd_pg_pool_init();
+            
             /* Dispatch to the appropriate handler. */
             kmod_log_msg(KCD_LOG_CRIT, "KCD starting.\n");
             
             if (kstr_equal_cstr(&global_opts.startup_mode, "frontend")) {
+                
+                /* Set up the TLS state shared by our children. */
+                ktls_server_init(global_opts.tls_cache_size);
+                
                 error = kcd_frontend_listener_loop();
                 if (error == -1) {
                     kmod_log_msg(KCD_LOG_CRIT, "Listener mode error: %s.\n", kmod_strerror());
@@ -755,7 +755,7 @@ int kcd_mgt_connect_kws(struct kcd_kws_cmd_exec_state *ces) {
 
         /* Accept the login. */
         if (cs.login_code == KANP_KWS_LOGIN_OK) {
-            kcd_kws_cmd_add_kws(ces->st, cs.kws, cs.user_last_event_id);
+            kcd_kws_cmd_add_kws(ces, cs.kws, cs.user_last_event_id);
             cs.kws = NULL;
         }
         
@@ -787,7 +787,7 @@ int kcd_mgt_disconnect_kws(struct kcd_kws_cmd_exec_state *ces) {
         if (!kws) break;
 	
 	/* Disconnect the user from the workspace. */
-        kcd_kws_cmd_remove_kws(ces->st, kws);
+        kcd_kws_cmd_remove_kws(ces, kws);
 	
     } while (0);
 	
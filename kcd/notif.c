@@ -416,7 +416,7 @@ static void kcd_notif_state_clean(struct kcd_notif_state *self) {
     kcd_notif_state_clear_kws_tree(self);
     krb_tree_clean(&self->kws_tree);
     kcd_mail_template_clean(&self->notif_tmpl);
-    pg_db_conn_clean(&self->conn);
+    kcd_pg_pool_put(&self->conn);
 }
 
 static struct kcd_notif_kws_notif* kcd_notif_kws_notif_new() {
@@ -1746,21 +1746,15 @@ static int kcd_notif_loop_have_conn(struct kcd_notif_state *st, struct kselect *
 /* Reconnect to the database and listen to the workspaces. */
 static int kcd_notif_attempt_connect(struct kcd_notif_state *st) {
     int error = 0;
-    kstr query, conn_str;
+    kstr query;
 
     kstr_init(&query);
-    kstr_init(&conn_str);
 
     kmod_log_msg(KCD_LOG_NOTIF, "kcd_notif_attempt_connect() called.\n");
 
     do {
         /* Connect to the database. */
-        kstr_sf(&conn_str, "dbname=%s user=%s password=%s host=%s port=%s", 
-                global_opts.db_name.data, global_opts.db_user.data,
-                global_opts.db_password.data, global_opts.db_host.data,
-                global_opts.db_port.data);
-
-        error = kcd_open_pg_conn(&st->conn, conn_str.data);
+        error = kcd_pg_pool_get(&st->conn);
         if (error) break;
 
         /* Freeze the database state. */
@@ -1786,7 +1780,6 @@ static int kcd_notif_attempt_connect(struct kcd_notif_state *st) {
     } while (0);
 
     kstr_clean(&query);
-    kstr_clean(&conn_str);
 
     return error;
 }
@@ -1826,9 +1819,13 @@ static int kcd_notif_loop_no_conn(struct kcd_notif_state *st, struct kselect *se
 /* Main loop of the notification mode. */
 static int kcd_notif_loop(struct kcd_notif_state *st) {
     int error = 0;
+    struct kpoll poll;
 
     kmod_log_msg(KCD_LOG_NOTIF, "kcd_notif_loop() called.\n");
 
+    /* The database socket stays registered while the connection is open. */
+    kpoll_init(&poll, 0);
+
     while (1) {
         int skip_select_flag = 0;
         struct kselect sel;
@@ -1849,19 +1846,22 @@ static int kcd_notif_loop(struct kcd_notif_state *st) {
             error = 0;
             skip_select_flag = 1;
             st->conn_flag = 0;
-            pg_db_reset(&st->conn);
+            kpoll_set(&poll, st->conn.sock, 0);
+            kcd_pg_pool_put(&st->conn);
             kcd_notif_state_clear_kws_tree(st);
         }
 
         /* Perform the select() call. */
         if (!skip_select_flag) {
             kmod_log_msg(KCD_LOG_NOTIF, "kcd_notif_loop(): doing select() call.\n");
-            error = kdaemon_do_select(&sel);
+            error = kdaemon_do_persistent_select(&sel, &poll);
             if (error) break;
             kmod_log_msg(KCD_LOG_NOTIF, "kcd_notif_loop(): out of select() call.\n");
         }
     }
 
+    kpoll_clean(&poll);
+
     return error;
 }
 
@@ -1887,6 +1887,7 @@ int kcd_notif_entry() {
     } while (0);
 
     kcd_notif_state_clean(&st);
+    kcd_pg_pool_clean();
 
     return error;
 }
@@ -21,6 +21,9 @@ static struct kcd_ticket_mode_dispatch_entry kcd_ticket_mode_dispatch_table[] =
     { KANP_CMD_KFS_UPLOAD_REQ, KANP_RES_KFS_UPLOAD_REQ, KANP_CMD_KFS_PHASE_1,
       KANP_KCD_TICKET_UPLOAD, kcd_kfs_handle_upload },
       
+    { KANP_CMD_KFS_UPLOAD_REQ, KANP_RES_KFS_UPLOAD_REQ, KANP_CMD_KFS_UPLOAD_JOIN,
+      KANP_KCD_TICKET_UPLOAD, kcd_kfs_handle_upload },
+      
     { KANP_CMD_VNC_CONNECT_TICKET, KANP_RES_VNC_CONNECT_TICKET, KANP_CMD_VNC_CONNECT_SESSION,
       KANP_KCD_TICKET_VNC_CLIENT, kcd_vnc_connect_session },
       
@@ -33,6 +36,7 @@ void kcd_ticket_mode_state_init(struct kcd_ticket_mode_state *self, struct kcd_c
     self->client = client;
     anp_tls_init(&self->xfer);
     pg_db_conn_init(&self->db_conn);
+    kpoll_init(&self->poll, 0);
     kcd_internal_ticket_init(&self->ticket);
     kstr_init(&self->query);
     kcd_pg_anp_query_init(&self->aq);
@@ -44,7 +48,8 @@ void kcd_ticket_mode_state_init(struct kcd_ticket_mode_state *self, struct kcd_c
 
 void kcd_ticket_mode_state_clean(struct kcd_ticket_mode_state *self) {
     anp_tls_clean(&self->xfer);
-    pg_db_conn_clean(&self->db_conn);
+    kpoll_clean(&self->poll);
+    kcd_pg_pool_put(&self->db_conn);
     anp_msg_destroy(self->in_msg);
     anp_msg_destroy(self->out_msg);
     kcd_internal_ticket_clean(&self->ticket);
@@ -116,7 +121,7 @@ int kcd_ticket_mode_kws_bound_query(struct kcd_ticket_mode_state *self, char *qu
     kcd_ticket_mode_new_out_msg(self, 0);
     return kcd_exec_kws_bound_query(&self->db_conn, &self->aq, query_name, cmd, self->out_msg, self->kws_id,
                                     date, self->login_type, self->user_id, self->client->effective_minor,
-                                    &self->kws_bound_buf);
+                                    &self->kws_bound_buf, NULL);
 }
 
 /* Perform a permission check. Return 0, -1 or -4. */
@@ -197,7 +202,7 @@ int kcd_ticket_mode_wait(struct kcd_ticket_mode_state *self, int64_t delay) {
     if (delay == -1) delay = 1000000000;
     ktime_from_msec(&self->sel.tv, delay + 1);
     
-    error = kdaemon_do_select(&self->sel);
+    error = kdaemon_do_persistent_select(&self->sel, &self->poll);
     kmod_log_msg(self->log_level, "kcd_ticket_mode_wait(): out of select().\n");
     if (error) return error;
     
@@ -218,16 +223,12 @@ int kcd_ticket_mode_timed_tls_xfer(struct kcd_ticket_mode_state *self, int64_t d
     return kcd_ticket_mode_wait(self, delay);
 }
 
-/* Send and clear the current output message to the client. Return 0, -1, or -4. */
-int kcd_ticket_mode_send_msg(struct kcd_ticket_mode_state *self) {
+/* Helper for kcd_ticket_mode_send_msg(). Wait for the message being sent to be
+ * sent. Return 0, -1 or -4.
+ */
+static int kcd_ticket_mode_wait_send(struct kcd_ticket_mode_state *self) {
     int error = 0;
     
-    kmod_log_msg(self->log_level, "kcd_ticket_mode_send_msg() called.\n");
-    
-    assert(self->out_msg);
-    anp_tls_send_msg(&self->xfer, self->out_msg);
-    kcd_ticket_mode_clear_out_msg(self);
-    
     while (1) {
         error = kcd_ticket_mode_process_notif(self);
         if (error) return error;
@@ -237,6 +238,38 @@ int kcd_ticket_mode_send_msg(struct kcd_ticket_mode_state *self) {
         if (error) return error;
     }
 }
+
+/* Send and clear the current output message to the client. Return 0, -1, or -4. */
+int kcd_ticket_mode_send_msg(struct kcd_ticket_mode_state *self) {
+    kmod_log_msg(self->log_level, "kcd_ticket_mode_send_msg() called.\n");
+    
+    assert(self->out_msg);
+    anp_tls_send_msg(&self->xfer, self->out_msg);
+    kcd_ticket_mode_clear_out_msg(self);
+    
+    return kcd_ticket_mode_wait_send(self);
+}
+
+/* Same as kcd_ticket_mode_send_msg(), but the external data of the array
+ * specified (anp_tls_ext_seg) is inserted in the payload of the message without
+ * being copied. The data can be released when this function returns.
+ */
+int kcd_ticket_mode_send_msg_ext(struct kcd_ticket_mode_state *self, karray *ext_array) {
+    int error = 0;
+    
+    kmod_log_msg(self->log_level, "kcd_ticket_mode_send_msg_ext() called.\n");
+    
+    /* The transfer takes ownership of the message. */
+    assert(self->out_msg);
+    anp_tls_send_msg_ext(&self->xfer, self->out_msg, ext_array);
+    self->out_msg = NULL;
+    
+    /* The external data must not be referenced after we return. */
+    error = kcd_ticket_mode_wait_send(self);
+    if (error) anp_tls_flush_send(&self->xfer);
+    
+    return error;
+}
     
 /* Receive the next message from the client. Return 0, -1, or -4. */
 int kcd_ticket_mode_recv_msg(struct kcd_ticket_mode_state *self) {
@@ -422,9 +455,7 @@ int kcd_ticket_mode_handle_conn(struct kcd_client *client, uint32_t app) {
     char *task_name = "";
     struct kcd_ticket_mode_dispatch_entry *entry;
     struct kcd_ticket_mode_state st;
-    kstr conn_str;
     
-    kstr_init(&conn_str);
     kcd_ticket_mode_state_init(&st, client);
     
     do {
@@ -443,12 +474,7 @@ int kcd_ticket_mode_handle_conn(struct kcd_client *client, uint32_t app) {
         kmod_log_msg(KCD_LOG_BRIEF, "kcd_ticket_mode_handle_conn() called.\n");
         
         /* Connect to the DB. */
-        kstr_sf(&conn_str, "dbname=%s user=%s password=%s host=%s port=%s", 
-                global_opts.db_name.data, global_opts.db_user.data,
-                global_opts.db_password.data, global_opts.db_host.data,
-                global_opts.db_port.data);
-
-	error = kcd_open_pg_conn(&st.db_conn, conn_str.data);
+	error = kcd_pg_pool_get(&st.db_conn);
 	if (error) break;
         
         /* Receive the initial message. */
@@ -498,7 +524,6 @@ int kcd_ticket_mode_handle_conn(struct kcd_client *client, uint32_t app) {
     assert(error == 0 || error == -1);
     
     kcd_ticket_mode_state_clean(&st);
-    kstr_clean(&conn_str);
     
     return error;
 }
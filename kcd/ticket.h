@@ -27,8 +27,11 @@ struct kcd_ticket_mode_state {
     /* Connection to the database. */
     struct pg_db_conn db_conn;
     
-    /* Select state. */
+    /* Select state. The select set is rebuilt before each wait, but the
+     * descriptors stay registered in the poll set for the session.
+     */
     struct kselect sel;
+    struct kpoll poll;
     
     /* Ticket received from the client. */
     struct kcd_internal_ticket ticket;
@@ -95,6 +98,7 @@ void kcd_ticket_mode_prepare_wait(struct kcd_ticket_mode_state *self);
 int kcd_ticket_mode_wait(struct kcd_ticket_mode_state *self, int64_t delay);
 int kcd_ticket_mode_timed_tls_xfer(struct kcd_ticket_mode_state *self, int64_t delay);
 int kcd_ticket_mode_send_msg(struct kcd_ticket_mode_state *self);
+int kcd_ticket_mode_send_msg_ext(struct kcd_ticket_mode_state *self, karray *ext_array);
 int kcd_ticket_mode_recv_msg(struct kcd_ticket_mode_state *self);
 int kcd_ticket_mode_timed_recv_msg(struct kcd_ticket_mode_state *self, int64_t delay);
 int kcd_ticket_mode_get_license_email(struct kcd_ticket_mode_state *self);
@@ -74,10 +74,14 @@
  */
 
 #include <dlfcn.h>
+#include <time.h>
 #include "common.h"
 #include "postgres.h"
 #include "fmgr.h"
 #include "executor/spi.h"
+#include "catalog/pg_type.h"
+#include "utils/builtins.h"
+#include "utils/array.h"
 
 /* Postgres magic symbol used to detect out-of-sync versions. */
 #ifdef PG_MODULE_MAGIC
@@ -92,6 +96,30 @@ PG_MODULE_MAGIC;
 /* Purge stale uploader delay: 30 minutes. */
 #define KCDPG_PURGE_UPLOADER_DELAY 30*60
 
+/* Delay after which a file of an upload can be taken over by another
+ * connection if the connection uploading it stopped refreshing it: 3 minutes.
+ */
+#define KCDPG_UPLOAD_STREAM_LEASE 3*60
+
+/* Prefix of the names of the archive partitions of the event log. The name of
+ * a partition ends with the year and month of its creation, as YYYYMM.
+ */
+#define KCDPG_EVT_PARTITION_PREFIX "kcd_kws_event_log_"
+
+/* SQL expression returning the value of the log retention field specified for
+ * the workspace ID expression specified.
+ */
+#define KCDPG_LOG_RETENTION(FIELD, KWS_ID) \
+    "COALESCE((SELECT " FIELD " FROM kcd_kws_log_retention WHERE kws_id = " KWS_ID "), " \
+    "(SELECT " FIELD " FROM kcd_kws_log_retention WHERE kws_id = 0), 0)"
+
+/* Maximum number of parameters of a cached query plan. */
+#define KCDPG_PLAN_MAX_PARAM 8
+
+/* Type OIDs of the bigint[] and bytea[] arrays. */
+#define KCDPG_INT8_ARRAY_OID 1016
+#define KCDPG_BYTEA_ARRAY_OID 1001
+
 /* List of flags associated to the root user. */
 #define KCDPG_ROOT_USER_FLAGS (KANP_USER_FLAG_ROOT | KANP_USER_FLAG_ADMIN | KANP_USER_FLAG_MANAGER |\
                                KANP_USER_FLAG_REGISTER)
@@ -189,7 +217,10 @@ PG_MODULE_MAGIC;
                     anp_read_uint32(&st.arg_buf, &wb->login_type) ||\
                     anp_read_uint32(&st.arg_buf, &wb->user_id) ||\
                     anp_read_uint32(&st.arg_buf, &wb->cmd_minor) ||\
-                    anp_read_bin(&st.arg_buf, &wb->cmd_buf)) {\
+                    anp_read_bin(&st.arg_buf, &wb->cmd_buf) ||\
+                    anp_read_uint32(&st.arg_buf, &wb->perm_cached_flag) ||\
+                    anp_read_uint32(&st.arg_buf, &wb->kws_flags) ||\
+                    anp_read_uint32(&st.arg_buf, &wb->user_flags)) {\
                     elog(ERROR, "bad workspace-bound argument: %s", kmod_strerror());\
                 }\
             }\
@@ -213,6 +244,9 @@ PG_MODULE_MAGIC;
                     anp_write_uint32(&st.ret_buf, wb->res_type);\
                     anp_write_bin(&st.ret_buf, &wb->res_buf);\
                     anp_write_uint32(&st.ret_buf, error ? 1 : 0);\
+                    anp_write_uint32(&st.ret_buf, wb->perm_valid_flag);\
+                    anp_write_uint32(&st.ret_buf, wb->kws_flags);\
+                    anp_write_uint32(&st.ret_buf, wb->user_flags);\
                 }\
                 if (error == 0) kbuffer_write_buffer(&st.ret_buf, &st.ext_buf);\
             }\
@@ -273,6 +307,17 @@ struct kcdpg_kws_bound_state {
 
     /* Minor version of the command sent by the client. */
     uint32_t cmd_minor;
+    
+    /* True if KCD provided the workspace and user flags from its permission
+     * cache. The queries that modify the flags clear this flag so that the
+     * flags are read from the database.
+     */
+    uint32_t perm_cached_flag;
+    
+    /* True if the workspace and user flags are known. They are returned to
+     * KCD so that it can cache them.
+     */
+    uint32_t perm_valid_flag;
 
     /* Type of the result to send to the client. */
     uint32_t res_type;
@@ -306,6 +351,29 @@ struct kcdpg_kws_prop_change_state {
     kbuffer evt_buf;
 };
 
+/* Event accumulated in an event batch. */
+struct kcdpg_batch_evt {
+    uint32_t minor;
+    uint32_t type;
+    kbuffer payload;
+};
+
+/* This structure accumulates the events posted in a workspace by a query, to
+ * write them in the event log with a single statement and a single
+ * notification.
+ */
+struct kcdpg_evt_batch {
+    
+    /* ID of the workspace of the events. */
+    uint64_t kws_id;
+    
+    /* Number of events accumulated. */
+    uint32_t nb_evt;
+    
+    /* Array of kcdpg_batch_evt. The entries past nb_evt are kept for reuse. */
+    karray evt_array;
+};
+
 /* True if debugging is enabled. */
 static int kcdpg_debug_flag = 0;
 
@@ -318,6 +386,77 @@ struct {
      void (*PQfreemem)(void *ptr);
 } kcdpg_libpq;
 
+/* Identifiers of the cached query plans. */
+enum kcdpg_plan_id {
+    KCDPG_PLAN_LOCK_SHARE,
+    KCDPG_PLAN_LOCK_UPDATE,
+    KCDPG_PLAN_LOCK_EVT,
+    KCDPG_PLAN_RESERVE_SEQ_ID,
+    KCDPG_PLAN_GET_KWS_FLAGS,
+    KCDPG_PLAN_GET_KWS_USER_FLAGS,
+    KCDPG_PLAN_UPDATE_KWS_FLAGS,
+    KCDPG_PLAN_UPDATE_KWS_USER_FLAGS,
+    KCDPG_PLAN_INSERT_EVENT,
+    KCDPG_PLAN_INSERT_EVENT_BATCH,
+    KCDPG_PLAN_INSERT_NOTIF,
+    KCDPG_PLAN_NB
+};
+
+/* This structure describes a query executed through a cached plan. The plan
+ * is prepared the first time the query is executed by the backend and it is
+ * kept until the backend exits. The integer parameters are passed as bigints
+ * since the uint32 values may not fit in an integer.
+ */
+struct kcdpg_plan {
+    
+    /* Query text, using $1, $2, ... for the parameters. */
+    char *query;
+    
+    /* Number of parameters and their types. */
+    int nb_param;
+    Oid param_types[KCDPG_PLAN_MAX_PARAM];
+    
+    /* Prepared plan, NULL if the plan has not been prepared yet. */
+    SPIPlanPtr plan;
+    
+    /* Number of times the plan has been executed. */
+    uint64_t nb_exec;
+};
+
+/* Cached query plans of this backend. */
+static struct kcdpg_plan kcdpg_plan_table[KCDPG_PLAN_NB] = {
+    [KCDPG_PLAN_LOCK_SHARE] =
+        { "SELECT NULL FROM kcd_locks WHERE kws_id = $1 AND name = $2 FOR SHARE", 2, { INT8OID, TEXTOID } },
+    [KCDPG_PLAN_LOCK_UPDATE] =
+        { "SELECT NULL FROM kcd_locks WHERE kws_id = $1 AND name = $2 FOR UPDATE", 2, { INT8OID, TEXTOID } },
+    [KCDPG_PLAN_LOCK_EVT] =
+        { "SELECT NULL FROM kcd_sequences WHERE kws_id = $1 AND name = 'event_log' FOR UPDATE", 1, { INT8OID } },
+    [KCDPG_PLAN_RESERVE_SEQ_ID] =
+        { "UPDATE kcd_sequences SET value = value + $3 WHERE kws_id = $1 AND name = $2 RETURNING value",
+          3, { INT8OID, TEXTOID, INT8OID } },
+    [KCDPG_PLAN_GET_KWS_FLAGS] =
+        { "SELECT flags FROM kcd_kws_list WHERE kws_id = $1", 1, { INT8OID } },
+    [KCDPG_PLAN_GET_KWS_USER_FLAGS] =
+        { "SELECT flags FROM kcd_kws_users WHERE kws_id = $1 AND user_id = $2", 2, { INT8OID, INT8OID } },
+    [KCDPG_PLAN_UPDATE_KWS_FLAGS] =
+        { "UPDATE kcd_kws_list SET flags = $2 WHERE kws_id = $1", 2, { INT8OID, INT8OID } },
+    [KCDPG_PLAN_UPDATE_KWS_USER_FLAGS] =
+        { "UPDATE kcd_kws_users SET flags = $3 WHERE kws_id = $1 AND user_id = $2", 3, { INT8OID, INT8OID, INT8OID } },
+    [KCDPG_PLAN_INSERT_EVENT] =
+        { "INSERT INTO kcd_kws_event_log_hot (kws_id, evt_id, major, minor, type, event, date) "
+          "VALUES ($1, $2, $3, $4, $5, $6, $7)",
+          7, { INT8OID, INT8OID, INT8OID, INT8OID, INT8OID, BYTEAOID, INT8OID } },
+    [KCDPG_PLAN_INSERT_EVENT_BATCH] =
+        { "INSERT INTO kcd_kws_event_log_hot (kws_id, evt_id, major, minor, type, event, date) "
+          "SELECT $1, $2 + s.i, 0, $3[s.i + 1], $4[s.i + 1], $5[s.i + 1], $6 "
+          "FROM generate_series(0, array_upper($3, 1) - 1) AS s(i)",
+          6, { INT8OID, INT8OID, KCDPG_INT8_ARRAY_OID, KCDPG_INT8_ARRAY_OID, KCDPG_BYTEA_ARRAY_OID, INT8OID } },
+    [KCDPG_PLAN_INSERT_NOTIF] =
+        { "INSERT INTO kcd_kws_notif_log (kws_id, notif_id, evt_id, date, user_id, type, payload) "
+          "VALUES ($1, $2, $3, $4, $5, $6, $7)",
+          7, { INT8OID, INT8OID, INT8OID, INT8OID, INT8OID, INT8OID, BYTEAOID } },
+};
+
 static struct kcdpg_kws_bound_state* kcdpg_kws_bound_state_new() {
     struct kcdpg_kws_bound_state *self = kcalloc(sizeof(struct kcdpg_kws_bound_state));
     self->res_type = KANP_RES_OK;
@@ -472,6 +611,52 @@ static void kcdpg_exec_query(char *query) {
     if (res <= 0) elog(ERROR, "query '%s' failed", query);
 }
 
+/* This function executes the cached plan specified with the parameter values
+ * specified. The plan is prepared if needed. If the query fails, an exception
+ * is thrown.
+ */
+static void kcdpg_exec_plan(enum kcdpg_plan_id id, Datum *values) {
+    struct kcdpg_plan *p = kcdpg_plan_table + id;
+    int res;
+    
+    if (!p->plan) {
+        SPIPlanPtr plan = SPI_prepare(p->query, p->nb_param, p->param_types);
+        if (!plan) elog(ERROR, "cannot prepare query '%s': %s", p->query, SPI_result_code_string(SPI_result));
+#if PG_VERSION_NUM >= 90200
+        if (SPI_keepplan(plan)) elog(ERROR, "cannot keep plan of query '%s'", p->query);
+#else
+        plan = SPI_saveplan(plan);
+        if (!plan) elog(ERROR, "cannot save plan of query '%s'", p->query);
+#endif
+        p->plan = plan;
+        KCDPG_DEBUG("prepared query '%s'", p->query);
+    }
+    
+    res = SPI_execute_plan(p->plan, values, NULL, false, 0);
+    if (res <= 0) elog(ERROR, "query '%s' failed", p->query);
+    p->nb_exec++;
+}
+
+/* Return an integer parameter value for a cached plan. */
+static Datum kcdpg_int_datum(uint64_t value) {
+    return Int64GetDatum((int64) value);
+}
+
+/* Return a text parameter value for a cached plan. */
+static Datum kcdpg_text_datum(char *value) {
+    return PointerGetDatum(cstring_to_text(value));
+}
+
+/* Return a binary string parameter value for a cached plan. The data is copied
+ * without escaping.
+ */
+static Datum kcdpg_bytea_datum(kbuffer *buf) {
+    bytea *value = (bytea *) palloc(VARHDRSZ + buf->len);
+    SET_VARSIZE(value, VARHDRSZ + buf->len);
+    memcpy(VARDATA(value), buf->data, buf->len);
+    return PointerGetDatum(value);
+}
+
 /* Shortcut functions to query workspace and user properties. */
 static int kcdpg_is_kws_public(uint32_t kws_flags) { return (kws_flags & KANP_KWS_FLAG_PUBLIC) > 0; }
 static int kcdpg_is_kws_secure(uint32_t kws_flags) { return (kws_flags & KANP_KWS_FLAG_SECURE) > 0; }
@@ -599,8 +784,10 @@ static void kcdpg_get_kws_name(kstr *ts, uint64_t kws_id, kstr *name) {
 
 /* Obtain the flags associated to the workspace specified, if any. */
 static uint32_t kcdpg_get_kws_flags(kstr *ts, uint64_t kws_id) {
-    kstr_sf(ts, "SELECT flags FROM kcd_kws_list WHERE kws_id = "PRINTF_64"u", kws_id);
-    return kcdpg_get_row_uint32(ts);
+    Datum values[] = { kcdpg_int_datum(kws_id) };
+    kcdpg_exec_plan(KCDPG_PLAN_GET_KWS_FLAGS, values);
+    if (!SPI_processed) return 0;
+    return kcdpg_get_uint32(0, 0);
 }
 
 /* Obtain the name_admin property of the workspace user specified. */
@@ -625,9 +812,11 @@ static void kcdpg_get_kws_user_name_user(kstr *ts, uint64_t kws_id, uint32_t use
 
 /* Obtain the flags associated to the workspace user specified. */
 static uint32_t kcdpg_get_kws_user_flags(kstr *ts, uint64_t kws_id, uint32_t user_id) {
+    Datum values[] = { kcdpg_int_datum(kws_id), kcdpg_int_datum(user_id) };
     if (!user_id) return KCDPG_ROOT_USER_FLAGS;
-    kstr_sf(ts, "SELECT flags FROM kcd_kws_users WHERE kws_id = "PRINTF_64"u AND user_id = %u", kws_id, user_id);
-    return kcdpg_get_row_uint32(ts);
+    kcdpg_exec_plan(KCDPG_PLAN_GET_KWS_USER_FLAGS, values);
+    if (!SPI_processed) return 0;
+    return kcdpg_get_uint32(0, 0);
 }
 
 /* Return the notification policy associated to the global user specified. */
@@ -759,9 +948,8 @@ static void kcdpg_create_seq(kstr *ts, uint64_t kws_id, char *name) {
  * target row was present in the lock table.
  */
 static int kcdpg_get_lock(kstr *ts, uint64_t kws_id, char *name, int write_flag) {
-    kstr_sf(ts, "SELECT NULL FROM kcd_locks WHERE kws_id = "PRINTF_64"u AND name = '%s' FOR %s",
-                kws_id, name, write_flag ? "UPDATE" : "SHARE");
-    kcdpg_exec_query(ts->data);
+    Datum values[] = { kcdpg_int_datum(kws_id), kcdpg_text_datum(name) };
+    kcdpg_exec_plan(write_flag ? KCDPG_PLAN_LOCK_UPDATE : KCDPG_PLAN_LOCK_SHARE, values);
     return (SPI_processed > 0);
 }
 
@@ -770,16 +958,32 @@ static void kcdpg_lock_kws_list(kstr *ts) { kcdpg_get_lock(ts, 0, "kws_list", 1)
 static int kcdpg_lock_kws(kstr *ts, uint64_t kws_id, int write_flag)
     { return kcdpg_get_lock(ts, kws_id, "kws", write_flag); }
 static void kcdpg_lock_kfs(kstr *ts, uint64_t kws_id, int write_flag) { kcdpg_get_lock(ts, kws_id, "kfs", write_flag); }
-static void kcdpg_lock_evt(kstr *ts, uint64_t kws_id) { kcdpg_get_lock(ts, kws_id, "event_log", 1); }
+
+/* Lock the event log of the workspace specified. The row of the event log
+ * sequence is the event log lock: posting an event updates that row, so a
+ * single row is locked for both purposes.
+ */
+static void kcdpg_lock_evt(kstr *ts, uint64_t kws_id) {
+    Datum values[] = { kcdpg_int_datum(kws_id) };
+    kcdpg_exec_plan(KCDPG_PLAN_LOCK_EVT, values);
+}
+
+/* Reserve 'count' consecutive IDs in the specified sequence and return the
+ * first one. The row of the sequence stays locked until the end of the
+ * transaction, hence the IDs are allocated without gaps and they become visible
+ * in increasing order. The event log relies on this; Postgres sequences would
+ * not provide these guarantees.
+ */
+static uint64_t kcdpg_reserve_seq_ids(kstr *ts, uint64_t kws_id, char *name, uint32_t count) {
+    Datum values[] = { kcdpg_int_datum(kws_id), kcdpg_text_datum(name), kcdpg_int_datum(count) };
+    kcdpg_exec_plan(KCDPG_PLAN_RESERVE_SEQ_ID, values);
+    if (SPI_processed != 1) elog(ERROR, "sequence '%s' for workspace "PRINTF_64"u not found", name, kws_id);
+    return kcdpg_get_uint64(0, 0) - count + 1;
+}
 
 /* Return the next ID in the specified sequence. */
 static uint64_t kcdpg_get_next_seq_id(kstr *ts, uint64_t kws_id, char *name) {
-    kstr_sf(ts, "UPDATE kcd_sequences SET value = value + 1 WHERE kws_id = "PRINTF_64"u AND name = '%s'", kws_id, name);
-    kcdpg_exec_query(ts->data);
-    kstr_sf(ts, "SELECT value FROM kcd_sequences WHERE kws_id = "PRINTF_64"u AND name = '%s'", kws_id, name);
-    kcdpg_exec_query(ts->data);
-    if (SPI_processed != 1) elog(ERROR, "sequence '%s' for workspace "PRINTF_64"u not found", name, kws_id);
-    return kcdpg_get_uint64(0, 0);
+    return kcdpg_reserve_seq_ids(ts, kws_id, name, 1);
 }
 
 /* Insert the user specified in the global user table if he is not already in
@@ -824,12 +1028,21 @@ static void kcdpg_insert_kws_user(kstr *ts, uint64_t kws_id, uint32_t user_id, u
     kcdpg_exec_query(ts->data);
 }
 
-/* Update the flags of the workspace specified. */
-static void kcdpg_update_kws_flags(kstr *ts, uint64_t kws_id, uint32_t flags) {
-    kstr_sf(ts, "UPDATE kcd_kws_list SET flags = %u WHERE kws_id = "PRINTF_64"u", flags, kws_id);
+/* Notify the listeners of the perm_check relation. */
+static void notify_perm_check(kstr *ts, uint64_t kws_id) { 
+    kstr_sf(ts, "NOTIFY kws_"PRINTF_64"u_perm_check", kws_id);
     kcdpg_exec_query(ts->data);
 }
 
+/* Update the flags of the workspace specified. The listeners of the perm_check
+ * relation are notified since KCD caches the flags.
+ */
+static void kcdpg_update_kws_flags(kstr *ts, uint64_t kws_id, uint32_t flags) {
+    Datum values[] = { kcdpg_int_datum(kws_id), kcdpg_int_datum(flags) };
+    kcdpg_exec_plan(KCDPG_PLAN_UPDATE_KWS_FLAGS, values);
+    notify_perm_check(ts, kws_id);
+}
+
 /* Update the name of the workspace. */
 static void kcdpg_update_kws_name(kstr *ts, uint64_t kws_id, kstr *name) {
     kstr_sf(ts, "UPDATE kcd_kws_list SET name = ");
@@ -838,12 +1051,14 @@ static void kcdpg_update_kws_name(kstr *ts, uint64_t kws_id, kstr *name) {
     kcdpg_exec_query(ts->data);
 }
     
-/* Update the flags of the workspace user specified. */
+/* Update the flags of the workspace user specified. The listeners of the
+ * perm_check relation are notified since KCD caches the flags.
+ */
 static void kcdpg_update_kws_user_flags(kstr *ts, uint64_t kws_id, uint32_t user_id, uint32_t flags) {
+    Datum values[] = { kcdpg_int_datum(kws_id), kcdpg_int_datum(user_id), kcdpg_int_datum(flags) };
     kcdpg_check_user_flags_consistency(flags);
-    kstr_sf(ts, "UPDATE kcd_kws_users SET flags = %u WHERE kws_id = "PRINTF_64"u AND user_id = %u",
-                 flags, kws_id, user_id);
-    kcdpg_exec_query(ts->data);
+    kcdpg_exec_plan(KCDPG_PLAN_UPDATE_KWS_USER_FLAGS, values);
+    notify_perm_check(ts, kws_id);
 }
 
 /* Update the name_admin of the workspace user specified. */
@@ -921,49 +1136,107 @@ static void kcdpg_insert_trusted_key_id(kstr *ts, uint64_t kws_id, uint64_t key_
     kcdpg_exec_query(ts->data);
 }
 
-/* This function removes the uploader specified. */
+/* This function removes the uploader specified and its files. */
 static void kcdpg_remove_uploader(kstr *ts, uint64_t kws_id, uint32_t share_id, uint32_t user_id, uint64_t commit_id) {
     kstr_sf(ts, "DELETE FROM kcd_kws_kfs_upload WHERE kws_id = "PRINTF_64"u AND share_id = %u AND user_id = %u "
                 "AND commit_id = "PRINTF_64"u", kws_id, share_id, user_id, commit_id);
     kcdpg_exec_query(ts->data);
+    
+    kstr_sf(ts, "DELETE FROM kcd_kws_kfs_upload_file WHERE kws_id = "PRINTF_64"u AND share_id = %u "
+                "AND commit_id = "PRINTF_64"u", kws_id, share_id, commit_id);
+    kcdpg_exec_query(ts->data);
 }
 
-/* Notify the listeners of the event log. */
-static void kcdpg_notify_evt(kstr *ts, uint64_t kws_id) { 
-    kstr_sf(ts, "NOTIFY kws_"PRINTF_64"u_event_log", kws_id);
+/* This function writes the phase 2 event of the upload specified in the event
+ * buffer, and its notification in the notification buffer if it is non-NULL.
+ * The event contains the files committed, in the upload order. The number of
+ * files committed is returned.
+ */
+static uint32_t kcdpg_write_upload_phase_two(kstr *ts, uint64_t kws_id, uint64_t date, uint32_t user_id,
+                                             uint32_t share_id, uint64_t commit_id, uint64_t public_email_id,
+                                             kbuffer *evt_buf, kbuffer *ntf_buf, kbuffer *tmp_buf,
+                                             uint32_t *evt_minor) {
+    uint32_t i, nb_commit;
+    
+    *evt_minor = 1;
+    
+    kstr_sf(ts, "SELECT inode, size, hash, create_flag, share_path FROM kcd_kws_kfs_upload_file "
+                "WHERE kws_id = "PRINTF_64"u AND share_id = %u AND commit_id = "PRINTF_64"u AND status = 1 "
+                "ORDER BY file_index", kws_id, share_id, commit_id);
     kcdpg_exec_query(ts->data);
+    nb_commit = SPI_processed;
+    
+    anp_write_uint64(evt_buf, kws_id);
+    anp_write_uint64(evt_buf, date);
+    anp_write_uint32(evt_buf, user_id);
+    anp_write_uint32(evt_buf, share_id);
+    anp_write_uint64(evt_buf, commit_id);
+    anp_write_uint32(evt_buf, nb_commit);
+    
+    if (ntf_buf) {
+        anp_write_uint64(ntf_buf, public_email_id);
+        anp_write_uint32(ntf_buf, nb_commit);
+    }
+    
+    for (i = 0; i < nb_commit; i++) {
+        anp_write_uint64(evt_buf, kcdpg_get_uint64(i, 0));
+        anp_write_uint64(evt_buf, kcdpg_get_uint64(i, 1));
+        kcdpg_get_bytea(i, 2, tmp_buf);
+        anp_write_bin(evt_buf, tmp_buf);
+        
+        /* Old clients only understand MD5 hashes. */
+        if (tmp_buf->len != 16) *evt_minor = 8;
+        
+        if (ntf_buf) {
+            anp_write_uint32(ntf_buf, kcdpg_get_uint32(i, 3));
+            anp_write_cstr(ntf_buf, kcdpg_row_val(i, 4));
+        }
+    }
+    
+    return nb_commit;
 }
 
-/* Notify the listeners of the perm_check relation. */
-static void notify_perm_check(kstr *ts, uint64_t kws_id) { 
-    kstr_sf(ts, "NOTIFY kws_"PRINTF_64"u_perm_check", kws_id);
+/* This function returns the size of the data received by the other
+ * connections than the one specified for the files of the upload that are not
+ * yet committed.
+ */
+static uint64_t kcdpg_get_upload_stream_size(kstr *ts, uint64_t kws_id, uint32_t share_id, uint64_t commit_id,
+                                             uint64_t stream_id) {
+    kstr_sf(ts, "SELECT coalesce(sum(size), 0) FROM kcd_kws_kfs_upload_file WHERE kws_id = "PRINTF_64"u "
+                "AND share_id = %u AND commit_id = "PRINTF_64"u AND status = 0 AND stream_id <> "PRINTF_64"u",
+                kws_id, share_id, commit_id, stream_id);
+    kcdpg_exec_query(ts->data);
+    return kcdpg_get_uint64(0, 0);
+}
+
+/* Notify the listeners of the event log. */
+static void kcdpg_notify_evt(kstr *ts, uint64_t kws_id) { 
+    kstr_sf(ts, "NOTIFY kws_"PRINTF_64"u_event_log", kws_id);
     kcdpg_exec_query(ts->data);
 }
 
-/* This function posts an event in the event log. The event log is locked and
- * notified. The event ID is returned.
+/* This function posts an event in the event log. The event log is locked by
+ * the allocation of the event ID and it is notified. The event ID is returned.
  */
 static uint64_t kcdpg_post_event_internal(kstr *ts, uint64_t kws_id, uint32_t evt_minor, uint32_t evt_type,
                                           kbuffer *evt_payload) {
     uint64_t evt_id;
+    Datum values[7];
     
     KCDPG_DEBUG("Posting event of type %u in workspace "PRINTF_64"u.", evt_type, kws_id);
      
-    /* Lock the event log. */
-    kcdpg_lock_evt(ts, kws_id);
-    
-    /* Get the next event ID. */
+    /* Lock the event log and get the next event ID. */
     evt_id = kcdpg_get_next_seq_id(ts, kws_id, "event_log");
     
     /* Insert the event in the log. */
-    kstr_sf(ts, "INSERT INTO kcd_kws_event_log (kws_id, evt_id, major, minor, type, event) VALUES (");
-    kcdpg_add_uint64(ts, kws_id); kstr_append_cstr(ts, ", ");
-    kcdpg_add_uint64(ts, evt_id); kstr_append_cstr(ts, ", ");
-    kcdpg_add_uint32(ts, 0); kstr_append_cstr(ts, ", ");
-    kcdpg_add_uint32(ts, evt_minor); kstr_append_cstr(ts, ", ");
-    kcdpg_add_uint32(ts, evt_type); kstr_append_cstr(ts, ", ");
-    kcdpg_add_bytea(ts, evt_payload); kstr_append_cstr(ts, ")");
-    kcdpg_exec_query(ts->data);
+    values[0] = kcdpg_int_datum(kws_id);
+    values[1] = kcdpg_int_datum(evt_id);
+    values[2] = kcdpg_int_datum(0);
+    values[3] = kcdpg_int_datum(evt_minor);
+    values[4] = kcdpg_int_datum(evt_type);
+    values[5] = kcdpg_bytea_datum(evt_payload);
+    values[6] = kcdpg_int_datum(ktime_now_sec());
+    kcdpg_exec_plan(KCDPG_PLAN_INSERT_EVENT, values);
     
     /* Notify the listeners. */
     kcdpg_notify_evt(ts, kws_id);
@@ -978,6 +1251,7 @@ static uint64_t kcdpg_post_event_internal(kstr *ts, uint64_t kws_id, uint32_t ev
 static uint64_t kcdpg_post_notif(kstr *ts, uint64_t kws_id, uint64_t evt_id, uint64_t date, uint32_t user_id,
                                  uint32_t type, kbuffer *payload) {
     uint64_t notif_id;
+    Datum values[7];
     
     KCDPG_DEBUG("Posting notification of type %u in workspace "PRINTF_64"u.", type, kws_id);
      
@@ -985,20 +1259,103 @@ static uint64_t kcdpg_post_notif(kstr *ts, uint64_t kws_id, uint64_t evt_id, uin
     notif_id = kcdpg_get_next_seq_id(ts, kws_id, "notif_log");
     
     /* Insert the notification in the log. */
-    kstr_sf(ts, "INSERT INTO kcd_kws_notif_log (kws_id, notif_id, evt_id, date, user_id, type, payload) "
-                "VALUES (");
-    kcdpg_add_uint64(ts, kws_id); kstr_append_cstr(ts, ", ");
-    kcdpg_add_uint64(ts, notif_id); kstr_append_cstr(ts, ", ");
-    kcdpg_add_uint64(ts, evt_id); kstr_append_cstr(ts, ", ");
-    kcdpg_add_uint64(ts, date); kstr_append_cstr(ts, ", ");
-    kcdpg_add_uint32(ts, user_id); kstr_append_cstr(ts, ", ");
-    kcdpg_add_uint32(ts, type); kstr_append_cstr(ts, ", ");
-    kcdpg_add_bytea(ts, payload); kstr_append_cstr(ts, ")");
-    kcdpg_exec_query(ts->data);
+    values[0] = kcdpg_int_datum(kws_id);
+    values[1] = kcdpg_int_datum(notif_id);
+    values[2] = kcdpg_int_datum(evt_id);
+    values[3] = kcdpg_int_datum(date);
+    values[4] = kcdpg_int_datum(user_id);
+    values[5] = kcdpg_int_datum(type);
+    values[6] = kcdpg_bytea_datum(payload);
+    kcdpg_exec_plan(KCDPG_PLAN_INSERT_NOTIF, values);
     
     return notif_id;
 }
 
+static void kcdpg_evt_batch_init(struct kcdpg_evt_batch *self) {
+    memset(self, 0, sizeof(struct kcdpg_evt_batch));
+    karray_init(&self->evt_array);
+}
+
+static void kcdpg_evt_batch_clean(struct kcdpg_evt_batch *self) {
+    int i;
+    
+    for (i = 0; i < self->evt_array.size; i++) {
+        struct kcdpg_batch_evt *e = self->evt_array.data[i];
+        kbuffer_clean(&e->payload);
+        kfree(e);
+    }
+    
+    karray_clean(&self->evt_array);
+}
+
+/* This function writes the events of the batch in the event log and notifies
+ * the listeners once. The event log is locked by the reservation of the event
+ * IDs. The events get consecutive IDs in the order they were added. The ID of
+ * the first event is returned, or 0 if the batch is empty.
+ */
+static uint64_t kcdpg_evt_batch_flush(kstr *ts, struct kcdpg_evt_batch *self) {
+    uint32_t i, nb_evt = self->nb_evt;
+    uint64_t first_evt_id;
+    Datum values[6];
+    Datum *minor_values, *type_values, *payload_values;
+    
+    if (!nb_evt) return 0;
+    
+    KCDPG_DEBUG("Posting %u events in workspace "PRINTF_64"u.", nb_evt, self->kws_id);
+    
+    /* Lock the event log and reserve the event IDs. */
+    first_evt_id = kcdpg_reserve_seq_ids(ts, self->kws_id, "event_log", nb_evt);
+    
+    /* Insert the events in the log. */
+    minor_values = palloc(nb_evt * sizeof(Datum));
+    type_values = palloc(nb_evt * sizeof(Datum));
+    payload_values = palloc(nb_evt * sizeof(Datum));
+    
+    for (i = 0; i < nb_evt; i++) {
+        struct kcdpg_batch_evt *e = self->evt_array.data[i];
+        minor_values[i] = kcdpg_int_datum(e->minor);
+        type_values[i] = kcdpg_int_datum(e->type);
+        payload_values[i] = kcdpg_bytea_datum(&e->payload);
+    }
+    
+    values[0] = kcdpg_int_datum(self->kws_id);
+    values[1] = kcdpg_int_datum(first_evt_id);
+    values[2] = PointerGetDatum(construct_array(minor_values, nb_evt, INT8OID, 8, FLOAT8PASSBYVAL, 'd'));
+    values[3] = PointerGetDatum(construct_array(type_values, nb_evt, INT8OID, 8, FLOAT8PASSBYVAL, 'd'));
+    values[4] = PointerGetDatum(construct_array(payload_values, nb_evt, BYTEAOID, -1, false, 'i'));
+    values[5] = kcdpg_int_datum(ktime_now_sec());
+    kcdpg_exec_plan(KCDPG_PLAN_INSERT_EVENT_BATCH, values);
+    
+    /* Notify the listeners. */
+    kcdpg_notify_evt(ts, self->kws_id);
+    
+    self->nb_evt = 0;
+    return first_evt_id;
+}
+
+/* This function adds an event to the batch. The batch is flushed first if it
+ * contains the events of another workspace.
+ */
+static void kcdpg_evt_batch_add(kstr *ts, struct kcdpg_evt_batch *self, uint64_t kws_id, uint32_t evt_minor,
+                                uint32_t evt_type, kbuffer *evt_payload) {
+    struct kcdpg_batch_evt *e;
+    
+    if (self->nb_evt && self->kws_id != kws_id) kcdpg_evt_batch_flush(ts, self);
+    self->kws_id = kws_id;
+    
+    if (self->nb_evt == (uint32_t) self->evt_array.size) {
+        e = kcalloc(sizeof(struct kcdpg_batch_evt));
+        kbuffer_init(&e->payload);
+        karray_push(&self->evt_array, e);
+    }
+    
+    e = self->evt_array.data[self->nb_evt++];
+    e->minor = evt_minor;
+    e->type = evt_type;
+    kbuffer_reset(&e->payload);
+    kbuffer_write_buffer(&e->payload, evt_payload);
+}
+
 /* Helper for kcdpg_perm_check_*() functions. */
 static int kcdpg_internal_perm_check(int pred, char *what) {
     if (!pred) {
@@ -1082,13 +1439,16 @@ static int kcdpg_perm_check_kws_not_frozen(uint32_t kws_flags, uint32_t user_fla
  * user flags.
  */
 static int kcdpg_perm_check_user_exist(kstr *ts, uint64_t kws_id, uint32_t user_id, uint32_t *flags) {
+    Datum values[2];
+    
     if (!user_id) {
         if (flags) *flags = KCDPG_ROOT_USER_FLAGS;
         return 0;
     }
     
-    kstr_sf(ts, "SELECT flags FROM kcd_kws_users WHERE kws_id = "PRINTF_64"u AND user_id = %u", kws_id, user_id);
-    kcdpg_exec_query(ts->data);
+    values[0] = kcdpg_int_datum(kws_id);
+    values[1] = kcdpg_int_datum(user_id);
+    kcdpg_exec_plan(KCDPG_PLAN_GET_KWS_USER_FLAGS, values);
     
     if (!SPI_processed) {
         kmod_set_error("no such user");
@@ -1154,17 +1514,24 @@ static int kcdpg_perm_check_modify_target_user_prop(kstr *ts,
 
 /* Validate that the workspace specified exists, lock the workspace as
  * requested, obtain the workspace flags, verify that the user can log in if
- * requested and perform the workspace freeze check if requested.
+ * requested and perform the workspace freeze check if requested. The flags
+ * cached by KCD, if any, are used instead of reading them. The flags cannot be
+ * stale by more than the delivery delay of the perm_check notification.
  */
 static int kcdpg_perm_check_kws_bound(kstr *ts, struct kcdpg_kws_bound_state *wb,
                                       int write_lock_kws_flag, int freeze_check_flag, int login_check_flag) {
                                 
     /* Lock the workspace, if any. */
     if (kcdpg_perm_check_lock_kws(ts, wb->kws_id, write_lock_kws_flag, NULL)) return -1;
-    wb->kws_flags = kcdpg_get_kws_flags(ts, wb->kws_id);
     
-    /* Get the user. */
-    if (kcdpg_perm_check_user_exist(ts, wb->kws_id, wb->user_id, &wb->user_flags)) return -1;
+    if (!wb->perm_cached_flag) {
+        wb->kws_flags = kcdpg_get_kws_flags(ts, wb->kws_id);
+        
+        /* Get the user. */
+        if (kcdpg_perm_check_user_exist(ts, wb->kws_id, wb->user_id, &wb->user_flags)) return -1;
+    }
+    
+    wb->perm_valid_flag = 1;
     
     /* Perform the login check. */
     if (login_check_flag && kcdpg_perm_check_kws_login(wb->kws_flags, wb->login_type, wb->user_flags, NULL)) return -1;
@@ -1277,17 +1644,31 @@ static void kcdpg_kws_prop_change_user_flags(struct kcdpg_kws_prop_change_state
     anp_write_uint32(&self->change_buf, flags);
 }
 
-/* Post the event and return the event ID, if any. */
-static uint64_t kcdpg_kws_prop_change_post_event(struct kcdpg_kws_prop_change_state *self, uint64_t date) {
-    if (!self->nb_change) return 0;
+/* Format the event in evt_buf. */
+static void kcdpg_kws_prop_change_format_event(struct kcdpg_kws_prop_change_state *self, uint64_t date) {
+    kbuffer_reset(&self->evt_buf);
     anp_write_uint64(&self->evt_buf, self->kws_id);
     anp_write_uint64(&self->evt_buf, date);
     anp_write_uint32(&self->evt_buf, self->user_id);
     anp_write_uint32(&self->evt_buf, self->nb_change);
     kbuffer_write_buffer(&self->evt_buf, &self->change_buf);
+}
+
+/* Post the event and return the event ID, if any. */
+static uint64_t kcdpg_kws_prop_change_post_event(struct kcdpg_kws_prop_change_state *self, uint64_t date) {
+    if (!self->nb_change) return 0;
+    kcdpg_kws_prop_change_format_event(self, date);
     return kcdpg_post_event_internal(&self->ts, self->kws_id, 4, KANP_EVT_KWS_PROP_CHANGE, &self->evt_buf);
 }
 
+/* Add the event, if any, to the event batch specified. */
+static void kcdpg_kws_prop_change_batch_event(struct kcdpg_kws_prop_change_state *self, uint64_t date,
+                                              struct kcdpg_evt_batch *batch) {
+    if (!self->nb_change) return;
+    kcdpg_kws_prop_change_format_event(self, date);
+    kcdpg_evt_batch_add(&self->ts, batch, self->kws_id, 4, KANP_EVT_KWS_PROP_CHANGE, &self->evt_buf);
+}
+
 
 /* Create a new workspace:
  *   BIN    Command buffer.
@@ -1401,7 +1782,7 @@ static void kcdpg_mgt_cmd_create_kws_create(struct kcdpg_cmd_mgt_create_kws_stat
     uint32_t i;
     kstr *ts = &st->ts, *ts2 = &st->ts2, *ts3 = &st->ts3;
     struct kcd_mgt_user_ticket *pt = &st->parsed_ticket;
-    static char *lock_list[] = { "kws", "kfs", "event_log" };
+    static char *lock_list[] = { "kws", "kfs" };
     static char *seq_list[] = { "user", "event_log", "notif_log", "kfs_commit", "kfs_inode", "vnc_session",
                                 "skurl_req_id" };
     
@@ -1840,6 +2221,9 @@ KCDPG_QUERY_START(register_kws_user)
         elog(ERROR, "bad register_kws_user argument: %s", kmod_strerror());
     }
     
+    /* The user flags are modified below, don't trust the cached flags. */
+    wb->perm_cached_flag = 0;
+    
     if (kcdpg_perm_check_kws_bound(ts, wb, 1, 0, 1)) {
         error = kcdpg_handle_kws_bound_perm_error(wb);
         break;
@@ -1961,6 +2345,7 @@ KCDPG_QUERY_STRUCT(cmd_mgt_invite_kws)
     kstr sender_name;
     kstr sender_email;
     struct kcdpg_kws_prop_change_state *pcs;
+    struct kcdpg_evt_batch evt_batch;
     
 KCDPG_QUERY_INIT(cmd_mgt_invite_kws, 1)
     karray_init(&self->user_array);
@@ -1970,6 +2355,7 @@ KCDPG_QUERY_INIT(cmd_mgt_invite_kws, 1)
     kstr_init(&self->root_email);
     kstr_init(&self->sender_name);
     kstr_init(&self->sender_email);
+    kcdpg_evt_batch_init(&self->evt_batch);
     
 KCDPG_QUERY_CLEAN(cmd_mgt_invite_kws)
     int i;
@@ -1982,6 +2368,7 @@ KCDPG_QUERY_CLEAN(cmd_mgt_invite_kws)
     kstr_clean(&self->sender_name);
     kstr_clean(&self->sender_email);
     kcdpg_kws_prop_change_state_destroy(self->pcs);
+    kcdpg_evt_batch_clean(&self->evt_batch);
     
 KCDPG_QUERY_STATIC
     
@@ -2205,7 +2592,7 @@ static void kcdpg_cmd_mgt_invite_kws_process_post_event(struct kcdpg_cmd_mgt_inv
             anp_write_kstr(&st->evt_buf, &iu->org_name);
         }
         
-        kcdpg_post_event_internal(&st->ts, wb->kws_id, evt_minor, KANP_EVT_KWS_INVITED, &st->evt_buf);
+        kcdpg_evt_batch_add(&st->ts, &st->evt_batch, wb->kws_id, evt_minor, KANP_EVT_KWS_INVITED, &st->evt_buf);
     }
     
     /* Process the banned users. */
@@ -2216,8 +2603,10 @@ static void kcdpg_cmd_mgt_invite_kws_process_post_event(struct kcdpg_cmd_mgt_inv
             kcdpg_kws_prop_change_user_flags(st->pcs, iu->user_id, iu->user_flags);
         }
         
-        kcdpg_kws_prop_change_post_event(st->pcs, wb->date);
+        kcdpg_kws_prop_change_batch_event(st->pcs, wb->date, &st->evt_batch);
     }
+    
+    kcdpg_evt_batch_flush(&st->ts, &st->evt_batch);
 
 KCDPG_QUERY_START(cmd_mgt_invite_kws)
     int i;
@@ -2298,11 +2687,13 @@ KCDPG_QUERY_START(delete_kws)
                                    "kcd_sequences",
                                    "kcd_kws_event_log",
                                    "kcd_kws_notif_log",
+                                   "kcd_kws_log_retention",
                                    "kcd_kws_trusted_key",
                                    "kcd_kws_users",
                                    "kcd_kws_user_invitation",
                                    "kcd_kws_login_ticket", 
                                    "kcd_kws_kfs_upload",
+                                   "kcd_kws_kfs_upload_file",
                                    "kcd_kws_kfs_download",
                                    "kcd_kws_kfs_limit",
                                    "kcd_kws_kfs_current_view",
@@ -2777,6 +3168,7 @@ static void kcdpg_phase_one_move_arg_destroy(struct kcdpg_phase_one_move_arg *se
 
 /* Handle KFS upload phase 1 (workspace-bound query):
  *   UINT32 Share ID.
+ *   UINT64 Stream ID, which identifies the connection uploading the files.
  *
  * Output:
  *   UINT64 Commit ID.
@@ -2794,6 +3186,9 @@ KCDPG_QUERY_STRUCT(upload_phase_one)
     /* KFS share ID. */
     uint32_t share_id;
     
+    /* ID of the connection performing the upload. */
+    uint64_t stream_id;
+    
     /* Public email ID related to the upload. */
     uint64_t public_email_id;
     
@@ -2917,6 +3312,19 @@ static void kcdpg_phase_one_handle_upload(struct kcdpg_upload_phase_one_state *s
     kstr_append_cstr(ts, ")");
     kcdpg_exec_query(ts->data);
     
+    /* Insert the file in the upload file table. The file is uploaded by this
+     * connection.
+     */
+    kstr_sf(ts, "INSERT INTO kcd_kws_kfs_upload_file (kws_id, share_id, commit_id, file_index, inode, create_flag, "
+                "share_path, perm_path, status, stream_id, stream_date, size) "
+                "VALUES ("PRINTF_64"u, %u, "PRINTF_64"u, %u, "PRINTF_64"u, %d, ",
+                st->wb->kws_id, st->share_id, st->local_commit_id, st->nb_upload, new_inode, create_flag);
+    kcdpg_add_str(ts, &st->share_path);
+    kstr_append_cstr(ts, ", ");
+    kcdpg_add_str(ts, &st->perm_path);
+    kstr_append_sf(ts, ", 0, "PRINTF_64"u, "PRINTF_64"u, 0)", st->stream_id, st->wb->date);
+    kcdpg_exec_query(ts->data);
+    
     /* Write the inode number and the paths in the upload buffer. */
     st->nb_upload++;
     anp_write_uint32(&st->upload_buf, create_flag);
@@ -3268,6 +3676,7 @@ static int kcdpg_phase_one_parse_cmd(struct kcdpg_upload_phase_one_state *st) {
     
     for (i = 0; i < st->nb_change_req; i++) {
         uint32_t op, ignored;
+        uint64_t run[4];
         
         if (anp_read_uint32(buf, &ignored) ||
             anp_read_uint32(buf, &op)) return -1;
@@ -3275,35 +3684,39 @@ static int kcdpg_phase_one_parse_cmd(struct kcdpg_upload_phase_one_state *st) {
         if (op == KANP_KFS_OP_CREATE_FILE || op == KANP_KFS_OP_CREATE_DIR) {
             struct kcdpg_phase_one_create_arg *a = kcdpg_phase_one_create_arg_new(op);
             kcdpg_phase_one_add_op(st, a, kcdpg_phase_one_op_create, kcdpg_phase_one_create_arg_destroy);
-            if (anp_read_uint64(buf, &a->parent_inode) ||
-                anp_read_uint64(buf, &a->parent_commit_id) ||
+            if (anp_read_uint64_array(buf, run, 2) ||
                 anp_read_kstr(buf, &a->entry_path) ||
                 !kcd_kfs_is_path_valid(&a->entry_path)) return -1;
+            a->parent_inode = run[0];
+            a->parent_commit_id = run[1];
         }
         
         else if (op == KANP_KFS_OP_UPDATE_FILE) {
             struct kcdpg_phase_one_update_arg *a = kcdpg_phase_one_update_arg_new();
             kcdpg_phase_one_add_op(st, a, kcdpg_phase_one_op_update, kcdpg_phase_one_update_arg_destroy);
-            if (anp_read_uint64(buf, &a->inode) ||
-                anp_read_uint64(buf, &a->commit_id)) return -1;
+            if (anp_read_uint64_array(buf, run, 2)) return -1;
+            a->inode = run[0];
+            a->commit_id = run[1];
         }
         
         else if (op == KANP_KFS_OP_DELETE_FILE || op == KANP_KFS_OP_DELETE_DIR) {
             struct kcdpg_phase_one_delete_arg *a = kcdpg_phase_one_delete_arg_new(op);
             kcdpg_phase_one_add_op(st, a, kcdpg_phase_one_op_delete, kcdpg_phase_one_delete_arg_destroy);
-            if (anp_read_uint64(buf, &a->inode) ||
-                anp_read_uint64(buf, &a->commit_id)) return -1;
+            if (anp_read_uint64_array(buf, run, 2)) return -1;
+            a->inode = run[0];
+            a->commit_id = run[1];
         }
         
         else if (op == KANP_KFS_OP_MOVE_FILE || op == KANP_KFS_OP_MOVE_DIR) {
             struct kcdpg_phase_one_move_arg *a = kcdpg_phase_one_move_arg_new(op);
             kcdpg_phase_one_add_op(st, a, kcdpg_phase_one_op_move, kcdpg_phase_one_move_arg_destroy);
-            if (anp_read_uint64(buf, &a->move_inode) ||
-                anp_read_uint64(buf, &a->move_commit_id) ||
-                anp_read_uint64(buf, &a->parent_inode) ||
-                anp_read_uint64(buf, &a->parent_commit_id) ||
+            if (anp_read_uint64_array(buf, run, 4) ||
                 anp_read_kstr(buf, &a->entry_path) ||
                 !kcd_kfs_is_path_valid(&a->entry_path)) return -1;
+            a->move_inode = run[0];
+            a->move_commit_id = run[1];
+            a->parent_inode = run[2];
+            a->parent_commit_id = run[3];
         }
         
         else {
@@ -3318,7 +3731,8 @@ KCDPG_QUERY_START(upload_phase_one)
     uint32_t i;
     
     /* Retrieve the arguments. */
-    if (anp_read_uint32(&st.arg_buf, &st.share_id)) {
+    if (anp_read_uint32(&st.arg_buf, &st.share_id) ||
+        anp_read_uint64(&st.arg_buf, &st.stream_id)) {
         elog(ERROR, "bad upload_phase_one argument: %s", kmod_strerror());
     }
     
@@ -3390,9 +3804,9 @@ KCDPG_QUERY_START(upload_phase_one)
     
     /* We must update the uploader table. */
     if (st.nb_upload) {
-        kstr_sf(ts, "INSERT INTO kcd_kws_kfs_upload (kws_id, share_id, user_id, commit_id, timestamp) "
-                    "VALUES ("PRINTF_64"u, %u, %u, "PRINTF_64"u, "PRINTF_64"u)",
-                    wb->kws_id, st.share_id, wb->user_id, st.local_commit_id, wb->date);
+        kstr_sf(ts, "INSERT INTO kcd_kws_kfs_upload (kws_id, share_id, user_id, commit_id, timestamp, public_email_id) "
+                    "VALUES ("PRINTF_64"u, %u, %u, "PRINTF_64"u, "PRINTF_64"u, "PRINTF_64"u)",
+                    wb->kws_id, st.share_id, wb->user_id, st.local_commit_id, wb->date, st.public_email_id);
         kcdpg_exec_query(ts->data);
     }
     
@@ -3410,55 +3824,61 @@ KCDPG_QUERY_START(upload_phase_one)
 KCDPG_QUERY_END(upload_phase_one)
 
 
-/* Handle KFS upload phase 2 (workspace-bound query):
+/* Commit or abort a file of a KFS upload (workspace-bound query):
  *   UINT32 Share ID.
  *   UINT64 Commit ID.
- *   UINT32 Public email ID.
- *   BIN    Event buffer.
- *   BIN    Notification buffer.
- *   UINT32 Number of commits.
- *     UINT64 Inode.
- *     UINT64 Size.
+ *   UINT64 Stream ID.
+ *   UINT64 Inode.
+ *   UINT32 Commit flag (1 if the file is committed, 0 if it is aborted).
+ *   UINT64 Size.
+ *   BIN    Hash.
+ *   STR    Blob name.
+ *
+ * Output:
+ *   UINT32 True if the file was the last file of the upload.
+ *
+ * The phase 2 event is posted when the last file of the upload is committed or
+ * aborted, by whichever connection uploads it.
  */
-KCDPG_QUERY_STRUCT(upload_phase_two)
+KCDPG_QUERY_STRUCT(upload_commit_file)
     
-    /* KFS share and user information. */
-    uint64_t total_size;
-    uint64_t commit_id;
-    uint64_t public_email_id;
+    /* KFS share and file information. */
     uint32_t share_id;
+    uint64_t commit_id;
+    uint64_t stream_id;
+    uint64_t inode;
+    uint32_t commit_flag;
+    uint64_t size;
+    kbuffer hash;
+    kstr blob;
     
-    /* Array of uploaded files. */
-    karray upload_array;
+    /* Temporary buffer. */
+    kbuffer tmp_buf;
     
-KCDPG_QUERY_INIT(upload_phase_two, 1)
-    karray_init(&self->upload_array);
+KCDPG_QUERY_INIT(upload_commit_file, 1)
+    kbuffer_init(&self->hash);
+    kstr_init(&self->blob);
+    kbuffer_init(&self->tmp_buf);
     
-KCDPG_QUERY_CLEAN(upload_phase_two)
-    uint32_t i;
-    for (i = 0; i < (uint32_t) self->upload_array.size; i++) kcd_kfs_uploaded_file_destroy(self->upload_array.data[i]);
-    karray_clean(&self->upload_array);
+KCDPG_QUERY_CLEAN(upload_commit_file)
+    kbuffer_clean(&self->hash);
+    kstr_clean(&self->blob);
+    kbuffer_clean(&self->tmp_buf);
     
-KCDPG_QUERY_START(upload_phase_two)
-    uint32_t i, nb_file;
-    uint64_t evt_id;
+KCDPG_QUERY_START(upload_commit_file)
+    uint32_t nb_commit, evt_minor;
+    uint64_t evt_id, public_email_id;
     
     /* Retrieve the arguments. */
     if (anp_read_uint32(&st.arg_buf, &st.share_id) ||
         anp_read_uint64(&st.arg_buf, &st.commit_id) ||
-        anp_read_uint64(&st.arg_buf, &st.public_email_id) ||
-        anp_read_bin(&st.arg_buf, &st.evt_buf) ||
-        anp_read_bin(&st.arg_buf, &st.ntf_buf) ||
-        anp_read_uint32(&st.arg_buf, &nb_file)) {
-        elog(ERROR, "bad upload_phase_two argument: %s", kmod_strerror());
-    }
-    
-    for (i = 0; i < nb_file; i++) {
-        struct kcd_kfs_uploaded_file *f = kcd_kfs_uploaded_file_new();
-        karray_push(&st.upload_array, f);
-        anp_read_uint64(&st.arg_buf, &f->inode);
-        anp_read_uint64(&st.arg_buf, &f->size);
-        st.total_size += f->size;
+        anp_read_uint64(&st.arg_buf, &st.stream_id) ||
+        anp_read_uint64(&st.arg_buf, &st.inode) ||
+        anp_read_uint32(&st.arg_buf, &st.commit_flag) ||
+        anp_read_uint64(&st.arg_buf, &st.size) ||
+        anp_read_bin(&st.arg_buf, &st.hash) ||
+        anp_read_kstr(&st.arg_buf, &st.blob)) {
+        elog(ERROR, "bad upload_commit_file argument: %s", kmod_strerror());
     }
     
     /* Lock the KFS application. We skip some permission checks since the event
@@ -3476,48 +3896,231 @@ KCDPG_QUERY_START(upload_phase_two)
         break;
     }
     
-    KCDPG_DEBUG("Uploader still exists, removing entry and posting event.");
+    /* Update the file. It must be uploaded by this connection. */
+    kstr_sf(ts, "UPDATE kcd_kws_kfs_upload_file SET status = %d, size = "PRINTF_64"u, hash = ",
+                st.commit_flag ? 1 : 2, st.commit_flag ? st.size : 0);
+    kcdpg_add_bytea(ts, &st.hash);
+    kstr_append_cstr(ts, ", blob = ");
+    kcdpg_add_str(ts, &st.blob);
+    kstr_append_sf(ts, " WHERE kws_id = "PRINTF_64"u AND share_id = %u AND commit_id = "PRINTF_64"u "
+                       "AND inode = "PRINTF_64"u AND status = 0 AND stream_id = "PRINTF_64"u",
+                       wb->kws_id, st.share_id, st.commit_id, st.inode, st.stream_id);
+    kcdpg_exec_query(ts->data);
     
-    /* Update the individual file sizes. */
-    for (i = 0; i < nb_file; i++) {
-        struct kcd_kfs_uploaded_file *f = st.upload_array.data[i];
-        kstr_sf(ts, "UPDATE kcd_kws_kfs_file_map SET size = "PRINTF_64"u "
-                    "WHERE kws_id = "PRINTF_64"u AND share_id = %u AND inode = "PRINTF_64"u",
-                    f->size, wb->kws_id, st.share_id, f->inode);
+    if (SPI_processed != 1) {
+        kmod_set_error("file with inode "PRINTF_64"u is not uploaded by this connection", st.inode);
+        error = -1;
+        break;
+    }
+    
+    /* Update the file size and blob, and the total file size. */
+    if (st.commit_flag) {
+        kstr_sf(ts, "UPDATE kcd_kws_kfs_file_map SET size = "PRINTF_64"u, blob = ", st.size);
+        kcdpg_add_str(ts, &st.blob);
+        kstr_append_sf(ts, " WHERE kws_id = "PRINTF_64"u AND share_id = %u AND inode = "PRINTF_64"u",
+                       wb->kws_id, st.share_id, st.inode);
+        kcdpg_exec_query(ts->data);
+        
+        kstr_sf(ts, "UPDATE kcd_kws_kfs_limit SET file_size = file_size + "PRINTF_64"u WHERE kws_id = "PRINTF_64"u",
+                    st.size, wb->kws_id);
         kcdpg_exec_query(ts->data);
     }
     
-    /* Update the total file size. */
-    kstr_sf(ts, "UPDATE kcd_kws_kfs_limit SET file_size = file_size + "PRINTF_64"u WHERE kws_id = "PRINTF_64"u",
-                st.total_size, wb->kws_id);
+    /* Some files are still being uploaded. */
+    kstr_sf(ts, "SELECT file_index FROM kcd_kws_kfs_upload_file WHERE kws_id = "PRINTF_64"u AND share_id = %u "
+                "AND commit_id = "PRINTF_64"u AND status = 0 LIMIT 1", wb->kws_id, st.share_id, st.commit_id);
+    kcdpg_exec_query(ts->data);
+    
+    if (SPI_processed) {
+        anp_write_uint32(&st.ext_buf, 0);
+        break;
+    }
+    
+    KCDPG_DEBUG("Last file of the upload, removing entry and posting event.");
+    
+    kstr_sf(ts, "SELECT public_email_id FROM kcd_kws_kfs_upload WHERE kws_id = "PRINTF_64"u AND share_id = %u "
+                "AND commit_id = "PRINTF_64"u", wb->kws_id, st.share_id, st.commit_id);
     kcdpg_exec_query(ts->data);
+    public_email_id = kcdpg_get_uint64(0, 0);
+    
+    nb_commit = kcdpg_write_upload_phase_two(ts, wb->kws_id, wb->date, wb->user_id, st.share_id, st.commit_id,
+                                             public_email_id, &st.evt_buf, &st.ntf_buf, &st.tmp_buf, &evt_minor);
     
     /* Remove the entry. */
     kcdpg_remove_uploader(ts, wb->kws_id, st.share_id, wb->user_id, st.commit_id);
     
     /* Post the event and the notification. */
-    evt_id = kcdpg_post_event_internal(ts, wb->kws_id, 1, KANP_EVT_KFS_PHASE_2, &st.evt_buf);
-    if (nb_file) kcdpg_post_notif(ts, wb->kws_id, evt_id, wb->date, wb->user_id, KANP_EVT_KFS_PHASE_2, &st.ntf_buf);
+    evt_id = kcdpg_post_event_internal(ts, wb->kws_id, evt_minor, KANP_EVT_KFS_PHASE_2, &st.evt_buf);
+    if (nb_commit) kcdpg_post_notif(ts, wb->kws_id, evt_id, wb->date, wb->user_id, KANP_EVT_KFS_PHASE_2, &st.ntf_buf);
+    
+    anp_write_uint32(&st.ext_buf, 1);
+
+KCDPG_QUERY_END(upload_commit_file)
+
+
+/* Join a KFS upload in progress (workspace-bound query):
+ *   UINT32 Share ID.
+ *   UINT64 Stream ID, which identifies the connection uploading the files.
+ *
+ * The command is KANP_CMD_KFS_UPLOAD_JOIN. The files requested must not be
+ * uploaded by another connection, unless that connection stopped refreshing
+ * them.
+ *
+ * Output:
+ *   UINT64 Commit ID.
+ *   UINT64 Public email ID.
+ *   UINT32 Number of files to upload.
+ *     UINT32 Create flag.
+ *     UINT64 Inode.
+ *     STR    Path in KFS share.
+ *     STR    Permanent path on storage filesystem.
+ *   UINT64 Size of the data received by the other connections.
+ */
+KCDPG_QUERY_STRUCT(join_upload)
+    uint32_t share_id;
+    uint64_t stream_id;
+    uint64_t commit_id;
+    uint32_t nb_upload;
+    
+KCDPG_QUERY_INIT(join_upload, 1)
+KCDPG_QUERY_CLEAN(join_upload)
+
+KCDPG_QUERY_START(join_upload)
+    uint32_t i;
+    uint64_t inode;
+    kbuffer *cmd_buf = &wb->cmd_buf;
+    
+    /* Retrieve the arguments. */
+    if (anp_read_uint32(&st.arg_buf, &st.share_id) ||
+        anp_read_uint64(&st.arg_buf, &st.stream_id)) {
+        elog(ERROR, "bad join_upload argument: %s", kmod_strerror());
+    }
+    
+    /* Read the command arguments. */
+    if (anp_read_bin(cmd_buf, &st.tb) ||
+        anp_read_uint64(cmd_buf, &st.commit_id) ||
+        anp_read_uint32(cmd_buf, &st.nb_upload)) {
+        error = -1;
+        break;
+    }
+    
+    if (st.nb_upload > (uint32_t) (cmd_buf->len - cmd_buf->pos) / 9) {
+        kmod_set_error("list of files truncated");
+        error = -1;
+        break;
+    }
+    
+    /* Lock the KFS application. */
+    if (kcpdg_perm_check_kws_bound_kfs(ts, wb, 1, 1, 1)) {
+        error = kcdpg_handle_kws_bound_perm_error(wb);
+        break;
+    }
+    
+    /* The uploader no longer exists. Report failure. */
+    if (!kcdpg_uploader_exist(ts, wb->kws_id, st.share_id, wb->user_id, st.commit_id, NULL)) {
+        kmod_set_error("the upload no longer exists");
+        anp_write_uint32(kcdpg_kws_bound_failure(wb), KANP_RES_FAIL_GEN);
+        anp_write_kstr(&wb->res_buf, kmod_kstrerror());
+        error = -2;
+        break;
+    }
+    
+    /* Refresh the entry. */
+    kstr_sf(ts, "UPDATE kcd_kws_kfs_upload SET timestamp = "PRINTF_64"u "
+                "WHERE kws_id = "PRINTF_64"u AND share_id = %u AND user_id = %u AND commit_id = "PRINTF_64"u",
+                wb->date, wb->kws_id, st.share_id, wb->user_id, st.commit_id);
+    kcdpg_exec_query(ts->data);
+    
+    kstr_sf(ts, "SELECT public_email_id FROM kcd_kws_kfs_upload WHERE kws_id = "PRINTF_64"u AND share_id = %u "
+                "AND commit_id = "PRINTF_64"u", wb->kws_id, st.share_id, st.commit_id);
+    kcdpg_exec_query(ts->data);
+    anp_write_uint64(&st.ext_buf, st.commit_id);
+    anp_write_uint64(&st.ext_buf, kcdpg_get_uint64(0, 0));
+    anp_write_uint32(&st.ext_buf, st.nb_upload);
+    
+    /* Take the files. */
+    for (i = 0; i < st.nb_upload; i++) {
+        if (anp_read_uint64(cmd_buf, &inode)) {
+            error = -1;
+            break;
+        }
+        
+        kstr_sf(ts, "UPDATE kcd_kws_kfs_upload_file SET stream_id = "PRINTF_64"u, stream_date = "PRINTF_64"u "
+                    "WHERE kws_id = "PRINTF_64"u AND share_id = %u AND commit_id = "PRINTF_64"u "
+                    "AND inode = "PRINTF_64"u AND status = 0 AND (stream_id = 0 OR stream_date < "PRINTF_64"u) "
+                    "RETURNING create_flag, share_path, perm_path",
+                    st.stream_id, wb->date, wb->kws_id, st.share_id, st.commit_id, inode,
+                    wb->date - KCDPG_UPLOAD_STREAM_LEASE);
+        kcdpg_exec_query(ts->data);
+        
+        if (SPI_processed != 1) {
+            kmod_set_error("file with inode "PRINTF_64"u cannot be uploaded", inode);
+            anp_write_uint32(kcdpg_kws_bound_failure(wb), KANP_RES_FAIL_GEN);
+            anp_write_kstr(&wb->res_buf, kmod_kstrerror());
+            error = -2;
+            
+            /* Release the files taken. */
+            kstr_sf(ts, "UPDATE kcd_kws_kfs_upload_file SET stream_id = 0 "
+                        "WHERE kws_id = "PRINTF_64"u AND share_id = %u AND commit_id = "PRINTF_64"u "
+                        "AND status = 0 AND stream_id = "PRINTF_64"u",
+                        wb->kws_id, st.share_id, st.commit_id, st.stream_id);
+            kcdpg_exec_query(ts->data);
+            break;
+        }
+        
+        anp_write_uint32(&st.ext_buf, kcdpg_get_uint32(0, 0));
+        anp_write_uint64(&st.ext_buf, inode);
+        anp_write_cstr(&st.ext_buf, kcdpg_row_val(0, 1));
+        anp_write_cstr(&st.ext_buf, kcdpg_row_val(0, 2));
+    }
+    
+    if (error) break;
+    
+    anp_write_uint64(&st.ext_buf, kcdpg_get_upload_stream_size(ts, wb->kws_id, st.share_id, st.commit_id,
+                                                               st.stream_id));
+    
+    /* Set the result type. */
+    wb->res_type = KANP_RES_KFS_UPLOAD_JOIN;
 
-KCDPG_QUERY_END(upload_phase_two)
+KCDPG_QUERY_END(join_upload)
 
 
 /* Refresh a KFS upload entry (workspace-bound query):
  *   UINT32 Share ID.
  *   UINT64 Commit ID.
+ *   UINT64 Stream ID.
+ *   UINT64 Inode of the file being uploaded, 0 if none.
+ *   UINT64 Size of the data received for that file.
+ *   UINT32 Number of files released by the connection.
+ *     UINT64 Inode.
+ *
+ * Output:
+ *   UINT64 Size of the data received by the other connections for the files of
+ *          the upload not yet committed.
  */
 KCDPG_QUERY_STRUCT(refresh_upload)
     uint64_t commit_id;
     uint32_t share_id;
+    uint64_t stream_id;
+    uint64_t inode;
+    uint64_t size;
+    uint32_t nb_release;
 
 KCDPG_QUERY_INIT(refresh_upload, 1)
 KCDPG_QUERY_CLEAN(refresh_upload)
 
 KCDPG_QUERY_START(refresh_upload)
     
+    uint32_t i;
+    uint64_t inode;
+    
     /* Retrieve the arguments. */
     if (anp_read_uint32(&st.arg_buf, &st.share_id) ||
-        anp_read_uint64(&st.arg_buf, &st.commit_id)) {
+        anp_read_uint64(&st.arg_buf, &st.commit_id) ||
+        anp_read_uint64(&st.arg_buf, &st.stream_id) ||
+        anp_read_uint64(&st.arg_buf, &st.inode) ||
+        anp_read_uint64(&st.arg_buf, &st.size) ||
+        anp_read_uint32(&st.arg_buf, &st.nb_release)) {
         elog(ERROR, "bad refresh_upload argument: %s", kmod_strerror());
     }
     
@@ -3541,6 +4144,36 @@ KCDPG_QUERY_START(refresh_upload)
                 "WHERE kws_id = "PRINTF_64"u AND share_id = %u AND user_id = %u AND commit_id = "PRINTF_64"u",
                 wb->date, wb->kws_id, st.share_id, wb->user_id, st.commit_id);
     kcdpg_exec_query(ts->data);
+    
+    /* Refresh the files uploaded by the connection. */
+    kstr_sf(ts, "UPDATE kcd_kws_kfs_upload_file SET stream_date = "PRINTF_64"u "
+                "WHERE kws_id = "PRINTF_64"u AND share_id = %u AND commit_id = "PRINTF_64"u AND stream_id = "PRINTF_64"u",
+                wb->date, wb->kws_id, st.share_id, st.commit_id, st.stream_id);
+    kcdpg_exec_query(ts->data);
+    
+    if (st.inode) {
+        kstr_sf(ts, "UPDATE kcd_kws_kfs_upload_file SET size = "PRINTF_64"u "
+                    "WHERE kws_id = "PRINTF_64"u AND share_id = %u AND commit_id = "PRINTF_64"u "
+                    "AND inode = "PRINTF_64"u AND status = 0 AND stream_id = "PRINTF_64"u",
+                    st.size, wb->kws_id, st.share_id, st.commit_id, st.inode, st.stream_id);
+        kcdpg_exec_query(ts->data);
+    }
+    
+    /* Release the files that the connection will not upload. */
+    for (i = 0; i < st.nb_release; i++) {
+        if (anp_read_uint64(&st.arg_buf, &inode)) {
+            elog(ERROR, "bad refresh_upload argument: %s", kmod_strerror());
+        }
+        
+        kstr_sf(ts, "UPDATE kcd_kws_kfs_upload_file SET stream_id = 0 "
+                    "WHERE kws_id = "PRINTF_64"u AND share_id = %u AND commit_id = "PRINTF_64"u "
+                    "AND inode = "PRINTF_64"u AND status = 0 AND stream_id = "PRINTF_64"u",
+                    wb->kws_id, st.share_id, st.commit_id, inode, st.stream_id);
+        kcdpg_exec_query(ts->data);
+    }
+    
+    anp_write_uint64(&st.ext_buf, kcdpg_get_upload_stream_size(ts, wb->kws_id, st.share_id, st.commit_id,
+                                                               st.stream_id));
 
 KCDPG_QUERY_END(refresh_upload)
 
@@ -3563,8 +4196,16 @@ KCDPG_QUERY_STRUCT(purge_upload)
      */
     struct krb_tree expired_tree;
     
+    /* Batch of the events posted in the workspace being purged. */
+    struct kcdpg_evt_batch evt_batch;
+    
+    /* Temporary buffer. */
+    kbuffer tmp_buf;
+    
 KCDPG_QUERY_INIT(purge_upload, 0)
     krb_tree_init_func(&self->expired_tree, kutil_uint64_cmp);
+    kcdpg_evt_batch_init(&self->evt_batch);
+    kbuffer_init(&self->tmp_buf);
 
 KCDPG_QUERY_CLEAN(purge_upload)
     uint32_t i, j, size; 
@@ -3580,9 +4221,11 @@ KCDPG_QUERY_CLEAN(purge_upload)
     }
     
     krb_tree_clean(&self->expired_tree);
+    kcdpg_evt_batch_clean(&self->evt_batch);
+    kbuffer_clean(&self->tmp_buf);
 
 KCDPG_QUERY_START(purge_upload)
-    uint32_t i, j, size;
+    uint32_t i, j, size, evt_minor;
     uint64_t now = ktime_now_sec(), expired_time;
     struct krb_node *iter, *node;
     karray *expired_array;
@@ -3638,21 +4281,24 @@ KCDPG_QUERY_START(purge_upload)
             /* The uploader still exists. */
             if (kcdpg_uploader_exist(ts, e->kws_id, e->share_id, e->user_id, e->commit_id, &e->timestamp)) {
                 KCDPG_DEBUG("Stale uploader exists, purging entry.");
+                
+                /* Prepare the event. The files committed before the upload
+                 * stalled are kept.
+                 */
+                kbuffer_reset(&st.evt_buf);
+                kcdpg_write_upload_phase_two(ts, e->kws_id, now, e->user_id, e->share_id, e->commit_id, 0,
+                                             &st.evt_buf, NULL, &st.tmp_buf, &evt_minor);
 
                 /* Remove the entry. */
                 kcdpg_remove_uploader(ts, e->kws_id, e->share_id, e->user_id, e->commit_id);
 
                 /* Post the event. */
-                kbuffer_reset(&st.evt_buf);
-                anp_write_uint64(&st.evt_buf, e->kws_id);
-                anp_write_uint64(&st.evt_buf, now);
-                anp_write_uint32(&st.evt_buf, e->user_id);
-                anp_write_uint32(&st.evt_buf, e->share_id);
-                anp_write_uint64(&st.evt_buf, e->commit_id);
-                anp_write_uint32(&st.evt_buf, 0);
-                kcdpg_post_event_internal(ts, e->kws_id, 1, KANP_EVT_KFS_PHASE_2, &st.evt_buf);
+                kcdpg_evt_batch_add(ts, &st.evt_batch, e->kws_id, evt_minor, KANP_EVT_KFS_PHASE_2, &st.evt_buf);
             }
         }
+        
+        /* Post the events of the workspace before locking the next one. */
+        kcdpg_evt_batch_flush(ts, &st.evt_batch);
     }
 
 KCDPG_QUERY_END(purge_upload)
@@ -3694,18 +4340,24 @@ KCDPG_QUERY_END(purge_att)
  *     UINT64 Commit ID.
  *
  * Output:
- *   Array of paths.
+ *   Array of paths, relative to the KFS directory. The path refers to the blob
+ *   of the file if it has one, otherwise to the file in the workspace
+ *   directory.
  */
 KCDPG_QUERY_STRUCT(download_file)
     uint32_t share_id;
     uint32_t nb_download;
     kbuffer path_buf;
+    
+    /* (inode, commit ID) pairs of the files to download. */
+    uint64_t *file_array;
 
 KCDPG_QUERY_INIT(download_file, 1)
     kbuffer_init(&self->path_buf);
 
 KCDPG_QUERY_CLEAN(download_file)
     kbuffer_clean(&self->path_buf);
+    if (self->file_array) kfree(self->file_array);
 
 KCDPG_QUERY_START(download_file)
     uint32_t i;
@@ -3721,15 +4373,22 @@ KCDPG_QUERY_START(download_file)
         elog(ERROR, "bad download_file() argument: %s", kmod_strerror());
     }
     
+    if (st.nb_download > (uint32_t) (st.arg_buf.len - st.arg_buf.pos) / 18) {
+        elog(ERROR, "bad download_file() argument: list of files truncated");
+    }
+    
+    st.file_array = kmalloc(MAX(st.nb_download, 1) * 2 * sizeof(uint64_t));
+    
+    if (anp_read_uint64_array(&st.arg_buf, st.file_array, st.nb_download * 2)) {
+        elog(ERROR, "bad download_file() argument: %s", kmod_strerror());
+    }
+    
     for (i = 0; i < st.nb_download; i++) {
-        uint64_t inode, commit_id;
+        uint64_t inode = st.file_array[i * 2], commit_id = st.file_array[i * 2 + 1];
         
-        if (anp_read_uint64(&st.arg_buf, &inode) ||
-            anp_read_uint64(&st.arg_buf, &commit_id)) {
-            elog(ERROR, "bad download_file() argument: %s", kmod_strerror());
-        }
+        char *blob;
         
-        kstr_sf(ts, "SELECT path FROM kcd_kws_kfs_file_map WHERE kws_id = "PRINTF_64"u AND "
+        kstr_sf(ts, "SELECT path, blob FROM kcd_kws_kfs_file_map WHERE kws_id = "PRINTF_64"u AND "
                     "share_id = %u AND inode = "PRINTF_64"u AND commit_id = "PRINTF_64"u",
                     wb->kws_id, st.share_id, inode, commit_id);
         kcdpg_exec_query(ts->data);
@@ -3740,7 +4399,12 @@ KCDPG_QUERY_START(download_file)
             break;
         }
         
-        anp_write_cstr(&st.ext_buf, kcdpg_row_val(0, 0));
+        blob = kcdpg_row_val(0, 1);
+        
+        if (*blob) kstr_sf(ts, "blob/%.2s/%s", blob, blob);
+        else kstr_sf(ts, PRINTF_64"u/%s", wb->kws_id, kcdpg_row_val(0, 0));
+        
+        anp_write_kstr(&st.ext_buf, ts);
     }
     
     if (error) break;
@@ -4361,6 +5025,9 @@ KCDPG_QUERY_START(handle_kws_prop_change)
         elog(ERROR, "bad handle_kws_prop_change argument: %s", kmod_strerror());
     }
     
+    /* The flags are modified below, don't trust the cached flags. */
+    wb->perm_cached_flag = 0;
+    
     /* Create the property change state object. */
     st.pcs = kcdpg_kws_prop_change_state_new(wb->kws_id, wb->user_id);
 
@@ -4536,3 +5203,264 @@ KCDPG_QUERY_START(get_usage_and_license_info)
     
 KCDPG_QUERY_END(get_usage_and_license_info)
 
+
+
+/* Return the execution statistics of the cached query plans of the backend
+ * (safe query).
+ *
+ * Output:
+ *   UINT32  Number of plans.
+ *   For each plan:
+ *     STR     Query text.
+ *     UINT32  True if the plan has been prepared.
+ *     UINT64  Number of executions.
+ */
+KCDPG_QUERY_STRUCT(get_plan_stats)
+
+KCDPG_QUERY_INIT(get_plan_stats, 0)
+
+KCDPG_QUERY_CLEAN(get_plan_stats)
+
+KCDPG_QUERY_START(get_plan_stats)
+    int i;
+    
+    anp_write_uint32(&st.ext_buf, KCDPG_PLAN_NB);
+    
+    for (i = 0; i < KCDPG_PLAN_NB; i++) {
+        struct kcdpg_plan *p = kcdpg_plan_table + i;
+        anp_write_cstr(&st.ext_buf, p->query);
+        anp_write_uint32(&st.ext_buf, p->plan != NULL);
+        anp_write_uint64(&st.ext_buf, p->nb_exec);
+    }
+    
+KCDPG_QUERY_END(get_plan_stats)
+
+
+/* This function sets the name of the archive partition of the event log that
+ * receives the events archived at the date specified.
+ */
+static void kcdpg_get_evt_partition_name(uint64_t date, kstr *name) {
+    time_t t = date;
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    kstr_sf(name, KCDPG_EVT_PARTITION_PREFIX"%04d%02d", tm.tm_year + 1900, tm.tm_mon + 1);
+}
+
+/* Archive the old events of the hot partition of the event log and delete the
+ * events of the hot partition and the notifications that are past their
+ * retention period (safe query):
+ *   UINT32 Maximum number of events to archive.
+ *
+ * Output:
+ *   UINT32 Number of events archived.
+ *   UINT32 Number of events deleted.
+ *   UINT32 Number of notifications deleted.
+ *
+ * The events are moved to the archive partition of the current month, which is
+ * created if needed. The archived events are not deleted here: the archive
+ * partitions are dropped as a whole once they expire (see
+ * drop_event_log_partition). The last event of a workspace is never deleted
+ * since its ID is used to check the consistency of the users' views.
+ */
+KCDPG_QUERY_STRUCT(compact_event_log)
+    uint32_t max_rows;
+    
+    /* Name of the archive partition of the current month. */
+    kstr partition;
+    
+    /* Query selecting the events to archive. */
+    kstr old_query;
+
+KCDPG_QUERY_INIT(compact_event_log, 0)
+    kstr_init(&self->partition);
+    kstr_init(&self->old_query);
+
+KCDPG_QUERY_CLEAN(compact_event_log)
+    kstr_clean(&self->partition);
+    kstr_clean(&self->old_query);
+
+KCDPG_QUERY_START(compact_event_log)
+    uint64_t now = ktime_now_sec();
+    uint32_t nb_archived, nb_evt_deleted, nb_notif_deleted;
+    
+    if (anp_read_uint32(&st.arg_buf, &st.max_rows)) {
+        elog(ERROR, "bad compact_event_log argument: %s", kmod_strerror());
+    }
+    
+    /* Serialize the compactions. The event log itself is not locked. */
+    kcdpg_exec_query("LOCK TABLE kcd_kws_event_log_partition IN EXCLUSIVE MODE");
+    
+    /* Create the archive partition of the current month if needed. */
+    kcdpg_get_evt_partition_name(now, &st.partition);
+    kstr_sf(ts, "SELECT NULL FROM kcd_kws_event_log_partition WHERE name = '%s'", st.partition.data);
+    kcdpg_exec_query(ts->data);
+    
+    if (!SPI_processed) {
+        KCDPG_DEBUG("Creating event log partition %s.", st.partition.data);
+        kstr_sf(ts, "CREATE TABLE %s (PRIMARY KEY (kws_id, evt_id)) INHERITS (kcd_kws_event_log)",
+                st.partition.data);
+        kcdpg_exec_query(ts->data);
+        kstr_sf(ts, "CREATE INDEX %s_index1 ON %s (date)", st.partition.data, st.partition.data);
+        kcdpg_exec_query(ts->data);
+        kstr_sf(ts, "GRANT ALL ON %s TO kcd", st.partition.data);
+        kcdpg_exec_query(ts->data);
+        kstr_sf(ts, "INSERT INTO kcd_kws_event_log_partition (name, creation_date) VALUES ('%s', "PRINTF_64"u)",
+                st.partition.data, now);
+        kcdpg_exec_query(ts->data);
+    }
+    
+    /* Archive the events that are older than the hot period of their
+     * workspace. The events posted before the event log was partitioned have
+     * no date.
+     */
+    kstr_sf(&st.old_query, "SELECT kws_id, evt_id FROM kcd_kws_event_log_hot h "
+                           "WHERE h.date IS NULL OR h.date < "PRINTF_64"u - 86400 * "
+                           KCDPG_LOG_RETENTION("hot_days", "h.kws_id")" "
+                           "ORDER BY kws_id, evt_id LIMIT %u", now, st.max_rows);
+#if PG_VERSION_NUM >= 90100
+    kstr_sf(ts, "WITH moved AS (DELETE FROM kcd_kws_event_log_hot WHERE (kws_id, evt_id) IN (%s) RETURNING *) "
+                "INSERT INTO %s SELECT * FROM moved", st.old_query.data, st.partition.data);
+    kcdpg_exec_query(ts->data);
+    nb_archived = SPI_processed;
+#else
+    /* The events are never updated, so both statements select the same
+     * events.
+     */
+    kstr_sf(ts, "INSERT INTO %s SELECT * FROM kcd_kws_event_log_hot WHERE (kws_id, evt_id) IN (%s)",
+            st.partition.data, st.old_query.data);
+    kcdpg_exec_query(ts->data);
+    nb_archived = SPI_processed;
+    kstr_sf(ts, "DELETE FROM kcd_kws_event_log_hot WHERE (kws_id, evt_id) IN (%s)", st.old_query.data);
+    kcdpg_exec_query(ts->data);
+#endif
+    
+    /* Delete the events of the hot partition that are past their retention
+     * period, which happens when it is shorter than the hot period.
+     */
+    kstr_sf(ts, "DELETE FROM kcd_kws_event_log_hot AS e "
+                "WHERE "KCDPG_LOG_RETENTION("keep_days", "e.kws_id")" > 0 "
+                "AND e.date < "PRINTF_64"u - 86400 * "KCDPG_LOG_RETENTION("keep_days", "e.kws_id")" "
+                "AND e.evt_id < (SELECT value FROM kcd_sequences WHERE kws_id = e.kws_id AND name = 'event_log')",
+                now);
+    kcdpg_exec_query(ts->data);
+    nb_evt_deleted = SPI_processed;
+    
+    /* Delete the notifications that are past their retention period. */
+    kstr_sf(ts, "DELETE FROM kcd_kws_notif_log AS n "
+                "WHERE "KCDPG_LOG_RETENTION("keep_days", "n.kws_id")" > 0 "
+                "AND n.date < "PRINTF_64"u - 86400 * "KCDPG_LOG_RETENTION("keep_days", "n.kws_id"),
+                now);
+    kcdpg_exec_query(ts->data);
+    nb_notif_deleted = SPI_processed;
+    
+    KCDPG_DEBUG("Archived %u events, deleted %u events and %u notifications.",
+                nb_archived, nb_evt_deleted, nb_notif_deleted);
+    
+    anp_write_uint32(&st.ext_buf, nb_archived);
+    anp_write_uint32(&st.ext_buf, nb_evt_deleted);
+    anp_write_uint32(&st.ext_buf, nb_notif_deleted);
+    
+KCDPG_QUERY_END(compact_event_log)
+
+
+/* Drop an expired archive partition of the event log (safe query).
+ *
+ * Output:
+ *   UINT32 True if a partition was dropped.
+ *
+ * A partition expires when all of its events are past the retention period of
+ * their workspace, except the last event of each workspace, which is moved to
+ * the archive partition of the current month. The rows of the partition are
+ * not deleted: the partition is detached from the event log and dropped. The
+ * retention is thus applied per partition, and a partition holding events
+ * that must be kept stays until they expire.
+ *
+ * At most one partition is dropped per transaction. Only the partition is
+ * locked exclusively, not the event log. The query fails instead of waiting if
+ * the partition is in use; the caller should roll back and retry later.
+ */
+KCDPG_QUERY_STRUCT(drop_event_log_partition)
+    
+    /* Name of the archive partition of the current month. */
+    kstr partition;
+    
+    /* Names of the other archive partitions. */
+    karray name_array;
+
+KCDPG_QUERY_INIT(drop_event_log_partition, 0)
+    kstr_init(&self->partition);
+    karray_init(&self->name_array);
+
+KCDPG_QUERY_CLEAN(drop_event_log_partition)
+    karray_clear_kstr(&self->name_array);
+    karray_clean(&self->name_array);
+    kstr_clean(&self->partition);
+
+KCDPG_QUERY_START(drop_event_log_partition)
+    uint64_t now = ktime_now_sec();
+    uint32_t i, dropped_flag = 0;
+    
+    /* Serialize with the compactions. */
+    kcdpg_exec_query("LOCK TABLE kcd_kws_event_log_partition IN EXCLUSIVE MODE");
+    
+    /* The partition receiving the events must exist to keep the last events
+     * of the workspaces. It is created by the compaction.
+     */
+    kcdpg_get_evt_partition_name(now, &st.partition);
+    kstr_sf(ts, "SELECT NULL FROM kcd_kws_event_log_partition WHERE name = '%s'", st.partition.data);
+    kcdpg_exec_query(ts->data);
+    
+    if (!SPI_processed) {
+        anp_write_uint32(&st.ext_buf, 0);
+        break;
+    }
+    
+    /* Get the partitions, except the one currently receiving the events. */
+    kstr_sf(ts, "SELECT name FROM kcd_kws_event_log_partition WHERE name <> '%s' ORDER BY name",
+            st.partition.data);
+    kcdpg_exec_query(ts->data);
+    
+    for (i = 0; i < SPI_processed; i++) {
+        kstr *name = kstr_new();
+        kcdpg_get_str(i, 0, name);
+        karray_push(&st.name_array, name);
+    }
+    
+    for (i = 0; i < (uint32_t) st.name_array.size; i++) {
+        kstr *name = st.name_array.data[i];
+        
+        /* Skip the partition if it holds events that must be kept. The events
+         * that have no date predate the partitioning and are kept.
+         */
+        kstr_sf(ts, "SELECT NULL FROM %s AS e "
+                    "WHERE NOT COALESCE("KCDPG_LOG_RETENTION("keep_days", "e.kws_id")" > 0 "
+                    "AND e.date < "PRINTF_64"u - 86400 * "KCDPG_LOG_RETENTION("keep_days", "e.kws_id")", FALSE) "
+                    "AND e.evt_id < (SELECT value FROM kcd_sequences WHERE kws_id = e.kws_id AND name = 'event_log') "
+                    "LIMIT 1", name->data, now);
+        kcdpg_exec_query(ts->data);
+        if (SPI_processed) continue;
+        
+        KCDPG_DEBUG("Dropping event log partition %s.", name->data);
+        kstr_sf(ts, "LOCK TABLE %s IN ACCESS EXCLUSIVE MODE NOWAIT", name->data);
+        kcdpg_exec_query(ts->data);
+        
+        /* Keep the last event of the workspaces. */
+        kstr_sf(ts, "INSERT INTO %s SELECT * FROM %s AS e "
+                    "WHERE e.evt_id >= (SELECT value FROM kcd_sequences WHERE kws_id = e.kws_id AND name = 'event_log')",
+                st.partition.data, name->data);
+        kcdpg_exec_query(ts->data);
+        
+        kstr_sf(ts, "ALTER TABLE %s NO INHERIT kcd_kws_event_log", name->data);
+        kcdpg_exec_query(ts->data);
+        kstr_sf(ts, "DROP TABLE %s", name->data);
+        kcdpg_exec_query(ts->data);
+        kstr_sf(ts, "DELETE FROM kcd_kws_event_log_partition WHERE name = '%s'", name->data);
+        kcdpg_exec_query(ts->data);
+        
+        dropped_flag = 1;
+        break;
+    }
+    
+    anp_write_uint32(&st.ext_buf, dropped_flag);
+    
+KCDPG_QUERY_END(drop_event_log_partition)
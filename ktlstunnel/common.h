@@ -31,6 +31,8 @@ extern struct kdaemon_opts global_opts;
 void kmod_log_msg(int level, const char *format, ...);
 void kdaemon_prepare_select(struct kselect *sel);
 int kdaemon_do_select(struct kselect *sel);
+void kdaemon_prepare_poll(struct kpoll *poll);
+int kdaemon_do_poll(struct kpoll *poll);
 
 #endif
 
@@ -175,7 +175,21 @@ int kdaemon_do_select(struct kselect *sel) {
 	return -1;
     }
     
-    kselect_wait(sel);
+    return kselect_wait(sel);
+}
+
+void kdaemon_prepare_poll(struct kpoll *poll) {
+    poll->tv.tv_sec = 100;
+    poll->tv.tv_usec = 0;
+}
+
+int kdaemon_do_poll(struct kpoll *poll) {
+    if (global_opts.quit_flag) {
+	kmod_set_error("must quit");
+	return -1;
+    }
+    
+    kpoll_wait(poll);
     
     return 0;
 }
@@ -42,6 +42,12 @@ KANP_KFS_SUBMESSAGE_FILE = 1
 KANP_KFS_SUBMESSAGE_CHUNK = 2
 KANP_KFS_SUBMESSAGE_COMMIT = 3
 KANP_KFS_SUBMESSAGE_ABORT = 4
+KANP_KFS_SUBMESSAGE_SKIP = 5
+KANP_KFS_SUBMESSAGE_HASH = 6
+
+# KFS hash types
+KANP_KFS_HASH_MD5 = 1
+KANP_KFS_HASH_SHA256 = 2
 
 # KFS operation identifiers
 KANP_KFS_OP_CREATE_FILE = 1
@@ -131,6 +137,8 @@ KANP_RES_KFS_DOWNLOAD_DATA = 335872768
 KANP_CMD_KFS_PHASE_1 = 268764160
 KANP_RES_KFS_PHASE_1 = 335873024
 KANP_CMD_KFS_PHASE_2 = 268764416
+KANP_CMD_KFS_UPLOAD_JOIN = 268764672
+KANP_RES_KFS_UPLOAD_JOIN = 335873536
 KANP_CMD_VNC_START_TICKET = 268828928
 KANP_RES_VNC_START_TICKET = 335937792
 KANP_CMD_VNC_START_SESSION = 268829184
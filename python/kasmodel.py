@@ -604,6 +604,11 @@ class RootConfigNode(AbstractConfigNode):
 
     prop_set.add_prop('kcd_default_kfs_quota', 10240, 'Default KFS quota, in megabytes.')
 
+    prop_set.add_prop('kcd_upload_write_budget', 4096,
+        'Maximum size of the uploaded data being written to the KFS in the background,\n' +
+        'per connection, in kilobytes. If this value is 0, the data is written\n' +
+        'synchronously.')
+
     prop_set.add_prop('kcd_db_purge_interval', 900, 'Database purge interval, in seconds.')
     
     # The following KCD fields are set automatically. Do not change their value
@@ -779,7 +784,7 @@ class RootConfigNode(AbstractConfigNode):
         for name in ['kfs_mode', 'kfs_purge_delay', 'kfs_dir', 'smb_mount_unc', 
                      'smb_mount_point', 'smb_mount_user', 'smb_mount_pwd', 
                      'smb_mount_delay', 'smb_check_delay', 'smb_heartbeat_name',
-                     'default_kfs_quota']:
+                     'default_kfs_quota', 'upload_write_budget']:
             ini_file.prop_key('config', name, 'kcd_' + name)
 
         # Write file.
@@ -47,6 +47,12 @@ class MonState:
         # Date at which we last purged the VNC sessions.
         self.vnc_last_purge_time = 0
         
+        # Date at which we last compacted the event log.
+        self.log_last_compact_time = 0
+        
+        # Date at which we last garbage collected the KFS blobs.
+        self.blob_last_gc_time = 0
+        
         # True if an action has been done in the current round.
         self.action_flag = 0
         
@@ -381,6 +387,85 @@ def handle_vnc():
     else:
         mon_state.time_to_wait = min(ttw, mon_state.time_to_wait)
 
+# Maximum number of events archived per transaction when the event log is
+# compacted.
+LOG_COMPACT_MAX_ROWS = 10000
+
+# This function executes the kcdpg query specified and returns the reply
+# message, skipping the return code.
+def exec_kcdpg_query(name, arg):
+    cur = exec_pg_query(mon_state.pg_conn, "SELECT %s(%s)" % (name, escape_pg_bytea(arg.get_payload())))
+    ret = ANP_msg()
+    ret.parse(cur.fetchone()[0].value)
+    if ret.get_u32() != 0: raise Exception(ret.get_str())
+    return ret
+
+# This function is called to compact the event log.
+def handle_log():
+    ttw = mon_state.log_last_compact_time + admin_conf.db_purge_interval - time.time()
+    
+    if ttw <= 0:
+        mon_state.action_flag = 1
+        mon_state.log_last_compact_time = time.time()
+        
+        try:
+            open_pg_conn_if_needed()
+            
+            # Archive the old events in small transactions to keep the locks
+            # short.
+            debug("Compacting event log.")
+            while 1:
+                arg = ANP_msg()
+                arg.add_u32(LOG_COMPACT_MAX_ROWS)
+                ret = exec_kcdpg_query("compact_event_log", arg)
+                mon_state.pg_conn.commit()
+                nb_archived = ret.get_u32()
+                debug("Archived %i events, deleted %i events and %i notifications." % \
+                      (nb_archived, ret.get_u32(), ret.get_u32()))
+                if nb_archived < LOG_COMPACT_MAX_ROWS: break
+            
+            # Drop the expired partitions. This fails if a partition is busy;
+            # we will retry on the next compaction.
+            while 1:
+                try:
+                    ret = exec_kcdpg_query("drop_event_log_partition", ANP_msg())
+                    mon_state.pg_conn.commit()
+                    if not ret.get_u32(): break
+                except Exception, e:
+                    debug("Cannot drop event log partition: %s." % str(e))
+                    mon_state.pg_conn.rollback()
+                    break
+                    
+        except Exception, e:
+            out("Compacting event log failed: %s." % str(e))
+            mon_state.pg_conn = None
+        
+    else:
+        mon_state.time_to_wait = min(ttw, mon_state.time_to_wait)
+
+# Interval between two garbage collections of the KFS blobs, in seconds. The
+# collection walks the whole blob store.
+BLOB_GC_INTERVAL = 86400
+
+# This function is called to garbage collect the KFS blobs that are no longer
+# referenced. The work is done by kcdhelper, outside the KCD.
+def handle_blob():
+    ttw = mon_state.blob_last_gc_time + BLOB_GC_INTERVAL - time.time()
+    
+    if ttw <= 0:
+        mon_state.action_flag = 1
+        mon_state.blob_last_gc_time = time.time()
+        
+        try:
+            debug("Garbage collecting KFS blobs.")
+            get_cmd_output(["/usr/bin/kcdhelper", "--gc-kfs"])
+        
+        except Exception, e:
+            out("Garbage collecting KFS blobs failed: %s." % str(e))
+        
+    else:
+        mon_state.time_to_wait = min(ttw, mon_state.time_to_wait)
+
 # This function contains the main loop of the monitor.
 def main_loop():
     global mon_state
@@ -401,6 +486,8 @@ def main_loop():
         handle_kfs()
         handle_vnc()
         handle_att()
+        handle_log()
+        handle_blob()
         
         # Wait for something to happen.
         if not mon_state.action_flag:
@@ -87,6 +87,11 @@ class BaseKcdClient(tcp_client.TcpClient):
             res_buf = am.get_bin()
             res_error = am.get_u32()
 
+            # Skip the permission flags, they are only cached by KCD.
+            am.get_u32()
+            am.get_u32()
+            am.get_u32()
+
             if res_type == kanp.KANP_RES_OK:
                 # Success
                 ext_buf_am = am
@@ -217,6 +222,9 @@ class BaseKcdClient(tcp_client.TcpClient):
         am.add_u32(user_id)
         am.add_u32(minor)
         am.add_bin(cmd)
+        am.add_u32(0) # no cached permissions
+        am.add_u32(0)
+        am.add_u32(0)
         # Other arguments
         am.add_u32(share_id)
         am.add_u64(inode_id)
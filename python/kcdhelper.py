@@ -8,7 +8,7 @@ from klog import *
 from kout import *
 from kpg import *
 from kanp import *
-import ConfigParser, getopt, shutil
+import ConfigParser, getopt, shutil, re, time, errno
 from config import CONF_DIR
 
 # Path to the kfs.ini file.
@@ -19,6 +19,11 @@ admin_conf = None
 
 # Postgres DB connection.
 db = None
+
+# Minimum age of an unreferenced blob or upload file before it is garbage
+# collected, in seconds. A blob is stored before the KFS file map references it
+# and an upload file is created before the upload table references it.
+BLOB_GC_GRACE = 86400
  
 # This function parses the configuration file of this script and returns the
 # corresponding configuration object.
@@ -35,7 +40,8 @@ def usage():
         " -h, --help:                             print help and exit.\n" +\
         " -d, --debug:                            prints debug information\n" +\
         " --delete-kws <kws_id>:                  delete the workspace specified.\n" +\
-        " --sync-kfs <kws_id>:                    synchronize the KFS files specified.\n"
+        " --sync-kfs <kws_id>:                    synchronize the KFS files specified.\n" +\
+        " --gc-kfs:                               delete the unreferenced KFS blobs.\n"
     out(s)
 
 # Execute the query specified and close the cursor obtained.
@@ -62,8 +68,9 @@ def delete_kws(kws_id):
     sync_kfs(kws_id)
 
 # Synchronize the files on the KFS. If the workspace is deleted, the workspace
-# KFS directory is deleted. Otherwise, the files in the KFS directory that are
-# not present in the KFS file map are deleted.
+# KFS directory is deleted. Otherwise, the data of the uploads that were not
+# resumed is deleted. The blobs no longer referenced are garbage collected
+# separately by gc_kfs(), which kasmond runs periodically.
 def sync_kfs(kws_id):
     status = get_kws_status(kws_id)
     kws_path = "%s%i/" % (admin_conf.kfs_dir, kws_id)
@@ -72,11 +79,19 @@ def sync_kfs(kws_id):
         shutil.rmtree(kws_path, 1)
     
     else:
+        # The workspace directory contains the files stored before the blob
+        # store was introduced and the data of the uploads in progress.
         path_dict = {}
-        cur = exec_pg_query(db, "SELECT path FROM kcd_kws_kfs_file_map WHERE kws_id = %i AND share_id = 0" % (kws_id))
+        cur = exec_pg_query(db, "SELECT path FROM kcd_kws_kfs_file_map WHERE kws_id = %i AND blob IS NULL" % (kws_id))
         for row in cur.fetchall():
             path_dict[row[0]] = 1
         cur.close()
+        cur = exec_pg_query(db, "SELECT perm_path FROM kcd_kws_kfs_upload_file WHERE kws_id = %i" % (kws_id))
+        for row in cur.fetchall():
+            path_dict[row[0]] = 1
+        cur.close()
+        
+        deadline = time.time() - BLOB_GC_GRACE
         
         for root, dirs, files in os.walk(kws_path):
             if not root.startswith(kws_path): raise Exception("walk error")
@@ -84,8 +99,85 @@ def sync_kfs(kws_id):
                 full_path = os.path.join(root, file)
                 share_path = full_path[len(kws_path):]
                 if not path_dict.has_key(share_path):
-                    try: delete_file(full_path)
+                    try:
+                        if os.stat(full_path).st_mtime < deadline: delete_file(full_path)
                     except: pass
+
+# Return a dictionary containing the blobs referenced by the KFS file map.
+def get_referenced_blobs():
+    blob_dict = {}
+    cur = exec_pg_query(db, "SELECT DISTINCT blob FROM kcd_kws_kfs_file_map WHERE blob IS NOT NULL")
+    for row in cur.fetchall():
+        blob_dict[row[0]] = 1
+    cur.close()
+    return blob_dict
+
+# Put the quarantined blob specified back in the blob store. If the KCD has
+# stored the blob again in the meantime, both copies have the same content.
+def restore_blob(path, store_path):
+    try:
+        os.link(path, store_path)
+    except OSError, e:
+        if e.errno != errno.EEXIST: raise
+    os.unlink(path)
+
+# Delete the blobs of the KFS blob store that are no longer referenced by the
+# KFS file map. The blobs modified recently are kept since the KCD stores (or
+# touches) a blob before it references it.
+#
+# The KCD may touch and reference an old blob while we examine it. Therefore,
+# the candidate blobs are first moved to a quarantine directory: from then on,
+# the KCD no longer finds them and stores its own copy. The references and the
+# modification times are then checked again, and the blobs that were
+# referenced or touched in the meantime are put back. The blobs left in
+# quarantine by a previous run are handled the same way.
+def gc_kfs():
+    blob_path = admin_conf.kfs_dir + "blob/"
+    quarantine_path = blob_path + "quarantine/"
+    deadline = time.time() - BLOB_GC_GRACE
+    
+    if not os.path.isdir(blob_path): return
+    if not os.path.isdir(quarantine_path): os.mkdir(quarantine_path)
+    
+    # Find the old blobs.
+    old_dict = {}
+    
+    for root, dirs, files in os.walk(blob_path):
+        if not root.startswith(blob_path): raise Exception("walk error")
+        if root == blob_path and "quarantine" in dirs: dirs.remove("quarantine")
+        for file in files:
+            full_path = os.path.join(root, file)
+            if not re.match("^[0-9a-f]{64}$", file): continue
+            try:
+                if os.stat(full_path).st_mtime < deadline: old_dict[file] = full_path
+            except OSError:
+                pass
+    
+    # Quarantine those that are not referenced.
+    ref_dict = get_referenced_blobs()
+    
+    for blob, full_path in old_dict.items():
+        if ref_dict.has_key(blob): continue
+        try:
+            os.rename(full_path, quarantine_path + blob)
+        except OSError:
+            pass
+    
+    # Delete the quarantined blobs that are still unused.
+    ref_dict = get_referenced_blobs()
+    
+    for file in os.listdir(quarantine_path):
+        full_path = quarantine_path + file
+        if not re.match("^[0-9a-f]{64}$", file): continue
+        try:
+            if ref_dict.has_key(file) or os.stat(full_path).st_mtime >= deadline:
+                debug("Restoring blob %s." % (file))
+                restore_blob(full_path, "%s%s/%s" % (blob_path, file[:2], file))
+            else:
+                debug("Deleting blob %s." % (file))
+                delete_file(full_path)
+        except OSError:
+            pass
     
 def main():
     global admin_conf, db
@@ -93,7 +185,7 @@ def main():
     ret_code = 0
     
     try:
-	opts, args = getopt.getopt(sys.argv[1:], "hd", ["help", "debug", "delete-kws=", "sync-kfs="])
+	opts, args = getopt.getopt(sys.argv[1:], "hd", ["help", "debug", "delete-kws=", "sync-kfs=", "gc-kfs"])
     except getopt.GetoptError, e:
 	sys.stderr.write("Options error: '%s'\n" % (str(e)) )
 	usage()
@@ -103,6 +195,7 @@ def main():
     debug_flag = 0
     delete_kws_flag = 0
     sync_kfs_flag = 0
+    gc_kfs_flag = 0
     kws_id = 0
     
     for k, v in opts:
@@ -116,6 +209,8 @@ def main():
 	elif k == "--sync-kfs":
             sync_kfs_flag = 1
             kws_id = int(v)
+	elif k == "--gc-kfs":
+            gc_kfs_flag = 1
 	    
     if len(args):
 	usage()
@@ -140,6 +235,7 @@ def main():
     try:
         if delete_kws_flag: delete_kws(kws_id)
         elif sync_kfs_flag: sync_kfs(kws_id)
+        elif gc_kfs_flag: gc_kfs()
     except Exception, e:
         out("Error: %s"  % (str(e)))
         ret_code = 1
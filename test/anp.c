@@ -100,6 +100,27 @@ UNIT_TEST(anp_parse)
     kbuffer_clean(&buf);
 }
 
+UNIT_TEST(anp_parse_lazy)
+{
+    struct anp_msg *bad_msg = anp_msg_new();
+    kbuffer buf;
+    uint8_t *data;
+    uint32_t len;
+
+    kbuffer_init(&buf);
+
+    TASSERT(anp_msg_get_bin_view(msg, 4, &data, &len) == 0 && len == 12 && memcmp("kbuffer test", data, len) == 0);
+    TASSERT(anp_msg_get_bin_view(msg, 3, &data, &len) == -1);
+    TASSERT(anp_msg_get_bin_view(msg, 5, &data, &len) == -1);
+
+    /* Truncated element. */
+    kbuffer_write(&buf, msg->payload.data, msg->payload.len - 1);
+    TASSERT(anp_msg_parse(bad_msg, &buf) == -1);
+
+    anp_msg_destroy(bad_msg);
+    kbuffer_clean(&buf);
+}
+
 UNIT_TEST(anp_msg_dump)
 {
     kstr str;
@@ -111,6 +132,43 @@ UNIT_TEST(anp_msg_dump)
     kstr_clean(&str);
 }
 
+UNIT_TEST(anp_msg_pool)
+{
+    struct anp_msg_pool pool;
+    struct anp_msg *m1, *m2;
+    karray array;
+
+    anp_msg_pool_init(&pool);
+    karray_init(&array);
+
+    m1 = anp_msg_pool_get(&pool);
+    m1->type = 7;
+    anp_msg_write_uint32(m1, 42);
+    anp_msg_destroy(m1);
+    TASSERT(pool.nb_alloc == 1 && pool.nb_live == 0 && pool.free_array.size == 1);
+
+    /* The message is reused and reset. */
+    m2 = anp_msg_pool_get(&pool);
+    TASSERT(m2 == m1 && pool.nb_reuse == 1);
+    TASSERT(m2->type == 0 && m2->payload.len == 0 && m2->nb_el == 0);
+
+    /* Messages are returned in bulk. */
+    karray_push(&array, m2);
+    karray_push(&array, anp_msg_pool_get(&pool));
+    karray_push(&array, anp_msg_new());
+    TASSERT(pool.nb_live == 2);
+    anp_msg_destroy_array(&array);
+    TASSERT(array.size == 0 && pool.nb_live == 0 && pool.peak_live == 2 && pool.free_array.size == 2);
+
+    /* The pool is not cleaned while a message is live. */
+    m1 = anp_msg_pool_get(&pool);
+    TASSERT(anp_msg_pool_clean(&pool) == -1 && pool.free_array.size == 1);
+    anp_msg_destroy(m1);
+
+    karray_clean(&array);
+    TASSERT(anp_msg_pool_clean(&pool) == 0);
+}
+
 UNIT_TEST(anp_clean)
 {
     anp_msg_destroy(msg);
@@ -0,0 +1,80 @@
+/* Copyright (C) 2026 Opersys inc., All rights reserved. */
+
+/* This program measures the throughput of the hashes computed by the KCD on
+ * the uploaded files, for several chunk sizes. With the MD5 hash type, the KCD
+ * computes both the MD5 and the SHA-256 hash of the file. With the SHA-256 hash
+ * type, it only computes the SHA-256 hash.
+ *
+ * Usage: hash_bench [total size in MB]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+
+static double get_time() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* Hash 'total_size' bytes in chunks of 'chunk_size' bytes with the algorithms
+ * specified and return the throughput in MB/s.
+ */
+static double bench(unsigned char *buf, size_t chunk_size, size_t total_size, int md5_flag, int sha256_flag) {
+    gnutls_hash_hd_t md5 = NULL, sha256 = NULL;
+    size_t done;
+    double start, elapsed;
+
+    if (md5_flag && gnutls_hash_init(&md5, GNUTLS_DIG_MD5) < 0) return 0;
+    if (sha256_flag && gnutls_hash_init(&sha256, GNUTLS_DIG_SHA256) < 0) return 0;
+
+    start = get_time();
+
+    for (done = 0; done < total_size; done += chunk_size) {
+        if (md5) gnutls_hash(md5, buf, chunk_size);
+        if (sha256) gnutls_hash(sha256, buf, chunk_size);
+    }
+
+    if (md5) gnutls_hash_deinit(md5, NULL);
+    if (sha256) gnutls_hash_deinit(sha256, NULL);
+
+    elapsed = get_time() - start;
+
+    return elapsed > 0 ? done / elapsed / (1024*1024) : 0;
+}
+
+int main(int argc, char **argv) {
+    size_t chunk_sizes[] = { 4*1024, 16*1024, 64*1024, 256*1024, 1024*1024 };
+    size_t total_size = 256*1024*1024, i;
+    unsigned char *buf;
+
+    if (argc > 1) total_size = (size_t) atoi(argv[1]) * 1024*1024;
+    if (total_size == 0) {
+        fprintf(stderr, "Usage: %s [total size in MB]\n", argv[0]);
+        return 1;
+    }
+
+    gnutls_global_init();
+
+    buf = malloc(chunk_sizes[4]);
+    for (i = 0; i < chunk_sizes[4]; i++) buf[i] = (unsigned char) (i * 31 + 7);
+
+    printf("%10s %14s %14s %14s\n", "chunk", "md5 MB/s", "sha256 MB/s", "md5+sha256 MB/s");
+
+    for (i = 0; i < sizeof(chunk_sizes) / sizeof(chunk_sizes[0]); i++) {
+        size_t c = chunk_sizes[i];
+        printf("%10lu %14.0f %14.0f %14.0f\n", (unsigned long) c,
+               bench(buf, c, total_size, 1, 0),
+               bench(buf, c, total_size, 0, 1),
+               bench(buf, c, total_size, 1, 1));
+    }
+
+    free(buf);
+    gnutls_global_deinit();
+
+    return 0;
+}
@@ -26,6 +26,9 @@ class KcdClient(BaseKcdClient):
         am.add_u32(user_id)
         am.add_u32(0) # command minor
         am.add_bin("") # command
+        am.add_u32(0) # no cached permissions
+        am.add_u32(0)
+        am.add_u32(0)
 
         # Do the query.
         ext_am, res_am = self.workspace_bound_request('get_next_skurl_req_id', am.get_payload())
@@ -127,6 +130,9 @@ class KcdClient(BaseKcdClient):
         am.add_u32(user_id)
         am.add_u32(0) # command minor
         am.add_bin("") # command
+        am.add_u32(0) # no cached permissions
+        am.add_u32(0)
+        am.add_u32(0)
         # Other arguments
         am.add_u32(int(compat_v2))
         if compat_v2: am.add_u32(request_id)
@@ -161,6 +167,9 @@ class KcdClient(BaseKcdClient):
         am.add_u32(user_id)
         am.add_u32(0) # command minor
         am.add_bin("") # command
+        am.add_u32(0) # no cached permissions
+        am.add_u32(0)
+        am.add_u32(0)
         # Other arguments
         am.add_u32(compat_v2)
         if compat_v2: am.add_u32(request_id)
@@ -269,6 +278,9 @@ class KcdClient(BaseKcdClient):
         am.add_u32(user_id)
         am.add_u32(kanp.KANP_MINOR) # command minor
         am.add_bin(cmd.get_payload()) # command
+        am.add_u32(0) # no cached permissions
+        am.add_u32(0)
+        am.add_u32(0)
 
         # Post chat message to KCD database.
         ext_am, res_am = self.workspace_bound_request('cmd_chat_msg', am.get_payload())